@@ -0,0 +1,233 @@
+// aof.cpp - Append-only command log with background rewrite (see aof.h)
+
+// stdlib
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// system
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// C++
+#include <string>
+#include <vector>
+// project
+#include "aof.h"
+#include "elserver.h"
+#include "logging.h"
+#include "snapshot.h"
+
+struct Aof {
+  bool enabled = false;
+  bool loading = false;    // Replaying; don't log the replayed commands
+  int fd = -1;
+  std::string path;
+  std::string buf;         // Commands not yet written to fd
+  size_t size = 0;         // Bytes written to the log
+  bool failing = false;    // The last write of buf failed
+  size_t base_size = 0;    // Size right after the last rewrite or open
+  bool rewriting = false;
+  std::string rewrite_buf; // Commands since the rewrite started
+};
+
+static Aof g_aof;
+
+static void put_u32(std::string *out, uint32_t v) {
+  uint32_t net = htonl(v);
+  out->append((const char *)&net, 4);
+}
+
+static bool write_full(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t rv = write(fd, data, len);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    } else if (rv <= 0) {
+      return false;
+    }
+    data += rv;
+    len -= (size_t)rv;
+  }
+  return true;
+}
+
+static size_t file_size(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+bool aof_open(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    LOG_SYS_ERROR("aof open() error");
+    return false;
+  }
+  g_aof.enabled = true;
+  g_aof.fd = fd;
+  g_aof.path = path;
+  g_aof.size = file_size(fd);
+  g_aof.base_size = g_aof.size;
+  aof_feed({k_version_mark, std::to_string(db.version)});
+  return true;
+}
+
+bool aof_enabled() { return g_aof.enabled; }
+
+void aof_feed(const std::vector<std::string> &command) {
+  if (!g_aof.enabled || g_aof.loading) {
+    return;
+  }
+  size_t start = g_aof.buf.size();
+  put_u32(&g_aof.buf, (uint32_t)command.size());
+  for (const std::string &s : command) {
+    put_u32(&g_aof.buf, (uint32_t)s.size());
+    g_aof.buf.append(s);
+  }
+  if (g_aof.rewriting) {
+    g_aof.rewrite_buf.append(g_aof.buf, start, std::string::npos);
+  }
+}
+
+bool aof_rewrite_start() {
+  if (!g_aof.enabled || g_aof.rewriting) {
+    return false;
+  }
+  std::string target = g_aof.path + ".rewrite";
+  if (!snapshot_start(target.c_str(), SNAPSHOT_AOF)) {
+    return false;
+  }
+  g_aof.rewriting = true;
+  g_aof.rewrite_buf.clear();
+  LOG_INFO("aof rewrite started");
+  return true;
+}
+
+// Appends the commands that arrived during the rewrite to the new log and
+// swaps it in place of the current one.
+static void aof_rewrite_finish() {
+  std::string target = g_aof.path + ".rewrite";
+  g_aof.rewriting = false;
+
+  if (!snapshot_last_ok()) {
+    LOG_ERROR("aof rewrite failed");
+    g_aof.rewrite_buf.clear();
+    return;
+  }
+
+  int fd = open(target.c_str(), O_WRONLY | O_APPEND);
+  const std::string &tail = g_aof.rewrite_buf;
+  bool ok = fd >= 0 && write_full(fd, tail.data(), tail.size()) &&
+            fsync(fd) == 0;
+  if (ok && rename(target.c_str(), g_aof.path.c_str()) < 0) {
+    ok = false;
+  }
+  g_aof.rewrite_buf.clear();
+  if (!ok) {
+    LOG_SYS_ERROR("aof rewrite swap error");
+    if (fd >= 0) {
+      close(fd);
+    }
+    unlink(target.c_str());
+    return;
+  }
+
+  // fd now refers to the live log. Commands still held back by failed
+  // writes are in the image or in rewrite_buf, so they are in it.
+  close(g_aof.fd);
+  g_aof.fd = fd;
+  g_aof.buf.clear();
+  g_aof.failing = false;
+  g_aof.size = file_size(fd);
+  g_aof.base_size = g_aof.size;
+  LOG_INFO("aof rewrite done, %zu bytes", g_aof.size);
+}
+
+void aof_step() {
+  if (!g_aof.enabled) {
+    return;
+  }
+
+  if (!g_aof.buf.empty()) {
+    if (write_full(g_aof.fd, g_aof.buf.data(), g_aof.buf.size())) {
+      if (g_aof.failing) {
+        LOG_INFO("aof writes resumed");
+        g_aof.failing = false;
+      }
+      g_aof.size += g_aof.buf.size();
+      g_aof.buf.clear();
+    } else {
+      // Keep buf and retry on the next iterations
+      if (!g_aof.failing) {
+        LOG_SYS_ERROR("aof write() error");
+        g_aof.failing = true;
+      }
+      // A failed write may have left part of a command behind; cut the
+      // log back to its last complete one so that replay reads all of it
+      if (ftruncate(g_aof.fd, (off_t)g_aof.size) < 0) {
+        LOG_SYS_ERROR("aof ftruncate() error");
+      }
+    }
+  }
+
+  if (g_aof.rewriting) {
+    if (!snapshot_active()) {
+      aof_rewrite_finish();
+    }
+  } else if (g_aof.size >= k_aof_rewrite_min_size &&
+             g_aof.size >=
+                 g_aof.base_size * (100 + k_aof_rewrite_growth) / 100) {
+    aof_rewrite_start();
+  }
+}
+
+static bool read_u32(FILE *fp, uint32_t *out) {
+  if (fread(out, 1, 4, fp) != 4) {
+    return false;
+  }
+  *out = ntohl(*out);
+  return true;
+}
+
+int64_t aof_load(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    return -1;
+  }
+
+  g_aof.loading = true;
+  int64_t replayed = 0;
+  std::vector<std::string> command;
+  uint32_t nstr;
+  while (read_u32(fp, &nstr)) {
+    bool ok = nstr >= 1 && nstr <= (uint32_t)MAX_ARGS;
+    command.resize(ok ? nstr : 0);
+    for (uint32_t i = 0; ok && i < nstr; i++) {
+      uint32_t len;
+      ok = read_u32(fp, &len);
+      if (ok) {
+        command[i].resize(len);
+        ok = len == 0 || fread(&command[i][0], 1, len, fp) == len;
+      }
+    }
+    if (!ok) {
+      LOG_ERROR("truncated or corrupt aof, ignoring the tail");
+      break;
+    }
+    if (nstr == 2 && command[0] == k_version_mark) {
+      uint64_t version = strtoull(command[1].c_str(), NULL, 10);
+      if (version > db.version) {
+        db.version = version;
+      }
+      continue;
+    }
+    process_request(command);
+    replayed++;
+  }
+  g_aof.loading = false;
+  fclose(fp);
+  return replayed;
+}
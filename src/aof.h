@@ -0,0 +1,65 @@
+#ifndef AOF_H
+#define AOF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Default append-only log file
+const char *const k_aof_path = "appendonly.aof";
+
+// The log is rewritten once it has grown by this many percent since the
+// last rewrite...
+const size_t k_aof_rewrite_growth = 100;
+
+// ...and is at least this large
+const size_t k_aof_rewrite_min_size = 64 << 20;
+
+// Name of the pseudo-command that records db.version in the log
+const char *const k_version_mark = "version";
+
+/**
+ * Append-only command log.
+ *
+ * Every successful write command is appended to the log in the request
+ * wire format, buffered in memory and written once per event loop
+ * iteration by aof_step(). A write that fails is retried on the next
+ * iterations, after cutting off whatever part of it reached the file, so
+ * the log never holds a torn command. At startup the log is replayed
+ * through process_request.
+ *
+ * A rewrite produces the minimal log for the current data without forking:
+ * the snapshot machinery writes one "set" frame per entry as of the moment
+ * the rewrite starts, while commands arriving meanwhile are kept in a
+ * rewrite buffer. When the image is complete, the buffer is appended to it
+ * and the result atomically replaces the log. Rewrites start automatically
+ * when the log has grown by k_aof_rewrite_growth percent.
+ *
+ * Entry versions are not logged. Instead "version <n>" frames record
+ * db.version when the log is opened and at the head of each rewrite, and
+ * replay raises db.version to them; see load_data() for how versions are
+ * kept from repeating across restarts.
+ */
+
+// Opens (or creates) the log for appending and records db.version in it.
+// Returns false on error.
+bool aof_open(const char *path);
+
+// True when commands are being logged
+bool aof_enabled();
+
+// Replays the log at path. Returns the number of commands replayed, not
+// counting version frames, or -1 if the file does not exist.
+int64_t aof_load(const char *path);
+
+// Appends a write command to the log.
+void aof_feed(const std::vector<std::string> &command);
+
+// Writes out buffered commands and drives rewrites; once per loop iteration.
+void aof_step();
+
+// Starts a rewrite. Returns false if a rewrite or snapshot is running.
+bool aof_rewrite_start();
+
+#endif // AOF_H
@@ -0,0 +1,487 @@
+// btree.cpp - B+tree ordered index with prefix-compressed key heads
+//
+// See btree.h for the node layout. Inserts split full nodes on the way back
+// up; deletes borrow from or merge with a sibling when a node drops below
+// k_btree_min keys.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "btree.h"
+
+static BTreeNode *new_node(BTree *tree, bool leaf) {
+  void *mem = NULL;
+  if (posix_memalign(&mem, 64, sizeof(BTreeNode)) != 0) {
+    abort();
+  }
+  memset(mem, 0, sizeof(BTreeNode));
+  BTreeNode *node = (BTreeNode *)mem;
+  node->leaf = leaf;
+  tree->nodes++;
+  return node;
+}
+
+static void free_node(BTree *tree, BTreeNode *node) {
+  free(node);
+  tree->nodes--;
+}
+
+static BTreeNode *child(const BTreeNode *node, size_t i) {
+  return (BTreeNode *)node->ptrs[i];
+}
+
+/**
+ * @brief Big-endian 4 bytes of key starting at off, zero padded
+ */
+static uint32_t key_head(const std::string &key, uint32_t off) {
+  uint32_t head = 0;
+  for (uint32_t i = 0; i < 4; i++) {
+    head <<= 8;
+    if (off + i < key.size()) {
+      head |= (uint8_t)key[off + i];
+    }
+  }
+  return head;
+}
+
+/**
+ * @brief Recompute the shared prefix and the heads after a modification
+ *
+ * Keys are sorted, so the prefix shared by the first and last key is
+ * shared by all of them.
+ */
+static void node_refresh(BTree *tree, BTreeNode *node) {
+  tree->node_writes++;
+  uint32_t plen = 0;
+  if (node->n > 0) {
+    const std::string &first = *node->keys[0];
+    const std::string &last = *node->keys[node->n - 1];
+    size_t max = std::min(first.size(), last.size());
+    while (plen < max && first[plen] == last[plen]) {
+      plen++;
+    }
+  }
+  node->prefix_len = plen;
+  for (size_t i = 0; i < node->n; i++) {
+    node->heads[i] = key_head(*node->keys[i], plen);
+  }
+}
+
+/**
+ * @brief Compare key against the prefix shared by the node's keys
+ *
+ * @return <0 if key sorts before every key of the node, >0 if after, 0 if
+ * key starts with the prefix
+ */
+static int prefix_cmp(const BTreeNode *node, const std::string &key) {
+  uint32_t plen = node->prefix_len;
+  if (plen == 0) {
+    return 0;
+  }
+  int c = memcmp(key.data(), node->keys[0]->data(),
+                 std::min((size_t)plen, key.size()));
+  if (c != 0) {
+    return c;
+  }
+  return key.size() < plen ? -1 : 0;
+}
+
+/**
+ * @brief Count the keys of the node below key (or not above it, if upper)
+ */
+static size_t node_bound(const BTreeNode *node, const std::string &key,
+                         bool upper) {
+  int pc = prefix_cmp(node, key);
+  if (pc < 0) {
+    return 0;
+  } else if (pc > 0) {
+    return node->n;
+  }
+
+  uint32_t head = key_head(key, node->prefix_len);
+  size_t lo = 0;
+  size_t hi = node->n;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int c;
+    if (node->heads[mid] != head) {
+      c = node->heads[mid] < head ? -1 : 1;
+    } else {
+      c = node->keys[mid]->compare(key);
+    }
+    if (c < 0 || (upper && c == 0)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/**
+ * @brief Insert key and ptr at position pos of a node that has room
+ *
+ * For inner nodes ptr is the child that goes right of the key.
+ */
+static void insert_at(BTreeNode *node, size_t pos, const std::string *key,
+                      void *ptr) {
+  size_t pshift = node->leaf ? pos : pos + 1;
+  size_t pend = node->leaf ? node->n : node->n + 1;
+  memmove(&node->keys[pos + 1], &node->keys[pos],
+          (node->n - pos) * sizeof(node->keys[0]));
+  memmove(&node->ptrs[pshift + 1], &node->ptrs[pshift],
+          (pend - pshift) * sizeof(node->ptrs[0]));
+  node->keys[pos] = key;
+  node->ptrs[pshift] = ptr;
+  node->n++;
+}
+
+/**
+ * @brief Remove key pos and its ptr (the right child for inner nodes)
+ */
+static void remove_at(BTreeNode *node, size_t pos) {
+  size_t pshift = node->leaf ? pos : pos + 1;
+  size_t pend = node->leaf ? node->n : node->n + 1;
+  memmove(&node->keys[pos], &node->keys[pos + 1],
+          (node->n - pos - 1) * sizeof(node->keys[0]));
+  memmove(&node->ptrs[pshift], &node->ptrs[pshift + 1],
+          (pend - pshift - 1) * sizeof(node->ptrs[0]));
+  node->n--;
+}
+
+/**
+ * @brief Insert into the subtree rooted at node
+ *
+ * @return The new right sibling if node was split (its separator is stored
+ * in *sep), otherwise NULL
+ */
+static BTreeNode *insert_rec(BTree *tree, BTreeNode *node,
+                             const std::string *key, void *val,
+                             const std::string **sep) {
+  size_t pos;
+  if (node->leaf) {
+    pos = node_bound(node, *key, false);
+    if (pos < node->n && *node->keys[pos] == *key) {
+      node->keys[pos] = key;
+      node->ptrs[pos] = val;
+      tree->node_writes++;
+      return NULL;
+    }
+    tree->size++;
+  } else {
+    pos = node_bound(node, *key, true);
+    BTreeNode *right = insert_rec(tree, child(node, pos), key, val, sep);
+    if (!right) {
+      return NULL;
+    }
+    key = *sep;
+    val = right;
+  }
+
+  if (node->n < k_btree_fanout) {
+    insert_at(node, pos, key, val);
+    node_refresh(tree, node);
+    return NULL;
+  }
+
+  // Split: lay out the fanout + 1 keys, then hand the upper half over
+  const std::string *keys[k_btree_fanout + 1];
+  void *ptrs[k_btree_fanout + 2];
+  size_t nptrs = node->leaf ? node->n : node->n + 1;
+  size_t pshift = node->leaf ? pos : pos + 1;
+  memcpy(keys, node->keys, pos * sizeof(keys[0]));
+  keys[pos] = key;
+  memcpy(keys + pos + 1, node->keys + pos, (node->n - pos) * sizeof(keys[0]));
+  memcpy(ptrs, node->ptrs, pshift * sizeof(ptrs[0]));
+  ptrs[pshift] = val;
+  memcpy(ptrs + pshift + 1, node->ptrs + pshift,
+         (nptrs - pshift) * sizeof(ptrs[0]));
+
+  size_t total = k_btree_fanout + 1;
+  size_t half = total / 2;
+  BTreeNode *right = new_node(tree, node->leaf);
+  if (node->leaf) {
+    node->n = half;
+    right->n = total - half;
+    memcpy(node->keys, keys, half * sizeof(keys[0]));
+    memcpy(node->ptrs, ptrs, half * sizeof(ptrs[0]));
+    memcpy(right->keys, keys + half, right->n * sizeof(keys[0]));
+    memcpy(right->ptrs, ptrs + half, right->n * sizeof(ptrs[0]));
+    right->ptrs[k_btree_fanout] = node->ptrs[k_btree_fanout];
+    node->ptrs[k_btree_fanout] = right;
+    *sep = new std::string(*right->keys[0]);
+  } else {
+    // keys[half] moves up to the parent
+    node->n = half;
+    right->n = total - half - 1;
+    memcpy(node->keys, keys, half * sizeof(keys[0]));
+    memcpy(node->ptrs, ptrs, (half + 1) * sizeof(ptrs[0]));
+    memcpy(right->keys, keys + half + 1, right->n * sizeof(keys[0]));
+    memcpy(right->ptrs, ptrs + half + 1, (right->n + 1) * sizeof(ptrs[0]));
+    *sep = keys[half];
+  }
+  node_refresh(tree, node);
+  node_refresh(tree, right);
+  return right;
+}
+
+/**
+ * @brief Insert a key, or replace the value of an equal key
+ *
+ * The tree keeps the key pointer, so *key must stay valid and unchanged
+ * until the key is deleted.
+ *
+ * @param tree Pointer to the tree
+ * @param key Key to insert
+ * @param val Value stored with the key
+ */
+void bt_insert(BTree *tree, const std::string *key, void *val) {
+  if (!tree->root) {
+    tree->root = new_node(tree, true);
+  }
+  const std::string *sep = NULL;
+  BTreeNode *right = insert_rec(tree, tree->root, key, val, &sep);
+  if (right) {
+    BTreeNode *root = new_node(tree, false);
+    root->n = 1;
+    root->keys[0] = sep;
+    root->ptrs[0] = tree->root;
+    root->ptrs[1] = right;
+    node_refresh(tree, root);
+    tree->root = root;
+  }
+}
+
+/**
+ * @brief Merge child i + 1 of parent into child i
+ */
+static void merge_kids(BTree *tree, BTreeNode *parent, size_t i) {
+  BTreeNode *left = child(parent, i);
+  BTreeNode *right = child(parent, i + 1);
+  if (left->leaf) {
+    memcpy(left->keys + left->n, right->keys,
+           right->n * sizeof(right->keys[0]));
+    memcpy(left->ptrs + left->n, right->ptrs,
+           right->n * sizeof(right->ptrs[0]));
+    left->n += right->n;
+    left->ptrs[k_btree_fanout] = right->ptrs[k_btree_fanout];
+    delete parent->keys[i];
+  } else {
+    left->keys[left->n] = parent->keys[i];
+    memcpy(left->keys + left->n + 1, right->keys,
+           right->n * sizeof(right->keys[0]));
+    memcpy(left->ptrs + left->n + 1, right->ptrs,
+           (right->n + 1) * sizeof(right->ptrs[0]));
+    left->n += right->n + 1;
+  }
+  free_node(tree, right);
+  remove_at(parent, i);
+  node_refresh(tree, left);
+  node_refresh(tree, parent);
+}
+
+/**
+ * @brief Restore k_btree_min keys in child i of parent
+ */
+static void fix_underflow(BTree *tree, BTreeNode *parent, size_t i) {
+  BTreeNode *node = child(parent, i);
+  BTreeNode *left = i > 0 ? child(parent, i - 1) : NULL;
+  BTreeNode *right = i < parent->n ? child(parent, i + 1) : NULL;
+
+  if (left && left->n > k_btree_min) {
+    // Borrow the last key of the left sibling
+    if (node->leaf) {
+      insert_at(node, 0, left->keys[left->n - 1], left->ptrs[left->n - 1]);
+      left->n--;
+      delete parent->keys[i - 1];
+      parent->keys[i - 1] = new std::string(*node->keys[0]);
+    } else {
+      memmove(&node->ptrs[1], &node->ptrs[0],
+              (node->n + 1) * sizeof(node->ptrs[0]));
+      memmove(&node->keys[1], &node->keys[0],
+              node->n * sizeof(node->keys[0]));
+      node->keys[0] = parent->keys[i - 1];
+      node->ptrs[0] = left->ptrs[left->n];
+      node->n++;
+      parent->keys[i - 1] = left->keys[left->n - 1];
+      left->n--;
+    }
+    node_refresh(tree, left);
+  } else if (right && right->n > k_btree_min) {
+    // Borrow the first key of the right sibling
+    if (node->leaf) {
+      insert_at(node, node->n, right->keys[0], right->ptrs[0]);
+      remove_at(right, 0);
+      delete parent->keys[i];
+      parent->keys[i] = new std::string(*right->keys[0]);
+    } else {
+      node->keys[node->n] = parent->keys[i];
+      node->ptrs[node->n + 1] = right->ptrs[0];
+      node->n++;
+      parent->keys[i] = right->keys[0];
+      memmove(&right->keys[0], &right->keys[1],
+              (right->n - 1) * sizeof(right->keys[0]));
+      memmove(&right->ptrs[0], &right->ptrs[1],
+              right->n * sizeof(right->ptrs[0]));
+      right->n--;
+    }
+    node_refresh(tree, right);
+  } else {
+    merge_kids(tree, parent, left ? i - 1 : i);
+    return;
+  }
+  node_refresh(tree, node);
+  node_refresh(tree, parent);
+}
+
+static void *delete_rec(BTree *tree, BTreeNode *node, const std::string &key,
+                        bool *found) {
+  if (node->leaf) {
+    size_t pos = node_bound(node, key, false);
+    if (pos == node->n || *node->keys[pos] != key) {
+      return NULL;
+    }
+    void *val = node->ptrs[pos];
+    remove_at(node, pos);
+    node_refresh(tree, node);
+    tree->size--;
+    *found = true;
+    return val;
+  }
+
+  size_t idx = node_bound(node, key, true);
+  void *val = delete_rec(tree, child(node, idx), key, found);
+  if (*found && child(node, idx)->n < k_btree_min) {
+    fix_underflow(tree, node, idx);
+  }
+  return val;
+}
+
+/**
+ * @brief Remove a key from the tree
+ *
+ * @param tree Pointer to the tree
+ * @param key Key to remove
+ * @return The value stored with the key, or NULL if not found
+ */
+void *bt_delete(BTree *tree, const std::string &key) {
+  if (!tree->root) {
+    return NULL;
+  }
+  bool found = false;
+  void *val = delete_rec(tree, tree->root, key, &found);
+
+  BTreeNode *root = tree->root;
+  if (!root->leaf && root->n == 0) {
+    tree->root = child(root, 0);
+    free_node(tree, root);
+  } else if (root->leaf && root->n == 0) {
+    tree->root = NULL;
+    free_node(tree, root);
+  }
+  return val;
+}
+
+/**
+ * @brief Find the leaf that would hold key
+ */
+static const BTreeNode *find_leaf(const BTree *tree, const std::string &key) {
+  const BTreeNode *node = tree->root;
+  while (node && !node->leaf) {
+    node = child(node, node_bound(node, key, true));
+  }
+  return node;
+}
+
+/**
+ * @brief Look up the value stored with key
+ *
+ * @return The value, or NULL if not found
+ */
+void *bt_lookup(const BTree *tree, const std::string &key) {
+  const BTreeNode *leaf = find_leaf(tree, key);
+  if (!leaf) {
+    return NULL;
+  }
+  size_t pos = node_bound(leaf, key, false);
+  if (pos < leaf->n && *leaf->keys[pos] == key) {
+    return leaf->ptrs[pos];
+  }
+  return NULL;
+}
+
+/**
+ * @brief Visit keys in [start, end) in order
+ *
+ * Work is bounded by limit: at most limit keys are visited. An empty end
+ * means no upper bound. To continue a range, call again with the last key
+ * visited plus a trailing '\0' as start.
+ *
+ * @param tree Pointer to the tree
+ * @param start Smallest key to visit
+ * @param end Keys from end on are not visited
+ * @param limit Maximum number of keys to visit
+ * @param fn Called per key; returning false stops the iteration
+ * @param arg Passed through to fn
+ * @return Number of keys visited
+ */
+size_t bt_range(const BTree *tree, const std::string &start,
+                const std::string &end, size_t limit,
+                bool (*fn)(const std::string &key, void *val, void *arg),
+                void *arg) {
+  const BTreeNode *leaf = find_leaf(tree, start);
+  if (!leaf) {
+    return 0;
+  }
+  size_t pos = node_bound(leaf, start, false);
+  size_t count = 0;
+
+  while (leaf && count < limit) {
+    for (; pos < leaf->n && count < limit; pos++) {
+      const std::string &key = *leaf->keys[pos];
+      if (!end.empty() && key >= end) {
+        return count;
+      }
+      count++;
+      if (!fn(key, leaf->ptrs[pos], arg)) {
+        return count;
+      }
+    }
+    leaf = child(leaf, k_btree_fanout);
+    pos = 0;
+  }
+  return count;
+}
+
+/**
+ * @brief Bytes used by the tree nodes (keys of leaves not included)
+ */
+size_t bt_memory_usage(const BTree *tree) {
+  return tree->nodes * sizeof(BTreeNode);
+}
+
+static void destroy_rec(BTree *tree, BTreeNode *node) {
+  if (!node->leaf) {
+    for (size_t i = 0; i <= node->n; i++) {
+      destroy_rec(tree, child(node, i));
+    }
+    for (size_t i = 0; i < node->n; i++) {
+      delete node->keys[i];
+    }
+  }
+  free_node(tree, node);
+}
+
+/**
+ * @brief Free every node of the tree (not the keys or values)
+ */
+void bt_destroy(BTree *tree) {
+  if (tree->root) {
+    destroy_rec(tree, tree->root);
+  }
+  *tree = BTree{};
+}
@@ -0,0 +1,58 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Maximum number of keys per node
+const size_t k_btree_fanout = 14;
+
+// Minimum number of keys per non-root node
+const size_t k_btree_min = k_btree_fanout / 2 - 1;
+
+/**
+ * @brief B+tree node laid out around cache lines
+ *
+ * The first cache line holds the header and a 4-byte head per key: the
+ * big-endian bytes of the key right after the prefix shared by every key in
+ * the node (prefix_len bytes). Searching a node compares heads only and
+ * touches the full key just to break ties, so a descent mostly costs one
+ * line per level even when keys share long prefixes such as time buckets.
+ *
+ * Leaves borrow their keys from the caller and keep one value per key;
+ * ptrs[k_btree_fanout] links to the next leaf. Inner nodes own copies of
+ * their separator keys and keep n + 1 children in ptrs; child i holds the
+ * keys below keys[i].
+ */
+struct alignas(64) BTreeNode {
+  uint16_t n;                              // Number of keys
+  uint8_t leaf;                            // 1 for leaves
+  uint8_t pad;
+  uint32_t prefix_len;                     // Bytes shared by all keys
+  uint32_t heads[k_btree_fanout];          // Key bytes after the prefix
+  const std::string *keys[k_btree_fanout]; // Sorted keys
+  void *ptrs[k_btree_fanout + 1];          // Values or children
+};
+
+/**
+ * @brief Ordered index from string keys to opaque values
+ */
+struct BTree {
+  BTreeNode *root = NULL;
+  size_t size = 0;        // Number of keys
+  size_t nodes = 0;       // Number of allocated nodes
+  uint64_t node_writes = 0; // Nodes modified, for write amplification stats
+};
+
+void bt_insert(BTree *tree, const std::string *key, void *val);
+void *bt_delete(BTree *tree, const std::string &key);
+void *bt_lookup(const BTree *tree, const std::string &key);
+size_t bt_range(const BTree *tree, const std::string &start,
+                const std::string &end, size_t limit,
+                bool (*fn)(const std::string &key, void *val, void *arg),
+                void *arg);
+size_t bt_memory_usage(const BTree *tree);
+void bt_destroy(BTree *tree);
+
+#endif
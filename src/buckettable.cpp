@@ -0,0 +1,260 @@
+// buckettable.cpp - A cache-line bucketized hash map with incremental
+// rehashing
+//
+// Instead of one HNode pointer per slot, each bucket is a 64-byte line
+// holding several (tag, node) pairs plus an overflow pointer. See
+// buckettable.h for the layout.
+
+#include <assert.h>
+#include <cstddef>
+#include <cstdint>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buckettable.h"
+
+/**
+ * @brief Derive the 8-bit tag of a hashcode
+ *
+ * The low bits of the hashcode select the bucket, so the tag is taken from
+ * a multiplicative mix of the whole code to stay useful within a bucket.
+ * Zero is reserved for empty slots.
+ */
+static uint8_t bucket_tag(uint64_t hashcode) {
+  uint8_t tag = (uint8_t)((hashcode * 0x9E3779B97F4A7C15ULL) >> 56);
+  return tag ? tag : 1;
+}
+
+/**
+ * @brief Initialize a bucket table with the specified number of buckets
+ *
+ * calloc keeps the demand-zero behaviour for large tables; the array is
+ * over-allocated by one bucket so it can be aligned to a cache line.
+ *
+ * @param table Pointer to the table to initialize
+ * @param n Number of buckets (must be a power of 2)
+ */
+static void initBucketTable(BucketTable *table, uint64_t n) {
+  assert(n > 0 && (n & (n - 1)) == 0);
+
+  table->size = 0;
+  table->mask = n - 1;
+  table->raw = calloc((size_t)n + 1, sizeof(Bucket));
+  uintptr_t p = ((uintptr_t)table->raw + 63) & ~(uintptr_t)63;
+  table->buckets = (Bucket *)p;
+}
+
+/**
+ * @brief Free the overflow chain hanging off a bucket
+ */
+static void free_overflow(Bucket *bucket) {
+  Bucket *cur = bucket->overflow;
+  while (cur) {
+    Bucket *next = cur->overflow;
+    free(cur);
+    cur = next;
+  }
+  bucket->overflow = NULL;
+}
+
+/**
+ * @brief Insert a node into a bucket table
+ *
+ * The node goes into the first empty slot of its bucket chain; a new
+ * overflow bucket is appended when the chain is full.
+ */
+static void b_insert(BucketTable *table, HNode *node) {
+  uint8_t tag = bucket_tag(node->hashcode);
+  Bucket *bucket = &table->buckets[node->hashcode & table->mask];
+
+  while (true) {
+    for (size_t i = 0; i < k_bucket_slots; i++) {
+      if (bucket->tags[i] == 0) {
+        bucket->tags[i] = tag;
+        bucket->nodes[i] = node;
+        table->size++;
+        return;
+      }
+    }
+    if (!bucket->overflow) {
+      void *mem = NULL;
+      if (posix_memalign(&mem, 64, sizeof(Bucket)) != 0) {
+        abort();
+      }
+      memset(mem, 0, sizeof(Bucket));
+      bucket->overflow = (Bucket *)mem;
+    }
+    bucket = bucket->overflow;
+  }
+}
+
+/**
+ * @brief Find the slot holding a matching node in a bucket table
+ *
+ * @param table Pointer to the table
+ * @param node Template node with the hashcode to look up
+ * @param cmp Comparison function to determine if nodes match
+ * @param out_bucket Receives the bucket containing the match
+ * @return Slot index within *out_bucket, or -1 if not found
+ */
+static int b_find(BucketTable *table, HNode *node,
+                  bool (*cmp)(HNode *, HNode *), Bucket **out_bucket) {
+  if (table->buckets == NULL) {
+    return -1;
+  }
+
+  uint8_t tag = bucket_tag(node->hashcode);
+  Bucket *bucket = &table->buckets[node->hashcode & table->mask];
+
+  for (; bucket; bucket = bucket->overflow) {
+    for (size_t i = 0; i < k_bucket_slots; i++) {
+      if (bucket->tags[i] == tag && cmp(bucket->nodes[i], node)) {
+        *out_bucket = bucket;
+        return (int)i;
+      }
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Perform incremental rehashing
+ *
+ * Moves up to k_resizing_work nodes from b2 to b1, walking b2 one bucket
+ * chain at a time. Overflow buckets are released once their chain has
+ * been drained.
+ *
+ * @param bmap Pointer to the bucketized map
+ */
+void bm_resizing(BMap *bmap) {
+  if (bmap->b2.buckets == NULL) {
+    return;
+  }
+
+  size_t nodes_moved = 0;
+
+  while (nodes_moved < k_resizing_work && bmap->b2.size > 0) {
+    Bucket *head = &bmap->b2.buckets[bmap->resizing_pos];
+
+    for (Bucket *bucket = head; bucket && nodes_moved < k_resizing_work;
+         bucket = bucket->overflow) {
+      for (size_t i = 0; i < k_bucket_slots && nodes_moved < k_resizing_work;
+           i++) {
+        if (bucket->tags[i] == 0) {
+          continue;
+        }
+        b_insert(&bmap->b1, bucket->nodes[i]);
+        bucket->tags[i] = 0;
+        bmap->b2.size--;
+        nodes_moved++;
+      }
+    }
+
+    if (nodes_moved == k_resizing_work) {
+      // The chain may still hold nodes past the work limit; resume here.
+      break;
+    }
+    free_overflow(head);
+    bmap->resizing_pos++;
+  }
+
+  // Clean up b2 if it's empty
+  if (bmap->b2.size == 0) {
+    for (uint64_t i = bmap->resizing_pos; i <= bmap->b2.mask; i++) {
+      free_overflow(&bmap->b2.buckets[i]);
+    }
+    free(bmap->b2.raw);
+    bmap->b2 = BucketTable{};
+  }
+}
+
+/**
+ * @brief Look up a node in the bucketized map
+ *
+ * @param bmap Pointer to the bucketized map
+ * @param node Template node with the hashcode to look up
+ * @param cmp Comparison function to determine if nodes match
+ * @return Pointer to the found node, or NULL if not found
+ */
+HNode *bm_lookup(BMap *bmap, HNode *node, bool (*cmp)(HNode *, HNode *)) {
+  bm_resizing(bmap);
+
+  Bucket *bucket;
+  int slot = b_find(&bmap->b1, node, cmp, &bucket);
+  if (slot < 0) {
+    slot = b_find(&bmap->b2, node, cmp, &bucket);
+  }
+  return slot < 0 ? NULL : bucket->nodes[slot];
+}
+
+/**
+ * @brief Insert a node into the bucketized map
+ *
+ * Starts a rehash into a table with twice as many buckets once the
+ * average chain holds k_bucket_max_load nodes.
+ *
+ * @param bmap Pointer to the bucketized map
+ * @param node Pointer to the node to insert
+ */
+void bm_insert(BMap *bmap, HNode *node) {
+  if (!bmap->b1.buckets) {
+    initBucketTable(&bmap->b1, 4);
+  }
+
+  b_insert(&bmap->b1, node);
+
+  if (!bmap->b2.buckets &&
+      (bmap->b1.mask + 1) * k_bucket_max_load <= bmap->b1.size) {
+    bmap->b2 = bmap->b1;
+    initBucketTable(&bmap->b1, (bmap->b2.mask + 1) * 2);
+    bmap->resizing_pos = 0;
+  }
+
+  bm_resizing(bmap);
+}
+
+/**
+ * @brief Delete a node from the bucketized map
+ *
+ * The slot is simply cleared; later inserts into the same chain reuse it.
+ *
+ * @param bmap Pointer to the bucketized map
+ * @param node Template node with the hashcode to delete
+ * @param cmp Comparison function to determine if nodes match
+ * @return Pointer to the deleted node or NULL if not found
+ */
+HNode *bm_delete(BMap *bmap, HNode *node, bool (*cmp)(HNode *, HNode *)) {
+  bm_resizing(bmap);
+
+  BucketTable *tables[2] = {&bmap->b1, &bmap->b2};
+  for (BucketTable *table : tables) {
+    Bucket *bucket;
+    int slot = b_find(table, node, cmp, &bucket);
+    if (slot >= 0) {
+      bucket->tags[slot] = 0;
+      table->size--;
+      return bucket->nodes[slot];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Release the bucket arrays of the map (not the nodes)
+ *
+ * @param bmap Pointer to the bucketized map
+ */
+void bm_destroy(BMap *bmap) {
+  BucketTable *tables[2] = {&bmap->b1, &bmap->b2};
+  for (BucketTable *table : tables) {
+    if (!table->buckets) {
+      continue;
+    }
+    for (uint64_t i = 0; i <= table->mask; i++) {
+      free_overflow(&table->buckets[i]);
+    }
+    free(table->raw);
+    *table = BucketTable{};
+  }
+  bmap->resizing_pos = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef BUCKETTABLE_H
+#define BUCKETTABLE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "hashtable.h"
+
+// Number of (tag, node) pairs that fit in one cache-line bucket
+const size_t k_bucket_slots = 6;
+
+// Average number of nodes per bucket before triggering rehash
+const size_t k_bucket_max_load = 4;
+
+/**
+ * @brief One cache line of a bucketized hash table
+ *
+ * Each slot pairs an 8-bit tag taken from the top of the hashcode with a
+ * pointer to the node. A lookup scans the tags of a single cache line and
+ * only dereferences nodes whose tag matches, so in the common case the
+ * bucket array costs one miss instead of the slot + node chain walk of
+ * HashTable. When all slots are taken, further nodes go to an overflow
+ * bucket chained from the last word of the line.
+ */
+struct alignas(64) Bucket {
+  uint8_t tags[k_bucket_slots]; // 0 marks an empty slot
+  uint8_t pad[8 - k_bucket_slots];
+  HNode *nodes[k_bucket_slots];
+  Bucket *overflow; // Next bucket for the same index, or NULL
+};
+
+static_assert(sizeof(Bucket) == 64, "Bucket must fill exactly a cache line");
+
+/**
+ * @brief Single bucketized table with a fixed number of buckets
+ */
+struct BucketTable {
+  Bucket *buckets = NULL; // Cache-line aligned array of buckets
+  void *raw = NULL;       // Allocation backing buckets, passed to free()
+  uint64_t mask;          // Number of buckets - 1
+  uint64_t size;          // Number of keys in the table
+};
+
+/**
+ * @brief Bucketized hash map with incremental rehashing support
+ *
+ * Same scheme as HMap: b1 receives new entries, b2 is the old table being
+ * drained into b1 a bucket at a time, starting at resizing_pos.
+ */
+struct BMap {
+  struct BucketTable b1;    // Primary table
+  struct BucketTable b2;    // Old table (used during rehashing)
+  int64_t resizing_pos = 0; // Next bucket of b2 to migrate
+};
+
+HNode *bm_lookup(BMap *bmap, HNode *node, bool (*cmp)(HNode *, HNode *));
+void bm_insert(BMap *bmap, HNode *node);
+HNode *bm_delete(BMap *bmap, HNode *node, bool (*cmp)(HNode *, HNode *));
+void bm_resizing(BMap *bmap);
+void bm_destroy(BMap *bmap);
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef ELCLIENT_H
+#define ELCLIENT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+
+/**
+ * libelclient: an asynchronous client for the native protocol.
+ *
+ * A client owns a pool of non-blocking connections to one server and an
+ * I/O thread that drives them with epoll. Any thread may send: the request
+ * is encoded straight into the connection's output buffer and its reply
+ * delivered through a future, so requests issued while the I/O thread is
+ * busy are pipelined into a single write and their responses matched up in
+ * order. The output buffers are swapped with the I/O thread's rather than
+ * reallocated, so steady-state sending does not allocate per request.
+ *
+ * A single-key command (see is_single_key_command() in protocol.h) goes to
+ * the pool connection chosen by hashing its key, its second string, so
+ * commands on one key are executed in the order they were sent. Every
+ * other command, such as mget, eval, exec, krange or ts.mrange, goes to the
+ * first connection. With more than one connection such a command may
+ * therefore overtake a command sent earlier on another connection; when
+ * that matters, wait for the earlier replies before sending it.
+ *
+ * With ClientOptions::tagged set, requests carry IDs and the server may
+ * answer a slow read after requests sent behind it, so one large range
+ * does not delay the replies queued after it. Commands on one key still
+ * take effect in order, since the server never lets a write overtake a
+ * read; only the order of the replies changes. Servers and proxies that do
+ * not take tagged requests fail them with an error reply.
+ *
+ * Errors are replies: a request that cannot be sent, or whose connection
+ * is lost before it is answered, completes with ok false and the reason in
+ * data. A lost connection is reconnected by the next request sent on it.
+ */
+
+struct ClientOptions {
+  std::string host = "127.0.0.1";
+  uint16_t port = 3333;
+  size_t connections = 1; // Pool size
+  bool tagged = false;     // Tag requests so replies may arrive out of order
+};
+
+struct ClientReply {
+  bool ok = false;  // False if no response was received
+  std::string data; // The response text, or why there is none
+};
+
+struct ElClient;
+
+// Connects every connection of the pool. Returns NULL and sets *error if a
+// connection cannot be made.
+ElClient *elclient_connect(const ClientOptions &options, std::string *error);
+
+// Stops the I/O thread, completes outstanding requests with an error and
+// frees the client.
+void elclient_close(ElClient *client);
+
+// Sends a command; the future completes with its reply.
+std::future<ClientReply> elclient_send(ElClient *client,
+                                       const std::vector<std::string> &command);
+
+// Sends several commands at once; the future completes when all are
+// answered, with the replies in command order.
+std::future<std::vector<ClientReply>>
+elclient_send_batch(ElClient *client,
+                    const std::vector<std::vector<std::string>> &commands);
+
+// Sends a command and waits for its reply.
+ClientReply elclient_call(ElClient *client,
+                          const std::vector<std::string> &command);
+
+// -----------------------------------------------------------------------
+// Shared-memory transport
+//
+// A client on the server's host may instead exchange requests with it
+// through shared memory (see shm.h), avoiding the network stack. This
+// client is synchronous and, like the server's rings, single producer: it
+// must be used by one thread at a time. It spins briefly waiting for a
+// reply before sleeping, so round trips to a busy server make no system
+// calls.
+// -----------------------------------------------------------------------
+struct ElShmClient;
+
+// Connects to the shared-memory listener at path (the server's --shm
+// socket). Returns NULL and sets *error on failure.
+ElShmClient *elclient_shm_connect(const char *path, std::string *error);
+
+// Sends a command and waits for its reply.
+ClientReply elclient_shm_call(ElShmClient *client,
+                              const std::vector<std::string> &command);
+
+void elclient_shm_close(ElShmClient *client);
+
+// -----------------------------------------------------------------------
+// UDP transport
+//
+// get and mget may be sent to a server started with --udp as single
+// datagrams (see udp.h), which costs the server no connection state. A
+// request is sent again if no response arrives in time, and repeated over
+// TCP, on a connection opened on first need, if its response does not fit
+// in a datagram. Like the shared-memory client this one is synchronous and
+// for one thread at a time.
+// -----------------------------------------------------------------------
+struct ElUdpClient;
+
+// Opens a UDP socket to the server of options. Returns NULL and sets
+// *error on failure.
+ElUdpClient *elclient_udp_connect(const ClientOptions &options,
+                                  std::string *error);
+
+// Sends a command and waits for its reply.
+ClientReply elclient_udp_call(ElUdpClient *client,
+                              const std::vector<std::string> &command);
+
+void elclient_udp_close(ElUdpClient *client);
+
+// Appends the request for tokens to out. Returns false, leaving out
+// unchanged, if it would exceed the server's request size limits.
+bool build_request(const std::vector<std::string> &tokens, std::string *out);
+
+// Splits the reply to a successful exec into the replies of the queued
+// commands, in order. Returns false if reply is not one.
+bool split_exec_reply(const std::string &reply,
+                      std::vector<std::string> *results);
+
+#endif // ELCLIENT_H
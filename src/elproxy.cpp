@@ -0,0 +1,660 @@
+// elproxy.cpp - Connection-multiplexing proxy
+
+// stdlib
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <stdio.h>
+#include <string.h>
+// system
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+// C++
+#include <deque>
+#include <string>
+#include <vector>
+// project
+#include "elserver.h"
+#include "logging.h"
+#include "protocol.h"
+
+using namespace std;
+
+/*
+ * Clients connect to the proxy exactly as they would to a server. Each
+ * complete request (framed by frame_request(), as the server does) is
+ * copied unchanged onto one of a few pipelined connections to a backend
+ * server, picked by hashing the request's key (its second string), so all
+ * commands on a key reach the same server over the same connection and
+ * stay ordered. Requests from many clients share each backend write, and
+ * the server sees k_proxy_backend_conns connections per proxy instead of
+ * one per client.
+ *
+ * Every request takes a slot at the back of its client's queue, and the
+ * backend connection remembers which slot each of its outstanding requests
+ * belongs to. Backends answer in order, so a response fills the slot at
+ * the front of that list; a client is sent the filled slots at the front of
+ * its queue, restoring its request order across backends. A response for
+ * the client's oldest slot, the common case, is copied straight to its
+ * output.
+ *
+ * Commands that do not act on their second string alone (mget, krange,
+ * ts.mrange, scripts, bgsave, ...) may touch keys sent over other
+ * connections, so the requests around them would no longer be executed in
+ * the client's order. Such a command is forwarded only once everything the
+ * client has in flight is answered, and nothing more is forwarded until it
+ * is answered in turn.
+ *
+ * Transactions keep state on the server connection and cannot be
+ * multiplexed, so multi, exec, discard, watch and unwatch are refused, as
+ * are tagged requests, whose out-of-order responses the slot queues cannot
+ * place.
+ * With several backends keys are partitioned among them; commands that
+ * touch other keys than their second string (ts.mrange, scripts) only see
+ * the keys of the backend they are sent to.
+ */
+
+// Port the proxy listens on
+const uint16_t PROXY_PORT = 3334;
+
+// Connections to each backend server
+const size_t k_proxy_backend_conns = 4;
+
+// Requests a client may have in flight before the proxy stops reading from
+// it, and output it may leave unread
+const size_t k_proxy_max_in_flight = 1024;
+const size_t k_proxy_max_output = 1 << 20;
+
+// Bytes read from a client per event before its requests are forwarded
+const size_t k_proxy_max_input = 64 * 1024;
+
+// Seconds between attempts to reconnect a lost backend connection
+const int64_t k_proxy_reconnect_secs = 1;
+
+enum ProxyKind { PK_LISTENER, PK_CLIENT, PK_BACKEND };
+
+// Fields shared by everything registered with epoll
+struct Endpoint {
+  ProxyKind kind;
+  int fd = -1;
+  uint32_t events = 0; // Currently registered epoll events
+  string in;
+  string out;
+  size_t sent = 0;
+};
+
+// A response a client is waiting for
+struct Slot {
+  bool ready = false;
+  string data; // The framed response
+};
+
+struct Client : Endpoint {
+  deque<Slot> slots; // In request order
+  size_t in_flight = 0;
+  bool barrier = false; // The last request forwarded must complete first
+  bool dirty = false;   // Queued for update_client()
+  bool closed = false;  // Socket closed; freed once nothing is in flight
+  bool closing = false; // Close after sending what is queued
+  Client() { kind = PK_CLIENT; }
+};
+
+// A request waiting for its response on a backend connection
+struct Waiter {
+  Client *client;
+  Slot *slot;
+};
+
+struct Backend : Endpoint {
+  size_t server;
+  bool connected = false;
+  bool dirty = false; // Has output not yet written this loop iteration
+  int64_t last_attempt = 0;
+  deque<Waiter> waiting;
+  Backend() { kind = PK_BACKEND; }
+};
+
+struct ServerAddr {
+  string host;
+  uint16_t port;
+};
+
+static int epoll_fd = -1;
+static Endpoint listener;
+static vector<ServerAddr> servers;
+static vector<Backend *> backends;
+static vector<Backend *> dirty_backends;
+static vector<Client *> dirty_clients;
+// Closed clients with nothing in flight, freed at the end of the round
+static vector<Client *> dead_clients;
+
+static int64_t now_secs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+// Registers, changes or keeps the epoll events of e
+static void set_events(Endpoint *e, uint32_t events) {
+  if (events == e->events) {
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = e;
+  if (epoll_ctl(epoll_fd, e->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, e->fd,
+                &ev) < 0) {
+    LOG_SYS_ERROR("epoll_ctl() error");
+  }
+  e->events = events;
+}
+
+// Writes as much queued output as the socket takes. Returns false if the
+// connection failed.
+static bool flush_out(Endpoint *e) {
+  while (e->sent < e->out.size()) {
+    ssize_t rv =
+        write(e->fd, e->out.data() + e->sent, e->out.size() - e->sent);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    } else if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else if (rv <= 0) {
+      return false;
+    }
+    e->sent += rv;
+  }
+  if (e->sent == e->out.size()) {
+    e->out.clear();
+    e->sent = 0;
+  } else if (e->sent > e->out.size() / 2) {
+    e->out.erase(0, e->sent);
+    e->sent = 0;
+  }
+  return true;
+}
+
+// Reads what is available into e->in, up to about max bytes. Returns false
+// on EOF or error.
+static bool read_in(Endpoint *e, size_t max) {
+  char buf[16384];
+  while (e->in.size() < max) {
+    ssize_t rv = read(e->fd, buf, sizeof(buf));
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    } else if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true;
+    } else if (rv <= 0) {
+      return false;
+    }
+    e->in.append(buf, rv);
+  }
+  return true;
+}
+
+static void frame_response(string *out, const char *msg, size_t len) {
+  int32_t net_sz = htonl((int32_t)len);
+  out->append((const char *)&net_sz, 4);
+  out->append(msg, len);
+}
+
+// -----------------------------------------------------------------------
+// Clients
+// -----------------------------------------------------------------------
+static void mark_dirty(Client *c) {
+  if (!c->dirty && !c->closed) {
+    c->dirty = true;
+    dirty_clients.push_back(c);
+  }
+}
+
+// Moves the filled slots at the front of c's queue to its output
+static void drain_slots(Client *c) {
+  while (!c->slots.empty() && c->slots.front().ready) {
+    c->out.append(c->slots.front().data);
+    c->slots.pop_front();
+  }
+  mark_dirty(c);
+}
+
+// Stores a response in slot, or straight in the output when slot is next
+static void deliver(Client *c, Slot *slot, const char *data, size_t len) {
+  c->in_flight--;
+  if (c->closed) {
+    // Its slots are gone; slot must not be touched
+    if (c->in_flight == 0) {
+      dead_clients.push_back(c);
+    }
+    return;
+  }
+  mark_dirty(c);
+  if (slot == &c->slots.front()) {
+    c->out.append(data, len);
+    c->slots.pop_front();
+    drain_slots(c);
+  } else {
+    slot->data.assign(data, len);
+    slot->ready = true;
+  }
+}
+
+// Answers a request at the proxy, in order with the forwarded ones
+static void answer(Client *c, const char *msg) {
+  c->slots.emplace_back();
+  Slot &slot = c->slots.back();
+  frame_response(&slot.data, msg, strlen(msg));
+  slot.ready = true;
+  drain_slots(c);
+}
+
+static void close_client(Client *c) {
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr) < 0) {
+    LOG_SYS_ERROR("epoll_ctl(DEL) error");
+  }
+  close(c->fd);
+  c->closed = true;
+  c->slots.clear();
+  if (c->in_flight == 0) {
+    dead_clients.push_back(c);
+  }
+}
+
+static bool connect_backend(Backend *b);
+
+static bool is_transaction_command(const char *name, uint32_t len) {
+  static const char *const names[] = {"multi", "exec", "discard", "watch",
+                                      "unwatch"};
+  for (const char *n : names) {
+    if (len == strlen(n) && memcmp(name, n, len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// FNV-1a, as the server hashes keys
+static uint64_t key_hash(const char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Forwards the complete requests buffered from c, until it has too much in
+// flight or must wait for a request to complete; see the comment at the top
+static void process_client(Client *c) {
+  size_t pos = 0;
+  const char *error;
+  while (!c->closing && c->in_flight < k_proxy_max_in_flight &&
+         c->out.size() - c->sent < k_proxy_max_output) {
+    const char *start = c->in.data() + pos;
+    int32_t n = frame_request(start, c->in.data() + c->in.size(), &error);
+    if (n == 0) {
+      break;
+    } else if (n < 0) {
+      answer(c, error);
+      c->closing = true;
+      break;
+    }
+
+    const char *name, *key;
+    uint32_t name_len, key_len, id;
+    request_arg(start, 0, &name, &name_len);
+    bool single_key = is_single_key_command(name, name_len);
+    if ((c->barrier || !single_key) && c->in_flight > 0) {
+      // update_client() resumes once the responses are in
+      break;
+    }
+    pos += n;
+    if (request_tag(start, &id)) {
+      // Clients are answered in request order; see the comment at the top
+      answer(c, "tagged requests are not supported through the proxy\n");
+      continue;
+    } else if (is_transaction_command(name, name_len)) {
+      answer(c, "transactions are not supported through the proxy\n");
+      continue;
+    }
+    if (request_nargs(start) >= 2) {
+      request_arg(start, 1, &key, &key_len);
+    } else {
+      key = name;
+      key_len = name_len;
+    }
+    uint64_t h = key_hash(key, key_len);
+    size_t server = h % servers.size();
+    Backend *b = backends[server * k_proxy_backend_conns +
+                          (h / servers.size()) % k_proxy_backend_conns];
+    if (b->fd < 0 && !connect_backend(b)) {
+      answer(c, "backend unavailable\n");
+      continue;
+    }
+
+    c->slots.emplace_back();
+    b->waiting.push_back({c, &c->slots.back()});
+    c->in_flight++;
+    c->barrier = !single_key;
+    b->out.append(start, n);
+    if (!b->dirty) {
+      b->dirty = true;
+      dirty_backends.push_back(b);
+    }
+  }
+  c->in.erase(0, pos);
+}
+
+// Writes c's output and picks the epoll events it needs next
+static void update_client(Client *c) {
+  c->dirty = false;
+  if (c->closed) {
+    return;
+  }
+  if (!flush_out(c)) {
+    close_client(c);
+    return;
+  }
+  if (c->closing && c->slots.empty() && c->out.empty()) {
+    close_client(c);
+    return;
+  }
+  bool backlog = c->in_flight >= k_proxy_max_in_flight ||
+                 c->out.size() - c->sent >= k_proxy_max_output;
+  if (!backlog && !c->in.empty()) {
+    // Resume requests held back while the client was over its limits
+    process_client(c);
+  }
+  uint32_t events = c->out.empty() ? 0u : (uint32_t)EPOLLOUT;
+  // Input held back behind a barrier is not read past k_proxy_max_input
+  if (!c->closing && c->in_flight < k_proxy_max_in_flight &&
+      c->out.size() - c->sent < k_proxy_max_output &&
+      c->in.size() < k_proxy_max_input) {
+    events |= EPOLLIN;
+  }
+  set_events(c, events | EPOLLRDHUP);
+}
+
+static void accept_clients() {
+  for (int i = 0; i < MAX_ACCEPTS_PER_EVENT; i++) {
+    int fd = accept4(listener.fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_SYS_ERROR("accept() error");
+      }
+      return;
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    Client *c = new Client;
+    c->fd = fd;
+    set_events(c, EPOLLIN | EPOLLRDHUP);
+  }
+}
+
+// -----------------------------------------------------------------------
+// Backends
+// -----------------------------------------------------------------------
+
+// Fails every request waiting on b and closes it; it reconnects on demand
+static void reset_backend(Backend *b, const char *why) {
+  LOG_WARN("backend %s:%d: %s", servers[b->server].host.c_str(),
+           (int)servers[b->server].port, why);
+  if (b->fd >= 0) {
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, b->fd, nullptr) < 0) {
+      LOG_SYS_ERROR("epoll_ctl(DEL) error");
+    }
+    close(b->fd);
+  }
+  b->fd = -1;
+  b->events = 0;
+  b->connected = false;
+  b->in.clear();
+  b->out.clear();
+  b->sent = 0;
+  string msg;
+  frame_response(&msg, "backend connection lost\n", 24);
+  while (!b->waiting.empty()) {
+    Waiter w = b->waiting.front();
+    b->waiting.pop_front();
+    deliver(w.client, w.slot, msg.data(), msg.size());
+  }
+}
+
+// Starts a non-blocking connect; requests queue until it completes. Returns
+// false if no attempt could be made.
+static bool connect_backend(Backend *b) {
+  int64_t now = now_secs();
+  if (b->last_attempt != 0 && now - b->last_attempt < k_proxy_reconnect_secs) {
+    return false;
+  }
+  b->last_attempt = now;
+
+  const ServerAddr &addr = servers[b->server];
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(addr.port);
+  if (inet_pton(AF_INET, addr.host.c_str(), &sa.sin_addr) != 1) {
+    struct hostent *he = gethostbyname(addr.host.c_str());
+    if (!he || he->h_addrtype != AF_INET) {
+      LOG_ERROR("cannot resolve backend host");
+      return false;
+    }
+    memcpy(&sa.sin_addr, he->h_addr_list[0], sizeof(sa.sin_addr));
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    LOG_SYS_ERROR("error creating socket");
+    return false;
+  }
+  int val = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 &&
+      errno != EINPROGRESS) {
+    LOG_SYS_ERROR("connect() error");
+    close(fd);
+    return false;
+  }
+  b->fd = fd;
+  b->connected = false;
+  set_events(b, EPOLLIN | EPOLLOUT);
+  return true;
+}
+
+// Splits the responses read from b and hands them to their clients
+static void process_backend(Backend *b) {
+  size_t pos = 0;
+  while (b->in.size() - pos >= 4) {
+    int32_t len;
+    memcpy(&len, b->in.data() + pos, 4);
+    len = ntohl(len);
+    if (len < 0 || b->waiting.empty()) {
+      b->in.erase(0, pos);
+      reset_backend(b, "unexpected response");
+      return;
+    }
+    if (b->in.size() - pos - 4 < (size_t)len) {
+      break;
+    }
+    Waiter w = b->waiting.front();
+    b->waiting.pop_front();
+    deliver(w.client, w.slot, b->in.data() + pos, 4 + (size_t)len);
+    pos += 4 + len;
+  }
+  b->in.erase(0, pos);
+}
+
+static void update_backend(Backend *b) {
+  b->dirty = false;
+  if (b->fd < 0 || !b->connected) {
+    return; // Output waits for the connect to complete
+  }
+  if (!flush_out(b)) {
+    reset_backend(b, "write failed");
+    return;
+  }
+  set_events(b, b->out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+}
+
+static void backend_event(Backend *b, uint32_t events) {
+  if (!b->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+      errno = err;
+      reset_backend(b, "connect failed");
+      return;
+    }
+    b->connected = true;
+    b->last_attempt = 0;
+    LOG_INFO("connected to backend %s:%d", servers[b->server].host.c_str(),
+             (int)servers[b->server].port);
+  }
+  if (events & EPOLLIN) {
+    bool open = read_in(b, SIZE_MAX);
+    process_backend(b);
+    if (!open) {
+      reset_backend(b, "connection closed");
+      return;
+    }
+  } else if (events & (EPOLLERR | EPOLLHUP)) {
+    reset_backend(b, "connection error");
+    return;
+  }
+  update_backend(b);
+}
+
+// -----------------------------------------------------------------------
+// Event loop
+// -----------------------------------------------------------------------
+static int open_listener(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    LOG_SYS_ERROR("error creating socket");
+    exit(EXIT_FAILURE);
+  }
+  int val = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    LOG_SYS_ERROR("bind() error");
+    exit(EXIT_FAILURE);
+  }
+  if (listen(fd, SOMAXCONN) < 0) {
+    LOG_SYS_ERROR("listen() error");
+    exit(EXIT_FAILURE);
+  }
+  LOG_INFO("proxy listening on port %d", (int)port);
+  return fd;
+}
+
+static void proxy_run(uint16_t port) {
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    LOG_SYS_ERROR("epoll_create1() error");
+    exit(EXIT_FAILURE);
+  }
+  listener.kind = PK_LISTENER;
+  listener.fd = open_listener(port);
+  set_events(&listener, EPOLLIN);
+  for (size_t s = 0; s < servers.size(); s++) {
+    for (size_t i = 0; i < k_proxy_backend_conns; i++) {
+      Backend *b = new Backend;
+      b->server = s;
+      backends.push_back(b);
+      connect_backend(b);
+    }
+  }
+
+  struct epoll_event events[64];
+  for (;;) {
+    int n = epoll_wait(epoll_fd, events, 64, -1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      LOG_SYS_ERROR("epoll_wait error");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+      Endpoint *e = (Endpoint *)events[i].data.ptr;
+      uint32_t ev = events[i].events;
+      if (e->kind == PK_LISTENER) {
+        accept_clients();
+      } else if (e->kind == PK_BACKEND) {
+        backend_event((Backend *)e, ev);
+      } else {
+        Client *c = (Client *)e;
+        if (ev & (EPOLLERR | EPOLLHUP)) {
+          close_client(c);
+          continue;
+        }
+        bool open = !(ev & EPOLLIN) || read_in(c, k_proxy_max_input);
+        if (!open || (ev & EPOLLRDHUP)) {
+          close_client(c);
+          continue;
+        }
+        process_client(c);
+        mark_dirty(c);
+      }
+    }
+    // Write what this round of events queued: each backend gets the
+    // requests of all its clients in one write, each client its responses.
+    // Clients let out of their limits forward more, so repeat until done.
+    vector<Backend *> bs;
+    vector<Client *> cs;
+    while (!dirty_backends.empty() || !dirty_clients.empty()) {
+      bs.swap(dirty_backends);
+      for (Backend *b : bs) {
+        update_backend(b);
+      }
+      bs.clear();
+      cs.swap(dirty_clients);
+      for (Client *c : cs) {
+        update_client(c);
+      }
+      cs.clear();
+    }
+    for (Client *c : dead_clients) {
+      delete c;
+    }
+    dead_clients.clear();
+  }
+}
+
+int main(int argc, char *argv[]) {
+  uint16_t port = PROXY_PORT;
+  for (int i = 1; i < argc; i++) {
+    const char *colon = strrchr(argv[i], ':');
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      port = (uint16_t)atoi(argv[++i]);
+    } else if (colon && colon != argv[i] && atoi(colon + 1) > 0) {
+      servers.push_back({string(argv[i], colon - argv[i]),
+                         (uint16_t)atoi(colon + 1)});
+    } else {
+      fprintf(stderr, "usage: %s [--port port] host:port [host:port ...]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (servers.empty()) {
+    servers.push_back({"127.0.0.1", SERVER_PORT});
+  }
+
+  log_init();
+  atexit(log_shutdown);
+  proxy_run(port);
+  return 0;
+}
@@ -11,23 +11,60 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 // C++
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <unordered_map>
 #include <vector>
 // project
+#include "aof.h"
 #include "elserver.h"
 #include "hashtable.h"
+#include "json.h"
 #include "logging.h"
+#include "memcache.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "script.h"
+#include "shm.h"
+#include "sketch.h"
+#include "snapshot.h"
+#include "timeseries.h"
+#include "udp.h"
+#include "valuetype.h"
+#include "vector.h"
 
 using namespace std;
 
-volatile bool running = true;
+static std::atomic<bool> running{true};
+// Wakes the event loop from server_stop(); registered with its own address
+// as the epoll data.ptr
+static std::atomic<int> wake_fd{-1};
 DB db;
 
+// A listening (or UDP) socket; epoll events for it carry a pointer to this
+// struct
+struct Listener {
+  int fd;
+  Protocol protocol;
+};
+static Listener listeners[MAX_LISTENERS];
+static size_t n_listeners = 0;
+
+// Returns the listener ptr refers to, or NULL if it is a connection
+static Listener *as_listener(void *ptr) {
+  Listener *l = (Listener *)ptr;
+  return l >= listeners && l < listeners + n_listeners ? l : NULL;
+}
+
 // -----------------------------------------------------------------------
 // set_fd_nb: sets fd to non-blocking mode
 // -----------------------------------------------------------------------
@@ -45,14 +82,17 @@ int set_fd_nb(int fd) {
   return 0;
 }
 
-// -----------------------------------------------------------------------
-// flush_write_buffer
-//   - We do real non-blocking writes
-// -----------------------------------------------------------------------
-int32_t flush_write_buffer(Connection *conn) {
+// Writes up to len bytes to the connection's socket or response ring.
+// Returns the number written, 0 if it takes no more for now, or -1 on error.
+static ssize_t send_some(Connection *conn, const char *data, size_t len) {
+  if (conn->shm) {
+    size_t n = shm_write(conn->shm, data, len);
+    metric_add(M_BYTES_OUT, (uint64_t)n);
+    return (ssize_t)n;
+  }
   while (true) {
-    ssize_t rv = write(conn->fd, conn->write_buffer + conn->bytes_sent,
-                       conn->write_buffer_size - conn->bytes_sent);
+    // MSG_NOSIGNAL: a client gone mid-reply is an error, not a SIGPIPE
+    ssize_t rv = send(conn->fd, data, len, MSG_NOSIGNAL);
     if (rv < 0 && errno == EINTR) {
       // retry
       continue;
@@ -65,18 +105,45 @@ int32_t flush_write_buffer(Connection *conn) {
     } else if (rv == 0) {
       // client closed connection
       return -1;
-    } else {
-      // wrote rv bytes
-      conn->bytes_sent += rv;
-      if (conn->bytes_sent == conn->write_buffer_size) {
-        // done
-        conn->write_buffer_size = 0;
-        conn->bytes_sent = 0;
-        return 1;
-      }
     }
+    metric_add(M_BYTES_OUT, (uint64_t)rv);
+    return rv;
+  }
+}
+
+// -----------------------------------------------------------------------
+// flush_write_buffer
+//   - We do real non-blocking writes
+//   - the overflow goes out once the write buffer is empty, straight from
+//     its string so a large reply takes few system calls
+// -----------------------------------------------------------------------
+int32_t flush_write_buffer(Connection *conn) {
+  while (conn->bytes_sent < conn->write_buffer_size) {
+    ssize_t rv = send_some(conn, conn->write_buffer + conn->bytes_sent,
+                           conn->write_buffer_size - conn->bytes_sent);
+    if (rv <= 0) {
+      return (int32_t)rv;
+    }
+    conn->bytes_sent += rv;
+  }
+  conn->write_buffer_size = 0;
+  conn->bytes_sent = 0;
+
+  while (conn->overflow_sent < conn->overflow.size()) {
+    ssize_t rv = send_some(conn, conn->overflow.data() + conn->overflow_sent,
+                           conn->overflow.size() - conn->overflow_sent);
+    if (rv <= 0) {
+      return (int32_t)rv;
+    }
+    conn->overflow_sent += rv;
   }
-  // never reached
+  if (conn->overflow.capacity() > VALUE_DOUBLING_MAX) {
+    // Don't keep the memory of a large reply around
+    std::string().swap(conn->overflow);
+  } else {
+    conn->overflow.clear();
+  }
+  conn->overflow_sent = 0;
   return 1;
 }
 
@@ -87,7 +154,7 @@ bool cmp(HNode *lhs, HNode *rhs) {
 }
 
 // FNV hash
-static uint64_t str_hash(const uint8_t *data, size_t len) {
+uint64_t str_hash(const uint8_t *data, size_t len) {
   uint32_t h = 0x811C9DC5;
   for (size_t i = 0; i < len; i++) {
     h = (h ^ data[i]) * 0x01000193;
@@ -95,63 +162,468 @@ static uint64_t str_hash(const uint8_t *data, size_t len) {
   return h;
 }
 
-void do_get(const char *key, RequestResponse *response) {
-  Entry entry;
-  entry.key = key;
-  entry.node.hashcode = str_hash((const uint8_t *)key, strlen(key));
-
-  HNode *node = hm_lookup(&db.hmap, &entry.node, &cmp);
+// True, with an error in response, if value is structured. The string
+// commands never return the tagged encoding of another type.
+static bool not_a_string(const string &value, RequestResponse *response) {
+  if (value_type(value) == VT_STRING) {
+    return false;
+  }
+  response->status = ERROR;
+  response->response = "value is not a string\n";
+  return true;
+}
 
+// Builds the GET response for a key given the result of its lookup
+static void get_response(const char *key, HNode *node,
+                         RequestResponse *response) {
   if (!node) {
     response->status = KEY_NOT_FOUND;
     response->response = "key not found\n";
   } else {
-    string value = container_of(node, struct Entry, node)->value;
+    const string &value = container_of(node, struct Entry, node)->value;
+    if (not_a_string(value, response)) {
+      return;
+    }
     response->status = SUCCESS;
     response->response = "get " + string(key) + " = " + value + "\n";
   }
 }
 
-void do_set(const char *key, const char *value, RequestResponse *response) {
+void do_get(const char *key, RequestResponse *response) {
   Entry entry;
   entry.key = key;
-  entry.value = value;
   entry.node.hashcode = str_hash((const uint8_t *)key, strlen(key));
 
-  HNode *node = hm_lookup(&db.hmap, &entry.node, &cmp);
+  HNode *node = sm_lookup(&db.smap, &entry.node, &cmp);
+  get_response(key, node, response);
+}
+
+static_assert(MAX_ARGS - 1 <= (int32_t)k_lookup_batch,
+              "mget must resolve all its keys in one batch");
 
-  if (node) {
-    container_of(node, struct Entry, node)->value = value;
-  } else {
-    Entry *ent = new Entry();
-    ent->key = key;
-    ent->value = value;
-    ent->node.hashcode = str_hash((const uint8_t *)key, strlen(key));
-    hm_insert(&db.hmap, &ent->node);
+// Looks up every key of an mget through one sm_lookup_batch call. The
+// response is a count line followed by each key's GET response.
+static void do_mget(const std::vector<std::string> &command,
+                    RequestResponse *response) {
+  static Entry probes[k_lookup_batch];
+  HNode *keys[k_lookup_batch];
+  HNode *found[k_lookup_batch];
+  size_t n = command.size() - 1;
+  for (size_t i = 0; i < n; i++) {
+    probes[i].key = command[i + 1];
+    probes[i].node.hashcode = str_hash((const uint8_t *)command[i + 1].data(),
+                                       command[i + 1].size());
+    keys[i] = &probes[i].node;
   }
+  sm_lookup_batch(&db.smap, keys, found, n, &cmp);
+
   response->status = SUCCESS;
-  response->response = "set " + string(key) + " to " + string(value) + "\n";
+  response->response = "mget " + std::to_string(n) + "\n";
+  RequestResponse one;
+  for (size_t i = 0; i < n; i++) {
+    get_response(command[i + 1].c_str(), found[i], &one);
+    response->response += one.response;
+  }
 }
 
-void do_del(const char *key, RequestResponse *response) {
-  Entry entry;
-  entry.key = key;
-  entry.node.hashcode = str_hash((const uint8_t *)key, strlen(key));
+// Connections watching each key, for WATCH
+static std::unordered_map<std::string, std::vector<Connection *>> watchers;
+
+// Marks the transactions watching key as dirty
+static void signal_modified(const std::string &key) {
+  if (watchers.empty()) {
+    return;
+  }
+  auto it = watchers.find(key);
+  if (it == watchers.end()) {
+    return;
+  }
+  for (Connection *conn : it->second) {
+    conn->tx.dirty = true;
+  }
+}
 
-  HNode *node = hm_lookup(&db.hmap, &entry.node, &cmp);
+static void watch_key(Connection *conn, const std::string &key) {
+  for (const std::string &k : conn->tx.watched) {
+    if (k == key) {
+      return;
+    }
+  }
+  conn->tx.watched.push_back(key);
+  watchers[key].push_back(conn);
+}
 
-  if (!node) {
+// Drops every watch of conn and clears its dirty flag
+static void unwatch_all(Connection *conn) {
+  for (const std::string &key : conn->tx.watched) {
+    auto it = watchers.find(key);
+    if (it == watchers.end()) {
+      continue;
+    }
+    std::vector<Connection *> &conns = it->second;
+    for (size_t i = 0; i < conns.size(); i++) {
+      if (conns[i] == conn) {
+        conns[i] = conns.back();
+        conns.pop_back();
+        break;
+      }
+    }
+    if (conns.empty()) {
+      watchers.erase(it);
+    }
+  }
+  conn->tx.watched.clear();
+  conn->tx.dirty = false;
+}
+
+// Probe used for single-key lookups, so that looking up a short key does not
+// allocate
+static Entry lookup_probe;
+
+Entry *db_lookup(const char *key, size_t len) {
+  lookup_probe.key.assign(key, len);
+  lookup_probe.node.hashcode = str_hash((const uint8_t *)key, len);
+  HNode *node = sm_lookup(&db.smap, &lookup_probe.node, &cmp);
+  return node ? container_of(node, struct Entry, node) : NULL;
+}
+
+Entry *db_set(const char *key, size_t key_len, const char *value,
+              size_t value_len) {
+  Entry *ent = db_lookup(key, key_len);
+  if (ent) {
+    snapshot_before_write(ent);
+    if (value_type(ent->value) == VT_VECTOR) {
+      vector_drop(ent);
+    }
+    if (ent->value.capacity() > VALUE_DOUBLING_MAX &&
+        ent->value.capacity() / 2 > value_len) {
+      // Drop the slack left by append or setrange on a large value
+      string(value, value_len).swap(ent->value);
+    } else {
+      ent->value.assign(value, value_len);
+    }
+  } else {
+    ent = new Entry();
+    ent->key.assign(key, key_len);
+    ent->value.assign(value, value_len);
+    ent->node.hashcode = lookup_probe.node.hashcode;
+    ent->epoch = snapshot_epoch();
+    sm_insert(&db.smap, &ent->node);
+    if (db.ordered) {
+      bt_insert(&db.index, &ent->key, ent);
+    }
+  }
+  ent->version = ++db.version;
+  signal_modified(ent->key);
+  return ent;
+}
+
+void db_touch(Entry *ent) {
+  snapshot_before_write(ent);
+  ent->version = ++db.version;
+  signal_modified(ent->key);
+}
+
+bool db_del(const char *key, size_t len) {
+  Entry *ent = db_lookup(key, len);
+  if (!ent) {
+    return false;
+  }
+  snapshot_before_write(ent);
+  signal_modified(ent->key);
+  if (value_type(ent->value) == VT_VECTOR) {
+    vector_drop(ent);
+  }
+  sm_delete(&db.smap, &ent->node, &cmp);
+  if (db.ordered) {
+    bt_delete(&db.index, ent->key);
+  }
+  delete ent;
+  return true;
+}
+
+void do_set(const string &key, const string &value,
+            RequestResponse *response) {
+  db_set(key.data(), key.size(), value.data(), value.size());
+  response->status = SUCCESS;
+  response->response = "set " + key + " to " + value + "\n";
+}
+
+void do_del(const char *key, RequestResponse *response) {
+  if (!db_del(key, strlen(key))) {
     response->status = KEY_NOT_FOUND;
     response->response = "key " + string(key) + " not found\n";
   } else {
-    HNode *deletedNode = hm_delete(&db.hmap, &entry.node, &cmp);
-    Entry *ent = container_of(deletedNode, struct Entry, node);
-    free(ent);
     response->status = SUCCESS;
     response->response = "key " + string(key) + " deleted\n";
   }
 }
 
+// getv key: the value together with its version, for a later cas
+void do_getv(const std::string &key, RequestResponse *response) {
+  Entry *ent = db_lookup(key.data(), key.size());
+  if (!ent) {
+    response->status = KEY_NOT_FOUND;
+    response->response = "key not found\n";
+    return;
+  }
+  if (not_a_string(ent->value, response)) {
+    return;
+  }
+  response->status = SUCCESS;
+  response->response = "getv " + key + " version " +
+                        std::to_string(ent->version) + " = " + ent->value +
+                        "\n";
+}
+
+// cas key expected_version value: sets key only if its version is still
+// expected_version. Version 0 means the key must not exist yet.
+void do_cas(const std::vector<std::string> &command,
+            RequestResponse *response) {
+  const std::string &key = command[1];
+  const std::string &value = command[3];
+  char *end;
+  unsigned long long expected = strtoull(command[2].c_str(), &end, 10);
+  if (command[2].empty() || *end != '\0') {
+    response->status = ERROR;
+    response->response = "invalid version\n";
+    return;
+  }
+  Entry *ent = db_lookup(key.data(), key.size());
+  uint64_t current = ent ? ent->version : 0;
+  if (current != expected) {
+    response->status = ERROR;
+    response->response =
+        "version mismatch, current version " + std::to_string(current) + "\n";
+    return;
+  }
+  ent = db_set(key.data(), key.size(), value.data(), value.size());
+  response->status = SUCCESS;
+  response->response =
+      "cas " + key + " version " + std::to_string(ent->version) + "\n";
+}
+
+// Makes room for a value to grow to len bytes, reserving ahead so that
+// repeated appends copy the value an amortized constant number of times
+static void value_grow(string *value, size_t len) {
+  if (len > value->capacity()) {
+    value->reserve(len <= VALUE_DOUBLING_MAX ? len * 2 : len + len / 4);
+  }
+  value->resize(len);
+}
+
+// The string value of key for append and setrange, created empty if
+// missing; NULL with the response filled in if key holds a structured value
+static Entry *string_entry(const string &key, RequestResponse *response) {
+  Entry *ent = db_lookup(key.data(), key.size());
+  if (!ent) {
+    return db_set(key.data(), key.size(), "", 0);
+  } else if (not_a_string(ent->value, response)) {
+    return NULL;
+  }
+  db_touch(ent);
+  return ent;
+}
+
+// append key value: the length of the value after appending
+static void do_append(const std::string &key, const std::string &value,
+                      RequestResponse *response) {
+  Entry *ent = db_lookup(key.data(), key.size());
+  if (ent && ent->value.size() + value.size() > MAX_VALUE_SIZE) {
+    response->status = ERROR;
+    response->response = "value too large\n";
+    return;
+  }
+  if (!(ent = string_entry(key, response))) {
+    return;
+  }
+  size_t at = ent->value.size();
+  value_grow(&ent->value, at + value.size());
+  memcpy(&ent->value[at], value.data(), value.size());
+  response->status = SUCCESS;
+  response->response = std::to_string(ent->value.size()) + "\n";
+}
+
+// setrange key offset value: overwrites the value from offset on, padding
+// with zero bytes past its end; the length of the value after writing
+static void do_setrange(const std::vector<std::string> &command,
+                        RequestResponse *response) {
+  const std::string &key = command[1];
+  const std::string &value = command[3];
+  char *end;
+  unsigned long long offset = strtoull(command[2].c_str(), &end, 10);
+  if (command[2].empty() || *end != '\0' || command[2][0] == '-' ||
+      offset > MAX_VALUE_SIZE || value.size() > MAX_VALUE_SIZE - offset) {
+    response->status = ERROR;
+    response->response = "invalid offset\n";
+    return;
+  }
+  Entry *ent = db_lookup(key.data(), key.size());
+  if (value.empty() && (!ent || value_type(ent->value) == VT_STRING)) {
+    // Nothing to write; report the length without creating the key
+    response->status = SUCCESS;
+    response->response = std::to_string(ent ? ent->value.size() : 0) + "\n";
+    return;
+  }
+  if (!(ent = string_entry(key, response))) {
+    return;
+  }
+  if (offset + value.size() > ent->value.size()) {
+    value_grow(&ent->value, offset + value.size());
+  }
+  memcpy(&ent->value[offset], value.data(), value.size());
+  response->status = SUCCESS;
+  response->response = std::to_string(ent->value.size()) + "\n";
+}
+
+// getrange key start end: the bytes from start to end inclusive. Negative
+// positions count from the end of the value; the range is clipped to it.
+static void do_getrange(const std::vector<std::string> &command,
+                        RequestResponse *response) {
+  char *end1, *end2;
+  long long start = strtoll(command[2].c_str(), &end1, 10);
+  long long stop = strtoll(command[3].c_str(), &end2, 10);
+  if (command[2].empty() || *end1 != '\0' || command[3].empty() ||
+      *end2 != '\0') {
+    response->status = ERROR;
+    response->response = "invalid range\n";
+    return;
+  }
+  const std::string &key = command[1];
+  Entry *ent = db_lookup(key.data(), key.size());
+  if (!ent) {
+    response->status = KEY_NOT_FOUND;
+    response->response = "key not found\n";
+    return;
+  }
+  if (not_a_string(ent->value, response)) {
+    return;
+  }
+  long long len = (long long)ent->value.size();
+  start = start < 0 ? std::max(start + len, 0LL) : start;
+  stop = stop < 0 ? stop + len : std::min(stop, len - 1);
+  response->status = SUCCESS;
+  response->response.clear();
+  if (start <= stop) {
+    response->response.assign(ent->value, (size_t)start,
+                              (size_t)(stop - start + 1));
+  }
+  response->response.push_back('\n');
+}
+
+// strlen key: the length of the value, 0 if key does not exist
+static void do_strlen(const std::string &key, RequestResponse *response) {
+  Entry *ent = db_lookup(key.data(), key.size());
+  if (ent && not_a_string(ent->value, response)) {
+    return;
+  }
+  response->status = SUCCESS;
+  response->response = std::to_string(ent ? ent->value.size() : 0) + "\n";
+}
+
+// Appends one key per line to the krange response while it fits
+static bool krange_cb(const string &key, void *, void *arg) {
+  string *out = (string *)arg;
+  if (out->size() + key.size() + 1 > MAX_MSG_SIZE) {
+    return false;
+  }
+  out->append(key);
+  out->push_back('\n');
+  return true;
+}
+
+// krange start end [limit]: keys in [start, end) in lexicographic order.
+// An empty end means no upper bound. At most limit keys (capped at
+// KRANGE_MAX_LIMIT and by the response size) are returned; to continue,
+// repeat with the last key plus a trailing '\0' as start.
+void do_krange(const std::vector<std::string> &command,
+               RequestResponse *response) {
+  if (!db.ordered) {
+    response->status = ERROR;
+    response->response = "ordered index disabled\n";
+    return;
+  }
+  size_t limit = KRANGE_DEFAULT_LIMIT;
+  if (command.size() == 4) {
+    char *end;
+    unsigned long long v = strtoull(command[3].c_str(), &end, 10);
+    if (command[3].empty() || *end != '\0') {
+      response->status = ERROR;
+      response->response = "invalid limit\n";
+      return;
+    }
+    limit = v < KRANGE_MAX_LIMIT ? (size_t)v : KRANGE_MAX_LIMIT;
+  }
+  response->status = SUCCESS;
+  response->response.clear();
+  bt_range(&db.index, command[1], command[2], limit, &krange_cb,
+           &response->response);
+}
+
+// script load <source> | script exists <sha> | script flush
+void do_script(const std::vector<std::string> &command,
+               RequestResponse *response) {
+  string sha, error;
+  if (command.size() == 3 && command[1] == "load") {
+    if (script_load(command[2], &sha, &error)) {
+      response->status = SUCCESS;
+      response->response = sha + "\n";
+    } else {
+      response->status = ERROR;
+      response->response = "script error: " + error + "\n";
+    }
+  } else if (command.size() == 3 && command[1] == "exists") {
+    response->status = SUCCESS;
+    response->response = script_exists(command[2]) ? "1\n" : "0\n";
+  } else if (command.size() == 2 && command[1] == "flush") {
+    script_flush();
+    response->status = SUCCESS;
+    response->response = "scripts flushed\n";
+  } else {
+    response->status = ERROR;
+    response->response =
+        "invalid arguments, script requires load <source>, exists <sha> "
+        "or flush\n";
+  }
+}
+
+// eval <source> [args...] | evalsha <sha> [args...]
+void do_eval(const std::vector<std::string> &command,
+             RequestResponse *response) {
+  string sha, result, error;
+  if (command[0] == "eval") {
+    if (!script_load(command[1], &sha, &error)) {
+      response->status = ERROR;
+      response->response = "script error: " + error + "\n";
+      return;
+    }
+  } else {
+    sha = command[1];
+  }
+  if (script_run(sha, command, 2, &result, &error)) {
+    response->status = SUCCESS;
+    response->response = result + "\n";
+  } else {
+    response->status = ERROR;
+    response->response = "script error: " + error + "\n";
+  }
+}
+
+// Builds the ordered index from the current contents of db.smap
+static void index_cb(HNode *node, void *) {
+  Entry *ent = container_of(node, struct Entry, node);
+  bt_insert(&db.index, &ent->key, ent);
+}
+
+// Commands that modify db and therefore go to the append-only log
+static bool is_write_command(const std::string &name) {
+  return name == "set" || name == "del" || name == "cas" ||
+         name == "append" || name == "setrange" ||
+         name == "cms.init" || name == "cms.incrby" ||
+         name == "topk.reserve" || name == "topk.add" || name == "vadd" ||
+         name == "json.set" || name == "json.numincrby" || name == "ts.add";
+}
+
 // -----------------------------------------------------------------------
 // process_request: executes a command vector
 // -----------------------------------------------------------------------
@@ -169,7 +641,7 @@ RequestResponse process_request(const std::vector<std::string> &command) {
       response.response =
           "invalid number of arguments, set requires two arguments\n";
     } else {
-      do_set(command[1].c_str(), command[2].c_str(), &response);
+      do_set(command[1], command[2], &response);
     }
   } else if (command[0] == "get") {
     if (command.size() != 2) {
@@ -178,6 +650,85 @@ RequestResponse process_request(const std::vector<std::string> &command) {
     } else {
       do_get(command[1].c_str(), &response);
     }
+  } else if (command[0] == "mget") {
+    if (command.size() < 2) {
+      response.status = ERROR;
+      response.response =
+          "invalid number of arguments, mget requires at least one key\n";
+    } else {
+      do_mget(command, &response);
+    }
+  } else if (command[0] == "getv") {
+    if (command.size() != 2) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments\n";
+    } else {
+      do_getv(command[1], &response);
+    }
+  } else if (command[0] == "cas") {
+    if (command.size() != 4) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments, cas requires key "
+                           "expected_version value\n";
+    } else {
+      do_cas(command, &response);
+    }
+  } else if (command[0] == "append") {
+    if (command.size() != 3) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments\n";
+    } else {
+      do_append(command[1], command[2], &response);
+    }
+  } else if (command[0] == "setrange" || command[0] == "getrange") {
+    if (command.size() != 4) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments\n";
+    } else if (command[0] == "setrange") {
+      do_setrange(command, &response);
+    } else {
+      do_getrange(command, &response);
+    }
+  } else if (command[0] == "strlen") {
+    if (command.size() != 2) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments\n";
+    } else {
+      do_strlen(command[1], &response);
+    }
+  } else if (command[0] == "krange") {
+    if (command.size() != 3 && command.size() != 4) {
+      response.status = ERROR;
+      response.response =
+          "invalid number of arguments, krange requires start end [limit]\n";
+    } else {
+      do_krange(command, &response);
+    }
+  } else if (command[0] == "bgsave") {
+    if (command.size() != 1) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments\n";
+    } else if (!snapshot_start(k_snapshot_path, SNAPSHOT_DUMP)) {
+      response.status = ERROR;
+      response.response = "snapshot already in progress\n";
+    } else {
+      response.status = SUCCESS;
+      response.response = "snapshot started\n";
+    }
+  } else if (command[0] == "bgrewriteaof") {
+    if (command.size() != 1) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments\n";
+    } else if (!aof_enabled()) {
+      response.status = ERROR;
+      response.response = "append only log disabled\n";
+    } else if (!aof_rewrite_start()) {
+      response.status = ERROR;
+      response.response = "rewrite or snapshot already in progress\n";
+    } else {
+      response.status = SUCCESS;
+      response.response = "aof rewrite started\n";
+    }
   } else if (command[0] == "del") {
     if (command.size() != 2) {
       response.status = ERROR;
@@ -186,156 +737,838 @@ RequestResponse process_request(const std::vector<std::string> &command) {
     } else {
       do_del(command[1].c_str(), &response);
     }
+  } else if (command[0].compare(0, 4, "cms.") == 0 ||
+             command[0].compare(0, 5, "topk.") == 0) {
+    sketch_request(command, &response);
+  } else if (command[0] == "vadd" || command[0] == "vsim" ||
+             command[0] == "vinfo") {
+    vector_request(command, &response);
+  } else if (command[0].compare(0, 5, "json.") == 0) {
+    json_request(command, &response);
+  } else if (command[0].compare(0, 3, "ts.") == 0) {
+    ts_request(command, &response);
+  } else if (command[0] == "script") {
+    do_script(command, &response);
+  } else if (command[0] == "eval" || command[0] == "evalsha") {
+    if (command.size() < 2 || command.size() - 2 > MAX_ARGS) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments, " + command[0] +
+                          " requires a script and up to 16 arguments\n";
+    } else {
+      do_eval(command, &response);
+    }
   } else {
     response.status = UNKNOWN_COMMAND;
     response.response = "unknown command\n";
   }
+
+  if (response.status == SUCCESS && is_write_command(command[0])) {
+    if (command[0] == "cas") {
+      // Versions are not logged; replay the outcome, not the check
+      aof_feed({"set", command[1], command[3]});
+    } else if (command[0] == "ts.add") {
+      // Log the timestamp "*" stood for; the response is that timestamp
+      aof_feed({"ts.add", command[1],
+                response.response.substr(0, response.response.size() - 1),
+                command[3]});
+    } else {
+      aof_feed(command);
+    }
+  }
   return response;
 }
 
 // -----------------------------------------------------------------------
-// try_one_request: parse & process exactly one request from the buffer
+// write_error: queue a fatal error message before closing the connection
+// -----------------------------------------------------------------------
+static void write_error(Connection *conn, const char *msg) {
+  size_t off = conn->write_buffer_size;
+  int32_t msgLen = (int32_t)strlen(msg);
+  if (off + 4 + msgLen > sizeof(conn->write_buffer)) {
+    return;
+  }
+  int32_t netLen = htonl(msgLen);
+  memcpy(conn->write_buffer + off, &netLen, 4);
+  memcpy(conn->write_buffer + off + 4, msg, msgLen);
+  conn->write_buffer_size += (4 + msgLen);
+  flush_write_buffer(conn);
+}
+
+// -----------------------------------------------------------------------
+// parse_request: parse exactly one request from the buffer into command
 //   - returns 0 => partial request, need more data
 //   - returns >0 => consumed that many bytes (fully parsed request)
 //   - returns -1 => fatal error => close connection
 // -----------------------------------------------------------------------
-int32_t try_one_request(Connection *conn, char *start) {
-  // Need at least 4 bytes for nStr
-  if (conn->read_buffer_size < 4) {
-    printf("not enough data to read\n");
-    return 0;
-  }
-  int32_t nStr;
-  memcpy(&nStr, start, 4);
-  nStr = ntohl(nStr);
-  start += 4;
-  int32_t consumed = 4;
-
-  if (nStr < 2 || nStr > 3) {
+int32_t parse_request(Connection *conn, char *start,
+                      std::vector<std::string> *command) {
+  const char *error;
+  int32_t consumed =
+      frame_request(start, conn->read_buffer + conn->read_buffer_size, &error);
+  if (consumed < 0) {
     // fatal
-    const char msg[] = "invalid command\n";
-    size_t off = conn->write_buffer_size;
-    int32_t msgLen = (int32_t)strlen(msg);
-    int32_t netLen = htonl(msgLen);
-    memcpy(conn->write_buffer + off, &netLen, 4);
-    memcpy(conn->write_buffer + off + 4, msg, msgLen);
-    conn->write_buffer_size += (4 + msgLen);
-    flush_write_buffer(conn);
+    write_error(conn, error);
     return -1;
+  } else if (consumed == 0) {
+    return 0;
   }
 
-  // We'll track how many bytes the "full request" is taking
-  size_t requestBytesSoFar = 4;
-
-  std::vector<std::string> command;
-  command.reserve(nStr);
-
+  int32_t nStr = request_nargs(start);
+  uint32_t id;
+  const char *p = start + (request_tag(start, &id) ? 8 : 4);
+  command->clear();
   for (int i = 0; i < nStr; i++) {
-    // Need 4 bytes for next string length
-    if ((conn->read_buffer + conn->read_buffer_size) - start < 4) {
-      printf("not enough data to read\n");
-      return 0;
-    }
     int32_t length;
-    memcpy(&length, start, 4);
+    memcpy(&length, p, 4);
     length = ntohl(length);
-    start += 4;
-    consumed += 4;
-    requestBytesSoFar += 4; // overhead for length
-
-    // If the sum of lengths so far plus this string is > MAX_MSG_SIZE, fatal
-    if (requestBytesSoFar + length > MAX_MSG_SIZE) {
-      LOG_ERROR("oversized Request");
-      char response[] = "oversized request\n";
-      int32_t length = htonl(strlen(response));
-      memcpy(conn->write_buffer + conn->write_buffer_size, &length, 4);
-      memcpy(conn->write_buffer + conn->write_buffer_size + 4, response,
-             strlen(response));
-      conn->write_buffer_size += (4 + strlen(response));
-      flush_write_buffer(conn);
-      return -1;
-    }
-
-    // Check if enough leftover data for the string
-    if ((conn->read_buffer + conn->read_buffer_size) - start < length) {
-      printf("not enough data to read\n");
-      return 0;
-    }
+    command->emplace_back(p + 4, length);
+    p += 4 + length;
+  }
+  return consumed;
+}
 
-    std::string val(start, length);
-    command.push_back(val);
-    start += length;
-    consumed += length;
-    requestBytesSoFar += length;
+// -----------------------------------------------------------------------
+// make_room: flush the write buffer and move what is left to the front
+//   - returns false => write error => close connection
+// -----------------------------------------------------------------------
+static bool make_room(Connection *conn) {
+  if (flush_write_buffer(conn) < 0) {
+    return false;
   }
+  // A partial flush leaves bytes_sent pointing into the buffer; compact
+  // so the free space is contiguous at the tail.
+  memmove(conn->write_buffer, conn->write_buffer + conn->bytes_sent,
+          conn->write_buffer_size - conn->bytes_sent);
+  conn->write_buffer_size -= conn->bytes_sent;
+  conn->bytes_sent = 0;
+  return true;
+}
 
-  // We have a complete command
-  RequestResponse resp = process_request(command);
+// -----------------------------------------------------------------------
+// append_response: frame a response into the write buffer
+//   - returns false if it cannot be queued => close connection
+// -----------------------------------------------------------------------
+bool append_response(Connection *conn, const RequestResponse &resp) {
+  int32_t net_sz = htonl((int32_t)resp.response.size());
+  return append_bytes(conn, (const char *)&net_sz, 4) &&
+         append_bytes(conn, resp.response.data(), resp.response.size());
+}
 
-  // Append the response
-  size_t off = conn->write_buffer_size;
-  int32_t sz = (int32_t)resp.response.size();
-  int32_t net_sz = htonl(sz);
-  memcpy(conn->write_buffer + off, &net_sz, 4);
-  memcpy(conn->write_buffer + off + 4, resp.response.c_str(), sz);
-  conn->write_buffer_size += (4 + sz);
+// Frames the response to a request with tag, echoing it if the request was
+// tagged (tag is k_untagged otherwise)
+static const int64_t k_untagged = -1;
 
-  return consumed;
+static bool append_reply(Connection *conn, int64_t tag,
+                         const RequestResponse &resp) {
+  if (tag == k_untagged) {
+    return append_response(conn, resp);
+  }
+  uint32_t header[2] = {htonl((uint32_t)resp.response.size() | FRAME_TAGGED),
+                        htonl((uint32_t)tag)};
+  return append_bytes(conn, (const char *)header, sizeof(header)) &&
+         append_bytes(conn, resp.response.data(), resp.response.size());
 }
 
 // -----------------------------------------------------------------------
-// read_all: repeatedly read from fd and parse requests
-//   - returns 0 => close connection
-//   - returns -1 => read error => also close
-//   - returns 1 => partial read but connection remains open
+// append_bytes: copy unframed bytes into the write buffer
+//   - flushes whenever the buffer fills up
+//   - what the socket does not take is kept in the overflow, which also
+//     pauses reading from the connection until it is written out
+//   - returns false on a write error => close connection
 // -----------------------------------------------------------------------
-int32_t read_all(Connection *conn) {
-  while (true) {
-    size_t capacity = sizeof(conn->read_buffer) - conn->read_buffer_size;
-    ssize_t rv =
-        read(conn->fd, conn->read_buffer + conn->read_buffer_size, capacity);
-    if (rv < 0 && errno == EINTR) {
-      continue;
-    } else if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-      // no more data
-      return 1;
-    } else if (rv < 0) {
-      LOG_SYS_ERROR("read() error");
-      return -1;
-    } else if (rv == 0) {
-      printf("EOF, the client closed the connection\n");
-      return 0;
+bool append_bytes(Connection *conn, const char *data, size_t len) {
+  while (len > 0) {
+    if (output_paused(conn)) {
+      // Keep the output in order behind what is already waiting
+      conn->overflow.append(data, len);
+      return true;
     }
-    // We read some data
-    conn->read_buffer_size += rv;
+    size_t room = sizeof(conn->write_buffer) - conn->write_buffer_size;
+    if (room == 0) {
+      if (!make_room(conn)) {
+        return false;
+      }
+      room = sizeof(conn->write_buffer) - conn->write_buffer_size;
+      if (room == 0) {
+        conn->overflow.append(data, len);
+        return true;
+      }
+    }
+    size_t n = len < room ? len : room;
+    memcpy(conn->write_buffer + conn->write_buffer_size, data, n);
+    conn->write_buffer_size += n;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
 
-    char *start = conn->read_buffer;
-    while (true) {
-      int32_t consumed = try_one_request(conn, start);
-      if (consumed > 0) {
-        start += consumed;
-      } else if (consumed == 0) {
-        // partial
-        break;
-      } else {
-        // consumed < 0 => fatal
+// Runs the queued commands of conn's transaction back to back; nothing else
+// executes in between since the event loop is single threaded. The results
+// are returned together in one response: "exec N\n", then each command's
+// response framed as on the wire, with a 4-byte length in network byte
+// order, since responses may themselves contain newlines.
+static void exec_transaction(Connection *conn, RequestResponse *response) {
+  Transaction &tx = conn->tx;
+  bool failed = tx.failed;
+  bool dirty = tx.dirty;
+  // The transaction's own writes must not mark it dirty
+  unwatch_all(conn);
+  tx.active = false;
+  tx.failed = false;
+
+  if (failed) {
+    response->status = ERROR;
+    response->response = "exec aborted, transaction discarded\n";
+  } else if (dirty) {
+    response->status = ERROR;
+    response->response = "exec aborted, watched key modified\n";
+  } else {
+    response->status = SUCCESS;
+    response->response = "exec " + std::to_string(tx.queued.size()) + "\n";
+    for (const std::vector<std::string> &command : tx.queued) {
+      std::string result = process_request(command).response;
+      uint32_t net_len = htonl((uint32_t)result.size());
+      response->response.append((const char *)&net_len, 4);
+      response->response += result;
+    }
+  }
+  tx.queued.clear();
+}
+
+// -----------------------------------------------------------------------
+// conn_request: execute a command in the context of its connection
+//   - handles multi/exec/discard/watch/unwatch
+//   - queues everything else while a transaction is open
+// -----------------------------------------------------------------------
+static RequestResponse conn_request(Connection *conn,
+                                    std::vector<std::string> *command) {
+  RequestResponse response;
+  Transaction &tx = conn->tx;
+  const std::string &name = (*command)[0];
+
+  if (name == "multi") {
+    if (command->size() != 1) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments\n";
+    } else if (tx.active) {
+      response.status = ERROR;
+      response.response = "multi calls can not be nested\n";
+    } else {
+      tx.active = true;
+      response.status = SUCCESS;
+      response.response = "ok\n";
+    }
+  } else if (name == "exec" || name == "discard") {
+    if (command->size() != 1) {
+      response.status = ERROR;
+      response.response = "invalid number of arguments\n";
+    } else if (!tx.active) {
+      response.status = ERROR;
+      response.response = name + " without multi\n";
+    } else if (name == "exec") {
+      exec_transaction(conn, &response);
+    } else {
+      unwatch_all(conn);
+      tx.active = false;
+      tx.failed = false;
+      tx.queued.clear();
+      response.status = SUCCESS;
+      response.response = "ok\n";
+    }
+  } else if (name == "watch") {
+    if (command->size() < 2) {
+      response.status = ERROR;
+      response.response =
+          "invalid number of arguments, watch requires at least one key\n";
+    } else if (tx.active) {
+      response.status = ERROR;
+      response.response = "watch inside multi is not allowed\n";
+    } else {
+      for (size_t i = 1; i < command->size(); i++) {
+        watch_key(conn, (*command)[i]);
+      }
+      response.status = SUCCESS;
+      response.response = "ok\n";
+    }
+  } else if (name == "unwatch") {
+    unwatch_all(conn);
+    response.status = SUCCESS;
+    response.response = "ok\n";
+  } else if (tx.active) {
+    if (tx.queued.size() >= MAX_MULTI_COMMANDS) {
+      tx.failed = true;
+      response.status = ERROR;
+      response.response = "too many queued commands\n";
+    } else {
+      tx.queued.push_back(std::move(*command));
+      response.status = SUCCESS;
+      response.response = "queued\n";
+    }
+  } else {
+    response = process_request(*command);
+  }
+  return response;
+}
+
+// -----------------------------------------------------------------------
+// try_one_request: parse & process exactly one request from the buffer
+//   - returns 0 => partial request, need more data
+//   - returns >0 => consumed that many bytes (fully parsed request)
+//   - returns -1 => fatal error => close connection
+// -----------------------------------------------------------------------
+int32_t try_one_request(Connection *conn, char *start) {
+  std::vector<std::string> command;
+  int32_t consumed = parse_request(conn, start, &command);
+  if (consumed <= 0) {
+    return consumed;
+  }
+
+  // We have a complete command
+  uint32_t id;
+  int64_t tag = request_tag(start, &id) ? id : k_untagged;
+  RequestResponse resp = conn_request(conn, &command);
+  if (!append_reply(conn, tag, resp)) {
+    return -1;
+  }
+  return consumed;
+}
+
+// -----------------------------------------------------------------------
+// GetBatch: consecutive pipelined GETs waiting to be resolved together
+// -----------------------------------------------------------------------
+struct GetBatch {
+  Entry probes[k_lookup_batch];
+  int64_t tags[k_lookup_batch];
+  size_t n = 0;
+};
+
+// Resolves the queued GETs with one sm_lookup_batch call and appends their
+// responses in request order. Returns false if the connection must close.
+static bool flush_get_batch(Connection *conn, GetBatch *batch) {
+  if (batch->n == 0) {
+    return true;
+  }
+  HNode *keys[k_lookup_batch];
+  HNode *found[k_lookup_batch];
+  for (size_t i = 0; i < batch->n; i++) {
+    keys[i] = &batch->probes[i].node;
+  }
+  sm_lookup_batch(&db.smap, keys, found, batch->n, &cmp);
+
+  RequestResponse resp;
+  bool ok = true;
+  for (size_t i = 0; i < batch->n && ok; i++) {
+    get_response(batch->probes[i].key.c_str(), found[i], &resp);
+    ok = append_reply(conn, batch->tags[i], resp);
+  }
+  batch->n = 0;
+  return ok;
+}
+
+// Counter for a native command name
+static MetricCounter command_metric(const std::string &name) {
+  if (name == "get") {
+    return M_CMD_GET;
+  } else if (name == "mget") {
+    return M_CMD_MGET;
+  } else if (name == "set") {
+    return M_CMD_SET;
+  } else if (name == "del") {
+    return M_CMD_DEL;
+  } else if (name == "krange") {
+    return M_CMD_KRANGE;
+  } else if (name == "bgsave") {
+    return M_CMD_BGSAVE;
+  } else if (name == "bgrewriteaof") {
+    return M_CMD_BGREWRITEAOF;
+  } else if (name == "getv") {
+    return M_CMD_GETV;
+  } else if (name == "cas") {
+    return M_CMD_CAS;
+  } else if (name == "append") {
+    return M_CMD_APPEND;
+  } else if (name == "setrange") {
+    return M_CMD_SETRANGE;
+  } else if (name == "getrange") {
+    return M_CMD_GETRANGE;
+  } else if (name == "strlen") {
+    return M_CMD_STRLEN;
+  } else if (name == "multi") {
+    return M_CMD_MULTI;
+  } else if (name == "exec") {
+    return M_CMD_EXEC;
+  } else if (name == "discard") {
+    return M_CMD_DISCARD;
+  } else if (name == "watch") {
+    return M_CMD_WATCH;
+  } else if (name == "unwatch") {
+    return M_CMD_UNWATCH;
+  } else if (name == "eval") {
+    return M_CMD_EVAL;
+  } else if (name == "evalsha") {
+    return M_CMD_EVALSHA;
+  } else if (name == "script") {
+    return M_CMD_SCRIPT;
+  } else if (name.compare(0, 4, "cms.") == 0) {
+    return M_CMD_CMS;
+  } else if (name.compare(0, 5, "topk.") == 0) {
+    return M_CMD_TOPK;
+  } else if (name == "vadd" || name == "vsim" || name == "vinfo") {
+    return M_CMD_VECTOR;
+  } else if (name.compare(0, 5, "json.") == 0) {
+    return M_CMD_JSON;
+  } else if (name.compare(0, 3, "ts.") == 0) {
+    return M_CMD_TS;
+  }
+  return M_CMD_UNKNOWN;
+}
+
+// Reads slow enough to be worth answering after the tagged requests
+// behind them
+static bool is_slow_read(const std::string &name) {
+  return name == "krange" || name == "getrange" || name == "vsim" ||
+         name == "json.get" || name == "ts.range" || name == "ts.mrange";
+}
+
+// Commands that may change db or the connection's transaction state, and so
+// must not run before the deferred reads sent ahead of them
+static bool is_barrier(const std::string &name) {
+  return is_write_command(name) || name == "eval" || name == "evalsha" ||
+         name == "multi" || name == "exec" || name == "discard" ||
+         name == "watch" || name == "unwatch";
+}
+
+// Connections with deferred requests; see deferred_step()
+static std::vector<Connection *> deferred_conns;
+
+// Executes and answers up to n of conn's deferred requests, oldest first.
+// Returns false if the connection must close.
+static bool run_deferred(Connection *conn, size_t n) {
+  for (; n > 0 && !conn->deferred.empty(); n--) {
+    DeferredRequest &req = conn->deferred.front();
+    RequestResponse resp = process_request(req.command);
+    bool ok = append_reply(conn, req.id, resp);
+    conn->deferred.pop_front();
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------
+// process_buffer: execute every complete request in the read buffer
+//   - runs of consecutive GETs are grouped through sm_lookup_batch
+//   - slow reads sent as tagged requests are deferred: they are answered
+//     after the requests behind them, executed a few per event loop
+//     iteration by deferred_step(). An untagged request, or any command
+//     that may write, first runs the connection's deferred requests, so
+//     untagged responses stay in request order and reads never see writes
+//     sent after them.
+//   - stops early while output is paused; see append_bytes
+//   - returns bytes consumed, or -1 => fatal error => close connection
+// -----------------------------------------------------------------------
+static int32_t process_buffer(Connection *conn) {
+  static GetBatch batch;
+  std::vector<std::string> command;
+  char *start = conn->read_buffer;
+
+  while (!output_paused(conn)) {
+    int32_t consumed = parse_request(conn, start, &command);
+    if (consumed < 0) {
+      batch.n = 0;
+      return -1;
+    } else if (consumed == 0) {
+      // partial
+      break;
+    }
+    uint32_t id;
+    int64_t tag = request_tag(start, &id) ? id : k_untagged;
+    start += consumed;
+    metric_add(command_metric(command[0]));
+
+    if (!conn->deferred.empty() &&
+        (tag == k_untagged || conn->tx.active || is_barrier(command[0]))) {
+      if (!flush_get_batch(conn, &batch) ||
+          !run_deferred(conn, conn->deferred.size())) {
+        batch.n = 0;
+        return -1;
+      }
+    }
+
+    if (tag != k_untagged && !conn->tx.active && is_slow_read(command[0])) {
+      if (conn->deferred.size() >= MAX_DEFERRED_REQUESTS &&
+          !run_deferred(conn, 1)) {
+        batch.n = 0;
+        return -1;
+      }
+      if (conn->deferred.empty() &&
+          std::find(deferred_conns.begin(), deferred_conns.end(), conn) ==
+              deferred_conns.end()) {
+        deferred_conns.push_back(conn);
+      }
+      conn->deferred.push_back({id, std::move(command)});
+      metric_add(M_DEFERRED_REQUESTS);
+      continue;
+    }
+
+    if (command[0] == "get" && command.size() == 2 && !conn->tx.active) {
+      batch.tags[batch.n] = tag;
+      Entry &probe = batch.probes[batch.n++];
+      probe.key.swap(command[1]);
+      probe.node.hashcode =
+          str_hash((const uint8_t *)probe.key.data(), probe.key.size());
+      if (batch.n == k_lookup_batch && !flush_get_batch(conn, &batch)) {
+        return -1;
+      }
+      continue;
+    }
+
+    // Any other command must observe the effects of the queued GETs'
+    // predecessors and precede their successors, so drain the batch first.
+    if (!flush_get_batch(conn, &batch)) {
+      return -1;
+    }
+    RequestResponse resp = conn_request(conn, &command);
+    if (!append_reply(conn, tag, resp)) {
+      return -1;
+    }
+  }
+
+  if (!flush_get_batch(conn, &batch)) {
+    return -1;
+  }
+  // Send the fast responses before the deferred requests hold the loop
+  if (!conn->deferred.empty() && has_output(conn) &&
+      flush_write_buffer(conn) < 0) {
+    return -1;
+  }
+  return (int32_t)(start - conn->read_buffer);
+}
+
+// -----------------------------------------------------------------------
+// process_input: execute the complete requests in the read buffer and
+// move what is left of it to the front
+//   - returns false => fatal error => close connection
+// -----------------------------------------------------------------------
+static bool process_input(Connection *conn) {
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int32_t used;
+  switch (conn->protocol) {
+  case PROTO_MEMCACHE:
+    used = mc_process_buffer(conn);
+    break;
+  case PROTO_HTTP:
+    used = http_process_buffer(conn);
+    break;
+  default:
+    used = process_buffer(conn);
+    break;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  metric_observe_latency((uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+                         (uint64_t)(t1.tv_nsec - t0.tv_nsec));
+  if (used < 0) {
+    return false;
+  }
+  // shift unconsumed data to front
+  memmove(conn->read_buffer, conn->read_buffer + used,
+          conn->read_buffer_size - used);
+  conn->read_buffer_size -= used;
+  return true;
+}
+
+// -----------------------------------------------------------------------
+// read_all: repeatedly read from fd and parse requests
+//   - stops reading while output is paused; see append_bytes
+//   - returns 0 => close connection
+//   - returns -1 => read error => also close
+//   - returns 1 => partial read but connection remains open
+// -----------------------------------------------------------------------
+int32_t read_all(Connection *conn) {
+  while (!output_paused(conn)) {
+    size_t capacity = sizeof(conn->read_buffer) - conn->read_buffer_size;
+    ssize_t rv;
+    if (conn->shm) {
+      // The ring has no EOF; a hangup is reported on the socket instead
+      rv = (ssize_t)shm_read(
+          conn->shm, conn->read_buffer + conn->read_buffer_size, capacity);
+      if (rv == 0) {
+        return 1;
+      }
+    } else {
+      rv = read(conn->fd, conn->read_buffer + conn->read_buffer_size,
+                capacity);
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      } else if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // no more data
+        return 1;
+      } else if (rv < 0) {
+        LOG_SYS_ERROR("read() error");
+        return -1;
+      } else if (rv == 0) {
+        LOG_DEBUG("EOF, the client closed the connection");
         return 0;
       }
     }
-    // shift unconsumed data to front
-    size_t used = (size_t)(start - conn->read_buffer);
-    memmove(conn->read_buffer, start, conn->read_buffer_size - used);
-    conn->read_buffer_size -= used;
+    // We read some data
+    conn->read_buffer_size += rv;
+    metric_add(M_BYTES_IN, (uint64_t)rv);
+    if (!process_input(conn)) {
+      // fatal
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// -----------------------------------------------------------------------
+// flush_output: write out conn's pending output
+//   - once an overflow is written out, serves the requests that waited
+//     behind it: those left in the read buffer, then those still unread
+//     (with edge-triggered epoll no new event would report them)
+//   - returns false => close connection
+// -----------------------------------------------------------------------
+static bool flush_output(Connection *conn) {
+  bool paused = output_paused(conn);
+  if (flush_write_buffer(conn) < 0) {
+    return false;
+  }
+  if (!paused || output_paused(conn)) {
+    return true;
   }
-  return 1; // unreachable
+  return process_input(conn) && read_all(conn) > 0;
 }
 
 // Global epoll-related
 struct epoll_event event, events[MAX_EVENTS];
-std::unordered_map<int, Connection *> fd2Connection;
+std::vector<Connection *> fd2Connection;
+// Closed connections kept for reuse by later accepts
+static std::vector<Connection *> free_connections;
+// Connections closed in the current loop iteration. Events for them may
+// still follow in the batch being handled (a shared-memory client has two
+// fds), so they are recycled only once it is done
+static std::vector<Connection *> closed_connections;
+// Open PROTO_SHM connections, whose rings the event loop polls
+static std::vector<Connection *> shm_conns;
+// When a request last arrived on a ring, and how long to keep polling
+// after it; see SHM_SPIN_NS
+static int64_t shm_last_input_ns = 0;
+static int64_t shm_spin_ns = 0;
 std::unordered_map<std::string, std::string> kvStore;
 
-int main() {
+// -----------------------------------------------------------------------
+// close_connection: unregister and close a client
+//   - marks conn closed (fd -1); recycle_connections() reclaims it later
+// -----------------------------------------------------------------------
+static void close_connection(int epoll_fd, Connection *conn) {
+  if (conn->fd < 0) {
+    return;
+  }
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr) < 0) {
+    LOG_SYS_ERROR("epoll_ctl(DEL) error");
+  }
+  close(conn->fd);
+  fd2Connection[conn->fd] = NULL;
+  unwatch_all(conn);
+  if (conn->shm) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->shm->wake_fd, nullptr);
+    shm_close(conn->shm);
+    conn->shm = NULL;
+    shm_conns.erase(std::remove(shm_conns.begin(), shm_conns.end(), conn),
+                    shm_conns.end());
+  }
+  deferred_conns.erase(
+      std::remove(deferred_conns.begin(), deferred_conns.end(), conn),
+      deferred_conns.end());
+  metric_add(M_CONNECTIONS_CLOSED);
+  conn->fd = -1;
+  closed_connections.push_back(conn);
+}
+
+// Moves the connections closed in this loop iteration to the freelist
+static void recycle_connections() {
+  for (Connection *conn : closed_connections) {
+    if (free_connections.size() < MAX_FREE_CONNECTIONS) {
+      free_connections.push_back(conn);
+    } else {
+      delete conn;
+    }
+  }
+  closed_connections.clear();
+}
+
+// Registers conn for EPOLLOUT while it has output left to write. Output to
+// a shared-memory ring is retried by shm_step() instead.
+static void want_write(int epoll_fd, Connection *conn) {
+  if (conn->shm) {
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = conn;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// -----------------------------------------------------------------------
+// deferred_step: answer the oldest deferred request of each connection
+//   - one per connection per loop iteration, so the slow requests of one
+//     client are interleaved with everyone's fast ones
+// -----------------------------------------------------------------------
+static void deferred_step(int epoll_fd) {
+  std::vector<Connection *> conns;
+  conns.swap(deferred_conns);
+  for (Connection *conn : conns) {
+    if (conn->deferred.empty()) {
+      continue;
+    }
+    if (!run_deferred(conn, 1) || (has_output(conn) && !flush_output(conn))) {
+      close_connection(epoll_fd, conn);
+      continue;
+    }
+    if (has_output(conn)) {
+      want_write(epoll_fd, conn);
+    }
+    // Requests served by flush_output() may have queued it already
+    if (!conn->deferred.empty() &&
+        std::find(deferred_conns.begin(), deferred_conns.end(), conn) ==
+            deferred_conns.end()) {
+      deferred_conns.push_back(conn);
+    }
+  }
+}
+
+// -----------------------------------------------------------------------
+// accept_connections: accept up to MAX_ACCEPTS_PER_EVENT pending clients
+//   - the listener is level-triggered, so any left over are reported again
+// -----------------------------------------------------------------------
+static void accept_connections(int epoll_fd, Listener *l) {
+  for (int i = 0; i < MAX_ACCEPTS_PER_EVENT; i++) {
+    struct sockaddr_in client_addr;
+    socklen_t sz = sizeof(client_addr);
+    int connfd =
+        accept4(l->fd, (struct sockaddr *)&client_addr, &sz, SOCK_NONBLOCK);
+    if (connfd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG_SYS_ERROR("accept() error");
+      }
+      return;
+    }
+    ShmChannel *shm = NULL;
+    if (l->protocol == PROTO_SHM) {
+      std::string error;
+      shm = shm_accept(connfd, &error);
+      if (!shm) {
+        LOG_ERROR(error.c_str());
+        close(connfd);
+        continue;
+      }
+      LOG_INFO("accepted shared-memory connection");
+    } else {
+      // Responses are often flushed in several small writes; don't let
+      // Nagle hold the later ones back waiting for the client's delayed ACK
+      int val = 1;
+      setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+      LOG_INFO("accepted connection from %s:%d",
+               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    }
+
+    Connection *conn;
+    if (!free_connections.empty()) {
+      conn = free_connections.back();
+      free_connections.pop_back();
+    } else {
+      conn = new Connection;
+    }
+    conn->reset(connfd, l->protocol);
+
+    // A shared-memory client never writes to its socket, which is watched
+    // only for the hangup; its eventfd wakes the loop for requests
+    struct epoll_event ev;
+    ev.events = shm ? EPOLLRDHUP : EPOLLIN | EPOLLET;
+    ev.data.ptr = conn;
+    bool ok = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connfd, &ev) == 0;
+    if (ok && shm) {
+      ev.events = EPOLLIN;
+      ok = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shm->wake_fd, &ev) == 0;
+    }
+    if (!ok) {
+      LOG_SYS_ERROR("epoll_ctl(ADD) client error");
+      if (shm) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connfd, nullptr);
+        shm_close(shm);
+      }
+      close(connfd);
+      free_connections.push_back(conn);
+      continue;
+    }
+    if ((size_t)connfd >= fd2Connection.size()) {
+      fd2Connection.resize(connfd + 1, NULL);
+    }
+    fd2Connection[connfd] = conn;
+    if (shm) {
+      conn->shm = shm;
+      shm_conns.push_back(conn);
+    }
+    metric_add(M_CONNECTIONS_ACCEPTED);
+  }
+}
+
+// Restores db from the append-only log if enabled and present, otherwise
+// from the snapshot file.
+//
+// A version handed out before a restart must never be handed out again, or
+// a client holding it could cas a key whose value has changed since. The
+// data files record db.version, but not the versions handed out after they
+// were last written, so numbering also starts at the wall clock in
+// nanoseconds: no run hands out versions faster than one per nanosecond,
+// so all of an earlier run's are below it. The recorded db.version guards
+// against the clock being set back. Loaded entries get new versions above
+// both.
+static void load_data(bool appendonly) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  db.version = std::max(db.version, (uint64_t)now.tv_sec * 1000000000 +
+                                        (uint64_t)now.tv_nsec);
+  if (appendonly) {
+    int64_t replayed = aof_load(k_aof_path);
+    bool had_log = replayed >= 0;
+    if (had_log) {
+      LOG_INFO("replayed %lld commands from %s", (long long)replayed,
+               k_aof_path);
+    }
+    if (!aof_open(k_aof_path)) {
+      exit(EXIT_FAILURE);
+    }
+    if (had_log) {
+      return;
+    }
+  }
+
+  int64_t loaded = snapshot_load(k_snapshot_path, &db.smap);
+  if (loaded >= 0) {
+    LOG_INFO("loaded %lld keys from %s", (long long)loaded, k_snapshot_path);
+  }
+  if (db.ordered) {
+    uint64_t cursor = 0;
+    do {
+      cursor = sm_scan(&db.smap, cursor, &index_cb, NULL);
+    } while (cursor != 0);
+  }
+  // A fresh log must start with the data we just loaded
+  if (appendonly && loaded > 0) {
+    aof_rewrite_start();
+  }
+}
+
+// -----------------------------------------------------------------------
+// open_listener: bind a non-blocking listening socket on port
+//   - exits the process on error
+// -----------------------------------------------------------------------
+static int open_listener(uint16_t port) {
   int fd = socket(AF_INET, SOCK_STREAM, 0);
   if (fd < 0) {
     LOG_SYS_ERROR("error creating socket");
@@ -347,7 +1580,7 @@ int main() {
   struct sockaddr_in server_addr;
   memset(&server_addr, 0, sizeof(server_addr));
   server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(3333);
+  server_addr.sin_port = htons(port);
   server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
   if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
@@ -357,11 +1590,152 @@ int main() {
   if (set_fd_nb(fd) < 0) {
     exit(EXIT_FAILURE);
   }
-  if (listen(fd, 10) < 0) {
+  if (listen(fd, SOMAXCONN) < 0) {
     LOG_SYS_ERROR("listen() error");
     exit(EXIT_FAILURE);
   }
-  printf("server listening on port 3333\n");
+  LOG_INFO("server listening on port %d", (int)port);
+  return fd;
+}
+
+// -----------------------------------------------------------------------
+// open_udp_socket: bind a non-blocking datagram socket on addr:port
+//   - exits the process on error
+// -----------------------------------------------------------------------
+static int open_udp_socket(const std::string &addr, uint16_t port) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    LOG_SYS_ERROR("error creating socket");
+    exit(EXIT_FAILURE);
+  }
+  int val = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+  struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, addr.c_str(), &server_addr.sin_addr) != 1) {
+    LOG_ERROR("invalid udp bind address");
+    exit(EXIT_FAILURE);
+  }
+
+  if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    LOG_SYS_ERROR("bind() error");
+    exit(EXIT_FAILURE);
+  }
+  if (set_fd_nb(fd) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  LOG_INFO("server listening on udp %s:%d", addr.c_str(), (int)port);
+  return fd;
+}
+
+// -----------------------------------------------------------------------
+// open_unix_listener: bind a non-blocking Unix socket listener at path
+//   - a socket file left behind by an earlier run is replaced
+//   - exits the process on error
+// -----------------------------------------------------------------------
+static int open_unix_listener(const std::string &path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    LOG_ERROR("shared-memory socket path too long");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  unlink(path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    LOG_SYS_ERROR("error creating socket");
+    exit(EXIT_FAILURE);
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    LOG_SYS_ERROR("bind() error");
+    exit(EXIT_FAILURE);
+  }
+  if (set_fd_nb(fd) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  if (listen(fd, SOMAXCONN) < 0) {
+    LOG_SYS_ERROR("listen() error");
+    exit(EXIT_FAILURE);
+  }
+  LOG_INFO("server listening on %s", path.c_str());
+  return fd;
+}
+
+static int64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// -----------------------------------------------------------------------
+// shm_step: serve the requests waiting in the shared-memory rings and
+// retry output that did not fit in a full response ring
+// -----------------------------------------------------------------------
+static void shm_step(int epoll_fd) {
+  for (size_t i = 0; i < shm_conns.size();) {
+    Connection *conn = shm_conns[i];
+    bool input = shm_readable(conn->shm) > 0;
+    if (input) {
+      shm_last_input_ns = monotonic_ns();
+    }
+    if ((input && read_all(conn) <= 0) ||
+        (has_output(conn) && !flush_output(conn))) {
+      // Removes conn from shm_conns
+      close_connection(epoll_fd, conn);
+      continue;
+    }
+    i++;
+  }
+}
+
+// Marks every shared-memory client's server side asleep before the loop
+// blocks, so the clients signal their eventfds. Returns false, leaving them
+// awake, if a ring has work after all.
+static bool shm_sleep_all() {
+  for (size_t i = 0; i < shm_conns.size(); i++) {
+    Connection *conn = shm_conns[i];
+    if (!shm_sleep_prepare(conn->shm, has_output(conn))) {
+      for (size_t j = 0; j < i; j++) {
+        shm_sleep_end(shm_conns[j]->shm);
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------
+// server_run: load data, listen and serve until server_stop()
+// -----------------------------------------------------------------------
+int server_run(const ServerOptions &options) {
+  running = true;
+  load_data(options.appendonly);
+
+  n_listeners = 0;
+  listeners[n_listeners++] = {open_listener(options.port), PROTO_NATIVE};
+  if (options.memcache_port != 0) {
+    listeners[n_listeners++] = {open_listener(options.memcache_port),
+                                PROTO_MEMCACHE};
+  }
+  if (options.metrics_port != 0) {
+    listeners[n_listeners++] = {open_listener(options.metrics_port),
+                                PROTO_HTTP};
+  }
+  if (!options.shm_path.empty()) {
+    listeners[n_listeners++] = {open_unix_listener(options.shm_path),
+                                PROTO_SHM};
+    shm_spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_NS : 0;
+  }
+  if (options.udp_port != 0) {
+    listeners[n_listeners++] = {
+        open_udp_socket(options.udp_bind, options.udp_port), PROTO_UDP};
+  }
 
   int epoll_fd = epoll_create1(0);
   if (epoll_fd < 0) {
@@ -369,121 +1743,141 @@ int main() {
     exit(EXIT_FAILURE);
   }
 
+  for (size_t i = 0; i < n_listeners; i++) {
+    event.events = EPOLLIN;
+    event.data.ptr = &listeners[i];
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listeners[i].fd, &event) < 0) {
+      LOG_SYS_ERROR("epoll_ctl(ADD) server socket error");
+      exit(EXIT_FAILURE);
+    }
+  }
+  wake_fd = eventfd(0, EFD_NONBLOCK);
   event.events = EPOLLIN;
-  event.data.fd = fd;
-  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
-    LOG_SYS_ERROR("epoll_ctl(ADD) server socket error");
+  event.data.ptr = &wake_fd;
+  if (wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) < 0) {
+    LOG_SYS_ERROR("eventfd error");
     exit(EXIT_FAILURE);
   }
 
   while (running) {
-    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    aof_step();
+    // Don't sleep while a snapshot still has entries to write out,
+    // vectors wait to be linked or requests were deferred, nor while
+    // shared-memory clients are active: polling their rings is what keeps
+    // their round trips free of system calls
+    bool busy = snapshot_active() || vector_pending() ||
+                !deferred_conns.empty() ||
+                (!shm_conns.empty() &&
+                 monotonic_ns() - shm_last_input_ns < shm_spin_ns);
+    bool shm_asleep = !busy && !shm_conns.empty() && shm_sleep_all();
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS,
+                       busy || (!shm_conns.empty() && !shm_asleep) ? 0 : -1);
+    if (shm_asleep) {
+      for (Connection *conn : shm_conns) {
+        shm_sleep_end(conn->shm);
+      }
+    }
     if (n < 0) {
       LOG_SYS_ERROR("epoll_wait error");
       break;
     }
+    snapshot_step();
+    vector_step();
     for (int i = 0; i < n; i++) {
-      if (events[i].data.fd == fd) {
-        while (true) {
-          struct sockaddr_in client_addr;
-          socklen_t sz = sizeof(client_addr);
-          int connfd = accept(fd, (struct sockaddr *)&client_addr, &sz);
-          if (connfd < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-              break;
-            }
-            LOG_SYS_ERROR("accept() error");
-            break;
-          }
-          printf("accepted connection from %s:%d\n",
-                 inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-
-          if (set_fd_nb(connfd) < 0) {
-            close(connfd);
-            continue;
-          }
-          struct epoll_event ev;
-          ev.events = EPOLLIN | EPOLLET;
-          ev.data.fd = connfd;
-          if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
-            LOG_SYS_ERROR("epoll_ctl(ADD) client error");
-            close(connfd);
-            continue;
-          }
-          Connection *c = new Connection;
-          c->fd = connfd;
-          fd2Connection[connfd] = c;
+      if (events[i].data.ptr == &wake_fd) {
+        // server_stop(); running is checked at the top of the loop
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0) {
+          LOG_SYS_ERROR("eventfd read() error");
         }
-      } else if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
-        int cfd = events[i].data.fd;
-        if (cfd == fd) {
+        continue;
+      }
+      Connection *conn = (Connection *)events[i].data.ptr;
+      if (Listener *l = as_listener(events[i].data.ptr)) {
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
           LOG_SYS_ERROR("epoll error on listening socket => exit");
           running = false;
+        } else if (l->protocol == PROTO_UDP) {
+          udp_serve(l->fd);
+        } else {
+          accept_connections(epoll_fd, l);
+        }
+      } else if (conn->fd < 0) {
+        // Closed by an earlier event of this batch
+        continue;
+      } else if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        if (conn->shm && !(events[i].events & EPOLLERR)) {
+          // The only way a shared-memory client says goodbye
+          LOG_DEBUG("shared-memory client hung up");
         } else {
           LOG_SYS_ERROR("epoll error on client => close");
-          if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cfd, nullptr) < 0) {
-            LOG_SYS_ERROR("epoll_ctl(DEL) error");
-          }
-          close(cfd);
-          auto it = fd2Connection.find(cfd);
-          if (it != fd2Connection.end()) {
-            delete it->second;
-            fd2Connection.erase(it);
-          }
         }
+        close_connection(epoll_fd, conn);
       } else {
         // handle read/write on existing client
-        int cfd = events[i].data.fd;
-        auto it = fd2Connection.find(cfd);
-        if (it == fd2Connection.end()) {
-          continue;
-        }
-        Connection *conn = it->second;
+        int cfd = conn->fd;
 
         if (events[i].events & EPOLLIN) {
           int rv = read_all(conn);
           if (rv <= 0) {
-            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cfd, nullptr);
-            close(cfd);
-            delete conn;
-            fd2Connection.erase(cfd);
+            close_connection(epoll_fd, conn);
             continue;
           }
         }
         // If we have data to write, enable EPOLLOUT
-        if (conn->write_buffer_size > 0) {
-          struct epoll_event ev;
-          ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-          ev.data.fd = cfd;
-          epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cfd, &ev);
+        if (has_output(conn)) {
+          want_write(epoll_fd, conn);
         }
 
         if (events[i].events & EPOLLOUT) {
-          int wv = flush_write_buffer(conn);
-          if (wv < 0) {
-            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cfd, nullptr);
-            close(cfd);
-            delete conn;
-            fd2Connection.erase(cfd);
-          } else if (conn->write_buffer_size == 0) {
+          if (!flush_output(conn)) {
+            close_connection(epoll_fd, conn);
+          } else if (has_output(conn)) {
+            // Requests served after an overflow drained may have replied
+            want_write(epoll_fd, conn);
+          } else {
             // turn off EPOLLOUT
             struct epoll_event ev;
             ev.events = EPOLLIN | EPOLLET;
-            ev.data.fd = cfd;
+            ev.data.ptr = conn;
             epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cfd, &ev);
           }
         }
       }
     }
+    deferred_step(epoll_fd);
+    shm_step(epoll_fd);
+    recycle_connections();
   }
 
   // cleanup
-  for (auto it = fd2Connection.begin(); it != fd2Connection.end();) {
-    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
-    close(it->first);
-    delete it->second;
-    it = fd2Connection.erase(it);
+  for (Connection *conn : fd2Connection) {
+    if (conn) {
+      close_connection(epoll_fd, conn);
+    }
+  }
+  recycle_connections();
+  for (Connection *conn : free_connections) {
+    delete conn;
+  }
+  free_connections.clear();
+  close(wake_fd);
+  wake_fd = -1;
+  for (size_t i = 0; i < n_listeners; i++) {
+    close(listeners[i].fd);
   }
+  if (!options.shm_path.empty()) {
+    unlink(options.shm_path.c_str());
+  }
+  n_listeners = 0;
   close(epoll_fd);
   return 0;
 }
+
+void server_stop() {
+  running = false;
+  uint64_t one = 1;
+  if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0) {
+    LOG_SYS_ERROR("eventfd write() error");
+  }
+}
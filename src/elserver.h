@@ -6,9 +6,12 @@
 #include <cstring>
 #include <string>
 // C++
-#include <unordered_map>
+#include <deque>
+#include <vector>
 // project
+#include "btree.h"
 #include "hashtable.h"
+#include "segtable.h"
 
 #define container_of(ptr, T, member) ((T *)((char *)ptr - offsetof(T, member)))
 
@@ -19,23 +22,122 @@ const size_t MAX_MSG_SIZE = 1 << 10;
 
 const int MAX_EVENTS = 10;
 
+// Connections accepted per listener event before going back to epoll_wait
+const int MAX_ACCEPTS_PER_EVENT = 64;
+
+// Closed Connection objects kept around for reuse
+const size_t MAX_FREE_CONNECTIONS = 1024;
+
+// Maximum number of strings in a single request
+const int32_t MAX_ARGS = 16;
+
+// Maximum number of slow tagged requests a connection may have deferred
+const size_t MAX_DEFERRED_REQUESTS = 64;
+
+// Maximum number of commands queued by one multi
+const size_t MAX_MULTI_COMMANDS = 256;
+
+// Default and maximum number of keys returned by one krange
+const size_t KRANGE_DEFAULT_LIMIT = 100;
+const size_t KRANGE_MAX_LIMIT = 1000;
+
+// Largest value append and setrange may build
+const size_t MAX_VALUE_SIZE = 512 * 1024 * 1024;
+
+// Values grown by append or setrange double their capacity up to this
+// size and grow by a quarter beyond it, bounding the slack of large values
+const size_t VALUE_DOUBLING_MAX = 1024 * 1024;
+
+// Port the server listens on
+const uint16_t SERVER_PORT = 3333;
+
+// Port of the memcached-compatible listener when enabled
+const uint16_t MEMCACHE_PORT = 11211;
+
+// Port of the Prometheus metrics listener when enabled
+const uint16_t METRICS_PORT = 9333;
+
+// Unix socket of the shared-memory listener when enabled
+const char *const SHM_SOCKET_PATH = "/tmp/elserver.sock";
+
+// How long the event loop keeps polling the shared-memory rings after the
+// last request arrived on one before it sleeps in epoll_wait. On a single
+// CPU polling only delays the client, and the loop sleeps at once.
+const int64_t SHM_SPIN_NS = 50 * 1000;
+
+// Maximum number of listening sockets
+const size_t MAX_LISTENERS = 5;
+
+// Wire protocol spoken on a listener and its connections. PROTO_SHM is the
+// native protocol carried over shared-memory rings (see shm.h), PROTO_UDP
+// native requests in datagrams (see udp.h), which have no connections.
+enum Protocol {
+  PROTO_NATIVE,
+  PROTO_MEMCACHE,
+  PROTO_HTTP,
+  PROTO_SHM,
+  PROTO_UDP
+};
+
+struct ShmChannel;
+
+// MULTI/EXEC state of a connection
+struct Transaction {
+  bool active = false; // Between multi and exec/discard
+  bool failed = false; // A command could not be queued; exec will abort
+  bool dirty = false;  // A watched key was modified since watch
+  std::vector<std::vector<std::string>> queued;
+  std::vector<std::string> watched;
+};
+
+// A slow tagged request put off so that the requests behind it are
+// answered first
+struct DeferredRequest {
+  uint32_t id;
+  std::vector<std::string> command;
+};
+
 // Connection structure that holds information about a client connection.
 // It includes file descriptor, read/write buffers, and related sizes.
+// Objects are recycled across accepts, so the buffers are not cleared;
+// only the first *_size bytes of each are meaningful.
+//
+// Output the socket does not take while write_buffer is full goes to
+// overflow, which is written out after write_buffer. While overflow holds
+// anything the connection's requests are not read, so a client that reads
+// slowly can hold back at most about one reply.
 struct Connection {
   int32_t fd;
+  Protocol protocol;
   size_t read_buffer_size;
   size_t write_buffer_size;
   size_t bytes_sent;
   char read_buffer[4 + MAX_MSG_SIZE];
   char write_buffer[4 + MAX_MSG_SIZE];
+  std::string overflow;
+  size_t overflow_sent; // Bytes of overflow already written
+  Transaction tx;
+  std::deque<DeferredRequest> deferred; // Oldest first
+  ShmChannel *shm; // Rings of a PROTO_SHM connection, else NULL
+
+  Connection() { reset(-1, PROTO_NATIVE); }
 
-  Connection() {
-    fd = -1;
+  // Prepares the object for a newly accepted client
+  void reset(int32_t new_fd, Protocol new_protocol) {
+    fd = new_fd;
+    protocol = new_protocol;
+    shm = NULL;
     read_buffer_size = 0;
     write_buffer_size = 0;
     bytes_sent = 0;
-    memset(read_buffer, 0, sizeof(read_buffer));
-    memset(write_buffer, 0, sizeof(write_buffer));
+    std::string().swap(overflow);
+    overflow_sent = 0;
+    tx.active = false;
+    tx.failed = false;
+    tx.dirty = false;
+    tx.queued.clear();
+    tx.watched.clear();
+    deferred.clear();
   }
 };
 
@@ -49,28 +151,100 @@ struct RequestResponse {
 };
 
 struct DB {
-  HMap hmap;
+  SMap smap;
+  BTree index;          // Ordered key index, kept only if ordered is set
+  bool ordered = false; // Enabled by --ordered-index
+  uint64_t version = 0; // Last version handed out to a write
 };
 
+// The fixed-size fields come first so that, for keys short enough to be
+// stored inline in the std::string, a lookup and version check read only
+// the first 64 bytes.
 struct Entry {
   struct HNode node;
+  uint64_t version = 0; // Bumped on every write; checked by cas
+  uint32_t epoch = 0;   // Last snapshot epoch this entry was written out in
+  uint32_t flags = 0;   // Opaque memcached client flags, not persisted
   std::string key;
   std::string value;
 };
 
-// Declarations of epoll event array and maps
+static_assert(offsetof(Entry, value) <= 64,
+              "entry header and inline key must fit in 64 bytes");
+
+// Options for server_run
+struct ServerOptions {
+  uint16_t port = SERVER_PORT;
+  uint16_t memcache_port = 0;         // 0 => no memcached listener
+  uint16_t metrics_port = 0;          // 0 => no metrics listener
+  std::string shm_path;               // Empty => no shared-memory listener
+  uint16_t udp_port = 0;              // 0 => no UDP listener
+  std::string udp_bind = "127.0.0.1"; // IPv4 address of the UDP listener
+  bool appendonly = false;
+};
+
+extern DB db;
+
+// Declarations of epoll event array and the fd-indexed connection table.
+// Epoll events carry the Connection pointer itself in data.ptr (listening
+// sockets carry their Listener); fd2Connection owns the live connections.
 extern struct epoll_event event, events[MAX_EVENTS];
-extern std::unordered_map<int, Connection *> fd2Connection;
+extern std::vector<Connection *> fd2Connection;
 
 // Sets a file descriptor to non-blocking mode.
 // Returns 0 on success and -1 on error.
 int set_fd_nb(int fd);
 
-// Flushes the connection's write buffer by writing data to the socket.
-// Returns a positive value on success, 0 if more data remains, or -1 on error.
-// Add this declaration
+// Flushes the connection's write buffer, then its overflow, by writing data
+// to the socket. Returns a positive value on success, 0 if more data
+// remains, or -1 on error.
 int32_t flush_write_buffer(Connection *conn);
 
+// True while the connection has output waiting to be written
+inline bool has_output(const Connection *conn) {
+  return conn->write_buffer_size > 0 || !conn->overflow.empty();
+}
+
+// True while reading the connection's requests is paused until its
+// overflow is written out
+inline bool output_paused(const Connection *conn) {
+  return !conn->overflow.empty();
+}
+
+// Parses a single request from the connection's read buffer into command.
+// Returns the number of bytes consumed, 0 if not enough data, or -1 on a
+// malformed request (an error response has been queued).
+int32_t parse_request(Connection *conn, char *start,
+                      std::vector<std::string> *command);
+
+// Frames a response into the connection's write buffer, flushing as it
+// fills. Returns false if the response cannot be queued.
+bool append_response(Connection *conn, const RequestResponse &resp);
+
+// Appends raw bytes to the write buffer, flushing as it fills; what the
+// socket does not take goes to the overflow. Returns false on a write
+// error.
+bool append_bytes(Connection *conn, const char *data, size_t len);
+
+// Finds the entry for key, or NULL.
+Entry *db_lookup(const char *key, size_t len);
+
+// Stores value under key, creating the entry if needed, and gives it a new
+// version. Keeps the snapshot and the ordered index up to date.
+Entry *db_set(const char *key, size_t key_len, const char *value,
+              size_t value_len);
+
+// Must be called before ent->value is changed in place: writes the old value
+// out to a running snapshot, gives the entry a new version and signals
+// watchers.
+void db_touch(Entry *ent);
+
+// Removes key. Returns false if it did not exist.
+bool db_del(const char *key, size_t len);
+
+// Executes a parsed command against db.
+RequestResponse process_request(const std::vector<std::string> &command);
+
 // Processes a single request from the connection's read buffer.
 // It reads the 4-byte length header, validates the message, and echoes the
 // message back. Returns the number of bytes consumed (header + message), 0 if
@@ -81,6 +255,17 @@ int32_t try_one_request(Connection *conn, char *start);
 // Returns 1 on success, 0 if EOF is reached, or -1 on error.
 int32_t read_all(Connection *conn);
 
+// Loads the data files, then serves clients until server_stop() is called.
+// Exits the process if a socket cannot be set up.
+int server_run(const ServerOptions &options);
+
+// Makes server_run() return; safe to call from another thread once the
+// server is listening.
+void server_stop();
+
+// FNV hash used for all keys
+uint64_t str_hash(const uint8_t *data, size_t len);
+
 // Comparison function for HNode pointers
 bool cmp(HNode *a, HNode *b);
 
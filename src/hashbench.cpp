@@ -0,0 +1,209 @@
+// hashbench.cpp - Micro-benchmark comparing the hash table engines
+//
+// usage: hashbench [nkeys] [nlookups]
+//
+// Builds nkeys entries with string keys, inserts them into each engine and
+// then looks them up in random order, reporting nanoseconds per operation
+// and the memory the engine needs per key.
+
+// stdlib
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+// C++
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+// project
+#include "btree.h"
+#include "buckettable.h"
+#include "hashtable.h"
+#include "segtable.h"
+
+#define container_of(ptr, T, member) ((T *)((char *)ptr - offsetof(T, member)))
+
+struct BenchEntry {
+  HNode node;
+  std::string key;
+};
+
+static bool bench_cmp(HNode *lhs, HNode *rhs) {
+  return container_of(lhs, BenchEntry, node)->key ==
+         container_of(rhs, BenchEntry, node)->key;
+}
+
+// FNV hash, same as the server's
+static uint64_t str_hash(const std::string &s) {
+  uint32_t h = 0x811C9DC5;
+  for (unsigned char c : s) {
+    h = (h ^ c) * 0x01000193;
+  }
+  return h;
+}
+
+static double now_ns() {
+  using namespace std::chrono;
+  return (double)duration_cast<nanoseconds>(
+             steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void report(const char *engine, const char *op, size_t n, double ns) {
+  printf("%-8s %-14s %10zu ops %8.1f ns/op\n", engine, op, n, ns / n);
+}
+
+// Largest single allocation made while growing the table
+static void report_alloc(const char *engine, size_t bytes) {
+  printf("%-8s %-14s %10zu bytes\n", engine, "largest_alloc", bytes);
+}
+
+// index: buckets + per-node links; total: also the entries themselves
+static void report_memory(const char *engine, size_t n, size_t index,
+                          size_t total) {
+  printf("%-8s %-14s %10zu keys %6.1f index bytes/key %6.1f total bytes/key\n",
+         engine, "memory", n, (double)index / n, (double)total / n);
+}
+
+int main(int argc, char *argv[]) {
+  size_t nkeys = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  size_t nlookups = argc > 2 ? strtoull(argv[2], NULL, 10) : nkeys;
+
+  std::vector<BenchEntry> entries(nkeys);
+  for (size_t i = 0; i < nkeys; i++) {
+    entries[i].key = "key:" + std::to_string(i);
+    entries[i].node.hashcode = str_hash(entries[i].key);
+  }
+
+  std::mt19937_64 rng(42);
+  std::vector<BenchEntry> probes(nlookups);
+  for (size_t i = 0; i < nlookups; i++) {
+    probes[i].key = entries[rng() % nkeys].key;
+    probes[i].node.hashcode = str_hash(probes[i].key);
+  }
+
+  // Chained HMap
+  {
+    HMap hmap;
+    double t0 = now_ns();
+    for (size_t i = 0; i < nkeys; i++) {
+      hm_insert(&hmap, &entries[i].node);
+    }
+    report("chained", "insert", nkeys, now_ns() - t0);
+    // Every rehash callocs the whole new h1
+    report_alloc("chained", (hmap.h1.mask + 1) * sizeof(HNode *));
+
+    size_t hits = 0;
+    t0 = now_ns();
+    for (size_t i = 0; i < nlookups; i++) {
+      hits += hm_lookup(&hmap, &probes[i].node, &bench_cmp) != NULL;
+    }
+    report("chained", "lookup", nlookups, now_ns() - t0);
+
+    HNode *keys[k_lookup_batch];
+    HNode *found[k_lookup_batch];
+    t0 = now_ns();
+    for (size_t i = 0; i < nlookups; i += k_lookup_batch) {
+      size_t cnt = std::min(k_lookup_batch, nlookups - i);
+      for (size_t j = 0; j < cnt; j++) {
+        keys[j] = &probes[i + j].node;
+      }
+      hm_lookup_batch(&hmap, keys, found, cnt, &bench_cmp);
+      for (size_t j = 0; j < cnt; j++) {
+        hits += found[j] != NULL;
+      }
+    }
+    report("chained", "lookup_batch", nlookups, now_ns() - t0);
+
+    if (hits != 2 * nlookups) {
+      fprintf(stderr, "chained: missing keys\n");
+      return EXIT_FAILURE;
+    }
+    size_t buckets = hm_memory_usage(&hmap);
+    report_memory("chained", nkeys, buckets + nkeys * sizeof(HNode),
+                  buckets + nkeys * sizeof(BenchEntry));
+    free(hmap.h1.table);
+    free(hmap.h2.table);
+  }
+
+  // Chained HMap plus the ordered B+tree index the server keeps with
+  // --ordered-index. Write amplification is the number of index nodes (and
+  // their bytes) rewritten per insert, on top of the single hash slot.
+  {
+    HMap hmap;
+    BTree tree;
+    double t0 = now_ns();
+    for (size_t i = 0; i < nkeys; i++) {
+      hm_insert(&hmap, &entries[i].node);
+      bt_insert(&tree, &entries[i].key, &entries[i]);
+    }
+    report("ordered", "insert", nkeys, now_ns() - t0);
+    printf("%-8s %-14s %10zu ops %8.2f nodes/op %8.1f bytes/op\n", "ordered",
+           "write_amp", nkeys, (double)tree.node_writes / nkeys,
+           (double)tree.node_writes * sizeof(BTreeNode) / nkeys);
+    size_t buckets = hm_memory_usage(&hmap);
+    size_t index = buckets + nkeys * sizeof(HNode) + bt_memory_usage(&tree);
+    report_memory("ordered", nkeys, index,
+                  index - nkeys * sizeof(HNode) + nkeys * sizeof(BenchEntry));
+
+    bt_destroy(&tree);
+    free(hmap.h1.table);
+    free(hmap.h2.table);
+  }
+
+  // Bucketized BMap
+  {
+    BMap bmap;
+    double t0 = now_ns();
+    for (size_t i = 0; i < nkeys; i++) {
+      bm_insert(&bmap, &entries[i].node);
+    }
+    report("bucket", "insert", nkeys, now_ns() - t0);
+
+    size_t hits = 0;
+    t0 = now_ns();
+    for (size_t i = 0; i < nlookups; i++) {
+      hits += bm_lookup(&bmap, &probes[i].node, &bench_cmp) != NULL;
+    }
+    report("bucket", "lookup", nlookups, now_ns() - t0);
+
+    if (hits != nlookups) {
+      fprintf(stderr, "bucket: missing keys\n");
+      return EXIT_FAILURE;
+    }
+    bm_destroy(&bmap);
+  }
+
+  // Segmented SMap
+  {
+    SMap smap;
+    double t0 = now_ns();
+    for (size_t i = 0; i < nkeys; i++) {
+      sm_insert(&smap, &entries[i].node);
+    }
+    report("segment", "insert", nkeys, now_ns() - t0);
+    // Growth allocates one segment, or reallocs the directory
+    report_alloc("segment", std::max(k_segment_slots * sizeof(HNode *),
+                                     smap.dir_cap * sizeof(HNode **)));
+
+    size_t hits = 0;
+    t0 = now_ns();
+    for (size_t i = 0; i < nlookups; i++) {
+      hits += sm_lookup(&smap, &probes[i].node, &bench_cmp) != NULL;
+    }
+    report("segment", "lookup", nlookups, now_ns() - t0);
+
+    if (hits != nlookups) {
+      fprintf(stderr, "segment: missing keys\n");
+      return EXIT_FAILURE;
+    }
+    size_t buckets = sm_memory_usage(&smap);
+    report_memory("segment", nkeys, buckets + nkeys * sizeof(HNode),
+                  buckets + nkeys * sizeof(BenchEntry));
+    sm_destroy(&smap);
+  }
+
+  return EXIT_SUCCESS;
+}
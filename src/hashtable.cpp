@@ -145,6 +145,78 @@ HNode *hm_lookup(HMap *hmap, HNode *node, bool (*cmp)(HNode *, HNode *)) {
   return from ? *from : NULL;
 }
 
+/**
+ * @brief Look up several nodes in the hash map at once
+ *
+ * A single lookup is a chain of dependent cache misses (bucket slot, then
+ * each node). Resolving the keys in groups of k_lookup_batch lets us issue
+ * the slot loads for every key first, then the first-node loads, and only
+ * then walk the chains, so the misses of different keys overlap instead of
+ * being paid one after another.
+ *
+ * @param hmap Pointer to the hash map
+ * @param keys Template nodes with the hashcodes to look up
+ * @param out Receives the found node for each key, or NULL if not found
+ * @param n Number of keys
+ * @param cmp Comparison function to determine if nodes match
+ */
+void hm_lookup_batch(HMap *hmap, HNode **keys, HNode **out, size_t n,
+                     bool (*cmp)(HNode *, HNode *)) {
+  // Do some rehashing work, once for the whole batch
+  hm_resizing(hmap);
+
+  HNode **slots1[k_lookup_batch];
+  HNode **slots2[k_lookup_batch];
+
+  for (size_t base = 0; base < n; base += k_lookup_batch) {
+    size_t cnt = n - base < k_lookup_batch ? n - base : k_lookup_batch;
+
+    // Stage 1: compute the bucket slots and prefetch them
+    for (size_t i = 0; i < cnt; i++) {
+      uint64_t hcode = keys[base + i]->hashcode;
+      slots1[i] = NULL;
+      slots2[i] = NULL;
+      if (hmap->h1.table) {
+        slots1[i] = &hmap->h1.table[hcode & hmap->h1.mask];
+        __builtin_prefetch(slots1[i]);
+      }
+      if (hmap->h2.table) {
+        slots2[i] = &hmap->h2.table[hcode & hmap->h2.mask];
+        __builtin_prefetch(slots2[i]);
+      }
+    }
+
+    // Stage 2: prefetch the first node of every chain
+    for (size_t i = 0; i < cnt; i++) {
+      if (slots1[i] && *slots1[i]) {
+        __builtin_prefetch(*slots1[i]);
+      }
+      if (slots2[i] && *slots2[i]) {
+        __builtin_prefetch(*slots2[i]);
+      }
+    }
+
+    // Stage 3: walk the chains, h1 first and then h2 like hm_lookup
+    for (size_t i = 0; i < cnt; i++) {
+      HNode *key = keys[base + i];
+      HNode *found = NULL;
+      for (HNode *cur = slots1[i] ? *slots1[i] : NULL; cur && !found;
+           cur = cur->next) {
+        if (cmp(cur, key)) {
+          found = cur;
+        }
+      }
+      for (HNode *cur = slots2[i] ? *slots2[i] : NULL; cur && !found;
+           cur = cur->next) {
+        if (cmp(cur, key)) {
+          found = cur;
+        }
+      }
+      out[base + i] = found;
+    }
+  }
+}
+
 /**
  * @brief Delete a node from the hash map
  *
@@ -220,3 +292,101 @@ void hm_insert(HMap *hmap, HNode *node) {
   // Do some rehashing work
   hm_resizing(hmap);
 }
+
+/**
+ * @brief Bytes used by the bucket arrays of the hash map
+ *
+ * Nodes are embedded in the caller's objects and are not included.
+ *
+ * @param hmap Pointer to the hash map
+ * @return Size of h1 and h2 bucket arrays in bytes
+ */
+size_t hm_memory_usage(const HMap *hmap) {
+  size_t bytes = 0;
+  if (hmap->h1.table) {
+    bytes += (hmap->h1.mask + 1) * sizeof(HNode *);
+  }
+  if (hmap->h2.table) {
+    bytes += (hmap->h2.mask + 1) * sizeof(HNode *);
+  }
+  return bytes;
+}
+
+/**
+ * @brief Reverse the bits of a 64-bit value
+ */
+static uint64_t rev_bits(uint64_t v) {
+  uint64_t r = 0;
+  for (int i = 0; i < 64; i++) {
+    r = (r << 1) | (v & 1);
+    v >>= 1;
+  }
+  return r;
+}
+
+/**
+ * @brief Advance a scan cursor to the next bucket under mask
+ *
+ * The cursor is incremented in reversed bit order, so buckets that a
+ * table doubling splits apart are visited next to each other.
+ */
+uint64_t scan_next(uint64_t cursor, uint64_t mask) {
+  cursor |= ~mask;
+  cursor = rev_bits(cursor);
+  cursor++;
+  return rev_bits(cursor);
+}
+
+/**
+ * @brief Call fn on every node of one bucket chain
+ */
+static void scan_bucket(HashTable *hashtable, uint64_t pos,
+                        void (*fn)(HNode *, void *), void *arg) {
+  for (HNode *cur = hashtable->table[pos & hashtable->mask]; cur;
+       cur = cur->next) {
+    fn(cur, arg);
+  }
+}
+
+/**
+ * @brief Visit the nodes of one bucket and return the next cursor
+ *
+ * Start with cursor 0 and keep calling with the returned cursor until it
+ * is 0 again. Every node present for the whole scan is visited at least
+ * once even if the map rehashes in between; nodes may be visited twice.
+ * While rehashing, one bucket of the smaller table is visited together
+ * with all buckets of the larger table it expands into. fn must not
+ * modify the map.
+ *
+ * @param hmap Pointer to the hash map
+ * @param cursor Cursor returned by the previous call, or 0
+ * @param fn Called for each node
+ * @param arg Passed through to fn
+ * @return The cursor for the next call, 0 when the scan is complete
+ */
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*fn)(HNode *, void *),
+                 void *arg) {
+  if (!hmap->h1.table) {
+    return 0;
+  }
+
+  if (!hmap->h2.table) {
+    scan_bucket(&hmap->h1, cursor, fn, arg);
+    return scan_next(cursor, hmap->h1.mask);
+  }
+
+  HashTable *small = &hmap->h1;
+  HashTable *large = &hmap->h2;
+  if (small->mask > large->mask) {
+    small = &hmap->h2;
+    large = &hmap->h1;
+  }
+
+  scan_bucket(small, cursor, fn, arg);
+  do {
+    scan_bucket(large, cursor, fn, arg);
+    cursor = scan_next(cursor, large->mask);
+  } while (cursor & (small->mask ^ large->mask));
+
+  return cursor;
+}
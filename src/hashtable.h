@@ -7,6 +7,9 @@ const size_t k_resizing_work = 128;
 // Maximum average number of nodes per bucket before triggering rehash
 const size_t k_max_load_factor = 8;
 
+// Number of keys whose cache misses are interleaved by hm_lookup_batch
+const size_t k_lookup_batch = 16;
+
 /**
  * @brief Base node structure for hash table entries
  *
@@ -51,8 +54,14 @@ HNode **h_lookup(HashTable *hashtable, HNode *node,
 HNode *h_detach(HashTable *hashtable, HNode **node);
 void hm_resizing(HMap *hmap);
 HNode *hm_lookup(HMap *hmap, HNode *node, bool (*cmp)(HNode *, HNode *));
+void hm_lookup_batch(HMap *hmap, HNode **keys, HNode **out, size_t n,
+                     bool (*cmp)(HNode *, HNode *));
 HNode *hm_delete(HMap *hmap, HNode *node, bool (*cmp)(HNode *, HNode *));
 void hm_trigger_rehashing(HMap *hmap);
 void hm_insert(HMap *hmap, HNode *node);
+size_t hm_memory_usage(const HMap *hmap);
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*fn)(HNode *, void *),
+                 void *arg);
+uint64_t scan_next(uint64_t cursor, uint64_t mask);
 
 #endif
@@ -0,0 +1,879 @@
+// json.cpp - JSON documents kept as compact binary trees
+
+// stdlib
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <stdio.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+// C++
+#include <string>
+#include <vector>
+// project
+#include "elserver.h"
+#include "json.h"
+#include "valuetype.h"
+
+using namespace std;
+
+/*
+ * Tree encoding, after the value tag:
+ *   null, false, true     tag
+ *   int, double           tag, 8 bytes
+ *   string                tag, u32 length, bytes
+ *   array                 tag, u32 size of the children, u32 count, values
+ *   object                tag, u32 size of the members, u32 count, then per
+ *                         member u32 key length, key bytes, value
+ */
+enum JsonTag : uint8_t {
+  J_NULL,
+  J_FALSE,
+  J_TRUE,
+  J_INT,
+  J_DOUBLE,
+  J_STRING,
+  J_ARRAY,
+  J_OBJECT,
+};
+
+// Bytes before the children of an array or object
+const size_t k_container_hdr = 9;
+
+static uint32_t get_u32(const string &v, size_t off) {
+  uint32_t x;
+  memcpy(&x, v.data() + off, sizeof(x));
+  return x;
+}
+
+static void put_u32(string *v, size_t off, uint32_t x) {
+  memcpy(&(*v)[off], &x, sizeof(x));
+}
+
+static void append_u32(string *out, uint32_t x) {
+  out->append((const char *)&x, sizeof(x));
+}
+
+// -----------------------------------------------------------------------
+// Parser
+// -----------------------------------------------------------------------
+struct Parser {
+  const char *p;
+  const char *end;
+  string *out;
+  int depth;
+};
+
+static void skip_ws(Parser *ps) {
+  while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\n' ||
+                             *ps->p == '\r' || *ps->p == '\t')) {
+    ps->p++;
+  }
+}
+
+// Length of the run at p free of '"', '\\' and control characters
+static size_t plain_run(const char *p, const char *end) {
+  const char *start = p;
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bslash = _mm_set1_epi8('\\');
+  const __m128i ctl = _mm_set1_epi8(0x1f);
+  while (end - p >= 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    // max(c, 0x1f) == 0x1f exactly for the control characters
+    __m128i hit = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(c, quote), _mm_cmpeq_epi8(c, bslash)),
+        _mm_cmpeq_epi8(_mm_max_epu8(c, ctl), ctl));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask) {
+      return (size_t)(p - start) + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) {
+    p++;
+  }
+  return (size_t)(p - start);
+}
+
+static bool parse_hex4(const char *p, uint32_t *out) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = p[i];
+    v <<= 4;
+    if (c >= '0' && c <= '9') {
+      v |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      v |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      v |= c - 'A' + 10;
+    } else {
+      return false;
+    }
+  }
+  *out = v;
+  return true;
+}
+
+static void put_utf8(string *out, uint32_t cp) {
+  if (cp < 0x80) {
+    out->push_back((char)cp);
+  } else if (cp < 0x800) {
+    out->push_back((char)(0xC0 | (cp >> 6)));
+    out->push_back((char)(0x80 | (cp & 0x3F)));
+  } else if (cp < 0x10000) {
+    out->push_back((char)(0xE0 | (cp >> 12)));
+    out->push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+    out->push_back((char)(0x80 | (cp & 0x3F)));
+  } else {
+    out->push_back((char)(0xF0 | (cp >> 18)));
+    out->push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+    out->push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+    out->push_back((char)(0x80 | (cp & 0x3F)));
+  }
+}
+
+// Parses the string after an opening quote; appends its length and bytes
+static bool parse_string(Parser *ps) {
+  string *out = ps->out;
+  size_t len_at = out->size();
+  append_u32(out, 0);
+  for (;;) {
+    size_t run = plain_run(ps->p, ps->end);
+    out->append(ps->p, run);
+    ps->p += run;
+    if (ps->p == ps->end) {
+      return false;
+    }
+    char c = *ps->p++;
+    if (c == '"') {
+      break;
+    }
+    if (c != '\\' || ps->p == ps->end) {
+      return false; // Control character or truncated escape
+    }
+    char e = *ps->p++;
+    switch (e) {
+    case '"':
+    case '\\':
+    case '/':
+      out->push_back(e);
+      break;
+    case 'b':
+      out->push_back('\b');
+      break;
+    case 'f':
+      out->push_back('\f');
+      break;
+    case 'n':
+      out->push_back('\n');
+      break;
+    case 'r':
+      out->push_back('\r');
+      break;
+    case 't':
+      out->push_back('\t');
+      break;
+    case 'u': {
+      uint32_t cp, lo;
+      if (ps->end - ps->p < 4 || !parse_hex4(ps->p, &cp)) {
+        return false;
+      }
+      ps->p += 4;
+      if (cp >= 0xD800 && cp < 0xDC00) {
+        if (ps->end - ps->p < 6 || ps->p[0] != '\\' || ps->p[1] != 'u' ||
+            !parse_hex4(ps->p + 2, &lo) || lo < 0xDC00 || lo > 0xDFFF) {
+          return false;
+        }
+        ps->p += 6;
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+      } else if (cp >= 0xDC00 && cp < 0xE000) {
+        return false;
+      }
+      put_utf8(out, cp);
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  size_t len = out->size() - len_at - sizeof(uint32_t);
+  if (len > UINT32_MAX) {
+    return false;
+  }
+  put_u32(out, len_at, (uint32_t)len);
+  return true;
+}
+
+static bool parse_number(Parser *ps) {
+  const char *p = ps->p, *end = ps->end;
+  bool integral = true;
+  if (p < end && *p == '-') {
+    p++;
+  }
+  if (p == end || !isdigit((unsigned char)*p)) {
+    return false;
+  }
+  if (*p == '0') {
+    p++;
+  } else {
+    while (p < end && isdigit((unsigned char)*p)) {
+      p++;
+    }
+  }
+  if (p < end && *p == '.') {
+    integral = false;
+    if (++p == end || !isdigit((unsigned char)*p)) {
+      return false;
+    }
+    while (p < end && isdigit((unsigned char)*p)) {
+      p++;
+    }
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    integral = false;
+    if (++p < end && (*p == '+' || *p == '-')) {
+      p++;
+    }
+    if (p == end || !isdigit((unsigned char)*p)) {
+      return false;
+    }
+    while (p < end && isdigit((unsigned char)*p)) {
+      p++;
+    }
+  }
+
+  string text(ps->p, p);
+  ps->p = p;
+  if (integral) {
+    errno = 0;
+    long long i = strtoll(text.c_str(), NULL, 10);
+    if (errno == 0) {
+      int64_t v = i;
+      ps->out->push_back(J_INT);
+      ps->out->append((const char *)&v, sizeof(v));
+      return true;
+    }
+  }
+  double d = strtod(text.c_str(), NULL);
+  if (!std::isfinite(d)) {
+    return false;
+  }
+  ps->out->push_back(J_DOUBLE);
+  ps->out->append((const char *)&d, sizeof(d));
+  return true;
+}
+
+static bool parse_literal(Parser *ps, const char *word, JsonTag tag) {
+  size_t len = strlen(word);
+  if ((size_t)(ps->end - ps->p) < len || memcmp(ps->p, word, len) != 0) {
+    return false;
+  }
+  ps->p += len;
+  ps->out->push_back(tag);
+  return true;
+}
+
+static bool parse_value(Parser *ps) {
+  skip_ws(ps);
+  if (ps->p == ps->end) {
+    return false;
+  }
+  switch (*ps->p) {
+  case '{':
+  case '[': {
+    bool object = *ps->p++ == '{';
+    char close = object ? '}' : ']';
+    if (++ps->depth > k_json_max_depth) {
+      return false;
+    }
+    size_t hdr = ps->out->size();
+    ps->out->push_back(object ? J_OBJECT : J_ARRAY);
+    append_u32(ps->out, 0);
+    append_u32(ps->out, 0);
+    uint32_t count = 0;
+    skip_ws(ps);
+    if (ps->p < ps->end && *ps->p == close) {
+      ps->p++;
+    } else {
+      for (;;) {
+        if (object) {
+          skip_ws(ps);
+          if (ps->p == ps->end || *ps->p++ != '"' || !parse_string(ps)) {
+            return false;
+          }
+          skip_ws(ps);
+          if (ps->p == ps->end || *ps->p++ != ':') {
+            return false;
+          }
+        }
+        if (!parse_value(ps)) {
+          return false;
+        }
+        count++;
+        skip_ws(ps);
+        if (ps->p == ps->end) {
+          return false;
+        }
+        char c = *ps->p++;
+        if (c == close) {
+          break;
+        } else if (c != ',') {
+          return false;
+        }
+      }
+    }
+    size_t size = ps->out->size() - hdr - k_container_hdr;
+    if (size > UINT32_MAX) {
+      return false;
+    }
+    put_u32(ps->out, hdr + 1, (uint32_t)size);
+    put_u32(ps->out, hdr + 5, count);
+    ps->depth--;
+    return true;
+  }
+  case '"':
+    ps->p++;
+    ps->out->push_back(J_STRING);
+    return parse_string(ps);
+  case 't':
+    return parse_literal(ps, "true", J_TRUE);
+  case 'f':
+    return parse_literal(ps, "false", J_FALSE);
+  case 'n':
+    return parse_literal(ps, "null", J_NULL);
+  default:
+    return parse_number(ps);
+  }
+}
+
+// Parses text as a single JSON value nested depth levels deep and appends
+// its tree to out
+static bool json_parse(const string &text, int depth, string *out) {
+  Parser ps = {text.data(), text.data() + text.size(), out, depth};
+  if (!parse_value(&ps)) {
+    return false;
+  }
+  skip_ws(&ps);
+  return ps.p == ps.end;
+}
+
+// -----------------------------------------------------------------------
+// Reading the tree
+// -----------------------------------------------------------------------
+
+// Size of the node at off, which must end by limit; 0 if it is malformed
+static size_t node_size(const string &v, size_t off, size_t limit) {
+  if (off >= limit) {
+    return 0;
+  }
+  size_t avail = limit - off, size;
+  switch ((uint8_t)v[off]) {
+  case J_NULL:
+  case J_FALSE:
+  case J_TRUE:
+    return 1;
+  case J_INT:
+  case J_DOUBLE:
+    return avail >= 9 ? 9 : 0;
+  case J_STRING:
+    if (avail < 5) {
+      return 0;
+    }
+    size = 5 + (size_t)get_u32(v, off + 1);
+    return size <= avail ? size : 0;
+  case J_ARRAY:
+  case J_OBJECT:
+    if (avail < k_container_hdr) {
+      return 0;
+    }
+    size = k_container_hdr + (size_t)get_u32(v, off + 1);
+    return size <= avail ? size : 0;
+  default:
+    return 0;
+  }
+}
+
+static void put_escaped(string *out, const char *s, size_t len) {
+  out->push_back('"');
+  for (size_t i = 0; i < len;) {
+    size_t run = plain_run(s + i, s + len);
+    out->append(s + i, run);
+    i += run;
+    if (i == len) {
+      break;
+    }
+    char c = s[i++];
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c == '\n') {
+      out->append("\\n");
+    } else if (c == '\t') {
+      out->append("\\t");
+    } else if (c == '\r') {
+      out->append("\\r");
+    } else {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+      out->append(buf);
+    }
+  }
+  out->push_back('"');
+}
+
+// Shortest of %.15g and %.17g that reads back as d
+static void put_double(string *out, double d) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.15g", d);
+  if (strtod(buf, NULL) != d) {
+    snprintf(buf, sizeof(buf), "%.17g", d);
+  }
+  out->append(buf);
+  if (strpbrk(buf, ".eEn") == NULL) {
+    out->append(".0"); // Stays a double when parsed again
+  }
+}
+
+// Appends the JSON text of the node at off; false if the tree is malformed
+static bool serialize(const string &v, size_t off, size_t limit, int depth,
+                      string *out) {
+  size_t size = node_size(v, off, limit);
+  if (size == 0 || depth > k_json_max_depth) {
+    return false;
+  }
+  switch ((uint8_t)v[off]) {
+  case J_NULL:
+    out->append("null");
+    return true;
+  case J_FALSE:
+    out->append("false");
+    return true;
+  case J_TRUE:
+    out->append("true");
+    return true;
+  case J_INT: {
+    int64_t i;
+    memcpy(&i, v.data() + off + 1, sizeof(i));
+    out->append(to_string(i));
+    return true;
+  }
+  case J_DOUBLE: {
+    double d;
+    memcpy(&d, v.data() + off + 1, sizeof(d));
+    put_double(out, d);
+    return true;
+  }
+  case J_STRING:
+    put_escaped(out, v.data() + off + 5, size - 5);
+    return true;
+  default:
+    break;
+  }
+
+  bool object = v[off] == J_OBJECT;
+  uint32_t count = get_u32(v, off + 5);
+  size_t child = off + k_container_hdr, end = off + size;
+  out->push_back(object ? '{' : '[');
+  for (uint32_t i = 0; i < count; i++) {
+    if (i > 0) {
+      out->push_back(',');
+    }
+    if (object) {
+      if (end - child < 4 || end - child - 4 < get_u32(v, child)) {
+        return false;
+      }
+      uint32_t klen = get_u32(v, child);
+      put_escaped(out, v.data() + child + 4, klen);
+      out->push_back(':');
+      child += 4 + klen;
+    }
+    size_t csize = node_size(v, child, end);
+    if (csize == 0 || !serialize(v, child, end, depth + 1, out)) {
+      return false;
+    }
+    child += csize;
+  }
+  out->push_back(object ? '}' : ']');
+  return child == end;
+}
+
+// -----------------------------------------------------------------------
+// Paths
+// -----------------------------------------------------------------------
+struct PathStep {
+  bool index;
+  int64_t n;
+  string key;
+};
+
+// Parses "$.a[0][\"b c\"]"; the "$" is optional
+static bool parse_path(const string &path, vector<PathStep> *steps) {
+  steps->clear();
+  size_t i = 0;
+  if (path == "$" || path == ".") {
+    return true;
+  }
+  if (!path.empty() && path[0] == '$') {
+    i = 1;
+  }
+  bool implicit_dot = i == 0 && !path.empty() && path[0] != '.' &&
+                      path[0] != '[';
+  while (i < path.size()) {
+    PathStep step;
+    if (path[i] == '.' || implicit_dot) {
+      i += implicit_dot ? 0 : 1;
+      implicit_dot = false;
+      size_t end = path.find_first_of(".[", i);
+      end = end == string::npos ? path.size() : end;
+      if (end == i) {
+        return false;
+      }
+      step.index = false;
+      step.key = path.substr(i, end - i);
+      i = end;
+    } else if (path[i] == '[') {
+      size_t close = path.find(']', i);
+      if (close == string::npos || close == i + 1) {
+        return false;
+      }
+      string inner = path.substr(i + 1, close - i - 1);
+      if (inner[0] == '"') {
+        if (inner.size() < 2 || inner.back() != '"') {
+          return false;
+        }
+        step.index = false;
+        step.key = inner.substr(1, inner.size() - 2);
+      } else {
+        char *end;
+        errno = 0;
+        step.index = true;
+        step.n = strtoll(inner.c_str(), &end, 10);
+        if (*end != '\0' || errno != 0) {
+          return false;
+        }
+      }
+      i = close + 1;
+    } else {
+      return false;
+    }
+    steps->push_back(step);
+  }
+  return steps->size() < (size_t)k_json_max_depth;
+}
+
+// Where a path leads in a document
+struct JsonLoc {
+  vector<size_t> parents; // Containers from the root down
+  size_t node;            // npos: the last step names a missing member
+};
+
+// Follows steps from the root of the document in v. Only the last step may
+// name a missing object member. Sets *error and returns false otherwise.
+static bool walk(const string &v, const vector<PathStep> &steps, JsonLoc *loc,
+                 const char **error) {
+  size_t cur = k_value_tag_len, limit = v.size();
+  loc->parents.clear();
+  *error = "corrupt document";
+  if (node_size(v, cur, limit) == 0) {
+    return false;
+  }
+  for (size_t s = 0; s < steps.size(); s++) {
+    const PathStep &step = steps[s];
+    uint8_t tag = (uint8_t)v[cur];
+    size_t end = cur + node_size(v, cur, limit);
+    size_t child = cur + k_container_hdr;
+    uint32_t count = tag >= J_ARRAY ? get_u32(v, cur + 5) : 0;
+    if (step.index) {
+      int64_t n = step.n < 0 ? step.n + count : step.n;
+      if (tag != J_ARRAY) {
+        *error = "path step into a non-array";
+        return false;
+      } else if (n < 0 || n >= count) {
+        *error = "path not found";
+        return false;
+      }
+      for (int64_t i = 0; i < n; i++) {
+        size_t csize = node_size(v, child, end);
+        if (csize == 0) {
+          return false;
+        }
+        child += csize;
+      }
+    } else {
+      if (tag != J_OBJECT) {
+        *error = "path step into a non-object";
+        return false;
+      }
+      bool found = false;
+      for (uint32_t i = 0; i < count && !found; i++) {
+        if (end - child < 4 || end - child - 4 < get_u32(v, child)) {
+          return false;
+        }
+        uint32_t klen = get_u32(v, child);
+        found = klen == step.key.size() &&
+                memcmp(v.data() + child + 4, step.key.data(), klen) == 0;
+        child += 4 + klen;
+        if (!found) {
+          size_t csize = node_size(v, child, end);
+          if (csize == 0) {
+            return false;
+          }
+          child += csize;
+        }
+      }
+      if (!found) {
+        if (s + 1 == steps.size()) {
+          loc->parents.push_back(cur);
+          loc->node = string::npos;
+          return true;
+        }
+        *error = "path not found";
+        return false;
+      }
+    }
+    loc->parents.push_back(cur);
+    cur = child;
+    limit = end;
+    if (node_size(v, cur, limit) == 0) {
+      return false;
+    }
+  }
+  loc->node = cur;
+  return true;
+}
+
+// -----------------------------------------------------------------------
+// Commands
+// -----------------------------------------------------------------------
+static void set_error(RequestResponse *response, const string &msg) {
+  response->status = ERROR;
+  response->response = msg + "\n";
+}
+
+// Looks up key as a document; NULL, with the response filled in, if it does
+// not exist or holds something else
+static Entry *json_entry(const string &key, RequestResponse *response) {
+  Entry *ent = db_lookup(key.data(), key.size());
+  if (!ent) {
+    response->status = KEY_NOT_FOUND;
+    response->response = "key not found\n";
+  } else if (value_type(ent->value) != VT_JSON) {
+    set_error(response, "value is not a json document");
+    ent = NULL;
+  }
+  return ent;
+}
+
+// Looks up key and follows path; false with the response filled in on error
+static bool json_locate(const string &key, const string &path, Entry **ent,
+                        JsonLoc *loc, RequestResponse *response) {
+  vector<PathStep> steps;
+  const char *error;
+  if (!parse_path(path, &steps)) {
+    set_error(response, "invalid path");
+    return false;
+  }
+  if (!(*ent = json_entry(key, response))) {
+    return false;
+  }
+  if (!walk((*ent)->value, steps, loc, &error)) {
+    set_error(response, error);
+    return false;
+  }
+  if (loc->node == string::npos) {
+    set_error(response, "path not found");
+    return false;
+  }
+  return true;
+}
+
+// json.set key path json
+static void do_json_set(const vector<string> &command,
+                        RequestResponse *response) {
+  const string &key = command[1];
+  vector<PathStep> steps;
+  string tree;
+  if (!parse_path(command[2], &steps)) {
+    set_error(response, "invalid path");
+    return;
+  }
+  if (!json_parse(command[3], (int)steps.size(), &tree)) {
+    set_error(response, "invalid json");
+    return;
+  }
+
+  Entry *ent = db_lookup(key.data(), key.size());
+  if (ent && value_type(ent->value) != VT_JSON) {
+    set_error(response, "value is not a json document");
+    return;
+  }
+  if (steps.empty()) {
+    string value;
+    value_tag(&value, VT_JSON);
+    value.append(tree);
+    db_set(key.data(), key.size(), value.data(), value.size());
+    response->status = SUCCESS;
+    response->response = "ok\n";
+    return;
+  }
+  if (!ent) {
+    response->status = KEY_NOT_FOUND;
+    response->response = "key not found\n";
+    return;
+  }
+
+  JsonLoc loc;
+  const char *error;
+  string &v = ent->value;
+  if (!walk(v, steps, &loc, &error)) {
+    set_error(response, error);
+    return;
+  }
+  size_t old_size = loc.node == string::npos ? 0 : node_size(v, loc.node,
+                                                             v.size());
+  size_t new_size = tree.size();
+  if (loc.node == string::npos) {
+    new_size += sizeof(uint32_t) + steps.back().key.size();
+  }
+  if (v.size() - old_size + new_size > UINT32_MAX) {
+    set_error(response, "document too large");
+    return;
+  }
+
+  db_touch(ent);
+  if (loc.node != string::npos) {
+    v.replace(loc.node, old_size, tree);
+  } else {
+    // New member at the end of the object
+    size_t obj = loc.parents.back();
+    string member;
+    append_u32(&member, (uint32_t)steps.back().key.size());
+    member.append(steps.back().key);
+    member.append(tree);
+    v.insert(obj + k_container_hdr + get_u32(v, obj + 1), member);
+    put_u32(&v, obj + 5, get_u32(v, obj + 5) + 1);
+  }
+  for (size_t p : loc.parents) {
+    put_u32(&v, p + 1, (uint32_t)(get_u32(v, p + 1) - old_size + new_size));
+  }
+  response->status = SUCCESS;
+  response->response = "ok\n";
+}
+
+// json.get key [path]
+static void do_json_get(const vector<string> &command,
+                        RequestResponse *response) {
+  Entry *ent;
+  JsonLoc loc;
+  if (!json_locate(command[1], command.size() == 3 ? command[2] : "$", &ent,
+                   &loc, response)) {
+    return;
+  }
+  response->response.clear();
+  if (!serialize(ent->value, loc.node, ent->value.size(),
+                 (int)loc.parents.size(), &response->response)) {
+    set_error(response, "corrupt document");
+    return;
+  }
+  response->status = SUCCESS;
+  response->response.push_back('\n');
+}
+
+// json.numincrby key path number
+static void do_json_numincrby(const vector<string> &command,
+                              RequestResponse *response) {
+  string by;
+  if (!json_parse(command[3], 0, &by) ||
+      (by[0] != J_INT && by[0] != J_DOUBLE)) {
+    set_error(response, "invalid number");
+    return;
+  }
+  Entry *ent;
+  JsonLoc loc;
+  if (!json_locate(command[1], command[2], &ent, &loc, response)) {
+    return;
+  }
+  string &v = ent->value;
+  uint8_t tag = (uint8_t)v[loc.node];
+  if (tag != J_INT && tag != J_DOUBLE) {
+    set_error(response, "value at path is not a number");
+    return;
+  }
+
+  int64_t a, b, sum;
+  double da, db_;
+  memcpy(&a, v.data() + loc.node + 1, sizeof(a));
+  memcpy(&b, by.data() + 1, sizeof(b));
+  memcpy(&da, &a, sizeof(da));
+  memcpy(&db_, &b, sizeof(db_));
+  char out[9];
+  if (tag == J_INT && by[0] == J_INT && !__builtin_add_overflow(a, b, &sum)) {
+    out[0] = J_INT;
+    memcpy(out + 1, &sum, sizeof(sum));
+  } else {
+    double d = (tag == J_INT ? (double)a : da) +
+               (by[0] == J_INT ? (double)b : db_);
+    if (!std::isfinite(d)) {
+      set_error(response, "result is not a finite number");
+      return;
+    }
+    out[0] = J_DOUBLE;
+    memcpy(out + 1, &d, sizeof(d));
+  }
+
+  db_touch(ent);
+  memcpy(&v[loc.node], out, sizeof(out));
+  response->status = SUCCESS;
+  response->response.clear();
+  serialize(v, loc.node, v.size(), 0, &response->response);
+  response->response.push_back('\n');
+}
+
+// json.mem key: bytes of the tree against the bytes of its compact text
+static void do_json_mem(const vector<string> &command,
+                        RequestResponse *response) {
+  Entry *ent = json_entry(command[1], response);
+  string text;
+  if (!ent) {
+    return;
+  }
+  if (!serialize(ent->value, k_value_tag_len, ent->value.size(), 0, &text)) {
+    set_error(response, "corrupt document");
+    return;
+  }
+  char buf[96];
+  snprintf(buf, sizeof(buf), "tree %zu text %zu ratio %.2f\n",
+           ent->value.size(), text.size(),
+           (double)ent->value.size() / (double)text.size());
+  response->status = SUCCESS;
+  response->response = buf;
+}
+
+// -----------------------------------------------------------------------
+// Dispatches the json.* commands
+// -----------------------------------------------------------------------
+void json_request(const vector<string> &command, RequestResponse *response) {
+  const string &name = command[0];
+  size_t argc = command.size();
+  if (name == "json.set" && argc == 4) {
+    do_json_set(command, response);
+  } else if (name == "json.get" && (argc == 2 || argc == 3)) {
+    do_json_get(command, response);
+  } else if (name == "json.numincrby" && argc == 4) {
+    do_json_numincrby(command, response);
+  } else if (name == "json.mem" && argc == 2) {
+    do_json_mem(command, response);
+  } else if (name == "json.set" || name == "json.get" ||
+             name == "json.numincrby" || name == "json.mem") {
+    set_error(response, "invalid number of arguments");
+  } else {
+    response->status = UNKNOWN_COMMAND;
+    response->response = "unknown command\n";
+  }
+}
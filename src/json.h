@@ -0,0 +1,44 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct RequestResponse;
+
+// Deepest nesting of arrays and objects a document may have
+const int k_json_max_depth = 64;
+
+/**
+ * JSON documents.
+ *
+ *   json.set key path json       -> ok
+ *   json.get key [path]          -> the JSON at path
+ *   json.numincrby key path n    -> the new number
+ *   json.mem key                 -> tree and text sizes
+ *
+ * A path is "$" followed by ".name", "[\"name\"]" and "[index]" steps
+ * (negative indexes count from the end); the leading "$" may be left out.
+ * json.set on "$" creates or replaces the document; otherwise it replaces
+ * the value at path or adds a new member to an object.
+ *
+ * A document is parsed once and kept in the entry's value as a compact
+ * binary tree: scalars are a tag and their bytes, strings are unescaped,
+ * and every array and object records the byte size of its children so that
+ * a path lookup skips whole subtrees. An update splices the new bytes into
+ * the value and adjusts the sizes of the containers above it, so changing a
+ * field of a large document moves memory but never re-parses or
+ * re-serializes it, and clients send and receive only the fragment. The
+ * parser scans strings 16 bytes at a time with SSE2.
+ *
+ * Reads check every offset against the value, so a plain string forged to
+ * look like a document is reported as corrupt.
+ */
+
+// Executes a json.* command against db.
+void json_request(const std::vector<std::string> &command,
+                  RequestResponse *response);
+
+#endif // JSON_H
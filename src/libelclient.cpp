@@ -0,0 +1,824 @@
+// libelclient.cpp - Asynchronous native protocol client
+
+// stdlib
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string.h>
+// system
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+// C++
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+// project
+#include "elclient.h"
+#include "elserver.h"
+#include "protocol.h"
+#include "shm.h"
+
+using namespace std;
+
+// Replies of one elclient_send_batch call
+struct BatchState {
+  promise<vector<ClientReply>> done;
+  vector<ClientReply> replies;
+  atomic<size_t> left;
+};
+
+// A request waiting for its reply: either a single send or one entry of a
+// batch
+struct Pending {
+  optional<promise<ClientReply>> single;
+  shared_ptr<BatchState> batch;
+  size_t index = 0;
+};
+
+static void complete(Pending *p, ClientReply &&reply) {
+  if (p->single) {
+    p->single->set_value(std::move(reply));
+    return;
+  }
+  BatchState *b = p->batch.get();
+  b->replies[p->index] = std::move(reply);
+  if (b->left.fetch_sub(1, memory_order_acq_rel) == 1) {
+    b->done.set_value(std::move(b->replies));
+  }
+}
+
+static ClientReply failure(const char *why) {
+  ClientReply reply;
+  reply.ok = false;
+  reply.data = why;
+  return reply;
+}
+
+struct ClientConn {
+  // Shared with the sending threads, under mu
+  mutex mu;
+  string queued;          // Encoded requests the I/O thread has not taken
+  deque<Pending> pending; // Sent or queued requests, oldest first
+  unordered_map<uint32_t, Pending> tagged; // The same, by ID, if tagged
+  uint32_t next_id = 0;
+
+  // I/O thread only
+  int fd = -1;
+  bool connected = false;
+  uint32_t events = 0;
+  string writing; // Requests taken from queued, being written
+  size_t sent = 0;
+  string in;
+};
+
+struct ElClient {
+  struct sockaddr_in addr;
+  bool tagged = false;
+  vector<ClientConn *> conns;
+  int epoll_fd = -1;
+  int wake_fd = -1; // Registered with its own address as data.ptr
+  atomic<bool> stop{false};
+  thread io;
+};
+
+// Appends the request for tokens to out, tagged with id if tagged is set
+static bool encode_request(const vector<string> &tokens, bool tagged,
+                           uint32_t id, string *out) {
+  size_t total = 4;
+  for (const string &token : tokens) {
+    total += 4 + token.size();
+  }
+  if (tokens.empty() || tokens.size() > (size_t)MAX_ARGS ||
+      total > MAX_MSG_SIZE) {
+    return false;
+  }
+  size_t at = out->size();
+  out->resize(at + total + (tagged ? 4 : 0));
+  char *ptr = &(*out)[at];
+
+  // Write the number of strings and the ID, then each string's length and
+  // bytes
+  uint32_t count = (uint32_t)tokens.size() | (tagged ? FRAME_TAGGED : 0);
+  int32_t net = htonl(count);
+  memcpy(ptr, &net, 4);
+  ptr += 4;
+  if (tagged) {
+    net = htonl(id);
+    memcpy(ptr, &net, 4);
+    ptr += 4;
+  }
+  for (const string &token : tokens) {
+    net = htonl((int32_t)token.size());
+    memcpy(ptr, &net, 4);
+    memcpy(ptr + 4, token.data(), token.size());
+    ptr += 4 + token.size();
+  }
+  return true;
+}
+
+bool build_request(const vector<string> &tokens, string *out) {
+  return encode_request(tokens, false, 0, out);
+}
+
+bool split_exec_reply(const string &reply, vector<string> *results) {
+  if (reply.compare(0, 5, "exec ") != 0) {
+    return false;
+  }
+  char *end;
+  unsigned long n = strtoul(reply.c_str() + 5, &end, 10);
+  if (end == reply.c_str() + 5 || *end != '\n') {
+    return false;
+  }
+  results->clear();
+  size_t at = (size_t)(end + 1 - reply.c_str());
+  for (; n > 0; n--) {
+    uint32_t len;
+    if (reply.size() - at < 4) {
+      return false;
+    }
+    memcpy(&len, reply.data() + at, 4);
+    len = ntohl(len);
+    if (reply.size() - at - 4 < len) {
+      return false;
+    }
+    results->emplace_back(reply, at + 4, len);
+    at += 4 + len;
+  }
+  return at == reply.size();
+}
+
+// -----------------------------------------------------------------------
+// I/O thread
+// -----------------------------------------------------------------------
+static void set_events(ElClient *client, ClientConn *conn, uint32_t events) {
+  if (events == conn->events) {
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = conn;
+  epoll_ctl(client->epoll_fd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+            conn->fd, &ev);
+  conn->events = events;
+}
+
+// Closes conn and completes everything sent or queued on it with why
+static void fail_conn(ElClient *client, ClientConn *conn, const char *why) {
+  if (conn->fd >= 0) {
+    epoll_ctl(client->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    close(conn->fd);
+  }
+  conn->fd = -1;
+  conn->connected = false;
+  conn->events = 0;
+  conn->writing.clear();
+  conn->sent = 0;
+  conn->in.clear();
+
+  deque<Pending> failed;
+  unordered_map<uint32_t, Pending> failed_tagged;
+  {
+    lock_guard<mutex> lock(conn->mu);
+    failed.swap(conn->pending);
+    failed_tagged.swap(conn->tagged);
+    conn->queued.clear();
+  }
+  for (Pending &p : failed) {
+    complete(&p, failure(why));
+  }
+  for (auto &kv : failed_tagged) {
+    complete(&kv.second, failure(why));
+  }
+}
+
+// Starts a non-blocking connect. Returns false if it failed at once.
+static bool start_connect(ElClient *client, ClientConn *conn) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    return false;
+  }
+  int val = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  int rv = connect(fd, (struct sockaddr *)&client->addr, sizeof(client->addr));
+  if (rv < 0 && errno != EINPROGRESS) {
+    close(fd);
+    return false;
+  }
+  conn->fd = fd;
+  conn->connected = rv == 0;
+  set_events(client, conn, conn->connected ? EPOLLIN : EPOLLIN | EPOLLOUT);
+  return true;
+}
+
+static void flush_conn(ElClient *client, ClientConn *conn) {
+  while (conn->sent < conn->writing.size()) {
+    ssize_t rv = write(conn->fd, conn->writing.data() + conn->sent,
+                       conn->writing.size() - conn->sent);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    } else if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      set_events(client, conn, EPOLLIN | EPOLLOUT);
+      return;
+    } else if (rv <= 0) {
+      fail_conn(client, conn, "connection lost");
+      return;
+    }
+    conn->sent += rv;
+  }
+  conn->writing.clear(); // Keeps its capacity for the next swap
+  conn->sent = 0;
+  set_events(client, conn, EPOLLIN);
+}
+
+// Moves what senders queued on conn to the I/O thread's buffer and writes
+static void take_queued(ElClient *client, ClientConn *conn) {
+  {
+    lock_guard<mutex> lock(conn->mu);
+    if (conn->queued.empty()) {
+      return;
+    } else if (conn->writing.empty()) {
+      conn->writing.swap(conn->queued);
+    } else {
+      conn->writing.append(conn->queued);
+      conn->queued.clear();
+    }
+  }
+  if (conn->fd < 0 && !start_connect(client, conn)) {
+    fail_conn(client, conn, "connect failed");
+  } else if (conn->connected) {
+    flush_conn(client, conn);
+  }
+}
+
+// A complete response in ClientConn::in
+struct Frame {
+  size_t at;  // Offset of the body
+  size_t len; // Length of the body
+  uint32_t id;
+};
+
+// Matches the complete responses in conn->in with their requests: in order,
+// or by ID if the client tags its requests
+static void process_responses(ElClient *client, ClientConn *conn) {
+  vector<Frame> frames;
+  size_t pos = 0;
+  string error; // Set if conn must be failed after the frames before it
+  while (error.empty() && conn->in.size() - pos >= 4) {
+    uint32_t word;
+    memcpy(&word, conn->in.data() + pos, 4);
+    word = ntohl(word);
+    bool tagged = word & FRAME_TAGGED;
+    size_t header = tagged ? 8 : 4;
+    size_t len = word & ~FRAME_TAGGED;
+    if (conn->in.size() - pos < header ||
+        conn->in.size() - pos - header < len) {
+      break;
+    }
+    Frame frame = {pos + header, len, 0};
+    if (tagged) {
+      memcpy(&frame.id, conn->in.data() + pos + 4, 4);
+      frame.id = ntohl(frame.id);
+    }
+    if (tagged == client->tagged) {
+      frames.push_back(frame);
+    } else if (!tagged) {
+      // A server that does not take tagged requests answers the first one
+      // with an error and closes
+      error.assign(conn->in, frame.at, len);
+      if (!error.empty() && error.back() == '\n') {
+        error.pop_back();
+      }
+      if (error.empty()) {
+        error = "tagged request refused";
+      }
+    } else {
+      error = "unexpected response";
+    }
+    pos += header + len;
+  }
+
+  vector<Pending> done;
+  size_t matched = 0;
+  {
+    lock_guard<mutex> lock(conn->mu);
+    for (; matched < frames.size(); matched++) {
+      if (client->tagged) {
+        auto it = conn->tagged.find(frames[matched].id);
+        if (it == conn->tagged.end()) {
+          break;
+        }
+        done.push_back(std::move(it->second));
+        conn->tagged.erase(it);
+      } else if (!conn->pending.empty()) {
+        done.push_back(std::move(conn->pending.front()));
+        conn->pending.pop_front();
+      } else {
+        break;
+      }
+    }
+  }
+  for (size_t i = 0; i < matched; i++) {
+    ClientReply reply;
+    reply.ok = true;
+    reply.data.assign(conn->in, frames[i].at, frames[i].len);
+    complete(&done[i], std::move(reply));
+  }
+  if (matched < frames.size()) {
+    error = "unexpected response";
+  }
+  if (!error.empty()) {
+    fail_conn(client, conn, error.c_str());
+    return;
+  }
+  conn->in.erase(0, pos);
+}
+
+static void conn_event(ElClient *client, ClientConn *conn, uint32_t events) {
+  if (!conn->connected) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+      fail_conn(client, conn, "connect failed");
+      return;
+    }
+    conn->connected = true;
+  }
+  if (events & EPOLLIN) {
+    char buf[16384];
+    for (;;) {
+      ssize_t rv = read(conn->fd, buf, sizeof(buf));
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      } else if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      } else if (rv <= 0) {
+        process_responses(client, conn);
+        fail_conn(client, conn, "connection lost");
+        return;
+      }
+      conn->in.append(buf, rv);
+    }
+    process_responses(client, conn);
+    if (conn->fd < 0) {
+      return;
+    }
+  } else if (events & (EPOLLERR | EPOLLHUP)) {
+    fail_conn(client, conn, "connection lost");
+    return;
+  }
+  flush_conn(client, conn);
+}
+
+static void io_main(ElClient *client) {
+  struct epoll_event events[16];
+  while (!client->stop.load(memory_order_acquire)) {
+    int n = epoll_wait(client->epoll_fd, events, 16, -1);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == &client->wake_fd) {
+        uint64_t count;
+        if (read(client->wake_fd, &count, sizeof(count)) < 0) {
+          // Nothing to do; the counter is read again on the next wake
+        }
+        for (ClientConn *conn : client->conns) {
+          take_queued(client, conn);
+        }
+      } else {
+        ClientConn *conn = (ClientConn *)events[i].data.ptr;
+        if (conn->fd >= 0) {
+          conn_event(client, conn, events[i].events);
+        }
+      }
+    }
+  }
+}
+
+// -----------------------------------------------------------------------
+// API
+// -----------------------------------------------------------------------
+// Fills *addr with the server address of options
+static bool resolve(const ClientOptions &options, struct sockaddr_in *addr,
+                    string *error) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(options.port);
+  if (inet_pton(AF_INET, options.host.c_str(), &addr->sin_addr) != 1) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    if (getaddrinfo(options.host.c_str(), NULL, &hints, &res) != 0) {
+      *error = "cannot resolve " + options.host;
+      return false;
+    }
+    addr->sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+  }
+  return true;
+}
+
+ElClient *elclient_connect(const ClientOptions &options, string *error) {
+  ElClient *client = new ElClient;
+  client->tagged = options.tagged;
+  if (!resolve(options, &client->addr, error)) {
+    delete client;
+    return NULL;
+  }
+
+  client->epoll_fd = epoll_create1(0);
+  client->wake_fd = eventfd(0, EFD_NONBLOCK);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &client->wake_fd;
+  bool ok = client->epoll_fd >= 0 && client->wake_fd >= 0 &&
+            epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->wake_fd,
+                      &ev) == 0;
+  for (size_t i = 0; ok && i < max<size_t>(options.connections, 1); i++) {
+    // Connect synchronously so that an unreachable server is reported here
+    ClientConn *conn = new ClientConn;
+    client->conns.push_back(conn);
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    ok = conn->fd >= 0 && connect(conn->fd, (struct sockaddr *)&client->addr,
+                                  sizeof(client->addr)) == 0;
+    if (ok) {
+      int val = 1;
+      setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+      ok = fcntl(conn->fd, F_SETFL,
+                 fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK) == 0;
+    }
+    if (ok) {
+      conn->connected = true;
+      set_events(client, conn, EPOLLIN);
+    }
+  }
+  if (!ok) {
+    *error = string("connect failed: ") + strerror(errno);
+    elclient_close(client);
+    return NULL;
+  }
+  client->io = thread(io_main, client);
+  return client;
+}
+
+void elclient_close(ElClient *client) {
+  client->stop.store(true, memory_order_release);
+  if (client->io.joinable()) {
+    uint64_t one = 1;
+    if (write(client->wake_fd, &one, sizeof(one)) < 0) {
+      // The thread is woken by its connections closing below otherwise
+    }
+    client->io.join();
+  }
+  for (ClientConn *conn : client->conns) {
+    fail_conn(client, conn, "client closed");
+    delete conn;
+  }
+  if (client->wake_fd >= 0) {
+    close(client->wake_fd);
+  }
+  if (client->epoll_fd >= 0) {
+    close(client->epoll_fd);
+  }
+  delete client;
+}
+
+// Connection a command is sent on: its key's for single-key commands, the
+// first one for any other
+static size_t conn_index(ElClient *client, const vector<string> &command) {
+  if (client->conns.size() == 1 || command.size() < 2 ||
+      !is_single_key_command(command[0].data(), command[0].size())) {
+    return 0;
+  }
+  const string &key = command[1];
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : key) {
+    h = (h ^ c) * 0x100000001b3ULL;
+  }
+  return h % client->conns.size();
+}
+
+// Encodes commands onto conn and queues their pending replies, waking the
+// I/O thread if conn had nothing queued
+static void enqueue(ElClient *client, ClientConn *conn,
+                    const vector<string> *const *commands, Pending *ps,
+                    size_t n) {
+  vector<size_t> rejected;
+  bool stopped = false, wake = false;
+  {
+    lock_guard<mutex> lock(conn->mu);
+    stopped = client->stop.load(memory_order_acquire);
+    bool was_empty = conn->queued.empty();
+    for (size_t i = 0; i < n; i++) {
+      uint32_t id = conn->next_id;
+      if (stopped ||
+          !encode_request(*commands[i], client->tagged, id, &conn->queued)) {
+        rejected.push_back(i);
+      } else if (client->tagged) {
+        conn->tagged.emplace(id, std::move(ps[i]));
+        conn->next_id++;
+      } else {
+        conn->pending.push_back(std::move(ps[i]));
+      }
+    }
+    wake = was_empty && !conn->queued.empty();
+  }
+  for (size_t i : rejected) {
+    complete(&ps[i], failure(stopped ? "client closed" : "invalid request"));
+  }
+  if (wake) {
+    uint64_t one = 1;
+    if (write(client->wake_fd, &one, sizeof(one)) < 0) {
+      // The counter is already non-zero; the thread will look anyway
+    }
+  }
+}
+
+future<ClientReply> elclient_send(ElClient *client,
+                                  const vector<string> &command) {
+  Pending p;
+  p.single.emplace();
+  future<ClientReply> f = p.single->get_future();
+  const vector<string> *cmd = &command;
+  enqueue(client, client->conns[conn_index(client, command)], &cmd, &p, 1);
+  return f;
+}
+
+future<vector<ClientReply>>
+elclient_send_batch(ElClient *client,
+                    const vector<vector<string>> &commands) {
+  shared_ptr<BatchState> state = make_shared<BatchState>();
+  state->replies.resize(commands.size());
+  state->left = commands.size();
+  future<vector<ClientReply>> f = state->done.get_future();
+  if (commands.empty()) {
+    state->done.set_value({});
+    return f;
+  }
+
+  // Group by connection so each is locked and woken once
+  vector<vector<size_t>> by_conn(client->conns.size());
+  for (size_t i = 0; i < commands.size(); i++) {
+    by_conn[conn_index(client, commands[i])].push_back(i);
+  }
+  vector<const vector<string> *> cmds;
+  vector<Pending> ps;
+  for (size_t c = 0; c < by_conn.size(); c++) {
+    if (by_conn[c].empty()) {
+      continue;
+    }
+    cmds.clear();
+    ps.clear();
+    ps.resize(by_conn[c].size());
+    for (size_t j = 0; j < by_conn[c].size(); j++) {
+      cmds.push_back(&commands[by_conn[c][j]]);
+      ps[j].batch = state;
+      ps[j].index = by_conn[c][j];
+    }
+    enqueue(client, client->conns[c], cmds.data(), ps.data(), ps.size());
+  }
+  return f;
+}
+
+ClientReply elclient_call(ElClient *client, const vector<string> &command) {
+  return elclient_send(client, command).get();
+}
+
+// -----------------------------------------------------------------------
+// Shared-memory client
+// -----------------------------------------------------------------------
+
+// How long to poll the rings before sleeping on the eventfd: a few round
+// trips to a server that is polling its side. Not done on a single CPU,
+// where it would only keep the server from running.
+const int64_t k_shm_spin_ns = 20 * 1000;
+
+struct ElShmClient {
+  ShmChannel *ch = NULL;
+  int sock = -1;
+  bool spin = false;
+  string out; // Encoded request, reused across calls
+  string in;  // Response bytes, reused across calls
+};
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Waits until the response ring has data or, with want_room, the request
+// ring has room. Returns false if the server went away.
+static bool shm_wait(ElShmClient *client, bool want_room) {
+  if (client->spin) {
+    chrono::steady_clock::time_point until =
+        chrono::steady_clock::now() + chrono::nanoseconds(k_shm_spin_ns);
+    for (int i = 1;; i++) {
+      if (shm_readable(client->ch) > 0 ||
+          (want_room && shm_writable(client->ch) > 0)) {
+        return true;
+      }
+      cpu_relax();
+      if (i % 64 == 0 && chrono::steady_clock::now() > until) {
+        break;
+      }
+    }
+  }
+  while (shm_sleep_prepare(client->ch, want_room)) {
+    struct pollfd fds[2] = {{client->ch->wake_fd, POLLIN, 0},
+                            {client->sock, POLLIN | POLLRDHUP, 0}};
+    int rv = poll(fds, 2, -1);
+    shm_sleep_end(client->ch);
+    if (rv < 0 && errno != EINTR) {
+      return false;
+    } else if (rv > 0 && fds[1].revents != 0) {
+      // The server never writes to the socket; anything there is a hangup
+      return false;
+    }
+  }
+  return true;
+}
+
+ElShmClient *elclient_shm_connect(const char *path, string *error) {
+  ElShmClient *client = new ElShmClient;
+  client->ch = shm_connect(path, &client->sock, error);
+  if (!client->ch) {
+    delete client;
+    return NULL;
+  }
+  client->spin = thread::hardware_concurrency() > 1;
+  return client;
+}
+
+ClientReply elclient_shm_call(ElShmClient *client,
+                              const vector<string> &command) {
+  client->out.clear();
+  if (!build_request(command, &client->out)) {
+    return failure("invalid request");
+  }
+  for (size_t sent = 0; sent < client->out.size();) {
+    size_t n = shm_write(client->ch, client->out.data() + sent,
+                         client->out.size() - sent);
+    if (n == 0 && !shm_wait(client, true)) {
+      return failure("connection lost");
+    }
+    sent += n;
+  }
+
+  // Read the length, then the body, straight into in
+  string &in = client->in;
+  in.resize(4);
+  size_t got = 0;
+  bool have_len = false;
+  while (got < in.size()) {
+    size_t n = shm_read(client->ch, &in[got], in.size() - got);
+    if (n == 0 && !shm_wait(client, false)) {
+      return failure("connection lost");
+    }
+    got += n;
+    if (!have_len && got == 4) {
+      uint32_t len;
+      memcpy(&len, in.data(), 4);
+      in.resize(4 + ntohl(len));
+      have_len = true;
+    }
+  }
+  ClientReply reply;
+  reply.ok = true;
+  reply.data.assign(client->in, 4, string::npos);
+  return reply;
+}
+
+void elclient_shm_close(ElShmClient *client) {
+  shm_close(client->ch);
+  close(client->sock);
+  delete client;
+}
+
+// -----------------------------------------------------------------------
+// UDP client
+// -----------------------------------------------------------------------
+
+// Attempts per request, and how long each waits for the response
+const int k_udp_attempts = 3;
+const int k_udp_timeout_ms = 100;
+
+struct ElUdpClient {
+  ClientOptions options;
+  int fd = -1;
+  uint32_t next_id = 0;
+  string out;                  // Request datagram, reused across calls
+  char in[UDP_MAX_DATAGRAM];   // Response datagram
+  ElClient *tcp = NULL;        // Opened when a response needs TCP
+};
+
+// Repeats command over TCP, connecting on first use
+static ClientReply udp_fallback(ElUdpClient *client,
+                                const vector<string> &command) {
+  if (!client->tcp) {
+    string error;
+    ClientOptions options = client->options;
+    options.connections = 1;
+    client->tcp = elclient_connect(options, &error);
+    if (!client->tcp) {
+      return failure(error.c_str());
+    }
+  }
+  return elclient_call(client->tcp, command);
+}
+
+ElUdpClient *elclient_udp_connect(const ClientOptions &options,
+                                  string *error) {
+  struct sockaddr_in addr;
+  if (!resolve(options, &addr, error)) {
+    return NULL;
+  }
+  // A connected socket only receives datagrams from the server
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    *error = string("connect failed: ") + strerror(errno);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  ElUdpClient *client = new ElUdpClient;
+  client->options = options;
+  client->fd = fd;
+  return client;
+}
+
+ClientReply elclient_udp_call(ElUdpClient *client,
+                              const vector<string> &command) {
+  uint32_t id = client->next_id++;
+  uint32_t net_id = htonl(id);
+  client->out.assign(UDP_HEADER_SIZE, '\0');
+  memcpy(&client->out[0], &net_id, 4);
+  if (!build_request(command, &client->out)) {
+    return failure("invalid request");
+  }
+
+  for (int attempt = 0; attempt < k_udp_attempts; attempt++) {
+    if (send(client->fd, client->out.data(), client->out.size(), 0) < 0) {
+      return failure(strerror(errno));
+    }
+    chrono::steady_clock::time_point deadline =
+        chrono::steady_clock::now() + chrono::milliseconds(k_udp_timeout_ms);
+    for (;;) {
+      int left = (int)chrono::duration_cast<chrono::milliseconds>(
+                     deadline - chrono::steady_clock::now())
+                     .count();
+      struct pollfd pfd = {client->fd, POLLIN, 0};
+      if (left <= 0 || poll(&pfd, 1, left) == 0) {
+        break; // Lost; send again
+      }
+      ssize_t n = recv(client->fd, client->in, sizeof(client->in), 0);
+      if (n < 0 && errno == ECONNREFUSED) {
+        return failure("connection refused");
+      } else if (n < (ssize_t)UDP_HEADER_SIZE ||
+                 memcmp(client->in, &net_id, 4) != 0) {
+        continue; // Late response to an earlier request, or noise
+      }
+      uint16_t flags;
+      memcpy(&flags, client->in + 4, 2);
+      if (ntohs(flags) & UDP_FLAG_USE_TCP) {
+        return udp_fallback(client, command);
+      }
+      uint32_t len;
+      memcpy(&len, client->in + UDP_HEADER_SIZE, 4);
+      len = ntohl(len);
+      if ((size_t)n < UDP_HEADER_SIZE + 4 ||
+          (size_t)n != UDP_HEADER_SIZE + 4 + len) {
+        return failure("invalid response");
+      }
+      ClientReply reply;
+      reply.ok = true;
+      reply.data.assign(client->in + UDP_HEADER_SIZE + 4, len);
+      return reply;
+    }
+  }
+  return failure("no response");
+}
+
+void elclient_udp_close(ElUdpClient *client) {
+  if (client->tcp) {
+    elclient_close(client->tcp);
+  }
+  close(client->fd);
+  delete client;
+}
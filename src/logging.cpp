@@ -0,0 +1,184 @@
+// logging.cpp - Asynchronous leveled logger (see logging.h)
+//
+// The ring is a bounded multi-producer queue: every slot carries a sequence
+// number telling producers when it is free and the drain thread when it
+// has been filled, so neither side takes a lock.
+
+// stdlib
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+// C++
+#include <algorithm>
+#include <atomic>
+#include <thread>
+// project
+#include "logging.h"
+
+struct LogSlot {
+  std::atomic<uint64_t> seq;
+  int64_t ts_ns;
+  int level;
+  uint32_t len;
+  char msg[k_log_msg_max];
+};
+
+struct LogRing {
+  LogSlot slots[k_log_slots];
+  alignas(64) std::atomic<uint64_t> tail{0}; // Next slot to fill
+  alignas(64) uint64_t head = 0;             // Next slot to drain
+  std::atomic<uint64_t> dropped{0};          // Messages lost to a full ring
+  std::atomic<bool> running{false};
+  std::thread thread;
+
+  LogRing() {
+    for (size_t i = 0; i < k_log_slots; i++) {
+      slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+};
+
+static LogRing g_log;
+
+static const char *const k_level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static int64_t now_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Lets at most k_log_rate_burst messages per second through a call site.
+// Returns the number of messages suppressed before this one, or -1 if this
+// one must be suppressed too.
+static int64_t rate_limit(LogSite *site) {
+  int64_t sec = now_ns(CLOCK_MONOTONIC_COARSE) / 1000000000;
+  if (site->window.load(std::memory_order_relaxed) != sec) {
+    site->window.store(sec, std::memory_order_relaxed);
+    site->emitted.store(0, std::memory_order_relaxed);
+  }
+  if (site->emitted.fetch_add(1, std::memory_order_relaxed) >=
+      k_log_rate_burst) {
+    site->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return -1;
+  }
+  return site->suppressed.exchange(0, std::memory_order_relaxed);
+}
+
+void log_write(LogSite *site, int level, const char *file, int line,
+               const char *fmt, ...) {
+  int64_t suppressed = rate_limit(site);
+  if (suppressed < 0) {
+    return;
+  }
+
+  // Claim a slot
+  LogSlot *slot;
+  uint64_t pos = g_log.tail.load(std::memory_order_relaxed);
+  while (true) {
+    slot = &g_log.slots[pos & (k_log_slots - 1)];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    int64_t diff = (int64_t)seq - (int64_t)pos;
+    if (diff == 0) {
+      if (g_log.tail.compare_exchange_weak(pos, pos + 1,
+                                           std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // full: drop rather than wait for the drain thread
+      g_log.dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = g_log.tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  int n = snprintf(slot->msg, sizeof(slot->msg), "[%s] %s:%d(): ",
+                   k_level_names[level], file, line);
+  if (n < 0 || (size_t)n >= sizeof(slot->msg)) {
+    n = 0;
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  int m = vsnprintf(slot->msg + n, sizeof(slot->msg) - n, fmt, ap);
+  va_end(ap);
+  size_t len = m < 0 ? n : std::min(sizeof(slot->msg) - 1, (size_t)(n + m));
+  if (suppressed > 0) {
+    int k = snprintf(slot->msg + len, sizeof(slot->msg) - len,
+                     " (%lld similar messages suppressed)",
+                     (long long)suppressed);
+    if (k > 0) {
+      len = std::min(sizeof(slot->msg) - 1, len + k);
+    }
+  }
+  slot->len = (uint32_t)len;
+  slot->level = level;
+  slot->ts_ns = now_ns(CLOCK_REALTIME);
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+// Writes out every filled slot. Returns the number of messages written.
+static size_t log_drain() {
+  size_t count = 0;
+  while (true) {
+    LogSlot *slot = &g_log.slots[g_log.head & (k_log_slots - 1)];
+    if (slot->seq.load(std::memory_order_acquire) != g_log.head + 1) {
+      break;
+    }
+    time_t sec = (time_t)(slot->ts_ns / 1000000000);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    FILE *out = slot->level >= LOG_LEVEL_WARN ? stderr : stdout;
+    fprintf(out, "%s.%03d %.*s\n", stamp,
+            (int)(slot->ts_ns / 1000000 % 1000), (int)slot->len, slot->msg);
+
+    slot->seq.store(g_log.head + k_log_slots, std::memory_order_release);
+    g_log.head++;
+    count++;
+  }
+
+  uint64_t dropped = g_log.dropped.exchange(0, std::memory_order_relaxed);
+  if (dropped > 0) {
+    fprintf(stderr, "[WARN] logger: %llu messages dropped, ring full\n",
+            (unsigned long long)dropped);
+  }
+  if (count > 0 || dropped > 0) {
+    fflush(stdout);
+    fflush(stderr);
+  }
+  return count;
+}
+
+static void log_main() {
+  while (g_log.running.load(std::memory_order_acquire)) {
+    if (log_drain() == 0) {
+      struct timespec ts = {0, 1000000}; // 1ms
+      nanosleep(&ts, NULL);
+    }
+  }
+  log_drain();
+}
+
+/**
+ * Starts the drain thread. Messages logged before this are kept in the ring.
+ */
+void log_init() {
+  if (g_log.running.exchange(true)) {
+    return;
+  }
+  g_log.thread = std::thread(log_main);
+}
+
+/**
+ * Writes out the remaining messages and stops the drain thread.
+ */
+void log_shutdown() {
+  if (!g_log.running.exchange(false)) {
+    return;
+  }
+  g_log.thread.join();
+}
@@ -1,11 +1,87 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <atomic>
+
+// Log levels; LOG_LEVEL selects the lowest level compiled in
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Messages longer than this are truncated
+const size_t k_log_msg_max = 240;
+
+// Messages queued before new ones are dropped; a power of 2
+const size_t k_log_slots = 4096;
+
+// Messages per call site per second before repeats are suppressed
+const int64_t k_log_rate_burst = 10;
+
+// Per call site rate limiting state, one static instance per LOG_* use
+struct LogSite {
+  std::atomic<int64_t> window{0};     // Second the counts refer to
+  std::atomic<int64_t> emitted{0};    // Messages let through this second
+  std::atomic<int64_t> suppressed{0}; // Messages dropped since last emitted
+};
+
+// Asynchronous logger. log_write formats the message into a slot of a
+// lock-free ring buffer and returns; a background thread started by
+// log_init writes the slots out. When the ring is full the message is
+// dropped and counted rather than waiting, so logging never blocks the
+// caller.
+void log_init();
+void log_shutdown();
+void log_write(LogSite *site, int level, const char *file, int line,
+               const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+
+#define LOG_AT(level, fmt, ...)                                                \
+  do {                                                                         \
+    static LogSite log_site_;                                                  \
+    log_write(&log_site_, (level), __FILE__, __LINE__, fmt, ##__VA_ARGS__);    \
+  } while (0)
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(fmt, ...) ((void)0)
+#endif
+
+// Errors go through the async logger in binaries built with LOG_ASYNC (the
+// server) and straight to stderr otherwise (the CLI client).
+#ifdef LOG_ASYNC
+#define LOG_ERROR(msg) LOG_AT(LOG_LEVEL_ERROR, "%s", (msg))
+
+#define LOG_SYS_ERROR(msg)                                                     \
+  LOG_AT(LOG_LEVEL_ERROR, "%s\n%s", (msg), strerror(errno))
+#else
 #define LOG_ERROR(msg)                                                         \
   fprintf(stderr, "[ERROR] %s:%d(): %s\n", __FILE__, __LINE__, (msg))
 
 #define LOG_SYS_ERROR(msg)                                                     \
   fprintf(stderr, "[ERROR] %s:%d(): %s\n%s\n", __FILE__, __LINE__, (msg),      \
           strerror(errno))
+#endif
 
 #endif // LOGGING_H
@@ -0,0 +1,43 @@
+// main.cpp - Server entry point
+
+// stdlib
+#include <cstdio>
+#include <cstdlib>
+#include <string.h>
+// project
+#include "elserver.h"
+#include "logging.h"
+
+int main(int argc, char *argv[]) {
+  ServerOptions options;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--ordered-index") == 0) {
+      db.ordered = true;
+    } else if (strcmp(argv[i], "--appendonly") == 0) {
+      options.appendonly = true;
+    } else if (strcmp(argv[i], "--memcached") == 0) {
+      options.memcache_port = MEMCACHE_PORT;
+    } else if (strcmp(argv[i], "--metrics") == 0) {
+      options.metrics_port = METRICS_PORT;
+    } else if (strcmp(argv[i], "--shm") == 0) {
+      options.shm_path = SHM_SOCKET_PATH;
+    } else if (strcmp(argv[i], "--udp") == 0) {
+      options.udp_port = SERVER_PORT;
+    } else if (strcmp(argv[i], "--udp-bind") == 0 && i + 1 < argc) {
+      options.udp_port = SERVER_PORT;
+      options.udp_bind = argv[++i];
+    } else {
+      fprintf(stderr,
+              "usage: %s [--ordered-index] [--appendonly] [--memcached] "
+              "[--metrics] [--shm] [--udp] [--udp-bind addr]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Flush queued messages on every exit path, including the error exits
+  log_init();
+  atexit(log_shutdown);
+
+  return server_run(options);
+}
@@ -0,0 +1,808 @@
+// memcache.cpp - memcached text and binary protocol frontend (see memcache.h)
+
+// stdlib
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string.h>
+// system
+#include <endian.h>
+// C++
+#include <string>
+#include <vector>
+// project
+#include "aof.h"
+#include "elserver.h"
+#include "hashtable.h"
+#include "logging.h"
+#include "memcache.h"
+#include "metrics.h"
+#include "valuetype.h"
+
+// Binary protocol header size and magic bytes
+const size_t k_bin_header = 24;
+const uint8_t k_bin_request = 0x80;
+const uint8_t k_bin_response = 0x81;
+
+// Most tokens on a non-get text command line
+const size_t k_mc_max_tokens = 8;
+
+enum BinOpcode : uint8_t {
+  BIN_GET = 0x00,
+  BIN_SET = 0x01,
+  BIN_ADD = 0x02,
+  BIN_REPLACE = 0x03,
+  BIN_DELETE = 0x04,
+  BIN_INCR = 0x05,
+  BIN_DECR = 0x06,
+  BIN_QUIT = 0x07,
+  BIN_GETQ = 0x09,
+  BIN_NOOP = 0x0a,
+  BIN_VERSION = 0x0b,
+  BIN_GETK = 0x0c,
+  BIN_GETKQ = 0x0d,
+  BIN_SETQ = 0x11,
+  BIN_ADDQ = 0x12,
+  BIN_REPLACEQ = 0x13,
+  BIN_DELETEQ = 0x14,
+  BIN_INCRQ = 0x15,
+  BIN_DECRQ = 0x16,
+  BIN_QUITQ = 0x17,
+};
+
+enum BinStatus : uint16_t {
+  BIN_OK = 0x00,
+  BIN_KEY_ENOENT = 0x01,
+  BIN_KEY_EEXISTS = 0x02,
+  BIN_E2BIG = 0x03,
+  BIN_EINVAL = 0x04,
+  BIN_NOT_STORED = 0x05,
+  BIN_DELTA_BADVAL = 0x06,
+  BIN_UNKNOWN_COMMAND = 0x81,
+};
+
+enum StoreMode { STORE_SET, STORE_ADD, STORE_REPLACE, STORE_CAS };
+
+enum McResult { MC_OK, MC_NOT_STORED, MC_EXISTS, MC_NOT_FOUND, MC_NON_NUMERIC };
+
+// A get waiting in the lookup batch
+struct McGet {
+  Entry probe;
+  bool binary;
+  bool with_cas;  // text "gets"
+  bool end_after; // text: last key of its command, "END" follows
+  uint8_t opcode; // binary
+  char opaque[4]; // binary, echoed back as is
+};
+
+struct McGetBatch {
+  McGet gets[k_lookup_batch];
+  size_t n = 0;
+};
+
+static McGetBatch g_batch;
+
+// Reused for logging writes so that only an enabled log costs allocations
+static std::vector<std::string> g_aof_command;
+
+// -----------------------------------------------------------------------
+// Store operations shared by both protocols
+// -----------------------------------------------------------------------
+static void mc_feed_set(const Entry *ent) {
+  if (!aof_enabled()) {
+    return;
+  }
+  g_aof_command.resize(3);
+  g_aof_command[0] = "set";
+  g_aof_command[1] = ent->key;
+  g_aof_command[2] = ent->value;
+  aof_feed(g_aof_command);
+}
+
+static void mc_feed_del(const char *key, size_t len) {
+  if (!aof_enabled()) {
+    return;
+  }
+  g_aof_command.resize(2);
+  g_aof_command[0] = "del";
+  g_aof_command[1].assign(key, len);
+  aof_feed(g_aof_command);
+}
+
+// Stores value under key according to mode. A nonzero cas must match the
+// entry's version. On success *out is the stored entry.
+static McResult mc_store(StoreMode mode, const char *key, size_t key_len,
+                         const char *value, size_t value_len, uint32_t flags,
+                         uint64_t cas, Entry **out) {
+  Entry *ent = db_lookup(key, key_len);
+  if (ent && mode == STORE_ADD) {
+    return MC_NOT_STORED;
+  }
+  if (!ent && mode == STORE_REPLACE) {
+    return MC_NOT_STORED;
+  }
+  if (!ent && (mode == STORE_CAS || cas != 0)) {
+    return MC_NOT_FOUND;
+  }
+  if (ent && (mode == STORE_CAS || cas != 0) && ent->version != cas) {
+    return MC_EXISTS;
+  }
+  ent = db_set(key, key_len, value, value_len);
+  ent->flags = flags;
+  mc_feed_set(ent);
+  *out = ent;
+  return MC_OK;
+}
+
+static McResult mc_delete(const char *key, size_t len, uint64_t cas) {
+  Entry *ent = db_lookup(key, len);
+  if (!ent) {
+    return MC_NOT_FOUND;
+  }
+  if (cas != 0 && ent->version != cas) {
+    return MC_EXISTS;
+  }
+  db_del(key, len);
+  mc_feed_del(key, len);
+  return MC_OK;
+}
+
+// Parses all of [s, s + len) as an unsigned decimal
+static bool parse_u64(const char *s, size_t len, uint64_t *out) {
+  if (len == 0 || len > 20) {
+    return false;
+  }
+  uint64_t v = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] < '0' || s[i] > '9') {
+      return false;
+    }
+    uint64_t next = v * 10 + (uint64_t)(s[i] - '0');
+    if (next / 10 != v) {
+      return false;
+    }
+    v = next;
+  }
+  *out = v;
+  return true;
+}
+
+// incr wraps around at 2^64, decr stops at 0. If the key is missing and
+// create is set, it is created with initial instead.
+static McResult mc_arith(const char *key, size_t len, bool incr,
+                         uint64_t delta, bool create, uint64_t initial,
+                         uint64_t *result, Entry **out) {
+  Entry *ent = db_lookup(key, len);
+  uint64_t v;
+  if (!ent) {
+    if (!create) {
+      return MC_NOT_FOUND;
+    }
+    v = initial;
+  } else if (!parse_u64(ent->value.data(), ent->value.size(), &v)) {
+    return MC_NON_NUMERIC;
+  } else if (incr) {
+    v += delta;
+  } else {
+    v = delta > v ? 0 : v - delta;
+  }
+  char buf[24];
+  int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)v);
+  uint32_t flags = ent ? ent->flags : 0;
+  ent = db_set(key, len, buf, (size_t)n);
+  ent->flags = flags;
+  mc_feed_set(ent);
+  *result = v;
+  *out = ent;
+  return MC_OK;
+}
+
+// -----------------------------------------------------------------------
+// Binary protocol responses
+// -----------------------------------------------------------------------
+static bool bin_response(Connection *conn, uint8_t opcode, uint16_t status,
+                         const char *opaque, uint64_t cas, const char *extras,
+                         uint8_t extras_len, const char *key, size_t key_len,
+                         const char *value, size_t value_len) {
+  char header[k_bin_header];
+  uint16_t key_len16 = htobe16((uint16_t)key_len);
+  uint16_t status16 = htobe16(status);
+  uint32_t body = htobe32((uint32_t)(extras_len + key_len + value_len));
+  uint64_t cas64 = htobe64(cas);
+  header[0] = (char)k_bin_response;
+  header[1] = (char)opcode;
+  memcpy(header + 2, &key_len16, 2);
+  header[4] = (char)extras_len;
+  header[5] = 0; // raw bytes
+  memcpy(header + 6, &status16, 2);
+  memcpy(header + 8, &body, 4);
+  memcpy(header + 12, opaque, 4);
+  memcpy(header + 16, &cas64, 8);
+  return append_bytes(conn, header, sizeof(header)) &&
+         append_bytes(conn, extras, extras_len) &&
+         append_bytes(conn, key, key_len) &&
+         append_bytes(conn, value, value_len);
+}
+
+static bool bin_status(Connection *conn, uint8_t opcode, uint16_t status,
+                       const char *opaque) {
+  const char *msg = "";
+  switch (status) {
+  case BIN_KEY_ENOENT:
+    msg = "Not found";
+    break;
+  case BIN_KEY_EEXISTS:
+    msg = "Data exists for key";
+    break;
+  case BIN_E2BIG:
+    msg = "Too large";
+    break;
+  case BIN_EINVAL:
+    msg = "Invalid arguments";
+    break;
+  case BIN_NOT_STORED:
+    msg = "Not stored";
+    break;
+  case BIN_DELTA_BADVAL:
+    msg = "Non-numeric server-side value for incr or decr";
+    break;
+  case BIN_UNKNOWN_COMMAND:
+    msg = "Unknown command";
+    break;
+  }
+  return bin_response(conn, opcode, status, opaque, 0, NULL, 0, NULL, 0, msg,
+                      strlen(msg));
+}
+
+static uint16_t bin_status_of(McResult r) {
+  switch (r) {
+  case MC_OK:
+    return BIN_OK;
+  case MC_NOT_STORED:
+    return BIN_NOT_STORED;
+  case MC_EXISTS:
+    return BIN_KEY_EEXISTS;
+  case MC_NOT_FOUND:
+    return BIN_KEY_ENOENT;
+  case MC_NON_NUMERIC:
+    return BIN_DELTA_BADVAL;
+  }
+  return BIN_EINVAL;
+}
+
+static MetricCounter store_metric(StoreMode mode) {
+  switch (mode) {
+  case STORE_ADD:
+    return M_MC_ADD;
+  case STORE_REPLACE:
+    return M_MC_REPLACE;
+  case STORE_CAS:
+    return M_MC_CAS;
+  default:
+    return M_MC_SET;
+  }
+}
+
+static bool mc_reply(Connection *conn, const char *msg) {
+  return append_bytes(conn, msg, strlen(msg));
+}
+
+// -----------------------------------------------------------------------
+// Batched gets
+// -----------------------------------------------------------------------
+
+// Writes the response of one resolved get; ent is NULL on a miss
+static bool mc_get_response(Connection *conn, const McGet &get, Entry *ent) {
+  if (ent && value_type(ent->value) != VT_STRING) {
+    // Structured values have no memcached form; report them as misses
+    ent = NULL;
+  }
+  if (!get.binary) {
+    if (ent) {
+      char header[k_mc_max_key + 64];
+      int n;
+      if (get.with_cas) {
+        n = snprintf(header, sizeof(header), "VALUE %s %u %zu %llu\r\n",
+                     ent->key.c_str(), ent->flags, ent->value.size(),
+                     (unsigned long long)ent->version);
+      } else {
+        n = snprintf(header, sizeof(header), "VALUE %s %u %zu\r\n",
+                     ent->key.c_str(), ent->flags, ent->value.size());
+      }
+      if (!append_bytes(conn, header, (size_t)n) ||
+          !append_bytes(conn, ent->value.data(), ent->value.size()) ||
+          !append_bytes(conn, "\r\n", 2)) {
+        return false;
+      }
+    }
+    return !get.end_after || mc_reply(conn, "END\r\n");
+  }
+
+  bool quiet = get.opcode == BIN_GETQ || get.opcode == BIN_GETKQ;
+  if (!ent) {
+    return quiet || bin_status(conn, get.opcode, BIN_KEY_ENOENT, get.opaque);
+  }
+  bool with_key = get.opcode == BIN_GETK || get.opcode == BIN_GETKQ;
+  uint32_t flags = htobe32(ent->flags);
+  return bin_response(conn, get.opcode, BIN_OK, get.opaque, ent->version,
+                      (const char *)&flags, 4, ent->key.data(),
+                      with_key ? ent->key.size() : 0, ent->value.data(),
+                      ent->value.size());
+}
+
+// Resolves the queued gets with one sm_lookup_batch call and writes their
+// responses in request order. Returns false if the connection must close.
+static bool mc_flush_gets(Connection *conn) {
+  if (g_batch.n == 0) {
+    return true;
+  }
+  HNode *keys[k_lookup_batch];
+  HNode *found[k_lookup_batch];
+  for (size_t i = 0; i < g_batch.n; i++) {
+    keys[i] = &g_batch.gets[i].probe.node;
+  }
+  sm_lookup_batch(&db.smap, keys, found, g_batch.n, &cmp);
+
+  bool ok = true;
+  for (size_t i = 0; i < g_batch.n && ok; i++) {
+    Entry *ent = found[i] ? container_of(found[i], struct Entry, node) : NULL;
+    ok = mc_get_response(conn, g_batch.gets[i], ent);
+  }
+  g_batch.n = 0;
+  return ok;
+}
+
+// Queues a get, resolving the batch when it is full
+static McGet *mc_queue_get(Connection *conn, const char *key, size_t len) {
+  if (g_batch.n == k_lookup_batch && !mc_flush_gets(conn)) {
+    return NULL;
+  }
+  McGet *get = &g_batch.gets[g_batch.n++];
+  get->probe.key.assign(key, len);
+  get->probe.node.hashcode = str_hash((const uint8_t *)key, len);
+  get->binary = false;
+  get->with_cas = false;
+  get->end_after = false;
+  return get;
+}
+
+// -----------------------------------------------------------------------
+// Text protocol
+// -----------------------------------------------------------------------
+struct Token {
+  const char *s;
+  size_t len;
+};
+
+// Finds the next space separated token in [*p, end)
+static bool next_token(const char **p, const char *end, Token *tok) {
+  const char *s = *p;
+  while (s < end && *s == ' ') {
+    s++;
+  }
+  if (s == end) {
+    return false;
+  }
+  const char *e = s;
+  while (e < end && *e != ' ') {
+    e++;
+  }
+  tok->s = s;
+  tok->len = (size_t)(e - s);
+  *p = e;
+  return true;
+}
+
+static bool token_is(const Token &tok, const char *word) {
+  return tok.len == strlen(word) && memcmp(tok.s, word, tok.len) == 0;
+}
+
+static bool parse_u32(const Token &tok, uint32_t *out) {
+  uint64_t v;
+  if (!parse_u64(tok.s, tok.len, &v) || v > UINT32_MAX) {
+    return false;
+  }
+  *out = (uint32_t)v;
+  return true;
+}
+
+// Queues the keys of a text get/gets
+static bool text_get(Connection *conn, const char *p, const char *end,
+                     bool with_cas) {
+  Token tok;
+  McGet *last = NULL;
+  while (next_token(&p, end, &tok)) {
+    if (tok.len > k_mc_max_key) {
+      return mc_flush_gets(conn) &&
+             mc_reply(conn, "CLIENT_ERROR bad command line format\r\n");
+    }
+    last = mc_queue_get(conn, tok.s, tok.len);
+    if (!last) {
+      return false;
+    }
+    last->with_cas = with_cas;
+  }
+  if (!last) {
+    return mc_reply(conn, "ERROR\r\n");
+  }
+  last->end_after = true;
+  return true;
+}
+
+// Writes the response to a text store command unless noreply was given
+static bool text_store_reply(Connection *conn, McResult r, bool noreply) {
+  if (noreply) {
+    return true;
+  }
+  switch (r) {
+  case MC_OK:
+    return mc_reply(conn, "STORED\r\n");
+  case MC_NOT_STORED:
+    return mc_reply(conn, "NOT_STORED\r\n");
+  case MC_EXISTS:
+    return mc_reply(conn, "EXISTS\r\n");
+  default:
+    return mc_reply(conn, "NOT_FOUND\r\n");
+  }
+}
+
+// -----------------------------------------------------------------------
+// mc_text_request: parse & execute one text protocol request
+//   - returns 0 => partial request, need more data
+//   - returns >0 => consumed that many bytes
+//   - returns -1 => fatal error => close connection
+// -----------------------------------------------------------------------
+static int32_t mc_text_request(Connection *conn, char *start, char *end) {
+  char *nl = (char *)memchr(start, '\n', end - start);
+  if (!nl) {
+    if (end - start == (ptrdiff_t)sizeof(conn->read_buffer)) {
+      mc_flush_gets(conn);
+      mc_reply(conn, "CLIENT_ERROR line too long\r\n");
+      flush_write_buffer(conn);
+      return -1;
+    }
+    return 0;
+  }
+  const char *line_end = nl > start && nl[-1] == '\r' ? nl - 1 : nl;
+  int32_t consumed = (int32_t)(nl + 1 - start);
+
+  const char *p = start;
+  Token cmd;
+  if (!next_token(&p, line_end, &cmd)) {
+    return mc_reply(conn, "ERROR\r\n") ? consumed : -1;
+  }
+  if (token_is(cmd, "get") || token_is(cmd, "gets")) {
+    metric_add(M_MC_GET);
+    return text_get(conn, p, line_end, cmd.len == 4) ? consumed : -1;
+  }
+
+  // Anything else must see the effects of the queued gets' predecessors
+  // and precede their successors
+  if (!mc_flush_gets(conn)) {
+    return -1;
+  }
+  Token tok[k_mc_max_tokens];
+  size_t ntok = 0;
+  while (ntok < k_mc_max_tokens && next_token(&p, line_end, &tok[ntok])) {
+    ntok++;
+  }
+  Token extra;
+  if (next_token(&p, line_end, &extra)) {
+    return mc_reply(conn, "ERROR\r\n") ? consumed : -1;
+  }
+  bool noreply = ntok > 0 && token_is(tok[ntok - 1], "noreply");
+  if (noreply) {
+    ntok--;
+  }
+  if (ntok > 0 && tok[0].len > k_mc_max_key) {
+    return mc_reply(conn, "CLIENT_ERROR bad command line format\r\n")
+               ? consumed
+               : -1;
+  }
+
+  bool is_cas = token_is(cmd, "cas");
+  if (is_cas || token_is(cmd, "set") || token_is(cmd, "add") ||
+      token_is(cmd, "replace")) {
+    // <key> <flags> <exptime> <bytes> [<cas unique>]
+    uint32_t flags, exptime, bytes;
+    uint64_t cas = 0;
+    if (ntok != (is_cas ? 5u : 4u) || !parse_u32(tok[1], &flags) ||
+        !parse_u32(tok[2], &exptime) || !parse_u32(tok[3], &bytes) ||
+        (is_cas && !parse_u64(tok[4].s, tok[4].len, &cas))) {
+      return mc_reply(conn, "CLIENT_ERROR bad command line format\r\n")
+                 ? consumed
+                 : -1;
+    }
+    if ((size_t)consumed + bytes + 2 > sizeof(conn->read_buffer)) {
+      mc_reply(conn, "SERVER_ERROR object too large for cache\r\n");
+      flush_write_buffer(conn);
+      return -1;
+    }
+    if (end - (nl + 1) < (ptrdiff_t)bytes + 2) {
+      return 0;
+    }
+    const char *data = nl + 1;
+    if (data[bytes] != '\r' || data[bytes + 1] != '\n') {
+      mc_reply(conn, "CLIENT_ERROR bad data chunk\r\n");
+      flush_write_buffer(conn);
+      return -1;
+    }
+    consumed += (int32_t)bytes + 2;
+
+    StoreMode mode = is_cas                     ? STORE_CAS
+                     : token_is(cmd, "add")     ? STORE_ADD
+                     : token_is(cmd, "replace") ? STORE_REPLACE
+                                                : STORE_SET;
+    metric_add(store_metric(mode));
+    Entry *ent;
+    McResult r = mc_store(mode, tok[0].s, tok[0].len, data, bytes, flags, cas,
+                          &ent);
+    return text_store_reply(conn, r, noreply) ? consumed : -1;
+  }
+
+  if (token_is(cmd, "delete")) {
+    if (ntok != 1) {
+      return mc_reply(conn, "CLIENT_ERROR bad command line format\r\n")
+                 ? consumed
+                 : -1;
+    }
+    metric_add(M_MC_DELETE);
+    McResult r = mc_delete(tok[0].s, tok[0].len, 0);
+    if (noreply) {
+      return consumed;
+    }
+    return mc_reply(conn, r == MC_OK ? "DELETED\r\n" : "NOT_FOUND\r\n")
+               ? consumed
+               : -1;
+  }
+
+  if (token_is(cmd, "incr") || token_is(cmd, "decr")) {
+    uint64_t delta;
+    if (ntok != 2) {
+      return mc_reply(conn, "ERROR\r\n") ? consumed : -1;
+    }
+    if (!parse_u64(tok[1].s, tok[1].len, &delta)) {
+      return mc_reply(conn, "CLIENT_ERROR invalid numeric delta argument\r\n")
+                 ? consumed
+                 : -1;
+    }
+    metric_add(cmd.s[0] == 'i' ? M_MC_INCR : M_MC_DECR);
+    uint64_t v;
+    Entry *ent;
+    McResult r = mc_arith(tok[0].s, tok[0].len, cmd.s[0] == 'i', delta, false,
+                          0, &v, &ent);
+    if (noreply) {
+      return consumed;
+    }
+    bool ok;
+    if (r == MC_NOT_FOUND) {
+      ok = mc_reply(conn, "NOT_FOUND\r\n");
+    } else if (r == MC_NON_NUMERIC) {
+      ok = mc_reply(conn, "CLIENT_ERROR cannot increment or decrement "
+                          "non-numeric value\r\n");
+    } else {
+      char buf[24];
+      int n = snprintf(buf, sizeof(buf), "%llu\r\n", (unsigned long long)v);
+      ok = append_bytes(conn, buf, (size_t)n);
+    }
+    return ok ? consumed : -1;
+  }
+
+  metric_add(M_MC_OTHER);
+  if (token_is(cmd, "version") && ntok == 0) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "VERSION %s\r\n", k_mc_version);
+    return append_bytes(conn, buf, (size_t)n) ? consumed : -1;
+  }
+  if (token_is(cmd, "quit")) {
+    flush_write_buffer(conn);
+    return -1;
+  }
+  return mc_reply(conn, "ERROR\r\n") ? consumed : -1;
+}
+
+// -----------------------------------------------------------------------
+// mc_bin_request: parse & execute one binary protocol request
+//   - returns 0 => partial request, need more data
+//   - returns >0 => consumed that many bytes
+//   - returns -1 => fatal error => close connection
+// -----------------------------------------------------------------------
+static int32_t mc_bin_request(Connection *conn, char *start, char *end) {
+  if (end - start < (ptrdiff_t)k_bin_header) {
+    return 0;
+  }
+  uint8_t opcode = (uint8_t)start[1];
+  uint16_t key_len;
+  uint32_t body_len;
+  uint64_t cas;
+  memcpy(&key_len, start + 2, 2);
+  memcpy(&body_len, start + 8, 4);
+  memcpy(&cas, start + 16, 8);
+  key_len = be16toh(key_len);
+  body_len = be32toh(body_len);
+  cas = be64toh(cas);
+  uint8_t extras_len = (uint8_t)start[4];
+  const char *opaque = start + 12;
+
+  if (k_bin_header + (size_t)body_len > sizeof(conn->read_buffer)) {
+    mc_flush_gets(conn);
+    bin_status(conn, opcode, BIN_E2BIG, opaque);
+    flush_write_buffer(conn);
+    return -1;
+  }
+  if (end - start < (ptrdiff_t)(k_bin_header + body_len)) {
+    return 0;
+  }
+  int32_t consumed = (int32_t)(k_bin_header + body_len);
+  const char *extras = start + k_bin_header;
+  const char *key = extras + extras_len;
+  if ((size_t)extras_len + key_len > body_len || key_len > k_mc_max_key) {
+    return mc_flush_gets(conn) && bin_status(conn, opcode, BIN_EINVAL, opaque)
+               ? consumed
+               : -1;
+  }
+  const char *value = key + key_len;
+  size_t value_len = body_len - extras_len - key_len;
+
+  if (opcode == BIN_GET || opcode == BIN_GETQ || opcode == BIN_GETK ||
+      opcode == BIN_GETKQ) {
+    if (key_len == 0 || extras_len != 0 || value_len != 0) {
+      return mc_flush_gets(conn) &&
+                     bin_status(conn, opcode, BIN_EINVAL, opaque)
+                 ? consumed
+                 : -1;
+    }
+    metric_add(M_MC_GET);
+    McGet *get = mc_queue_get(conn, key, key_len);
+    if (!get) {
+      return -1;
+    }
+    get->binary = true;
+    get->opcode = opcode;
+    memcpy(get->opaque, opaque, 4);
+    return consumed;
+  }
+
+  if (!mc_flush_gets(conn)) {
+    return -1;
+  }
+  bool ok = true;
+  switch (opcode) {
+  case BIN_SET:
+  case BIN_ADD:
+  case BIN_REPLACE:
+  case BIN_SETQ:
+  case BIN_ADDQ:
+  case BIN_REPLACEQ: {
+    if (extras_len != 8 || key_len == 0) {
+      ok = bin_status(conn, opcode, BIN_EINVAL, opaque);
+      break;
+    }
+    uint32_t flags;
+    memcpy(&flags, extras, 4);
+    flags = be32toh(flags);
+    uint8_t base = opcode >= BIN_SETQ ? opcode - (BIN_SETQ - BIN_SET) : opcode;
+    StoreMode mode = base == BIN_ADD       ? STORE_ADD
+                     : base == BIN_REPLACE ? STORE_REPLACE
+                                           : STORE_SET;
+    metric_add(cas != 0 ? M_MC_CAS : store_metric(mode));
+    Entry *ent;
+    McResult r =
+        mc_store(mode, key, key_len, value, value_len, flags, cas, &ent);
+    if (r != MC_OK) {
+      ok = bin_status(conn, opcode, bin_status_of(r), opaque);
+    } else if (base == opcode) {
+      ok = bin_response(conn, opcode, BIN_OK, opaque, ent->version, NULL, 0,
+                        NULL, 0, NULL, 0);
+    }
+    break;
+  }
+  case BIN_DELETE:
+  case BIN_DELETEQ: {
+    if (extras_len != 0 || key_len == 0 || value_len != 0) {
+      ok = bin_status(conn, opcode, BIN_EINVAL, opaque);
+      break;
+    }
+    metric_add(M_MC_DELETE);
+    McResult r = mc_delete(key, key_len, cas);
+    if (r != MC_OK) {
+      ok = bin_status(conn, opcode, bin_status_of(r), opaque);
+    } else if (opcode == BIN_DELETE) {
+      ok = bin_response(conn, opcode, BIN_OK, opaque, 0, NULL, 0, NULL, 0,
+                        NULL, 0);
+    }
+    break;
+  }
+  case BIN_INCR:
+  case BIN_DECR:
+  case BIN_INCRQ:
+  case BIN_DECRQ: {
+    // extras: delta, initial value, expiration (all big-endian)
+    if (extras_len != 20 || key_len == 0 || value_len != 0) {
+      ok = bin_status(conn, opcode, BIN_EINVAL, opaque);
+      break;
+    }
+    uint64_t delta, initial;
+    uint32_t expiration;
+    memcpy(&delta, extras, 8);
+    memcpy(&initial, extras + 8, 8);
+    memcpy(&expiration, extras + 16, 4);
+    delta = be64toh(delta);
+    initial = be64toh(initial);
+    // An expiration of all ones means "don't create a missing key"
+    bool create = be32toh(expiration) != 0xffffffff;
+    bool incr = opcode == BIN_INCR || opcode == BIN_INCRQ;
+    metric_add(incr ? M_MC_INCR : M_MC_DECR);
+    Entry *ent = NULL;
+    uint64_t v;
+    McResult r;
+    if (cas != 0) {
+      Entry *cur = db_lookup(key, key_len);
+      r = !cur                   ? MC_NOT_FOUND
+          : cur->version != cas ? MC_EXISTS
+                                : MC_OK;
+    } else {
+      r = MC_OK;
+    }
+    if (r == MC_OK) {
+      r = mc_arith(key, key_len, incr, delta, create, initial, &v, &ent);
+    }
+    if (r != MC_OK) {
+      ok = bin_status(conn, opcode, bin_status_of(r), opaque);
+    } else if (opcode == BIN_INCR || opcode == BIN_DECR) {
+      uint64_t net = htobe64(v);
+      ok = bin_response(conn, opcode, BIN_OK, opaque, ent->version, NULL, 0,
+                        NULL, 0, (const char *)&net, 8);
+    }
+    break;
+  }
+  case BIN_NOOP:
+    metric_add(M_MC_OTHER);
+    ok = bin_response(conn, opcode, BIN_OK, opaque, 0, NULL, 0, NULL, 0, NULL,
+                      0);
+    break;
+  case BIN_VERSION:
+    metric_add(M_MC_OTHER);
+    ok = bin_response(conn, opcode, BIN_OK, opaque, 0, NULL, 0, NULL, 0,
+                      k_mc_version, strlen(k_mc_version));
+    break;
+  case BIN_QUIT:
+  case BIN_QUITQ:
+    if (opcode == BIN_QUIT) {
+      bin_response(conn, opcode, BIN_OK, opaque, 0, NULL, 0, NULL, 0, NULL,
+                   0);
+    }
+    flush_write_buffer(conn);
+    return -1;
+  default:
+    metric_add(M_MC_OTHER);
+    ok = bin_status(conn, opcode, BIN_UNKNOWN_COMMAND, opaque);
+    break;
+  }
+  return ok ? consumed : -1;
+}
+
+int32_t mc_process_buffer(Connection *conn) {
+  char *start = conn->read_buffer;
+  char *end = conn->read_buffer + conn->read_buffer_size;
+
+  while (start < end && !output_paused(conn)) {
+    int32_t consumed = (uint8_t)*start == k_bin_request
+                           ? mc_bin_request(conn, start, end)
+                           : mc_text_request(conn, start, end);
+    if (consumed < 0) {
+      g_batch.n = 0;
+      return -1;
+    } else if (consumed == 0) {
+      // partial
+      break;
+    }
+    start += consumed;
+  }
+
+  if (!mc_flush_gets(conn)) {
+    g_batch.n = 0;
+    return -1;
+  }
+  return (int32_t)(start - conn->read_buffer);
+}
@@ -0,0 +1,44 @@
+#ifndef MEMCACHE_H
+#define MEMCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct Connection;
+
+// Longest key memcached accepts
+const size_t k_mc_max_key = 250;
+
+// Version reported to memcached clients
+const char *const k_mc_version = "1.6.0";
+
+/**
+ * memcached-compatible frontend.
+ *
+ * Connections accepted on the memcached listener speak the memcached text
+ * protocol (get, gets, set, add, replace, cas, delete, incr, decr, version,
+ * quit) or the binary protocol (the same operations, their quiet variants,
+ * GETK/GETKQ and NOOP); every request is classified by its first byte, 0x80
+ * being the binary request magic. Both map onto the same db as the native
+ * protocol: writes go through db_set/db_del and reach the snapshot, the
+ * ordered index and the append-only log like native set/del, and the entry
+ * version serves as the CAS unique. Keys holding structured values (JSON,
+ * vectors, sketches, time series) read as misses.
+ *
+ * Keys and values are parsed in place in the read buffer and responses are
+ * written straight into the write buffer. Lookups of consecutive get
+ * requests, including multi-key text gets and pipelined binary GETQ/GETKQ
+ * runs, are resolved k_lookup_batch at a time through sm_lookup_batch.
+ *
+ * Expiration times are accepted but ignored, and client flags are kept in
+ * memory only. A request must fit in the connection's read buffer; larger
+ * ones get SERVER_ERROR (text) or E2BIG (binary) and the connection is
+ * closed.
+ */
+
+// Executes the complete requests in conn's read buffer, stopping early while
+// its output is paused. Returns the number of bytes consumed, or -1 if the
+// connection must be closed.
+int32_t mc_process_buffer(Connection *conn);
+
+#endif // MEMCACHE_H
@@ -0,0 +1,256 @@
+// metrics.cpp - Per-thread metrics and the Prometheus endpoint (see metrics.h)
+
+// stdlib
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string.h>
+// system
+#include <unistd.h>
+// C++
+#include <mutex>
+#include <string>
+// project
+#include "btree.h"
+#include "elserver.h"
+#include "metrics.h"
+#include "segtable.h"
+#include "snapshot.h"
+
+thread_local MetricsShard *t_metrics_shard = NULL;
+
+static std::mutex g_shards_mu;
+static MetricsShard *g_shards = NULL;
+
+MetricsShard *metrics_register_shard() {
+  MetricsShard *shard = new MetricsShard();
+  std::lock_guard<std::mutex> lock(g_shards_mu);
+  shard->next = g_shards;
+  g_shards = shard;
+  t_metrics_shard = shard;
+  return shard;
+}
+
+// Command counters as {protocol, command} label pairs
+static const char *const k_command_labels[][2] = {
+    {"native", "get"},        {"native", "set"},
+    {"native", "del"},        {"native", "krange"},
+    {"native", "bgsave"},     {"native", "bgrewriteaof"},
+    {"native", "getv"},       {"native", "cas"},
+    {"native", "append"},     {"native", "setrange"},
+    {"native", "getrange"},   {"native", "strlen"},
+    {"native", "multi"},      {"native", "exec"},
+    {"native", "discard"},    {"native", "watch"},
+    {"native", "unwatch"},    {"native", "eval"},
+    {"native", "evalsha"},    {"native", "script"},
+    {"native", "cms"},        {"native", "topk"},
+    {"native", "vector"},     {"native", "json"},
+    {"native", "ts"},         {"native", "mget"},
+    {"native", "unknown"},
+    {"memcached", "get"},     {"memcached", "set"},
+    {"memcached", "add"},     {"memcached", "replace"},
+    {"memcached", "cas"},     {"memcached", "delete"},
+    {"memcached", "incr"},    {"memcached", "decr"},
+    {"memcached", "other"},
+};
+
+static_assert(sizeof(k_command_labels) / sizeof(k_command_labels[0]) ==
+                  M_MC_OTHER - M_CMD_GET + 1,
+              "one label pair per command counter");
+
+// Sum of every shard
+struct MetricsTotal {
+  uint64_t counters[M_COUNTER_COUNT] = {};
+  uint64_t latency[k_latency_buckets] = {};
+  uint64_t latency_sum_ns = 0;
+};
+
+static void metrics_collect(MetricsTotal *total) {
+  std::lock_guard<std::mutex> lock(g_shards_mu);
+  for (MetricsShard *shard = g_shards; shard; shard = shard->next) {
+    for (size_t i = 0; i < M_COUNTER_COUNT; i++) {
+      total->counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < k_latency_buckets; i++) {
+      total->latency[i] += shard->latency[i].load(std::memory_order_relaxed);
+    }
+    total->latency_sum_ns +=
+        shard->latency_sum_ns.load(std::memory_order_relaxed);
+  }
+}
+
+// Resident set size from /proc, 0 if unavailable
+static uint64_t resident_bytes() {
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp) {
+    return 0;
+  }
+  unsigned long long size = 0, resident = 0;
+  int n = fscanf(fp, "%llu %llu", &size, &resident);
+  fclose(fp);
+  return n == 2 ? resident * (uint64_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+static void put_metric(std::string *out, const char *name, const char *type,
+                       const char *help) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+           type);
+  out->append(buf);
+}
+
+static void put_value(std::string *out, const char *name, const char *labels,
+                      double value) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s%s %.17g\n", name, labels, value);
+  out->append(buf);
+}
+
+// Renders every metric in the Prometheus text exposition format
+static void metrics_render(std::string *out) {
+  MetricsTotal t;
+  metrics_collect(&t);
+  char labels[128];
+
+  put_metric(out, "rah_commands_total", "counter", "Commands executed.");
+  for (size_t i = M_CMD_GET; i <= M_MC_OTHER; i++) {
+    const char *const *l = k_command_labels[i - M_CMD_GET];
+    snprintf(labels, sizeof(labels), "{protocol=\"%s\",cmd=\"%s\"}", l[0],
+             l[1]);
+    put_value(out, "rah_commands_total", labels, (double)t.counters[i]);
+  }
+
+  put_metric(out, "rah_connections_accepted_total", "counter",
+             "Client connections accepted.");
+  put_value(out, "rah_connections_accepted_total", "",
+            (double)t.counters[M_CONNECTIONS_ACCEPTED]);
+  put_metric(out, "rah_connected_clients", "gauge",
+             "Client connections currently open.");
+  put_value(out, "rah_connected_clients", "",
+            (double)(t.counters[M_CONNECTIONS_ACCEPTED] -
+                     t.counters[M_CONNECTIONS_CLOSED]));
+  put_metric(out, "rah_net_input_bytes_total", "counter",
+             "Bytes read from clients.");
+  put_value(out, "rah_net_input_bytes_total", "",
+            (double)t.counters[M_BYTES_IN]);
+  put_metric(out, "rah_net_output_bytes_total", "counter",
+             "Bytes written to clients.");
+  put_value(out, "rah_net_output_bytes_total", "",
+            (double)t.counters[M_BYTES_OUT]);
+  put_metric(out, "rah_deferred_requests_total", "counter",
+             "Slow tagged requests answered after later requests.");
+  put_value(out, "rah_deferred_requests_total", "",
+            (double)t.counters[M_DEFERRED_REQUESTS]);
+  put_metric(out, "rah_udp_requests_total", "counter",
+             "Requests received over UDP.");
+  put_value(out, "rah_udp_requests_total", "",
+            (double)t.counters[M_UDP_REQUESTS]);
+  put_metric(out, "rah_udp_too_large_total", "counter",
+             "UDP requests whose response was too large for a datagram.");
+  put_value(out, "rah_udp_too_large_total", "",
+            (double)t.counters[M_UDP_TOO_LARGE]);
+
+  put_metric(out, "rah_batch_duration_seconds", "histogram",
+             "Time to execute the requests received in one read.");
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < k_latency_buckets; i++) {
+    cumulative += t.latency[i];
+    if (i + 1 < k_latency_buckets) {
+      snprintf(labels, sizeof(labels), "{le=\"%g\"}",
+               (double)(1ull << i) / 1e6);
+    } else {
+      snprintf(labels, sizeof(labels), "{le=\"+Inf\"}");
+    }
+    put_value(out, "rah_batch_duration_seconds_bucket", labels,
+              (double)cumulative);
+  }
+  put_value(out, "rah_batch_duration_seconds_sum", "",
+            (double)t.latency_sum_ns / 1e9);
+  put_value(out, "rah_batch_duration_seconds_count", "", (double)cumulative);
+
+  const SMap &smap = db.smap;
+  uint64_t buckets = sm_buckets(&smap);
+  uint64_t round = (uint64_t)k_segment_slots << smap.level;
+  put_metric(out, "rah_keys", "gauge", "Keys in the keyspace.");
+  put_value(out, "rah_keys", "", (double)smap.size);
+  put_metric(out, "rah_hashtable_buckets", "gauge",
+             "Buckets of the hash table.");
+  put_value(out, "rah_hashtable_buckets", "", (double)buckets);
+  put_metric(out, "rah_hashtable_split_ratio", "gauge",
+             "Fraction of the buckets split in the running table doubling.");
+  put_value(out, "rah_hashtable_split_ratio", "",
+            buckets ? (double)smap.split_pos / (double)round : 0);
+  put_metric(out, "rah_hashtable_memory_bytes", "gauge",
+             "Memory used by the hash table directory and segments.");
+  put_value(out, "rah_hashtable_memory_bytes", "",
+            (double)sm_memory_usage(&smap));
+  put_metric(out, "rah_hashtable_bytes_per_key", "gauge",
+             "Hash table memory plus the embedded nodes, per key.");
+  put_value(out, "rah_hashtable_bytes_per_key", "",
+            smap.size ? (double)(sm_memory_usage(&smap) +
+                                 smap.size * sizeof(HNode)) /
+                            (double)smap.size
+                      : 0);
+  put_metric(out, "rah_index_memory_bytes", "gauge",
+             "Memory used by the ordered key index.");
+  put_value(out, "rah_index_memory_bytes", "",
+            db.ordered ? (double)bt_memory_usage(&db.index) : 0);
+  put_metric(out, "rah_resident_memory_bytes", "gauge",
+             "Resident set size of the process.");
+  put_value(out, "rah_resident_memory_bytes", "", (double)resident_bytes());
+  put_metric(out, "rah_snapshot_in_progress", "gauge",
+             "1 while a snapshot or log rewrite runs.");
+  put_value(out, "rah_snapshot_in_progress", "", snapshot_active() ? 1 : 0);
+}
+
+// Queues a complete HTTP response with the given status line and body
+static bool http_reply(Connection *conn, const char *status,
+                       const std::string &body) {
+  char header[256];
+  int n = snprintf(header, sizeof(header),
+                   "HTTP/1.1 %s\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: %zu\r\n\r\n",
+                   status, body.size());
+  return append_bytes(conn, header, (size_t)n) &&
+         append_bytes(conn, body.data(), body.size());
+}
+
+// -----------------------------------------------------------------------
+// http_process_buffer: answer every complete HTTP request in the buffer
+//   - GET /metrics (or /) is a scrape, anything else a 404
+//   - request bodies are not supported
+// -----------------------------------------------------------------------
+int32_t http_process_buffer(Connection *conn) {
+  char *start = conn->read_buffer;
+  char *end = conn->read_buffer + conn->read_buffer_size;
+
+  while (start < end && !output_paused(conn)) {
+    char *headers_end = (char *)memmem(start, end - start, "\r\n\r\n", 4);
+    if (!headers_end) {
+      if (end - start == (ptrdiff_t)sizeof(conn->read_buffer)) {
+        http_reply(conn, "431 Request Header Fields Too Large", "");
+        flush_write_buffer(conn);
+        return -1;
+      }
+      break;
+    }
+
+    bool ok;
+    if (strncmp(start, "GET /metrics ", 13) == 0 ||
+        strncmp(start, "GET / ", 6) == 0) {
+      std::string body;
+      metrics_render(&body);
+      ok = http_reply(conn, "200 OK", body);
+    } else if (strncmp(start, "GET ", 4) == 0) {
+      ok = http_reply(conn, "404 Not Found", "not found\n");
+    } else {
+      ok = http_reply(conn, "405 Method Not Allowed", "");
+    }
+    if (!ok) {
+      return -1;
+    }
+    start = headers_end + 4;
+  }
+  return (int32_t)(start - conn->read_buffer);
+}
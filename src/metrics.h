@@ -0,0 +1,119 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+struct Connection;
+
+// Counters kept by every thread
+enum MetricCounter {
+  M_CONNECTIONS_ACCEPTED,
+  M_CONNECTIONS_CLOSED,
+  M_BYTES_IN,
+  M_BYTES_OUT,
+  M_DEFERRED_REQUESTS,
+  M_UDP_REQUESTS,
+  M_UDP_TOO_LARGE,
+  // Native protocol commands
+  M_CMD_GET,
+  M_CMD_SET,
+  M_CMD_DEL,
+  M_CMD_KRANGE,
+  M_CMD_BGSAVE,
+  M_CMD_BGREWRITEAOF,
+  M_CMD_GETV,
+  M_CMD_CAS,
+  M_CMD_APPEND,
+  M_CMD_SETRANGE,
+  M_CMD_GETRANGE,
+  M_CMD_STRLEN,
+  M_CMD_MULTI,
+  M_CMD_EXEC,
+  M_CMD_DISCARD,
+  M_CMD_WATCH,
+  M_CMD_UNWATCH,
+  M_CMD_EVAL,
+  M_CMD_EVALSHA,
+  M_CMD_SCRIPT,
+  M_CMD_CMS,
+  M_CMD_TOPK,
+  M_CMD_VECTOR,
+  M_CMD_JSON,
+  M_CMD_TS,
+  M_CMD_MGET,
+  M_CMD_UNKNOWN,
+  // memcached commands, text and binary
+  M_MC_GET,
+  M_MC_SET,
+  M_MC_ADD,
+  M_MC_REPLACE,
+  M_MC_CAS,
+  M_MC_DELETE,
+  M_MC_INCR,
+  M_MC_DECR,
+  M_MC_OTHER,
+  M_COUNTER_COUNT
+};
+
+// Latency histogram buckets: bucket i counts durations below 2^i us, the
+// last one everything else
+const size_t k_latency_buckets = 18;
+
+struct MetricsShard {
+  std::atomic<uint64_t> counters[M_COUNTER_COUNT];
+  std::atomic<uint64_t> latency[k_latency_buckets];
+  std::atomic<uint64_t> latency_sum_ns;
+  MetricsShard *next;
+};
+
+/**
+ * Metrics for the Prometheus scrape endpoint.
+ *
+ * Every thread records into its own MetricsShard, and only that thread
+ * writes it, so recording is a relaxed load and store with no lock and no
+ * formatting. A scrape walks the list of shards, sums them and adds the
+ * gauges that are read from db at that moment (keys, table growth,
+ * memory), then renders the Prometheus text format.
+ *
+ * The shard list is guarded by a mutex that only shard registration (the
+ * first metric of each thread) and scrapes take.
+ */
+
+extern thread_local MetricsShard *t_metrics_shard;
+
+// Allocates and registers the calling thread's shard
+MetricsShard *metrics_register_shard();
+
+inline MetricsShard *metrics_shard() {
+  MetricsShard *shard = t_metrics_shard;
+  return shard ? shard : metrics_register_shard();
+}
+
+inline void metric_add(MetricCounter c, uint64_t n = 1) {
+  std::atomic<uint64_t> &v = metrics_shard()->counters[c];
+  v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Records the time taken to execute the requests of one read
+inline void metric_observe_latency(uint64_t ns) {
+  MetricsShard *shard = metrics_shard();
+  uint64_t us = ns / 1000;
+  size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+  if (bucket >= k_latency_buckets) {
+    bucket = k_latency_buckets - 1;
+  }
+  std::atomic<uint64_t> &b = shard->latency[bucket];
+  b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic<uint64_t> &sum = shard->latency_sum_ns;
+  sum.store(sum.load(std::memory_order_relaxed) + ns,
+            std::memory_order_relaxed);
+}
+
+// Executes the complete HTTP requests in conn's read buffer, stopping early
+// while its output is paused. Returns the number of bytes consumed, or -1
+// if the connection must be closed.
+int32_t http_process_buffer(Connection *conn);
+
+#endif // METRICS_H
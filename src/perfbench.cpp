@@ -0,0 +1,447 @@
+// perfbench.cpp - End-to-end latency regression benchmark
+//
+// usage: perf_bench [--reference path] thresholds.json
+//        perf_bench --serve port
+//
+// Starts the server of this build and the server of a reference build as
+// two child processes and drives the same fixed set of workloads against
+// both over loopback, alternating between them. Every run of a workload
+// gives the ratio of the two throughputs and of the two p99 latencies, so
+// both servers see the same machine state. Exits with status 1 if the
+// median ratio of any workload is worse than thresholds.json allows.
+//
+// path is the perf_bench of the reference build. It defaults to this
+// binary, which measures the noise of the comparison itself. With --serve
+// only the server is run, on the given port.
+
+// stdlib
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <signal.h>
+#include <string.h>
+// system
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+// C++
+#include <algorithm>
+#include <string>
+#include <vector>
+// project
+#include "elserver.h"
+#include "logging.h"
+
+// The server under test listens on k_bench_port and the reference on the
+// port after it, both off the default port so a development server can keep
+// running
+const uint16_t k_bench_port = SERVER_PORT + 1;
+
+// Each workload is run this many times on both servers and the median of
+// each ratio is kept, which follows the typical run instead of the luckiest
+const int k_bench_runs = 9;
+
+// Thresholds used for a workload that thresholds.json does not list. Paired
+// runs of one binary against itself stay within a few percent of each other
+// even while the machine's speed drifts by tens of percent.
+const double k_default_max_throughput_drop_pct = 10;
+const double k_default_max_p99_increase_pct = 20;
+
+enum BenchOp {
+  OP_GET,     // get of preloaded keys
+  OP_SET,     // overwrite of preloaded keys
+  OP_MIXED,   // alternating get and overwrite of preloaded keys
+  OP_SET_NEW, // set of keys never seen before, growing the table
+};
+
+struct Workload {
+  const char *name;
+  size_t conns;      // Client connections
+  size_t depth;      // Requests in flight per connection
+  size_t rounds;     // Round trips per connection
+  size_t value_size; // Bytes per value
+  BenchOp op;
+  size_t keys;       // Preloaded key space
+};
+
+static const Workload k_workloads[] = {
+    {"small_get", 8, 1, 5000, 16, OP_GET, 10000},
+    {"small_set", 8, 1, 5000, 16, OP_SET, 10000},
+    {"large_value", 4, 1, 5000, 900, OP_MIXED, 1000},
+    {"deep_pipeline", 1, 64, 1000, 16, OP_GET, 10000},
+    {"rehash_inserts", 1, 16, 12500, 16, OP_SET_NEW, 0},
+    {"many_connections", 256, 1, 100, 16, OP_GET, 10000},
+};
+
+struct BenchResult {
+  double ops_per_sec = 0;
+  double p99_us = 0;
+};
+
+struct BenchConn {
+  int fd;
+  std::string out; // Requests of the current round
+  char in[4 + MAX_MSG_SIZE];
+};
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void put_u32(std::string *out, uint32_t v) {
+  uint32_t net = htonl(v);
+  out->append((const char *)&net, 4);
+}
+
+static void put_request(std::string *out,
+                        std::initializer_list<const std::string *> tokens) {
+  put_u32(out, (uint32_t)tokens.size());
+  for (const std::string *t : tokens) {
+    put_u32(out, (uint32_t)t->size());
+    out->append(*t);
+  }
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t rv = send(fd, data, len, 0);
+    if (rv <= 0) {
+      LOG_SYS_ERROR("send() error");
+      return false;
+    }
+    data += rv;
+    len -= (size_t)rv;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, char *data, size_t len) {
+  while (len > 0) {
+    ssize_t rv = recv(fd, data, len, 0);
+    if (rv <= 0) {
+      LOG_SYS_ERROR("recv() error");
+      return false;
+    }
+    data += rv;
+    len -= (size_t)rv;
+  }
+  return true;
+}
+
+// Reads one response into conn->in. Returns its length, or -1 on error.
+static int32_t recv_response(BenchConn *conn) {
+  uint32_t len;
+  if (!recv_all(conn->fd, (char *)&len, 4)) {
+    return -1;
+  }
+  len = ntohl(len);
+  if (len > MAX_MSG_SIZE || !recv_all(conn->fd, conn->in, len)) {
+    return -1;
+  }
+  return (int32_t)len;
+}
+
+// Connects to the server on port, retrying while it starts up
+static int bench_connect(uint16_t port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 500; attempt++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      LOG_SYS_ERROR("socket() error");
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      int val = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+      return fd;
+    }
+    close(fd);
+    usleep(10000);
+  }
+  LOG_SYS_ERROR("connect() error");
+  return -1;
+}
+
+static std::string bench_key(const char *prefix, size_t i) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%s:%zu", prefix, i);
+  return buf;
+}
+
+// Sets keys [0, w.keys) to values of w.value_size bytes
+static bool preload(const Workload &w, BenchConn *conn) {
+  std::string set = "set";
+  std::string value(w.value_size, 'v');
+  const size_t batch = 64;
+  for (size_t i = 0; i < w.keys; i += batch) {
+    size_t n = std::min(batch, w.keys - i);
+    conn->out.clear();
+    for (size_t j = 0; j < n; j++) {
+      std::string key = bench_key("key", i + j);
+      put_request(&conn->out, {&set, &key, &value});
+    }
+    if (!send_all(conn->fd, conn->out.data(), conn->out.size())) {
+      return false;
+    }
+    for (size_t j = 0; j < n; j++) {
+      if (recv_response(conn) < 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Runs w once against the server on port. Every round each connection
+// sends depth requests, then all responses are read; a request's latency is
+// from the send of its batch to the arrival of its response.
+static bool run_workload(const Workload &w, uint16_t port, uint64_t *new_keys,
+                         BenchResult *result) {
+  std::vector<BenchConn *> conns;
+  bool ok = true;
+  for (size_t i = 0; ok && i < w.conns; i++) {
+    BenchConn *conn = new BenchConn;
+    conn->fd = bench_connect(port);
+    conns.push_back(conn);
+    ok = conn->fd >= 0;
+  }
+  if (ok && w.keys > 0) {
+    ok = preload(w, conns[0]);
+  }
+
+  std::string get = "get", set = "set";
+  std::string value(w.value_size, 'v');
+  std::vector<uint64_t> latencies;
+  latencies.reserve(w.conns * w.depth * w.rounds);
+  std::vector<uint64_t> sent_at(w.conns);
+  uint64_t seq = 0;
+
+  uint64_t start = now_ns();
+  for (size_t round = 0; ok && round < w.rounds; round++) {
+    for (size_t c = 0; ok && c < w.conns; c++) {
+      BenchConn *conn = conns[c];
+      conn->out.clear();
+      for (size_t d = 0; d < w.depth; d++, seq++) {
+        bool is_get = w.op == OP_GET || (w.op == OP_MIXED && seq % 2 == 0);
+        std::string key = w.op == OP_SET_NEW
+                              ? bench_key("new", (*new_keys)++)
+                              : bench_key("key", seq * 7919 % w.keys);
+        if (is_get) {
+          put_request(&conn->out, {&get, &key});
+        } else {
+          put_request(&conn->out, {&set, &key, &value});
+        }
+      }
+      sent_at[c] = now_ns();
+      ok = send_all(conn->fd, conn->out.data(), conn->out.size());
+    }
+    for (size_t c = 0; ok && c < w.conns; c++) {
+      for (size_t d = 0; ok && d < w.depth; d++) {
+        int32_t len = recv_response(conns[c]);
+        ok = len >= 0;
+        latencies.push_back(now_ns() - sent_at[c]);
+      }
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  for (BenchConn *conn : conns) {
+    if (conn->fd >= 0) {
+      close(conn->fd);
+    }
+    delete conn;
+  }
+  if (!ok || latencies.empty()) {
+    return false;
+  }
+
+  size_t p99 = latencies.size() * 99 / 100;
+  std::nth_element(latencies.begin(), latencies.begin() + p99,
+                   latencies.end());
+  result->ops_per_sec = (double)latencies.size() * 1e9 / (double)elapsed;
+  result->p99_us = (double)latencies[p99] / 1e3;
+  return true;
+}
+
+static double median(std::vector<double> *values) {
+  size_t mid = values->size() / 2;
+  std::nth_element(values->begin(), values->begin() + mid, values->end());
+  return (*values)[mid];
+}
+
+// Returns the number following "key": after position from in doc, or
+// fallback if there is none. Only the shape of bench/perf_thresholds.json is
+// understood.
+static double json_number(const std::string &doc, size_t from,
+                          const char *key, double fallback) {
+  std::string quoted = std::string("\"") + key + "\"";
+  size_t pos = doc.find(quoted, from);
+  if (pos == std::string::npos) {
+    return fallback;
+  }
+  pos = doc.find(':', pos + quoted.size());
+  if (pos == std::string::npos) {
+    return fallback;
+  }
+  return strtod(doc.c_str() + pos + 1, NULL);
+}
+
+static bool read_file(const char *path, std::string *out) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    return false;
+  }
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    out->append(buf, n);
+  }
+  fclose(fp);
+  return true;
+}
+
+// Runs path --serve port as a child process. Returns its pid, or -1.
+static pid_t spawn_server(const char *path, uint16_t port) {
+  char arg[8];
+  snprintf(arg, sizeof(arg), "%u", (unsigned)port);
+  pid_t pid = fork();
+  if (pid < 0) {
+    LOG_SYS_ERROR("fork() error");
+    return -1;
+  }
+  if (pid == 0) {
+    execl(path, path, "--serve", arg, (char *)NULL);
+    // The log writer thread did not survive the fork
+    fprintf(stderr, "cannot run %s: %s\n", path, strerror(errno));
+    _exit(127);
+  }
+  return pid;
+}
+
+static void stop_server(pid_t pid) {
+  if (pid > 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+static int serve(uint16_t port) {
+  log_init();
+  ServerOptions options;
+  options.port = port;
+  int rv = server_run(options);
+  log_shutdown();
+  return rv;
+}
+
+int main(int argc, char *argv[]) {
+  const char *reference = "/proc/self/exe";
+  const char *thresholds_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      return serve((uint16_t)atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "--reference") == 0 && i + 1 < argc) {
+      reference = argv[++i];
+    } else {
+      thresholds_path = argv[i];
+    }
+  }
+  if (!thresholds_path) {
+    fprintf(stderr,
+            "usage: %s [--reference path] thresholds.json\n"
+            "       %s --serve port\n",
+            argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string thresholds;
+  if (!read_file(thresholds_path, &thresholds)) {
+    fprintf(stderr, "cannot read %s\n", thresholds_path);
+    return EXIT_FAILURE;
+  }
+
+  log_init();
+  // Index 0 is the server under test, index 1 the reference
+  const uint16_t ports[2] = {k_bench_port, (uint16_t)(k_bench_port + 1)};
+  pid_t pids[2] = {spawn_server("/proc/self/exe", ports[0]),
+                   spawn_server(reference, ports[1])};
+
+  // Runs go round-robin over the workloads, so that a stretch in which the
+  // machine is slow costs each workload one run rather than all of them.
+  // Within a run the two servers take turns going first.
+  const size_t n = sizeof(k_workloads) / sizeof(k_workloads[0]);
+  std::vector<std::vector<double>> ops(n), p99s(n), ops_ratio(n), p99_ratio(n);
+  uint64_t new_keys[2] = {0, 0};
+  bool ok = pids[0] > 0 && pids[1] > 0;
+  for (int run = 0; ok && run < k_bench_runs; run++) {
+    for (size_t i = 0; ok && i < n; i++) {
+      BenchResult r[2];
+      for (int turn = 0; ok && turn < 2; turn++) {
+        int side = (run + turn) % 2;
+        ok = run_workload(k_workloads[i], ports[side], &new_keys[side],
+                          &r[side]);
+        if (!ok) {
+          fprintf(stderr, "workload %s failed against the %s server\n",
+                  k_workloads[i].name, side == 0 ? "tested" : "reference");
+        }
+      }
+      if (ok) {
+        ops[i].push_back(r[0].ops_per_sec);
+        p99s[i].push_back(r[0].p99_us);
+        ops_ratio[i].push_back(r[0].ops_per_sec / r[1].ops_per_sec);
+        p99_ratio[i].push_back(r[0].p99_us / r[1].p99_us);
+      }
+    }
+  }
+
+  stop_server(pids[0]);
+  stop_server(pids[1]);
+  log_shutdown();
+  if (!ok) {
+    return EXIT_FAILURE;
+  }
+
+  bool failed = false;
+  printf("%-18s %12s %10s %10s %8s %10s %8s\n", "workload", "ops/s", "p99 us",
+         "ops/s chg", "limit", "p99 chg", "limit");
+  for (size_t i = 0; i < n; i++) {
+    const Workload &w = k_workloads[i];
+    double max_drop = k_default_max_throughput_drop_pct;
+    double max_increase = k_default_max_p99_increase_pct;
+    size_t at = thresholds.find(std::string("\"") + w.name + "\"");
+    if (at != std::string::npos) {
+      max_drop = json_number(thresholds, at, "max_throughput_drop_pct",
+                             max_drop);
+      max_increase = json_number(thresholds, at, "max_p99_increase_pct",
+                                 max_increase);
+    }
+
+    // Changes against the reference, in percent
+    double ops_change = (median(&ops_ratio[i]) - 1) * 100;
+    double p99_change = (median(&p99_ratio[i]) - 1) * 100;
+    bool slow = ops_change < -max_drop || p99_change > max_increase;
+    printf("%-18s %12.0f %10.1f %+9.1f%% %7.0f%% %+9.1f%% %7.0f%%%s\n",
+           w.name, median(&ops[i]), median(&p99s[i]), ops_change, -max_drop,
+           p99_change, max_increase, slow ? "  REGRESSION" : "");
+    failed = failed || slow;
+  }
+
+  if (failed) {
+    printf("slower than the reference beyond the thresholds in %s\n",
+           thresholds_path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
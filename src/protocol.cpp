@@ -0,0 +1,91 @@
+// protocol.cpp - Native protocol framing
+
+// stdlib
+#include <cstddef>
+#include <cstdint>
+#include <string.h>
+// system
+#include <arpa/inet.h>
+// project
+#include "elserver.h"
+#include "logging.h"
+#include "protocol.h"
+
+static int32_t read_i32(const char *p) {
+  int32_t v;
+  memcpy(&v, p, 4);
+  return (int32_t)ntohl(v);
+}
+
+int32_t frame_request(const char *start, const char *end,
+                      const char **error) {
+  // Need at least 4 bytes for nStr
+  if (end - start < 4) {
+    LOG_DEBUG("not enough data to read");
+    return 0;
+  }
+  uint32_t count = (uint32_t)read_i32(start);
+  int32_t nStr = (int32_t)(count & ~FRAME_TAGGED);
+  if (nStr < 1 || nStr > MAX_ARGS) {
+    *error = "invalid command\n";
+    return -1;
+  }
+
+  // The ID of a tagged request is not part of the size limit
+  size_t consumed = 4;
+  size_t limit = MAX_MSG_SIZE;
+  if (count & FRAME_TAGGED) {
+    if (end - start < 8) {
+      LOG_DEBUG("not enough data to read");
+      return 0;
+    }
+    consumed = 8;
+    limit += 4;
+  }
+  for (int i = 0; i < nStr; i++) {
+    // Need 4 bytes for next string length
+    if ((size_t)(end - start) - consumed < 4) {
+      LOG_DEBUG("not enough data to read");
+      return 0;
+    }
+    int32_t length = read_i32(start + consumed);
+    consumed += 4;
+
+    // If the sum of lengths so far plus this string is > MAX_MSG_SIZE, fatal
+    if (length < 0 || consumed + length > limit) {
+      LOG_ERROR("oversized Request");
+      *error = "oversized request\n";
+      return -1;
+    }
+
+    // Check if enough leftover data for the string
+    if ((size_t)(end - start) - consumed < (size_t)length) {
+      LOG_DEBUG("not enough data to read");
+      return 0;
+    }
+    consumed += length;
+  }
+  return (int32_t)consumed;
+}
+
+void request_arg(const char *request, int i, const char **data,
+                 uint32_t *len) {
+  const char *p = request + (read_i32(request) & FRAME_TAGGED ? 8 : 4);
+  for (int j = 0; j < i; j++) {
+    p += 4 + read_i32(p);
+  }
+  *len = (uint32_t)read_i32(p);
+  *data = p + 4;
+}
+
+int32_t request_nargs(const char *request) {
+  return read_i32(request) & ~FRAME_TAGGED;
+}
+
+bool request_tag(const char *request, uint32_t *id) {
+  if (!(read_i32(request) & FRAME_TAGGED)) {
+    return false;
+  }
+  *id = (uint32_t)read_i32(request + 4);
+  return true;
+}
@@ -0,0 +1,78 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string.h>
+
+/**
+ * Framing of the native protocol, shared by the server, the proxy and the
+ * client library.
+ *
+ * A request is a 4-byte count of strings (1 to MAX_ARGS), then each string
+ * as a 4-byte length and its bytes, all lengths in network order; the whole
+ * request is at most MAX_MSG_SIZE bytes. A response is a 4-byte length and
+ * that many bytes.
+ *
+ * A tagged request sets FRAME_TAGGED in its string count and follows the
+ * count with a 4-byte ID of the client's choosing, which does not count
+ * towards MAX_MSG_SIZE. Its response sets FRAME_TAGGED in the length and
+ * follows it with the same ID. Responses to tagged requests may be sent out
+ * of request order; see process_buffer() for the rules the server follows.
+ */
+
+const uint32_t FRAME_TAGGED = 0x80000000u;
+
+/**
+ * Over UDP every datagram holds one request or response frame behind an
+ * 8-byte header: a 4-byte request ID chosen by the client and echoed in
+ * the response, 2 bytes of flags and 2 reserved bytes, all in network
+ * order. A response too large for one datagram is sent as a bare header
+ * with UDP_FLAG_USE_TCP set instead; the client repeats the request over
+ * TCP. See udp.h for the commands served.
+ */
+const size_t UDP_HEADER_SIZE = 8;
+const uint16_t UDP_FLAG_USE_TCP = 1;
+
+// Largest datagram sent or accepted, small enough not to be fragmented on
+// an Ethernet path
+const size_t UDP_MAX_DATAGRAM = 1400;
+
+// Checks the request starting at start, with buffered data up to end.
+// Returns its size in bytes, 0 if more data is needed, or -1 if it is
+// malformed, setting *error to the message to send before closing.
+int32_t frame_request(const char *start, const char *end,
+                      const char **error);
+
+// Reads the i-th string of a request that frame_request() accepted; the
+// request must have more than i strings.
+void request_arg(const char *request, int i, const char **data,
+                 uint32_t *len);
+
+// Number of strings in a request that frame_request() accepted
+int32_t request_nargs(const char *request);
+
+// Returns true and sets *id if a request that frame_request() accepted is
+// tagged
+bool request_tag(const char *request, uint32_t *id);
+
+// Commands that touch only the key in their second string. Sending all of
+// them for one key over one connection keeps them in order; any other
+// command may touch several keys, so the proxy and the client pool order it
+// against everything sent before it.
+inline bool is_single_key_command(const char *name, size_t len) {
+  static const char *const names[] = {
+      "get", "set", "del", "getv", "cas", "append", "setrange", "getrange",
+      "strlen", "vadd", "vsim", "vinfo", "json.set", "json.get",
+      "json.numincrby", "json.mem", "ts.add", "ts.range", "ts.info",
+      "cms.init", "cms.incrby", "cms.query", "topk.reserve", "topk.add",
+      "topk.list"};
+  for (const char *n : names) {
+    if (len == strlen(n) && memcmp(name, n, len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif // PROTOCOL_H
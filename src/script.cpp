@@ -0,0 +1,650 @@
+// script.cpp - stack bytecode interpreter for server-side scripts
+
+// stdlib
+#include <cerrno>
+#include <ctype.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string.h>
+// C++
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+// project
+#include "aof.h"
+#include "elserver.h"
+#include "script.h"
+#include "sha1.h"
+#include "valuetype.h"
+
+using namespace std;
+
+enum Opcode : uint8_t {
+  OP_INT,   // i64 operand
+  OP_STR,   // u32 index into Script::strings
+  OP_NIL,
+  OP_ARG,   // u8 argument number
+  OP_LOAD,  // u8 local
+  OP_STORE, // u8 local
+  OP_DUP,
+  OP_DROP,
+  OP_SWAP,
+  OP_OVER,
+  OP_ROT,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_EQ,
+  OP_NE,
+  OP_LT,
+  OP_GT,
+  OP_LE,
+  OP_GE,
+  OP_NOT,
+  OP_AND,
+  OP_OR,
+  OP_CONCAT,
+  OP_LEN,
+  OP_ISNIL,
+  OP_JMP, // u32 target
+  OP_JZ,  // u32 target; pops the condition
+  OP_GET,
+  OP_SET,
+  OP_DEL,
+  OP_EXISTS,
+  OP_CALL,
+  OP_RET,
+};
+
+struct Script {
+  vector<uint8_t> code;
+  vector<string> strings;
+  list<string>::iterator lru; // Position of the SHA-1 in lru
+};
+
+enum ScriptType : uint8_t { V_NIL, V_INT, V_STR };
+
+struct Value {
+  ScriptType type = V_NIL;
+  int64_t i = 0;
+  string s;
+};
+
+static unordered_map<string, Script> scripts;
+// SHA-1s of the cached scripts, most recently used first
+static list<string> lru;
+
+// Words that compile to a single opcode without operands
+static const pair<const char *, Opcode> k_simple_words[] = {
+    {"nil", OP_NIL},      {"dup", OP_DUP},     {"drop", OP_DROP},
+    {"swap", OP_SWAP},    {"over", OP_OVER},   {"rot", OP_ROT},
+    {"+", OP_ADD},        {"-", OP_SUB},       {"*", OP_MUL},
+    {"/", OP_DIV},        {"mod", OP_MOD},     {"=", OP_EQ},
+    {"<>", OP_NE},        {"<", OP_LT},        {">", OP_GT},
+    {"<=", OP_LE},        {">=", OP_GE},       {"not", OP_NOT},
+    {"and", OP_AND},      {"or", OP_OR},       {"..", OP_CONCAT},
+    {"len", OP_LEN},      {"nil?", OP_ISNIL},  {"get", OP_GET},
+    {"set", OP_SET},      {"del", OP_DEL},     {"exists", OP_EXISTS},
+    {"call", OP_CALL},    {"exit", OP_RET},
+};
+
+// -----------------------------------------------------------------------
+// Compiler
+// -----------------------------------------------------------------------
+static void emit_u32(vector<uint8_t> *code, uint32_t v) {
+  size_t at = code->size();
+  code->resize(at + sizeof(v));
+  memcpy(code->data() + at, &v, sizeof(v));
+}
+
+static void patch_u32(vector<uint8_t> *code, size_t at, uint32_t v) {
+  memcpy(code->data() + at, &v, sizeof(v));
+}
+
+// Parses a whole token as a decimal integer
+static bool parse_int(const string &s, int64_t *out) {
+  if (s.empty()) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  long long v = strtoll(s.c_str(), &end, 10);
+  if (errno != 0 || *end != '\0' || !(isdigit(s.back()))) {
+    return false;
+  }
+  *out = v;
+  return true;
+}
+
+// Parses the slot number of $N, @N and !N
+static bool parse_slot(const string &token, size_t limit, uint8_t *out) {
+  int64_t n;
+  if (token.size() < 2 || !parse_int(token.substr(1), &n) || n < 0 ||
+      (size_t)n >= limit || token[1] == '-' || token[1] == '+') {
+    return false;
+  }
+  *out = (uint8_t)n;
+  return true;
+}
+
+enum BlockKind { B_IF, B_ELSE, B_BEGIN, B_WHILE };
+
+struct Block {
+  BlockKind kind;
+  size_t at; // Operand to patch, or loop start for B_BEGIN
+};
+
+static bool compile(const string &src, Script *out, string *error) {
+  vector<uint8_t> &code = out->code;
+  vector<Block> blocks;
+  size_t pos = 0;
+  while (pos < src.size()) {
+    char c = src[pos];
+    if (isspace((unsigned char)c)) {
+      pos++;
+      continue;
+    }
+    if (c == '#') {
+      while (pos < src.size() && src[pos] != '\n') {
+        pos++;
+      }
+      continue;
+    }
+
+    if (c == '"') {
+      string s;
+      pos++;
+      while (pos < src.size() && src[pos] != '"') {
+        if (src[pos] == '\\' && pos + 1 < src.size()) {
+          pos++;
+          s += src[pos] == 'n' ? '\n' : src[pos];
+        } else {
+          s += src[pos];
+        }
+        pos++;
+      }
+      if (pos == src.size()) {
+        *error = "unterminated string";
+        return false;
+      }
+      pos++;
+      code.push_back(OP_STR);
+      emit_u32(&code, (uint32_t)out->strings.size());
+      out->strings.push_back(std::move(s));
+      continue;
+    }
+
+    size_t start = pos;
+    while (pos < src.size() && !isspace((unsigned char)src[pos])) {
+      pos++;
+    }
+    string token = src.substr(start, pos - start);
+
+    int64_t n;
+    uint8_t slot;
+    bool simple = false;
+    for (const auto &w : k_simple_words) {
+      if (token == w.first) {
+        code.push_back(w.second);
+        simple = true;
+        break;
+      }
+    }
+    if (simple) {
+      continue;
+    }
+
+    if (parse_int(token, &n)) {
+      code.push_back(OP_INT);
+      size_t at = code.size();
+      code.resize(at + sizeof(n));
+      memcpy(code.data() + at, &n, sizeof(n));
+    } else if (token[0] == '$' && parse_slot(token, MAX_ARGS, &slot)) {
+      code.push_back(OP_ARG);
+      code.push_back(slot);
+    } else if (token[0] == '@' && parse_slot(token, k_script_locals, &slot)) {
+      code.push_back(OP_LOAD);
+      code.push_back(slot);
+    } else if (token[0] == '!' && parse_slot(token, k_script_locals, &slot)) {
+      code.push_back(OP_STORE);
+      code.push_back(slot);
+    } else if (token == "if") {
+      code.push_back(OP_JZ);
+      blocks.push_back({B_IF, code.size()});
+      emit_u32(&code, 0);
+    } else if (token == "else") {
+      if (blocks.empty() || blocks.back().kind != B_IF) {
+        *error = "else without if";
+        return false;
+      }
+      code.push_back(OP_JMP);
+      size_t at = code.size();
+      emit_u32(&code, 0);
+      patch_u32(&code, blocks.back().at, (uint32_t)code.size());
+      blocks.back() = {B_ELSE, at};
+    } else if (token == "then") {
+      if (blocks.empty() ||
+          (blocks.back().kind != B_IF && blocks.back().kind != B_ELSE)) {
+        *error = "then without if";
+        return false;
+      }
+      patch_u32(&code, blocks.back().at, (uint32_t)code.size());
+      blocks.pop_back();
+    } else if (token == "begin") {
+      blocks.push_back({B_BEGIN, code.size()});
+    } else if (token == "until") {
+      if (blocks.empty() || blocks.back().kind != B_BEGIN) {
+        *error = "until without begin";
+        return false;
+      }
+      code.push_back(OP_JZ);
+      emit_u32(&code, (uint32_t)blocks.back().at);
+      blocks.pop_back();
+    } else if (token == "while") {
+      if (blocks.empty() || blocks.back().kind != B_BEGIN) {
+        *error = "while without begin";
+        return false;
+      }
+      code.push_back(OP_JZ);
+      blocks.push_back({B_WHILE, code.size()});
+      emit_u32(&code, 0);
+    } else if (token == "repeat") {
+      if (blocks.size() < 2 || blocks.back().kind != B_WHILE) {
+        *error = "repeat without while";
+        return false;
+      }
+      code.push_back(OP_JMP);
+      emit_u32(&code, (uint32_t)blocks[blocks.size() - 2].at);
+      patch_u32(&code, blocks.back().at, (uint32_t)code.size());
+      blocks.pop_back();
+      blocks.pop_back();
+    } else {
+      *error = "unknown word " + token;
+      return false;
+    }
+  }
+
+  if (!blocks.empty()) {
+    *error = "unterminated block";
+    return false;
+  }
+  code.push_back(OP_RET);
+  return true;
+}
+
+// -----------------------------------------------------------------------
+// Interpreter
+// -----------------------------------------------------------------------
+static string to_text(const Value &v) {
+  if (v.type == V_INT) {
+    return to_string(v.i);
+  }
+  return v.s;
+}
+
+static bool to_int(const Value &v, int64_t *out) {
+  if (v.type == V_INT) {
+    *out = v.i;
+    return true;
+  }
+  return v.type == V_STR && parse_int(v.s, out);
+}
+
+static bool truthy(const Value &v) {
+  switch (v.type) {
+  case V_NIL:
+    return false;
+  case V_INT:
+    return v.i != 0;
+  default:
+    return !v.s.empty();
+  }
+}
+
+static Value int_value(int64_t i) {
+  Value v;
+  v.type = V_INT;
+  v.i = i;
+  return v;
+}
+
+static Value str_value(string s) {
+  Value v;
+  v.type = V_STR;
+  v.s = std::move(s);
+  return v;
+}
+
+static bool execute(const Script &script, const vector<string> &args,
+                    size_t first_arg, string *result, string *error) {
+  const uint8_t *code = script.code.data();
+  vector<Value> stack;
+  stack.reserve(32);
+  Value locals[k_script_locals];
+  size_t pc = 0;
+
+// Fails the script unless the stack holds at least n values
+#define NEED(n)                                                                \
+  if (stack.size() < (n)) {                                                    \
+    *error = "stack underflow";                                                \
+    return false;                                                              \
+  }
+
+  for (uint64_t steps = 0;; steps++) {
+    if (steps == k_script_max_steps) {
+      *error = "step limit exceeded";
+      return false;
+    }
+    if (stack.size() >= k_script_max_stack) {
+      *error = "stack overflow";
+      return false;
+    }
+
+    uint8_t op = code[pc++];
+    switch (op) {
+    case OP_INT: {
+      int64_t i;
+      memcpy(&i, code + pc, sizeof(i));
+      pc += sizeof(i);
+      stack.push_back(int_value(i));
+      break;
+    }
+    case OP_STR: {
+      uint32_t idx;
+      memcpy(&idx, code + pc, sizeof(idx));
+      pc += sizeof(idx);
+      stack.push_back(str_value(script.strings[idx]));
+      break;
+    }
+    case OP_NIL:
+      stack.emplace_back();
+      break;
+    case OP_ARG: {
+      size_t n = first_arg + code[pc++];
+      stack.push_back(n < args.size() ? str_value(args[n]) : Value());
+      break;
+    }
+    case OP_LOAD:
+      stack.push_back(locals[code[pc++]]);
+      break;
+    case OP_STORE:
+      NEED(1);
+      locals[code[pc++]] = std::move(stack.back());
+      stack.pop_back();
+      break;
+    case OP_DUP:
+      NEED(1);
+      stack.push_back(stack.back());
+      break;
+    case OP_DROP:
+      NEED(1);
+      stack.pop_back();
+      break;
+    case OP_SWAP:
+      NEED(2);
+      swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+      break;
+    case OP_OVER:
+      NEED(2);
+      stack.push_back(stack[stack.size() - 2]);
+      break;
+    case OP_ROT: {
+      // ( a b c -- b c a )
+      NEED(3);
+      size_t n = stack.size();
+      swap(stack[n - 3], stack[n - 2]);
+      swap(stack[n - 2], stack[n - 1]);
+      break;
+    }
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_LT:
+    case OP_GT:
+    case OP_LE:
+    case OP_GE: {
+      NEED(2);
+      int64_t a, b;
+      if (!to_int(stack[stack.size() - 2], &a) ||
+          !to_int(stack[stack.size() - 1], &b)) {
+        *error = "value is not an integer";
+        return false;
+      }
+      if ((op == OP_DIV || op == OP_MOD) && b == 0) {
+        *error = "division by zero";
+        return false;
+      }
+      int64_t r = 0;
+      switch (op) {
+      case OP_ADD:
+        r = (int64_t)((uint64_t)a + (uint64_t)b);
+        break;
+      case OP_SUB:
+        r = (int64_t)((uint64_t)a - (uint64_t)b);
+        break;
+      case OP_MUL:
+        r = (int64_t)((uint64_t)a * (uint64_t)b);
+        break;
+      case OP_DIV:
+        r = (a == INT64_MIN && b == -1) ? a : a / b;
+        break;
+      case OP_MOD:
+        r = (a == INT64_MIN && b == -1) ? 0 : a % b;
+        break;
+      case OP_LT:
+        r = a < b;
+        break;
+      case OP_GT:
+        r = a > b;
+        break;
+      case OP_LE:
+        r = a <= b;
+        break;
+      default:
+        r = a >= b;
+        break;
+      }
+      stack.pop_back();
+      stack.back() = int_value(r);
+      break;
+    }
+    case OP_EQ:
+    case OP_NE: {
+      NEED(2);
+      const Value &a = stack[stack.size() - 2];
+      const Value &b = stack[stack.size() - 1];
+      bool eq = (a.type == V_NIL || b.type == V_NIL)
+                    ? a.type == b.type
+                    : to_text(a) == to_text(b);
+      stack.pop_back();
+      stack.back() = int_value(eq == (op == OP_EQ));
+      break;
+    }
+    case OP_NOT:
+      NEED(1);
+      stack.back() = int_value(!truthy(stack.back()));
+      break;
+    case OP_AND:
+    case OP_OR: {
+      NEED(2);
+      bool a = truthy(stack[stack.size() - 2]);
+      bool b = truthy(stack[stack.size() - 1]);
+      stack.pop_back();
+      stack.back() = int_value(op == OP_AND ? (a && b) : (a || b));
+      break;
+    }
+    case OP_CONCAT: {
+      NEED(2);
+      string s = to_text(stack[stack.size() - 2]);
+      string t = to_text(stack.back());
+      if (s.size() + t.size() > MAX_VALUE_SIZE) {
+        *error = "value too large";
+        return false;
+      }
+      s += t;
+      stack.pop_back();
+      stack.back() = str_value(std::move(s));
+      break;
+    }
+    case OP_LEN:
+      NEED(1);
+      stack.back() = int_value((int64_t)to_text(stack.back()).size());
+      break;
+    case OP_ISNIL:
+      NEED(1);
+      stack.back() = int_value(stack.back().type == V_NIL);
+      break;
+    case OP_JMP: {
+      uint32_t target;
+      memcpy(&target, code + pc, sizeof(target));
+      pc = target;
+      break;
+    }
+    case OP_JZ: {
+      NEED(1);
+      uint32_t target;
+      memcpy(&target, code + pc, sizeof(target));
+      pc += sizeof(target);
+      if (!truthy(stack.back())) {
+        pc = target;
+      }
+      stack.pop_back();
+      break;
+    }
+    case OP_GET: {
+      NEED(1);
+      string key = to_text(stack.back());
+      Entry *ent = db_lookup(key.data(), key.size());
+      if (ent && value_type(ent->value) != VT_STRING) {
+        *error = "value is not a string";
+        return false;
+      }
+      stack.back() = ent ? str_value(ent->value) : Value();
+      break;
+    }
+    case OP_SET: {
+      NEED(2);
+      string key = to_text(stack[stack.size() - 2]);
+      string value = to_text(stack.back());
+      if (value.size() > MAX_VALUE_SIZE) {
+        *error = "value too large";
+        return false;
+      }
+      db_set(key.data(), key.size(), value.data(), value.size());
+      aof_feed({"set", key, value});
+      stack.pop_back();
+      stack.pop_back();
+      break;
+    }
+    case OP_DEL: {
+      NEED(1);
+      string key = to_text(stack.back());
+      bool deleted = db_del(key.data(), key.size());
+      if (deleted) {
+        aof_feed({"del", key});
+      }
+      stack.back() = int_value(deleted);
+      break;
+    }
+    case OP_EXISTS: {
+      NEED(1);
+      string key = to_text(stack.back());
+      stack.back() = int_value(db_lookup(key.data(), key.size()) != NULL);
+      break;
+    }
+    case OP_CALL: {
+      NEED(1);
+      int64_t n;
+      if (!to_int(stack.back(), &n) || n < 1 || n > (int64_t)MAX_ARGS) {
+        *error = "call needs a command length between 1 and 16";
+        return false;
+      }
+      stack.pop_back();
+      NEED((size_t)n);
+      vector<string> command;
+      command.reserve(n);
+      for (size_t i = stack.size() - n; i < stack.size(); i++) {
+        command.push_back(to_text(stack[i]));
+      }
+      stack.resize(stack.size() - n);
+      if (command[0] == "eval" || command[0] == "evalsha" ||
+          command[0] == "script") {
+        // Would recurse, or free the script being run
+        *error = "scripts cannot call " + command[0];
+        return false;
+      }
+      RequestResponse response = process_request(command);
+      stack.push_back(str_value(std::move(response.response)));
+      break;
+    }
+    case OP_RET:
+      if (stack.empty() || stack.back().type == V_NIL) {
+        *result = "(nil)";
+      } else {
+        *result = to_text(stack.back());
+      }
+      return true;
+    default:
+      *error = "bad opcode";
+      return false;
+    }
+  }
+#undef NEED
+}
+
+// -----------------------------------------------------------------------
+// Cache
+// -----------------------------------------------------------------------
+// Marks script as the most recently used
+static void touch(Script *script) {
+  lru.splice(lru.begin(), lru, script->lru);
+}
+
+bool script_load(const string &source, string *sha, string *error) {
+  string digest = sha1_hex(source.data(), source.size());
+  auto it = scripts.find(digest);
+  if (it != scripts.end()) {
+    touch(&it->second);
+    *sha = digest;
+    return true;
+  }
+
+  Script script;
+  if (!compile(source, &script, error)) {
+    return false;
+  }
+  if (scripts.size() >= k_script_cache_max) {
+    scripts.erase(lru.back());
+    lru.pop_back();
+  }
+  lru.push_front(digest);
+  script.lru = lru.begin();
+  scripts.emplace(digest, std::move(script));
+  *sha = digest;
+  return true;
+}
+
+bool script_exists(const string &sha) { return scripts.count(sha) != 0; }
+
+void script_flush() {
+  scripts.clear();
+  lru.clear();
+}
+
+bool script_run(const string &sha, const vector<string> &args,
+                size_t first_arg, string *result, string *error) {
+  auto it = scripts.find(sha);
+  if (it == scripts.end()) {
+    *error = "no script with that sha";
+    return false;
+  }
+  touch(&it->second);
+  return execute(it->second, args, first_arg, result, error);
+}
@@ -0,0 +1,69 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Instructions a script may execute before it is aborted
+const uint64_t k_script_max_steps = 1000000;
+
+// Values a script may have on its stack
+const size_t k_script_max_stack = 1024;
+
+// Local variable slots, @0..@7 and !0..!7
+const size_t k_script_locals = 8;
+
+// Scripts kept in the cache; loading another evicts the least recently
+// used one
+const size_t k_script_cache_max = 1024;
+
+/**
+ * Server-side scripts.
+ *
+ * Scripts are written in a small stack language, compiled once to bytecode
+ * and cached under the SHA-1 of their source. A script evicted from the
+ * full cache is unknown to evalsha until it is loaded again. Words are
+ * separated by whitespace; "#" starts a comment running to the end of the
+ * line.
+ *
+ *   42 -7 "text" nil      push a literal
+ *   $0 .. $15             push an argument (nil if not given)
+ *   @0 .. @7, !0 .. !7    load / store a local
+ *   dup drop swap over rot
+ *   + - * / mod           integer arithmetic; strings are parsed as numbers
+ *   = <> < > <= >=        comparisons, pushing 1 or 0 (= and <> compare text)
+ *   not and or            nil, 0 and "" are false
+ *   .. len nil?           concatenate, length, test for nil; strings are
+ *                         limited to MAX_VALUE_SIZE bytes
+ *   if [else] then, begin until, begin while repeat, exit
+ *   get set del exists    direct db access: ( key -- value|nil ),
+ *                         ( key value -- ), ( key -- 1|0 ), ( key -- 1|0 );
+ *                         get fails on structured values
+ *   call                  ( name arg... n -- response ) runs any other
+ *                         command through process_request
+ *
+ * The result is the value left on top of the stack. The data operations
+ * run against db directly without building or parsing requests, and their
+ * writes reach the append-only log as plain set/del, so replay does not
+ * re-run the script. A script runs to completion without other commands
+ * interleaving; when it fails part way, the writes it made stay.
+ */
+
+// Compiles source and caches it. Sets *sha on success, *error otherwise.
+bool script_load(const std::string &source, std::string *sha,
+                 std::string *error);
+
+// True if a script with this SHA-1 is cached
+bool script_exists(const std::string &sha);
+
+// Drops every cached script
+void script_flush();
+
+// Runs the cached script sha with args[first_arg..] as $0, $1, ... Sets
+// *result on success, *error otherwise.
+bool script_run(const std::string &sha, const std::vector<std::string> &args,
+                size_t first_arg, std::string *result, std::string *error);
+
+#endif // SCRIPT_H
@@ -0,0 +1,257 @@
+// segtable.cpp - Segmented linear hashing
+//
+// See segtable.h. The address of a key is its hash modulo the bucket count
+// of the current round; buckets below split_pos have already been split and
+// use the next round's modulus instead.
+
+#include <cstddef>
+#include <cstdint>
+#include <stdlib.h>
+
+#include "segtable.h"
+
+/**
+ * @brief Number of buckets at the start of the current round
+ */
+static uint64_t round_buckets(const SMap *smap) {
+  return (uint64_t)k_segment_slots << smap->level;
+}
+
+/**
+ * @brief Map a hashcode to its bucket slot
+ */
+static HNode **sm_slot(SMap *smap, uint64_t hashcode) {
+  uint64_t n = round_buckets(smap);
+  uint64_t idx = hashcode & (n - 1);
+  if (idx < smap->split_pos) {
+    idx = hashcode & (2 * n - 1);
+  }
+  return &smap->segments[idx / k_segment_slots][idx % k_segment_slots];
+}
+
+/**
+ * @brief Append a zeroed segment, doubling the directory if needed
+ */
+static void add_segment(SMap *smap) {
+  if (smap->nsegments == smap->dir_cap) {
+    size_t cap = smap->dir_cap ? smap->dir_cap * 2 : 1;
+    HNode ***dir = (HNode ***)realloc(smap->segments, cap * sizeof(HNode **));
+    if (!dir) {
+      abort();
+    }
+    smap->segments = dir;
+    smap->dir_cap = cap;
+  }
+  smap->segments[smap->nsegments++] =
+      (HNode **)calloc(k_segment_slots, sizeof(HNode *));
+}
+
+/**
+ * @brief Split the bucket at split_pos into itself and its buddy
+ *
+ * Only the nodes of one chain are touched.
+ */
+static void sm_split(SMap *smap) {
+  uint64_t n = round_buckets(smap);
+  uint64_t buddy = smap->split_pos + n;
+  if (buddy / k_segment_slots >= smap->nsegments) {
+    add_segment(smap);
+  }
+
+  uint64_t pos = smap->split_pos;
+  HNode **from = &smap->segments[pos / k_segment_slots][pos % k_segment_slots];
+  HNode **to =
+      &smap->segments[buddy / k_segment_slots][buddy % k_segment_slots];
+
+  HNode *cur = *from;
+  *from = NULL;
+  while (cur) {
+    HNode *next = cur->next;
+    HNode **dst = (cur->hashcode & (2 * n - 1)) == pos ? from : to;
+    cur->next = *dst;
+    *dst = cur;
+    cur = next;
+  }
+
+  if (++smap->split_pos == n) {
+    smap->level++;
+    smap->split_pos = 0;
+  }
+}
+
+/**
+ * @brief Look up a node in the segmented map
+ *
+ * @param smap Pointer to the map
+ * @param node Template node with the hashcode to look up
+ * @param cmp Comparison function to determine if nodes match
+ * @return Pointer to the found node, or NULL if not found
+ */
+HNode *sm_lookup(SMap *smap, HNode *node, bool (*cmp)(HNode *, HNode *)) {
+  if (!smap->segments) {
+    return NULL;
+  }
+  for (HNode *cur = *sm_slot(smap, node->hashcode); cur; cur = cur->next) {
+    if (cmp(cur, node)) {
+      return cur;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Look up several nodes in the segmented map at once
+ *
+ * As in hm_lookup_batch, the bucket slots of up to k_lookup_batch keys are
+ * prefetched first, then the first node of every chain, and only then are
+ * the chains walked, so the cache misses of different keys overlap.
+ *
+ * @param smap Pointer to the map
+ * @param keys Template nodes with the hashcodes to look up
+ * @param out Receives the found node for each key, or NULL if not found
+ * @param n Number of keys
+ * @param cmp Comparison function to determine if nodes match
+ */
+void sm_lookup_batch(SMap *smap, HNode **keys, HNode **out, size_t n,
+                     bool (*cmp)(HNode *, HNode *)) {
+  if (!smap->segments) {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = NULL;
+    }
+    return;
+  }
+
+  HNode **slots[k_lookup_batch];
+  for (size_t base = 0; base < n; base += k_lookup_batch) {
+    size_t cnt = n - base < k_lookup_batch ? n - base : k_lookup_batch;
+
+    for (size_t i = 0; i < cnt; i++) {
+      slots[i] = sm_slot(smap, keys[base + i]->hashcode);
+      __builtin_prefetch(slots[i]);
+    }
+    for (size_t i = 0; i < cnt; i++) {
+      if (*slots[i]) {
+        __builtin_prefetch(*slots[i]);
+      }
+    }
+    for (size_t i = 0; i < cnt; i++) {
+      HNode *found = NULL;
+      for (HNode *cur = *slots[i]; cur && !found; cur = cur->next) {
+        if (cmp(cur, keys[base + i])) {
+          found = cur;
+        }
+      }
+      out[base + i] = found;
+    }
+  }
+}
+
+/**
+ * @brief Insert a node into the segmented map
+ *
+ * Splits one bucket whenever the average chain exceeds k_max_load_factor.
+ *
+ * @param smap Pointer to the map
+ * @param node Pointer to the node to insert
+ */
+void sm_insert(SMap *smap, HNode *node) {
+  if (!smap->segments) {
+    add_segment(smap);
+  }
+
+  HNode **slot = sm_slot(smap, node->hashcode);
+  node->next = *slot;
+  *slot = node;
+  smap->size++;
+
+  uint64_t buckets = round_buckets(smap) + smap->split_pos;
+  if (smap->size > buckets * k_max_load_factor) {
+    sm_split(smap);
+  }
+}
+
+/**
+ * @brief Delete a node from the segmented map
+ *
+ * The map does not shrink.
+ *
+ * @param smap Pointer to the map
+ * @param node Template node with the hashcode to delete
+ * @param cmp Comparison function to determine if nodes match
+ * @return Pointer to the deleted node or NULL if not found
+ */
+HNode *sm_delete(SMap *smap, HNode *node, bool (*cmp)(HNode *, HNode *)) {
+  if (!smap->segments) {
+    return NULL;
+  }
+  for (HNode **link = sm_slot(smap, node->hashcode); *link;
+       link = &(*link)->next) {
+    if (cmp(*link, node)) {
+      HNode *found = *link;
+      *link = found->next;
+      smap->size--;
+      return found;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Visit the nodes of one bucket and return the next cursor
+ *
+ * Works like hm_scan. The cursor walks the 2 * round_buckets hash classes
+ * of the current round in reversed bit order; a bucket that is not split
+ * yet holds two classes and is visited with the first of them. Every node
+ * present for the whole scan is visited at least once even if buckets are
+ * split in between; nodes may be visited twice. fn must not modify the
+ * map.
+ *
+ * @param smap Pointer to the map
+ * @param cursor Cursor returned by the previous call, or 0
+ * @param fn Called for each node
+ * @param arg Passed through to fn
+ * @return The cursor for the next call, 0 when the scan is complete
+ */
+uint64_t sm_scan(SMap *smap, uint64_t cursor, void (*fn)(HNode *, void *),
+                 void *arg) {
+  if (!smap->segments) {
+    return 0;
+  }
+  uint64_t n = round_buckets(smap);
+  uint64_t pos = cursor & (2 * n - 1);
+  uint64_t low = pos & (n - 1);
+  if (low < smap->split_pos || pos == low) {
+    for (HNode *cur = smap->segments[pos / k_segment_slots]
+                                    [pos % k_segment_slots];
+         cur; cur = cur->next) {
+      fn(cur, arg);
+    }
+  }
+  return scan_next(cursor, 2 * n - 1);
+}
+
+/**
+ * @brief Number of buckets in use
+ */
+uint64_t sm_buckets(const SMap *smap) {
+  return smap->segments ? round_buckets(smap) + smap->split_pos : 0;
+}
+
+/**
+ * @brief Bytes used by the directory and segments (nodes not included)
+ */
+size_t sm_memory_usage(const SMap *smap) {
+  return smap->dir_cap * sizeof(HNode **) +
+         smap->nsegments * k_segment_slots * sizeof(HNode *);
+}
+
+/**
+ * @brief Release the directory and segments of the map (not the nodes)
+ */
+void sm_destroy(SMap *smap) {
+  for (size_t i = 0; i < smap->nsegments; i++) {
+    free(smap->segments[i]);
+  }
+  free(smap->segments);
+  *smap = SMap{};
+}
@@ -0,0 +1,43 @@
+#ifndef SEGTABLE_H
+#define SEGTABLE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "hashtable.h"
+
+// Buckets per segment; the largest allocation growth ever makes
+const size_t k_segment_slots = 1024;
+
+/**
+ * @brief Hash map that grows by splitting one bucket at a time
+ *
+ * Buckets live in fixed-size segments reached through a small directory of
+ * segment pointers. Growth follows linear hashing: when the load factor
+ * exceeds k_max_load_factor the bucket at split_pos is split into itself
+ * and its buddy split_pos + (k_segment_slots << level), allocating a new
+ * segment only when the buddy starts one. There is never a second table,
+ * so the extra memory during growth is at most one segment, and each
+ * insert moves at most one chain. db keeps its keys in an SMap.
+ */
+struct SMap {
+  HNode ***segments = NULL; // Directory of segments
+  size_t nsegments = 0;     // Segments allocated
+  size_t dir_cap = 0;       // Capacity of the directory
+  uint32_t level = 0;       // Number of completed doublings
+  uint64_t split_pos = 0;   // Next bucket to split in this round
+  uint64_t size = 0;        // Number of keys in the map
+};
+
+HNode *sm_lookup(SMap *smap, HNode *node, bool (*cmp)(HNode *, HNode *));
+void sm_lookup_batch(SMap *smap, HNode **keys, HNode **out, size_t n,
+                     bool (*cmp)(HNode *, HNode *));
+void sm_insert(SMap *smap, HNode *node);
+HNode *sm_delete(SMap *smap, HNode *node, bool (*cmp)(HNode *, HNode *));
+uint64_t sm_scan(SMap *smap, uint64_t cursor, void (*fn)(HNode *, void *),
+                 void *arg);
+uint64_t sm_buckets(const SMap *smap);
+size_t sm_memory_usage(const SMap *smap);
+void sm_destroy(SMap *smap);
+
+#endif
@@ -0,0 +1,86 @@
+// sha1.cpp - SHA-1 (FIPS 180-4), used to name cached scripts
+
+// stdlib
+#include <cstddef>
+#include <cstdint>
+#include <string.h>
+// C++
+#include <string>
+// project
+#include "sha1.h"
+
+static uint32_t rol(uint32_t v, int n) { return (v << n) | (v >> (32 - n)); }
+
+// Mixes one 64-byte block into state
+static void sha1_block(uint32_t state[5], const uint8_t *block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+           (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t t = rol(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rol(b, 30);
+    b = a;
+    a = t;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+std::string sha1_hex(const void *data, size_t len) {
+  uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                       0xC3D2E1F0};
+  const uint8_t *p = (const uint8_t *)data;
+  size_t left = len;
+  for (; left >= 64; left -= 64, p += 64) {
+    sha1_block(state, p);
+  }
+
+  // Final block(s): the rest, a 1 bit, zeros and the bit length
+  uint8_t tail[128] = {0};
+  memcpy(tail, p, left);
+  tail[left] = 0x80;
+  size_t tail_len = left + 9 <= 64 ? 64 : 128;
+  uint64_t bits = (uint64_t)len * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[tail_len - 1 - i] = (uint8_t)(bits >> (i * 8));
+  }
+  for (size_t off = 0; off < tail_len; off += 64) {
+    sha1_block(state, tail + off);
+  }
+
+  static const char digits[] = "0123456789abcdef";
+  std::string hex(k_sha1_hex_len, '0');
+  for (int i = 0; i < 20; i++) {
+    uint8_t byte = (uint8_t)(state[i / 4] >> (24 - (i % 4) * 8));
+    hex[i * 2] = digits[byte >> 4];
+    hex[i * 2 + 1] = digits[byte & 0xf];
+  }
+  return hex;
+}
@@ -0,0 +1,14 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Length of a SHA-1 digest in hex
+const size_t k_sha1_hex_len = 40;
+
+// Returns the SHA-1 digest of data as 40 lowercase hex digits
+std::string sha1_hex(const void *data, size_t len);
+
+#endif // SHA1_H
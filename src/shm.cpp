@@ -0,0 +1,270 @@
+// shm.cpp - Shared-memory ring transport
+
+// stdlib
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string.h>
+// system
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+// C++
+#include <algorithm>
+#include <string>
+// project
+#include "shm.h"
+
+// File descriptors sent by the server, in order
+enum { SHM_FD_REGION, SHM_FD_SERVER_WAKE, SHM_FD_CLIENT_WAKE, SHM_FD_COUNT };
+
+// A ring's indexes and bytes
+struct RingView {
+  ShmRing *ring;
+  char *data;
+  size_t size;
+};
+
+static RingView requests(const ShmChannel *ch) {
+  return {&ch->region->requests, ch->region->request_data,
+          k_shm_request_ring_size};
+}
+
+static RingView responses(const ShmChannel *ch) {
+  return {&ch->region->responses, ch->region->response_data,
+          k_shm_response_ring_size};
+}
+
+static RingView incoming(const ShmChannel *ch) {
+  return ch->server ? requests(ch) : responses(ch);
+}
+
+static RingView outgoing(const ShmChannel *ch) {
+  return ch->server ? responses(ch) : requests(ch);
+}
+
+static std::atomic<uint32_t> *own_flag(const ShmChannel *ch) {
+  return ch->server ? &ch->region->server_sleeping
+                    : &ch->region->client_sleeping;
+}
+
+static std::atomic<uint32_t> *peer_flag(const ShmChannel *ch) {
+  return ch->server ? &ch->region->client_sleeping
+                    : &ch->region->server_sleeping;
+}
+
+// Signals the peer if it went to sleep; only the first of several wakers
+// clears the flag and pays for the write
+static void wake_peer(ShmChannel *ch) {
+  std::atomic<uint32_t> *flag = peer_flag(ch);
+  if (flag->load() != 0 && flag->exchange(0) != 0) {
+    uint64_t one = 1;
+    if (write(ch->peer_fd, &one, sizeof(one)) < 0) {
+      // The counter is already non-zero; the peer will wake anyway
+    }
+  }
+}
+
+size_t shm_write(ShmChannel *ch, const char *data, size_t len) {
+  RingView r = outgoing(ch);
+  uint64_t head = r.ring->head.load(std::memory_order_relaxed);
+  size_t n = std::min(len, r.size - (size_t)(head - r.ring->tail.load()));
+  if (n == 0) {
+    return 0;
+  }
+  size_t at = head & (r.size - 1);
+  size_t first = std::min(n, r.size - at);
+  memcpy(r.data + at, data, first);
+  memcpy(r.data, data + first, n - first);
+  r.ring->head.store(head + n);
+  wake_peer(ch);
+  return n;
+}
+
+size_t shm_read(ShmChannel *ch, char *buf, size_t cap) {
+  RingView r = incoming(ch);
+  uint64_t tail = r.ring->tail.load(std::memory_order_relaxed);
+  size_t n = std::min(cap, (size_t)(r.ring->head.load() - tail));
+  if (n == 0) {
+    return 0;
+  }
+  size_t at = tail & (r.size - 1);
+  size_t first = std::min(n, r.size - at);
+  memcpy(buf, r.data + at, first);
+  memcpy(buf + first, r.data, n - first);
+  r.ring->tail.store(tail + n);
+  wake_peer(ch);
+  return n;
+}
+
+size_t shm_readable(const ShmChannel *ch) {
+  RingView r = incoming(ch);
+  return (size_t)(r.ring->head.load() - r.ring->tail.load());
+}
+
+size_t shm_writable(const ShmChannel *ch) {
+  RingView r = outgoing(ch);
+  return r.size - (size_t)(r.ring->head.load() - r.ring->tail.load());
+}
+
+bool shm_sleep_prepare(ShmChannel *ch, bool want_room) {
+  own_flag(ch)->store(1);
+  if (shm_readable(ch) > 0 || (want_room && shm_writable(ch) > 0)) {
+    own_flag(ch)->store(0);
+    return false;
+  }
+  return true;
+}
+
+void shm_sleep_end(ShmChannel *ch) {
+  own_flag(ch)->store(0);
+  uint64_t count;
+  if (read(ch->wake_fd, &count, sizeof(count)) < 0) {
+    // EAGAIN: nobody signalled
+  }
+}
+
+// -----------------------------------------------------------------------
+// Handshake
+// -----------------------------------------------------------------------
+ShmChannel *shm_accept(int sock, std::string *error) {
+  int fds[SHM_FD_COUNT];
+  fds[SHM_FD_REGION] = memfd_create("elserver-shm", MFD_CLOEXEC);
+  fds[SHM_FD_SERVER_WAKE] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fds[SHM_FD_CLIENT_WAKE] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  void *mem = MAP_FAILED;
+  if (fds[SHM_FD_REGION] >= 0 && fds[SHM_FD_SERVER_WAKE] >= 0 &&
+      fds[SHM_FD_CLIENT_WAKE] >= 0 &&
+      ftruncate(fds[SHM_FD_REGION], sizeof(ShmRegion)) == 0) {
+    mem = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED,
+               fds[SHM_FD_REGION], 0);
+  }
+  if (mem == MAP_FAILED) {
+    *error = std::string("cannot create shared memory: ") + strerror(errno);
+    for (int fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    return NULL;
+  }
+
+  // The memfd starts zeroed, so the ring indexes and flags are already 0
+  ShmRegion *region = (ShmRegion *)mem;
+  region->magic = k_shm_magic;
+  region->version = k_shm_version;
+
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  ssize_t rv = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  close(fds[SHM_FD_REGION]); // The mapping keeps the memory alive
+  if (rv != 1) {
+    *error = std::string("cannot send shared memory: ") + strerror(errno);
+    munmap(mem, sizeof(ShmRegion));
+    close(fds[SHM_FD_SERVER_WAKE]);
+    close(fds[SHM_FD_CLIENT_WAKE]);
+    return NULL;
+  }
+
+  ShmChannel *ch = new ShmChannel;
+  ch->region = region;
+  ch->server = true;
+  ch->wake_fd = fds[SHM_FD_SERVER_WAKE];
+  ch->peer_fd = fds[SHM_FD_CLIENT_WAKE];
+  return ch;
+}
+
+ShmChannel *shm_connect(const char *path, int *sock, std::string *error) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    *error = "socket path too long";
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    *error = std::string("connect failed: ") + strerror(errno);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  int fds[SHM_FD_COUNT];
+  char byte;
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t rv;
+  do {
+    rv = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (rv < 0 && errno == EINTR);
+  struct cmsghdr *cmsg = rv == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    *error = "server did not send shared memory";
+    close(fd);
+    return NULL;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  struct stat st;
+  void *mem = MAP_FAILED;
+  if (fstat(fds[SHM_FD_REGION], &st) == 0 &&
+      (size_t)st.st_size >= sizeof(ShmRegion)) {
+    mem = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED,
+               fds[SHM_FD_REGION], 0);
+  }
+  close(fds[SHM_FD_REGION]);
+  ShmRegion *region = (ShmRegion *)mem;
+  if (mem == MAP_FAILED || region->magic != k_shm_magic ||
+      region->version != k_shm_version) {
+    *error = "incompatible shared memory region";
+    if (mem != MAP_FAILED) {
+      munmap(mem, sizeof(ShmRegion));
+    }
+    close(fds[SHM_FD_SERVER_WAKE]);
+    close(fds[SHM_FD_CLIENT_WAKE]);
+    close(fd);
+    return NULL;
+  }
+
+  ShmChannel *ch = new ShmChannel;
+  ch->region = region;
+  ch->server = false;
+  ch->wake_fd = fds[SHM_FD_CLIENT_WAKE];
+  ch->peer_fd = fds[SHM_FD_SERVER_WAKE];
+  *sock = fd;
+  return ch;
+}
+
+void shm_close(ShmChannel *ch) {
+  munmap(ch->region, sizeof(ShmRegion));
+  close(ch->wake_fd);
+  close(ch->peer_fd);
+  delete ch;
+}
@@ -0,0 +1,102 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Shared-memory transport for clients on the same host.
+ *
+ * A client connects to the server's Unix socket and receives three file
+ * descriptors over it: a memfd holding a ShmRegion and one eventfd per side.
+ * From then on the socket only signals that the client went away; requests
+ * and responses travel through the region's two single-producer,
+ * single-consumer byte rings, framed exactly as on TCP.
+ *
+ * Neither side makes a system call while the other is busy: the server
+ * polls the rings from its event loop and the client spins on the response
+ * ring. A side that runs out of work sets its sleeping flag, checks the
+ * rings once more and then blocks on its eventfd; a side that makes
+ * progress on a ring the sleeper is waiting on clears the flag and signals
+ * the eventfd. All flag and ring index accesses are sequentially
+ * consistent, so either the sleeper sees the progress or the other side
+ * sees the flag.
+ */
+
+// Bytes in each ring; powers of two. The response ring is sized like a
+// loopback socket buffer; as over TCP, a reply that does not fit waits in
+// the connection's overflow and is copied in as the client drains the ring.
+// The memfd is populated lazily, so unused ring space costs no memory.
+const size_t k_shm_request_ring_size = 1 << 20;
+const size_t k_shm_response_ring_size = 8 << 20;
+
+// Identifies a region laid out as below
+const uint32_t k_shm_magic = 0x656c7368; // "elsh"
+const uint32_t k_shm_version = 1;
+
+// Indexes of a ring; each on its own cache line so producer and consumer
+// do not share one
+struct ShmRing {
+  alignas(64) std::atomic<uint64_t> head; // Bytes ever written
+  alignas(64) std::atomic<uint64_t> tail; // Bytes ever read
+};
+
+struct ShmRegion {
+  uint32_t magic;
+  uint32_t version;
+  alignas(64) std::atomic<uint32_t> server_sleeping;
+  alignas(64) std::atomic<uint32_t> client_sleeping;
+  ShmRing requests;  // Client to server
+  ShmRing responses; // Server to client
+  alignas(64) char request_data[k_shm_request_ring_size];
+  alignas(64) char response_data[k_shm_response_ring_size];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "ring indexes must be lock-free to be shared between processes");
+
+// One side's view of a region
+struct ShmChannel {
+  ShmRegion *region = NULL;
+  bool server = false;
+  int wake_fd = -1; // Signalled to wake this side
+  int peer_fd = -1; // Signalled to wake the other side
+};
+
+// Copies up to len bytes into the outgoing ring, waking the peer if it is
+// asleep. Returns the number of bytes copied.
+size_t shm_write(ShmChannel *ch, const char *data, size_t len);
+
+// Copies up to cap bytes out of the incoming ring, waking the peer if it is
+// asleep. Returns the number of bytes copied.
+size_t shm_read(ShmChannel *ch, char *buf, size_t cap);
+
+// Bytes waiting in the incoming ring
+size_t shm_readable(const ShmChannel *ch);
+
+// Free bytes in the outgoing ring
+size_t shm_writable(const ShmChannel *ch);
+
+// Marks this side asleep unless the incoming ring has data or, if
+// want_room is set, the outgoing ring has room. Returns false, leaving the
+// side awake, if there is work to do.
+bool shm_sleep_prepare(ShmChannel *ch, bool want_room);
+
+// Marks this side awake again and consumes a pending wakeup
+void shm_sleep_end(ShmChannel *ch);
+
+// Server: sets up a region for the client on sock and sends it the file
+// descriptors. Returns NULL and sets *error on failure.
+ShmChannel *shm_accept(int sock, std::string *error);
+
+// Client: connects to the server's socket at path and maps the region it
+// sends. On success *sock is the socket, which must stay open while the
+// channel is used. Returns NULL and sets *error on failure.
+ShmChannel *shm_connect(const char *path, int *sock, std::string *error);
+
+// Unmaps the region and closes the eventfds
+void shm_close(ShmChannel *ch);
+
+#endif // SHM_H
@@ -0,0 +1,436 @@
+// sketch.cpp - count-min and top-k sketch value types
+
+// stdlib
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <immintrin.h>
+#include <string.h>
+// C++
+#include <algorithm>
+#include <string>
+#include <vector>
+// project
+#include "elserver.h"
+#include "sketch.h"
+#include "valuetype.h"
+
+using namespace std;
+
+// Starts every sketch value; the counters follow it
+struct SketchHeader {
+  char tag[k_value_tag_len];
+  uint32_t width;
+  uint32_t depth;
+  uint32_t k; // top-k: list capacity; 0 for count-min
+  uint32_t n; // top-k: items in the list
+  uint32_t reserved[3];
+};
+
+static_assert(sizeof(SketchHeader) == 32, "sketch header layout");
+
+// An item of a top-k list; encoded after the counters as u32 count,
+// u32 length, bytes
+struct TopkItem {
+  string item;
+  uint32_t count;
+};
+
+// A decoded view of a sketch value
+struct Sketch {
+  SketchHeader hdr;
+  uint32_t *counters; // depth rows of width counters
+  size_t counters_end; // Offset of the top-k list in the value
+};
+
+// 64-bit FNV-1a with a final mix, so that both halves are usable as
+// independent row hashes
+static uint64_t item_hash(const string &item) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : item) {
+    h = (h ^ c) * 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static bool parse_u32(const string &s, uint32_t *out) {
+  char *end;
+  errno = 0;
+  unsigned long long v = strtoull(s.c_str(), &end, 10);
+  if (s.empty() || s[0] == '-' || *end != '\0' || errno != 0 ||
+      v > UINT32_MAX) {
+    return false;
+  }
+  *out = (uint32_t)v;
+  return true;
+}
+
+static string sketch_new(ValueType type, uint32_t width, uint32_t depth,
+                         uint32_t k) {
+  SketchHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.width = width;
+  hdr.depth = depth;
+  hdr.k = k;
+  string value;
+  value_tag(&value, type);
+  value.append((const char *)&hdr + k_value_tag_len,
+               sizeof(hdr) - k_value_tag_len);
+  value.resize(sizeof(hdr) + (size_t)width * depth * sizeof(uint32_t), '\0');
+  return value;
+}
+
+// Validates value as a sketch of the given type and points out at it
+static bool sketch_open(string *value, ValueType type, Sketch *out) {
+  if (value_type(*value) != type || value->size() < sizeof(SketchHeader)) {
+    return false;
+  }
+  memcpy(&out->hdr, value->data(), sizeof(SketchHeader));
+  const SketchHeader &hdr = out->hdr;
+  if (hdr.width == 0 || hdr.width > k_cms_max_width || hdr.depth == 0 ||
+      hdr.depth > k_cms_max_depth) {
+    return false;
+  }
+  out->counters_end =
+      sizeof(SketchHeader) + (size_t)hdr.width * hdr.depth * sizeof(uint32_t);
+  if (type == VT_CMS) {
+    if (value->size() != out->counters_end || hdr.k != 0) {
+      return false;
+    }
+  } else if (value->size() < out->counters_end || hdr.k == 0 ||
+             hdr.k > k_topk_max_k || hdr.n > hdr.k) {
+    return false;
+  }
+  out->counters = (uint32_t *)&(*value)[sizeof(SketchHeader)];
+  return true;
+}
+
+// Decodes the top-k list; false if it is malformed
+static bool topk_read(const string &value, const Sketch &sk,
+                      vector<TopkItem> *items) {
+  size_t pos = sk.counters_end;
+  items->resize(sk.hdr.n);
+  for (TopkItem &it : *items) {
+    uint32_t len;
+    if (value.size() - pos < 8) {
+      return false;
+    }
+    memcpy(&it.count, value.data() + pos, 4);
+    memcpy(&len, value.data() + pos + 4, 4);
+    pos += 8;
+    if (value.size() - pos < len) {
+      return false;
+    }
+    it.item.assign(value, pos, len);
+    pos += len;
+  }
+  return pos == value.size();
+}
+
+// Replaces the top-k list in value, highest estimate first
+static void topk_write(string *value, const Sketch &sk,
+                       vector<TopkItem> *items) {
+  stable_sort(items->begin(), items->end(),
+              [](const TopkItem &a, const TopkItem &b) {
+                return a.count > b.count;
+              });
+  value->resize(sk.counters_end);
+  for (const TopkItem &it : *items) {
+    uint32_t len = (uint32_t)it.item.size();
+    value->append((const char *)&it.count, 4);
+    value->append((const char *)&len, 4);
+    value->append(it.item);
+  }
+  uint32_t n = (uint32_t)items->size();
+  memcpy(&(*value)[offsetof(SketchHeader, n)], &n, sizeof(n));
+}
+
+// est[i] = min(est[i], v[i]) for i < n
+static void min_into_scalar(uint32_t *est, const uint32_t *v, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    est[i] = v[i] < est[i] ? v[i] : est[i];
+  }
+}
+
+// The same, 4 lanes at a time; compiled for SSE4.1 whatever the build
+// flags, like the kernels in vecdist.cpp, and used if the CPU has it
+__attribute__((target("sse4.1"))) static void
+min_into_sse41(uint32_t *est, const uint32_t *v, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(est + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(v + i));
+    _mm_storeu_si128((__m128i *)(est + i), _mm_min_epu32(a, b));
+  }
+  min_into_scalar(est + i, v + i, n - i);
+}
+
+typedef void (*MinIntoFn)(uint32_t *est, const uint32_t *v, size_t n);
+
+static MinIntoFn select_min_into() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.1") ? min_into_sse41 : min_into_scalar;
+}
+
+static const MinIntoFn min_into = select_min_into();
+
+// Adds incr[i] (may be 0) to the counters of items[i] and stores each
+// item's estimate afterwards in est[i]. n <= k_sketch_batch.
+static void cms_batch(const Sketch &sk, const string *const *items,
+                      const uint32_t *incr, uint32_t *est, size_t n) {
+  const uint32_t width = sk.hdr.width, depth = sk.hdr.depth;
+  uint32_t *slots[k_cms_max_depth][k_sketch_batch];
+
+  // Stage 1: hash every item and prefetch its counter in every row
+  for (size_t i = 0; i < n; i++) {
+    uint64_t h = item_hash(*items[i]);
+    uint32_t a = (uint32_t)h, b = (uint32_t)(h >> 32) | 1;
+    for (uint32_t r = 0; r < depth; r++) {
+      uint32_t col = (uint32_t)((a + (uint64_t)r * b) % width);
+      slots[r][i] = sk.counters + (size_t)r * width + col;
+      __builtin_prefetch(slots[r][i], 1);
+    }
+  }
+
+  // Stage 2: apply the increments, saturating
+  for (uint32_t r = 0; r < depth; r++) {
+    for (size_t i = 0; i < n; i++) {
+      uint32_t c = *slots[r][i];
+      *slots[r][i] = c + incr[i] < c ? UINT32_MAX : c + incr[i];
+    }
+  }
+
+  // Stage 3: minimum across rows for the whole batch
+  uint32_t row[k_sketch_batch];
+  for (size_t i = 0; i < n; i++) {
+    est[i] = UINT32_MAX;
+  }
+  for (uint32_t r = 0; r < depth; r++) {
+    for (size_t i = 0; i < n; i++) {
+      row[i] = *slots[r][i];
+    }
+    min_into(est, row, n);
+  }
+}
+
+// Looks up key as a sketch of type, decoding the top-k list into list when
+// it is given. When modify is set, creates the sketch with the default
+// dimensions if the key does not exist and prepares the entry for an
+// in-place update. Returns NULL, with the response filled in, on failure.
+static Entry *sketch_entry(const string &key, ValueType type, bool modify,
+                           Sketch *sk, vector<TopkItem> *list,
+                           RequestResponse *response) {
+  Entry *ent = db_lookup(key.data(), key.size());
+  bool created = false;
+  if (!ent && !modify) {
+    response->status = KEY_NOT_FOUND;
+    response->response = "key not found\n";
+    return NULL;
+  } else if (!ent) {
+    string value =
+        sketch_new(type, k_cms_default_width, k_cms_default_depth,
+                   type == VT_TOPK ? k_topk_default_k : 0);
+    ent = db_set(key.data(), key.size(), value.data(), value.size());
+    created = true;
+  }
+  if (!sketch_open(&ent->value, type, sk) ||
+      (list && !topk_read(ent->value, *sk, list))) {
+    response->status = ERROR;
+    response->response = "value is not a sketch of this type\n";
+    return NULL;
+  }
+  if (modify && !created) {
+    db_touch(ent);
+  }
+  return ent;
+}
+
+// cms.init key width depth / topk.reserve key k [width depth]
+static void do_sketch_init(const vector<string> &command, ValueType type,
+                           RequestResponse *response) {
+  uint32_t width = k_cms_default_width, depth = k_cms_default_depth, k = 0;
+  size_t dims = type == VT_CMS ? 2 : 3;
+  bool ok = true;
+  if (type == VT_TOPK) {
+    ok = parse_u32(command[2], &k) && k >= 1 && k <= k_topk_max_k;
+  }
+  if (type == VT_CMS || command.size() == 5) {
+    ok = ok && parse_u32(command[dims], &width) &&
+         parse_u32(command[dims + 1], &depth);
+  }
+  if (!ok || width == 0 || width > k_cms_max_width || depth == 0 ||
+      depth > k_cms_max_depth) {
+    response->status = ERROR;
+    response->response = "invalid sketch dimensions\n";
+    return;
+  }
+  if (db_lookup(command[1].data(), command[1].size())) {
+    response->status = ERROR;
+    response->response = "key exists\n";
+    return;
+  }
+  string value = sketch_new(type, width, depth, k);
+  db_set(command[1].data(), command[1].size(), value.data(), value.size());
+  response->status = SUCCESS;
+  response->response = command[0].substr(0, command[0].find('.')) + " " +
+                       command[1] + " width " + to_string(width) + " depth " +
+                       to_string(depth);
+  if (type == VT_TOPK) {
+    response->response += " k " + to_string(k);
+  }
+  response->response += "\n";
+}
+
+// cms.incrby key item count [item count ...] / cms.query key item [item ...]
+static void do_cms(const vector<string> &command, bool incr,
+                   RequestResponse *response) {
+  const string *items[k_sketch_batch];
+  uint32_t counts[k_sketch_batch];
+  uint32_t est[k_sketch_batch];
+  size_t step = incr ? 2 : 1;
+  for (size_t i = 3; incr && i < command.size(); i += 2) {
+    if (!parse_u32(command[i], &counts[0])) {
+      response->status = ERROR;
+      response->response = "invalid count\n";
+      return;
+    }
+  }
+
+  Sketch sk;
+  if (!sketch_entry(command[1], VT_CMS, incr, &sk, NULL, response)) {
+    return;
+  }
+  response->status = SUCCESS;
+  response->response.clear();
+  size_t n = 0;
+  for (size_t i = 2; i < command.size(); i += step) {
+    items[n] = &command[i];
+    counts[n] = 0;
+    if (incr) {
+      parse_u32(command[i + 1], &counts[n]);
+    }
+    if (++n == k_sketch_batch || i + step >= command.size()) {
+      cms_batch(sk, items, counts, est, n);
+      for (size_t j = 0; j < n; j++) {
+        response->response += to_string(est[j]) + "\n";
+      }
+      n = 0;
+    }
+  }
+}
+
+// topk.add key item [item ...]: one line per item, naming the item it
+// pushed out of the list or "(nil)"
+static void do_topk_add(const vector<string> &command,
+                        RequestResponse *response) {
+  Sketch sk;
+  vector<TopkItem> list;
+  Entry *ent = sketch_entry(command[1], VT_TOPK, true, &sk, &list, response);
+  if (!ent) {
+    return;
+  }
+
+  const string *items[k_sketch_batch];
+  uint32_t ones[k_sketch_batch];
+  uint32_t est[k_sketch_batch];
+  fill(ones, ones + k_sketch_batch, 1);
+  response->status = SUCCESS;
+  response->response.clear();
+  for (size_t base = 2; base < command.size(); base += k_sketch_batch) {
+    size_t n = min(k_sketch_batch, command.size() - base);
+    for (size_t i = 0; i < n; i++) {
+      items[i] = &command[base + i];
+    }
+    cms_batch(sk, items, ones, est, n);
+
+    for (size_t i = 0; i < n; i++) {
+      auto it = find_if(list.begin(), list.end(), [&](const TopkItem &t) {
+        return t.item == *items[i];
+      });
+      if (it != list.end()) {
+        it->count = est[i];
+        response->response += "(nil)\n";
+      } else if (list.size() < sk.hdr.k) {
+        list.push_back({*items[i], est[i]});
+        response->response += "(nil)\n";
+      } else {
+        auto low = min_element(list.begin(), list.end(),
+                               [](const TopkItem &a, const TopkItem &b) {
+                                 return a.count < b.count;
+                               });
+        if (est[i] > low->count) {
+          response->response += low->item + "\n";
+          *low = {*items[i], est[i]};
+        } else {
+          response->response += "(nil)\n";
+        }
+      }
+    }
+  }
+  topk_write(&ent->value, sk, &list);
+}
+
+// topk.list key
+static void do_topk_list(const vector<string> &command,
+                         RequestResponse *response) {
+  Sketch sk;
+  vector<TopkItem> list;
+  if (!sketch_entry(command[1], VT_TOPK, false, &sk, &list, response)) {
+    return;
+  }
+  response->status = SUCCESS;
+  response->response.clear();
+  for (const TopkItem &it : list) {
+    response->response += it.item + " " + to_string(it.count) + "\n";
+  }
+}
+
+// -----------------------------------------------------------------------
+// Dispatches the cms.* and topk.* commands
+// -----------------------------------------------------------------------
+void sketch_request(const vector<string> &command,
+                    RequestResponse *response) {
+  const string &name = command[0];
+  size_t argc = command.size();
+  bool ok;
+  if (name == "cms.init") {
+    ok = argc == 4;
+  } else if (name == "cms.incrby") {
+    ok = argc >= 4 && argc % 2 == 0;
+  } else if (name == "cms.query" || name == "topk.add") {
+    ok = argc >= 3;
+  } else if (name == "topk.reserve") {
+    ok = argc == 3 || argc == 5;
+  } else if (name == "topk.list") {
+    ok = argc == 2;
+  } else {
+    response->status = UNKNOWN_COMMAND;
+    response->response = "unknown command\n";
+    return;
+  }
+  if (!ok) {
+    response->status = ERROR;
+    response->response = "invalid number of arguments\n";
+    return;
+  }
+
+  if (name == "cms.init") {
+    do_sketch_init(command, VT_CMS, response);
+  } else if (name == "cms.incrby") {
+    do_cms(command, true, response);
+  } else if (name == "cms.query") {
+    do_cms(command, false, response);
+  } else if (name == "topk.reserve") {
+    do_sketch_init(command, VT_TOPK, response);
+  } else if (name == "topk.add") {
+    do_topk_add(command, response);
+  } else {
+    do_topk_list(command, response);
+  }
+}
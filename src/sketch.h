@@ -0,0 +1,59 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct RequestResponse;
+
+// Count-min dimensions used when a command creates a sketch implicitly:
+// width counters per row, depth rows (32KB)
+const uint32_t k_cms_default_width = 2048;
+const uint32_t k_cms_default_depth = 4;
+
+const uint32_t k_cms_max_width = 1 << 20;
+const uint32_t k_cms_max_depth = 16;
+
+// Items a top-k sketch tracks unless topk.reserve says otherwise
+const uint32_t k_topk_default_k = 10;
+const uint32_t k_topk_max_k = 1000;
+
+// Items hashed, prefetched and reduced together
+const size_t k_sketch_batch = 16;
+
+/**
+ * Count-min and top-k sketches.
+ *
+ *   cms.init key width depth
+ *   cms.incrby key item count [item count ...]  -> new estimates
+ *   cms.query key item [item ...]               -> estimates
+ *   topk.reserve key k [width depth]
+ *   topk.add key item [item ...]                -> item evicted per add
+ *   topk.list key                               -> "item count" lines
+ *
+ * A count-min sketch is depth rows of width 32-bit saturating counters,
+ * stored row-major after a small header in the entry's value, so its size
+ * is fixed however many distinct items it sees. An item maps to one counter
+ * per row through two halves of a 64-bit hash; its estimate is the minimum
+ * of those counters and never undercounts.
+ *
+ * Items are processed k_sketch_batch at a time: all of their counter
+ * addresses are computed and prefetched first, then the counters are
+ * updated row by row, and the minimum across rows is taken for the whole
+ * batch at once with vector min instructions where available.
+ *
+ * A top-k sketch is a count-min sketch followed by the k items with the
+ * highest estimates seen so far. An added item enters the list when the
+ * list has room or its estimate beats the smallest one there.
+ *
+ * cms.incrby and topk.add create a sketch with the default dimensions when
+ * the key does not exist. Updates modify the value in place.
+ */
+
+// Executes a cms.* or topk.* command against db.
+void sketch_request(const std::vector<std::string> &command,
+                    RequestResponse *response);
+
+#endif // SKETCH_H
@@ -0,0 +1,316 @@
+// snapshot.cpp - Fork-less incremental snapshots (see snapshot.h)
+
+// stdlib
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <stdio.h>
+#include <string.h>
+// system
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+// C++
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+// project
+#include "aof.h"
+#include "elserver.h"
+#include "hashtable.h"
+#include "logging.h"
+#include "snapshot.h"
+
+static const char k_snapshot_magic[8] = {'R', 'A', 'H', 'S',
+                                         'N', 'A', 'P', '1'};
+
+// State shared between the event loop and the writer thread
+struct SnapshotWriter {
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<std::string> chunks; // Serialized data waiting to be written
+  size_t queued = 0;              // Bytes in chunks
+  bool done = false;              // No more chunks will be queued
+  std::atomic<bool> finished{false};
+  bool ok = false; // Set by the writer before finished
+  std::thread thread;
+};
+
+// Snapshot state owned by the event loop
+struct Snapshot {
+  bool active = false;
+  bool last_ok = false;
+  SnapshotFormat format = SNAPSHOT_DUMP;
+  uint32_t epoch = 0;   // Entries with a smaller epoch are unvisited
+  uint64_t cursor = 0;  // sm_scan cursor
+  bool scanned = false; // The scan has wrapped around
+  std::string pending;  // Chunk being filled
+  std::string path;
+  SnapshotWriter *writer = NULL;
+};
+
+static Snapshot g_snapshot;
+
+static void put_u32(std::string *out, uint32_t v) {
+  uint32_t net = htonl(v);
+  out->append((const char *)&net, 4);
+}
+
+static void put_u64(std::string *out, uint64_t v) {
+  put_u32(out, (uint32_t)(v >> 32));
+  put_u32(out, (uint32_t)v);
+}
+
+static void put_str(std::string *out, const std::string &s) {
+  put_u32(out, (uint32_t)s.size());
+  out->append(s);
+}
+
+// Hands the pending chunk to the writer thread
+static void queue_pending() {
+  if (g_snapshot.pending.empty()) {
+    return;
+  }
+  SnapshotWriter *w = g_snapshot.writer;
+  {
+    std::lock_guard<std::mutex> lock(w->mu);
+    w->queued += g_snapshot.pending.size();
+    w->chunks.push_back(std::move(g_snapshot.pending));
+  }
+  w->cv.notify_one();
+  g_snapshot.pending = std::string();
+  g_snapshot.pending.reserve(k_snapshot_chunk);
+}
+
+// Serializes an entry into the image and marks it visited
+static void emit(Entry *ent) {
+  ent->epoch = g_snapshot.epoch;
+  if (g_snapshot.format == SNAPSHOT_AOF) {
+    put_u32(&g_snapshot.pending, 3);
+    put_u32(&g_snapshot.pending, 3);
+    g_snapshot.pending.append("set");
+  }
+  put_u32(&g_snapshot.pending, (uint32_t)ent->key.size());
+  g_snapshot.pending.append(ent->key);
+  put_u32(&g_snapshot.pending, (uint32_t)ent->value.size());
+  g_snapshot.pending.append(ent->value);
+  if (g_snapshot.pending.size() >= k_snapshot_chunk) {
+    queue_pending();
+  }
+}
+
+struct ScanState {
+  size_t emitted;
+};
+
+static void scan_cb(HNode *node, void *arg) {
+  Entry *ent = container_of(node, struct Entry, node);
+  if (ent->epoch < g_snapshot.epoch) {
+    emit(ent);
+    ((ScanState *)arg)->emitted++;
+  }
+}
+
+static bool write_full(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t rv = write(fd, data, len);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    } else if (rv <= 0) {
+      return false;
+    }
+    data += rv;
+    len -= (size_t)rv;
+  }
+  return true;
+}
+
+// Writer thread: drains chunks into path.tmp, then renames it into place
+static void writer_main(SnapshotWriter *w, std::string path,
+                        SnapshotFormat format) {
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0;
+  if (!ok) {
+    LOG_SYS_ERROR("snapshot open() error");
+  } else if (format == SNAPSHOT_DUMP) {
+    ok = write_full(fd, k_snapshot_magic, sizeof(k_snapshot_magic));
+  }
+
+  while (true) {
+    std::string chunk;
+    {
+      std::unique_lock<std::mutex> lock(w->mu);
+      w->cv.wait(lock, [w] { return w->done || !w->chunks.empty(); });
+      if (w->chunks.empty()) {
+        break;
+      }
+      chunk = std::move(w->chunks.front());
+      w->chunks.pop_front();
+      w->queued -= chunk.size();
+    }
+    if (ok && !write_full(fd, chunk.data(), chunk.size())) {
+      LOG_SYS_ERROR("snapshot write() error");
+      ok = false;
+    }
+  }
+
+  if (fd >= 0) {
+    if (ok && fsync(fd) < 0) {
+      LOG_SYS_ERROR("snapshot fsync() error");
+      ok = false;
+    }
+    close(fd);
+  }
+  if (ok && rename(tmp.c_str(), path.c_str()) < 0) {
+    LOG_SYS_ERROR("snapshot rename() error");
+    ok = false;
+  }
+  if (!ok) {
+    unlink(tmp.c_str());
+  }
+  LOG_INFO("snapshot %s %s", path.c_str(), ok ? "saved" : "failed");
+  w->ok = ok;
+  w->finished = true;
+}
+
+bool snapshot_start(const char *path, SnapshotFormat format) {
+  if (g_snapshot.active) {
+    return false;
+  }
+  g_snapshot.active = true;
+  g_snapshot.format = format;
+  g_snapshot.epoch++;
+  g_snapshot.cursor = 0;
+  g_snapshot.scanned = false;
+  g_snapshot.path = path;
+  g_snapshot.pending.clear();
+  g_snapshot.pending.reserve(k_snapshot_chunk);
+  // Every version handed out so far, including those of entries deleted
+  // since, is at most db.version
+  if (format == SNAPSHOT_DUMP) {
+    put_u64(&g_snapshot.pending, db.version);
+  } else {
+    put_u32(&g_snapshot.pending, 2);
+    put_str(&g_snapshot.pending, k_version_mark);
+    put_str(&g_snapshot.pending, std::to_string(db.version));
+  }
+  g_snapshot.writer = new SnapshotWriter;
+  g_snapshot.writer->thread =
+      std::thread(writer_main, g_snapshot.writer, g_snapshot.path, format);
+  return true;
+}
+
+bool snapshot_active() { return g_snapshot.active; }
+
+bool snapshot_last_ok() { return g_snapshot.last_ok; }
+
+uint32_t snapshot_epoch() { return g_snapshot.epoch; }
+
+void snapshot_before_write(Entry *ent) {
+  if (g_snapshot.active && ent->epoch < g_snapshot.epoch) {
+    emit(ent);
+  }
+}
+
+void snapshot_step() {
+  if (!g_snapshot.active) {
+    return;
+  }
+  SnapshotWriter *w = g_snapshot.writer;
+
+  if (!g_snapshot.scanned) {
+    size_t queued;
+    {
+      std::lock_guard<std::mutex> lock(w->mu);
+      queued = w->queued;
+    }
+    // Back off while the writer thread catches up
+    if (queued < k_snapshot_max_queued) {
+      ScanState state = {0};
+      do {
+        g_snapshot.cursor =
+            sm_scan(&db.smap, g_snapshot.cursor, &scan_cb, &state);
+      } while (g_snapshot.cursor != 0 && state.emitted < k_snapshot_work);
+
+      if (g_snapshot.cursor == 0) {
+        g_snapshot.scanned = true;
+        queue_pending();
+        {
+          std::lock_guard<std::mutex> lock(w->mu);
+          w->done = true;
+        }
+        w->cv.notify_one();
+      }
+    }
+    return;
+  }
+
+  if (w->finished) {
+    w->thread.join();
+    g_snapshot.last_ok = w->ok;
+    delete w;
+    g_snapshot.writer = NULL;
+    g_snapshot.active = false;
+  }
+}
+
+static bool read_full(FILE *fp, void *buf, size_t len) {
+  return fread(buf, 1, len, fp) == len;
+}
+
+static bool read_str(FILE *fp, std::string *out) {
+  uint32_t len;
+  if (!read_full(fp, &len, 4)) {
+    return false;
+  }
+  out->resize(ntohl(len));
+  return out->empty() || read_full(fp, &(*out)[0], out->size());
+}
+
+int64_t snapshot_load(const char *path, SMap *smap) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    return -1;
+  }
+  char magic[sizeof(k_snapshot_magic)];
+  if (!read_full(fp, magic, sizeof(magic)) ||
+      memcmp(magic, k_snapshot_magic, sizeof(magic)) != 0) {
+    LOG_ERROR("not a snapshot file");
+    fclose(fp);
+    return -1;
+  }
+  uint32_t mark[2];
+  if (!read_full(fp, mark, sizeof(mark))) {
+    LOG_ERROR("truncated snapshot file");
+    fclose(fp);
+    return -1;
+  }
+  uint64_t version = (uint64_t)ntohl(mark[0]) << 32 | ntohl(mark[1]);
+  if (version > db.version) {
+    db.version = version;
+  }
+
+  int64_t loaded = 0;
+  std::string key, value;
+  while (read_str(fp, &key)) {
+    if (!read_str(fp, &value)) {
+      LOG_ERROR("truncated snapshot file");
+      break;
+    }
+    Entry *ent = new Entry();
+    ent->key.swap(key);
+    ent->value.swap(value);
+    ent->node.hashcode =
+        str_hash((const uint8_t *)ent->key.data(), ent->key.size());
+    ent->epoch = g_snapshot.epoch;
+    ent->version = ++db.version;
+    sm_insert(smap, &ent->node);
+    loaded++;
+  }
+  fclose(fp);
+  return loaded;
+}
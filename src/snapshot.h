@@ -0,0 +1,72 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct Entry;
+struct SMap;
+
+// Default snapshot file
+const char *const k_snapshot_path = "dump.rah";
+
+// Entries serialized per event loop iteration while a snapshot runs
+const size_t k_snapshot_work = 2048;
+
+// Serialized bytes handed to the writer thread in one chunk
+const size_t k_snapshot_chunk = 64 << 10;
+
+// Stop scanning while the writer thread lags behind by this many bytes
+const size_t k_snapshot_max_queued = 64 << 20;
+
+/**
+ * Fork-less point-in-time snapshots.
+ *
+ * Each Entry records the snapshot epoch it was last written out in. Starting
+ * a snapshot bumps the global epoch, so every existing entry is "unvisited".
+ * The event loop then calls snapshot_step(), which scans db.smap with
+ * sm_scan and serializes unvisited entries, marking them visited. A write
+ * to an unvisited entry calls snapshot_before_write() first, which emits
+ * the old value. New entries are created already visited. The image thus
+ * holds exactly the data as of snapshot_start().
+ *
+ * Serialized entries are handed to a writer thread that owns all file I/O;
+ * the file is written to a temporary name and renamed when complete.
+ *
+ * SNAPSHOT_DUMP format: "RAHSNAP1", the 8-byte db.version as of
+ * snapshot_start() then, per entry, a 4-byte key length, the key, a 4-byte
+ * value length and the value (integers in network byte order).
+ * SNAPSHOT_AOF writes a "version <db.version>" frame, then one "set key
+ * value" request frame per entry instead, which is how the append-only log
+ * is rewritten.
+ *
+ * Entry versions themselves are not saved: loaded entries get new ones
+ * above the recorded db.version, so that no version handed out before a
+ * restart is handed out again.
+ */
+enum SnapshotFormat { SNAPSHOT_DUMP, SNAPSHOT_AOF };
+
+// Starts a snapshot into path. Returns false if one is already running.
+bool snapshot_start(const char *path, SnapshotFormat format);
+
+// True while a snapshot is being produced
+bool snapshot_active();
+
+// Whether the last finished snapshot was written and renamed into place
+bool snapshot_last_ok();
+
+// Serializes up to k_snapshot_work entries; called once per loop iteration.
+void snapshot_step();
+
+// Must be called before an existing entry is modified or deleted.
+void snapshot_before_write(Entry *ent);
+
+// Epoch that newly created entries must be stamped with.
+uint32_t snapshot_epoch();
+
+// Loads a snapshot file into smap at startup, raising db.version to the one
+// it records first. Returns the number of entries loaded, or -1 if the file
+// is missing or malformed.
+int64_t snapshot_load(const char *path, SMap *smap);
+
+#endif // SNAPSHOT_H
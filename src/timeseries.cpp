@@ -0,0 +1,704 @@
+// timeseries.cpp - Gorilla-compressed time series
+
+// stdlib
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <stdio.h>
+#include <string.h>
+// system
+#include <time.h>
+// C++
+#include <algorithm>
+#include <string>
+#include <vector>
+// project
+#include "elserver.h"
+#include "timeseries.h"
+#include "valuetype.h"
+
+using namespace std;
+
+/*
+ * Value layout: SeriesHeader, then the chunks in time order, each a
+ * ChunkHeader followed by (bits + 7) / 8 bytes of bit stream. Only the last
+ * chunk is appended to, so it grows at the end of the value; the series
+ * header records where it starts.
+ *
+ * The first sample of a chunk is in its header. Each later sample writes
+ * its timestamp as the delta-of-delta from the previous two:
+ *   0                      '0'
+ *   [-63, 64]              '10'   7 bits
+ *   [-255, 256]            '110'  9 bits
+ *   [-2047, 2048]          '1110' 12 bits
+ *   otherwise              '1111' 64 bits
+ * and its value as the XOR of its bits with the previous value's:
+ *   0                      '0'
+ *   within the previous    '10'   the bits between the previous leading
+ *   leading/trailing zeros        and trailing zeros
+ *   otherwise              '11'   6 bits of leading zeros, 6 bits of
+ *                                 length - 1, the meaningful bits
+ */
+struct SeriesHeader {
+  char tag[4];
+  uint32_t chunks;
+  uint64_t samples;
+  uint64_t last_chunk;
+};
+static_assert(sizeof(SeriesHeader) == 24, "series header layout");
+
+struct ChunkHeader {
+  int64_t first_ts;
+  int64_t last_ts;
+  int64_t last_delta;
+  double first_value;
+  double last_value;
+  double min;
+  double max;
+  double sum;
+  uint32_t count;
+  uint32_t bits;
+  uint8_t leading; // Window of the last XOR; 0xff before the first
+  uint8_t trailing;
+  uint8_t reserved[6];
+};
+static_assert(sizeof(ChunkHeader) == 80, "chunk header layout");
+
+static const uint8_t k_no_window = 0xff;
+
+// Where a chunk starts and its decoded header
+struct ChunkRef {
+  size_t off;
+  ChunkHeader h;
+};
+
+static size_t chunk_bytes(const ChunkHeader &h) {
+  return sizeof(ChunkHeader) + ((size_t)h.bits + 7) / 8;
+}
+
+// Reads the chunk headers of a series, checking that they tile the value
+static bool series_open(const string &value, vector<ChunkRef> *chunks,
+                        SeriesHeader *sh) {
+  if (value_type(value) != VT_TS || value.size() < sizeof(SeriesHeader)) {
+    return false;
+  }
+  memcpy(sh, value.data(), sizeof(*sh));
+  chunks->clear();
+  size_t off = sizeof(SeriesHeader);
+  uint64_t samples = 0;
+  for (uint32_t i = 0; i < sh->chunks; i++) {
+    ChunkRef c;
+    if (value.size() - off < sizeof(ChunkHeader)) {
+      return false;
+    }
+    c.off = off;
+    memcpy(&c.h, value.data() + off, sizeof(c.h));
+    if (c.h.count == 0 || c.h.count > k_ts_chunk_samples ||
+        value.size() - off < chunk_bytes(c.h) || c.h.first_ts > c.h.last_ts ||
+        (i > 0 && c.h.first_ts <= chunks->back().h.last_ts)) {
+      return false;
+    }
+    samples += c.h.count;
+    off += chunk_bytes(c.h);
+    chunks->push_back(c);
+  }
+  return off == value.size() && samples == sh->samples &&
+         (chunks->empty() || chunks->back().off == sh->last_chunk);
+}
+
+// Reads the headers ts.add needs: the series and its last chunk, which must
+// end the value. Returns false if they do not fit together.
+static bool series_tail(const string &value, SeriesHeader *sh,
+                        ChunkHeader *last) {
+  if (value_type(value) != VT_TS || value.size() < sizeof(SeriesHeader)) {
+    return false;
+  }
+  memcpy(sh, value.data(), sizeof(*sh));
+  if (sh->chunks == 0) {
+    return value.size() == sizeof(SeriesHeader);
+  } else if (sh->last_chunk < sizeof(SeriesHeader) ||
+             sh->last_chunk > value.size() ||
+             value.size() - sh->last_chunk < sizeof(ChunkHeader)) {
+    return false;
+  }
+  memcpy(last, value.data() + sh->last_chunk, sizeof(*last));
+  return last->count > 0 && last->count <= k_ts_chunk_samples &&
+         sh->last_chunk + chunk_bytes(*last) == value.size();
+}
+
+// -----------------------------------------------------------------------
+// Bit streams
+// -----------------------------------------------------------------------
+
+// Appends the low n bits of x, most significant first, to the stream of
+// *bits bits that starts at base in v and runs to the end of v
+static void put_bits(string *v, size_t base, uint32_t *bits, uint64_t x,
+                     int n) {
+  while (n > 0) {
+    size_t byte = base + (*bits >> 3);
+    if (byte == v->size()) {
+      v->push_back('\0');
+    }
+    int room = 8 - (int)(*bits & 7);
+    int take = min(room, n);
+    uint8_t part = (uint8_t)((x >> (n - take)) & ((1u << take) - 1));
+    (*v)[byte] = (char)((uint8_t)(*v)[byte] | (part << (room - take)));
+    *bits += take;
+    n -= take;
+  }
+}
+
+struct BitReader {
+  const uint8_t *p;
+  uint64_t pos;
+  uint64_t limit;
+};
+
+static bool get_bits(BitReader *r, int n, uint64_t *out) {
+  if (r->limit - r->pos < (uint64_t)n) {
+    return false;
+  }
+  uint64_t x = 0;
+  while (n > 0) {
+    int used = (int)(r->pos & 7);
+    int take = min(8 - used, n);
+    uint8_t byte = r->p[r->pos >> 3];
+    x = (x << take) | ((byte >> (8 - used - take)) & ((1u << take) - 1));
+    r->pos += take;
+    n -= take;
+  }
+  *out = x;
+  return true;
+}
+
+static uint64_t double_bits(double d) {
+  uint64_t b;
+  memcpy(&b, &d, sizeof(b));
+  return b;
+}
+
+static double bits_double(uint64_t b) {
+  double d;
+  memcpy(&d, &b, sizeof(d));
+  return d;
+}
+
+// Appends a sample to a series whose headers series_tail() read, starting a
+// new chunk when the last one is full. Differences wrap like unsigned
+// integers so that any increasing timestamps round-trip.
+static void series_append(string *v, SeriesHeader sh, ChunkHeader h,
+                          int64_t ts, double value) {
+  size_t off = sh.last_chunk;
+  if (sh.chunks == 0 || h.count == k_ts_chunk_samples) {
+    memset(&h, 0, sizeof(h));
+    h.first_ts = h.last_ts = ts;
+    h.first_value = h.last_value = value;
+    h.min = h.max = h.sum = value;
+    h.count = 1;
+    h.leading = k_no_window;
+    off = sh.last_chunk = v->size();
+    v->append((const char *)&h, sizeof(h));
+    sh.chunks++;
+  } else {
+    size_t base = off + sizeof(ChunkHeader);
+    int64_t delta = (int64_t)((uint64_t)ts - (uint64_t)h.last_ts);
+    int64_t dod = (int64_t)((uint64_t)delta - (uint64_t)h.last_delta);
+    if (dod == 0) {
+      put_bits(v, base, &h.bits, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+      put_bits(v, base, &h.bits, 0x2, 2);
+      put_bits(v, base, &h.bits, (uint64_t)(dod + 63), 7);
+    } else if (dod >= -255 && dod <= 256) {
+      put_bits(v, base, &h.bits, 0x6, 3);
+      put_bits(v, base, &h.bits, (uint64_t)(dod + 255), 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+      put_bits(v, base, &h.bits, 0xe, 4);
+      put_bits(v, base, &h.bits, (uint64_t)(dod + 2047), 12);
+    } else {
+      put_bits(v, base, &h.bits, 0xf, 4);
+      put_bits(v, base, &h.bits, (uint64_t)dod, 64);
+    }
+
+    uint64_t x = double_bits(value) ^ double_bits(h.last_value);
+    if (x == 0) {
+      put_bits(v, base, &h.bits, 0, 1);
+    } else {
+      int leading = __builtin_clzll(x), trailing = __builtin_ctzll(x);
+      if (h.leading != k_no_window && leading >= h.leading &&
+          trailing >= h.trailing) {
+        put_bits(v, base, &h.bits, 0x2, 2);
+        put_bits(v, base, &h.bits, x >> h.trailing,
+                 64 - h.leading - h.trailing);
+      } else {
+        int len = 64 - leading - trailing;
+        put_bits(v, base, &h.bits, 0x3, 2);
+        put_bits(v, base, &h.bits, (uint64_t)leading, 6);
+        put_bits(v, base, &h.bits, (uint64_t)(len - 1), 6);
+        put_bits(v, base, &h.bits, x >> trailing, len);
+        h.leading = (uint8_t)leading;
+        h.trailing = (uint8_t)trailing;
+      }
+    }
+
+    h.last_delta = delta;
+    h.last_ts = ts;
+    h.last_value = value;
+    h.min = min(h.min, value);
+    h.max = max(h.max, value);
+    h.sum += value;
+    h.count++;
+  }
+  sh.samples++;
+  memcpy(&(*v)[0], &sh, sizeof(sh));
+  memcpy(&(*v)[off], &h, sizeof(h));
+}
+
+// Decodes the samples of one chunk in order
+struct ChunkCursor {
+  const ChunkHeader *h;
+  BitReader r;
+  uint32_t seen;
+  int64_t ts;
+  int64_t delta;
+  uint64_t value;
+  int leading;
+  int trailing;
+  bool corrupt;
+};
+
+static void cursor_init(ChunkCursor *c, const string &v, const ChunkRef &ref) {
+  c->h = &ref.h;
+  c->r.p = (const uint8_t *)v.data() + ref.off + sizeof(ChunkHeader);
+  c->r.pos = 0;
+  c->r.limit = ref.h.bits;
+  c->seen = 0;
+  c->delta = 0;
+  c->leading = c->trailing = 0;
+  c->corrupt = false;
+}
+
+// Bit stream decoding of one sample after the first
+static bool decode_sample(ChunkCursor *c) {
+  static const int widths[] = {0, 7, 9, 12, 64};
+  static const uint64_t bias[] = {0, 63, 255, 2047, 0};
+  uint64_t b, dod, mode, x, leading, len;
+  int ones;
+  for (ones = 0; ones < 4; ones++) {
+    if (!get_bits(&c->r, 1, &b)) {
+      return false;
+    } else if (b == 0) {
+      break;
+    }
+  }
+  if (!get_bits(&c->r, widths[ones], &dod)) {
+    return false;
+  }
+  c->delta = (int64_t)((uint64_t)c->delta + dod - bias[ones]);
+  c->ts = (int64_t)((uint64_t)c->ts + (uint64_t)c->delta);
+
+  if (!get_bits(&c->r, 1, &b)) {
+    return false;
+  } else if (b == 0) {
+    return true;
+  }
+  if (!get_bits(&c->r, 1, &mode)) {
+    return false;
+  }
+  if (mode == 1) {
+    if (!get_bits(&c->r, 6, &leading) || !get_bits(&c->r, 6, &len) ||
+        leading + len + 1 > 64) {
+      return false;
+    }
+    c->leading = (int)leading;
+    c->trailing = (int)(64 - leading - len - 1);
+  }
+  if (!get_bits(&c->r, 64 - c->leading - c->trailing, &x)) {
+    return false;
+  }
+  c->value ^= x << c->trailing;
+  return true;
+}
+
+// Next sample; false at the end of the chunk or, setting corrupt, if the
+// stream ends early
+static bool cursor_next(ChunkCursor *c, int64_t *ts, double *value) {
+  if (c->seen == c->h->count) {
+    return false;
+  }
+  if (c->seen++ == 0) {
+    c->ts = c->h->first_ts;
+    c->value = double_bits(c->h->first_value);
+  } else if (!decode_sample(c)) {
+    c->corrupt = true;
+    return false;
+  }
+  *ts = c->ts;
+  *value = bits_double(c->value);
+  return true;
+}
+
+// -----------------------------------------------------------------------
+// Aggregation
+// -----------------------------------------------------------------------
+enum Aggregation {
+  AGG_RAW,
+  AGG_AVG,
+  AGG_SUM,
+  AGG_MIN,
+  AGG_MAX,
+  AGG_COUNT,
+  AGG_FIRST,
+  AGG_LAST,
+};
+
+static bool parse_aggregation(const string &s, Aggregation *out) {
+  static const char *const names[] = {"raw", "avg",   "sum",   "min",
+                                      "max", "count", "first", "last"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (s == names[i]) {
+      *out = (Aggregation)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Shortest of %.15g and %.17g that reads back as d
+static void put_double(string *out, double d) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.15g", d);
+  if (strtod(buf, NULL) != d) {
+    snprintf(buf, sizeof(buf), "%.17g", d);
+  }
+  out->append(buf);
+}
+
+// Collects the lines of one range query
+struct RangeOut {
+  Aggregation agg;
+  int64_t bucket;
+  string *out;
+  size_t lines;
+  // The open window
+  bool open;
+  int64_t start;
+  uint64_t count;
+  double sum, min, max, first, last;
+};
+
+static int64_t window_of(const RangeOut &ro, int64_t ts) {
+  int64_t r = ts % ro.bucket;
+  return ts - (r < 0 ? r + ro.bucket : r);
+}
+
+static void emit(RangeOut *ro, int64_t ts, double value) {
+  ro->out->append(to_string(ts));
+  ro->out->push_back(' ');
+  put_double(ro->out, value);
+  ro->out->push_back('\n');
+  ro->lines++;
+}
+
+static void close_window(RangeOut *ro) {
+  if (!ro->open) {
+    return;
+  }
+  double v = 0;
+  switch (ro->agg) {
+  case AGG_AVG:
+    v = ro->sum / (double)ro->count;
+    break;
+  case AGG_SUM:
+    v = ro->sum;
+    break;
+  case AGG_MIN:
+    v = ro->min;
+    break;
+  case AGG_MAX:
+    v = ro->max;
+    break;
+  case AGG_COUNT:
+    v = (double)ro->count;
+    break;
+  case AGG_FIRST:
+    v = ro->first;
+    break;
+  default:
+    v = ro->last;
+    break;
+  }
+  emit(ro, ro->start, v);
+  ro->open = false;
+}
+
+// Folds count samples with the given summary, all in the window of ts, into
+// the aggregation
+static void add_summary(RangeOut *ro, int64_t ts, uint64_t count, double sum,
+                        double lo, double hi, double first, double last) {
+  int64_t start = window_of(*ro, ts);
+  if (ro->open && start != ro->start) {
+    close_window(ro);
+  }
+  if (!ro->open) {
+    ro->open = true;
+    ro->start = start;
+    ro->count = 0;
+    ro->sum = 0;
+    ro->min = lo;
+    ro->max = hi;
+    ro->first = first;
+  }
+  ro->count += count;
+  ro->sum += sum;
+  ro->min = min(ro->min, lo);
+  ro->max = max(ro->max, hi);
+  ro->last = last;
+}
+
+static bool range_full(const RangeOut &ro) {
+  return ro.lines >= k_ts_range_max;
+}
+
+// Runs a range query over one series; false if its value is corrupt
+static bool series_range(const string &v, int64_t from, int64_t to,
+                         RangeOut *ro) {
+  SeriesHeader sh;
+  vector<ChunkRef> chunks;
+  if (!series_open(v, &chunks, &sh)) {
+    return false;
+  }
+  ro->lines = 0;
+  ro->open = false;
+  for (const ChunkRef &c : chunks) {
+    if (c.h.last_ts < from) {
+      continue;
+    } else if (c.h.first_ts > to || range_full(*ro)) {
+      break;
+    }
+    if (ro->agg != AGG_RAW && c.h.first_ts >= from && c.h.last_ts <= to &&
+        window_of(*ro, c.h.first_ts) == window_of(*ro, c.h.last_ts)) {
+      add_summary(ro, c.h.first_ts, c.h.count, c.h.sum, c.h.min, c.h.max,
+                  c.h.first_value, c.h.last_value);
+      continue;
+    }
+    ChunkCursor cur;
+    int64_t ts;
+    double value;
+    cursor_init(&cur, v, c);
+    while (cursor_next(&cur, &ts, &value) && ts <= to && !range_full(*ro)) {
+      if (ts < from) {
+        continue;
+      } else if (ro->agg == AGG_RAW) {
+        emit(ro, ts, value);
+      } else {
+        add_summary(ro, ts, 1, value, value, value, value, value);
+      }
+    }
+    if (cur.corrupt) {
+      return false;
+    }
+  }
+  if (!range_full(*ro)) {
+    close_window(ro);
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------
+// Commands
+// -----------------------------------------------------------------------
+static void set_error(RequestResponse *response, const char *msg) {
+  response->status = ERROR;
+  response->response = string(msg) + "\n";
+}
+
+static bool parse_i64(const string &s, int64_t *out) {
+  char *end;
+  errno = 0;
+  long long v = strtoll(s.c_str(), &end, 10);
+  if (s.empty() || *end != '\0' || errno != 0) {
+    return false;
+  }
+  *out = v;
+  return true;
+}
+
+// Parses a range bound, where "-" and "+" are the ends of time
+static bool parse_bound(const string &s, int64_t *out) {
+  if (s == "-") {
+    *out = INT64_MIN;
+    return true;
+  } else if (s == "+") {
+    *out = INT64_MAX;
+    return true;
+  }
+  return parse_i64(s, out);
+}
+
+// Parses from and to at command[at], and agg and bucket after them when argc
+// says they are there
+static bool parse_query(const vector<string> &command, size_t at, size_t argc,
+                        int64_t *from, int64_t *to, RangeOut *ro,
+                        RequestResponse *response) {
+  ro->agg = AGG_RAW;
+  ro->bucket = 1;
+  if (!parse_bound(command[at], from) || !parse_bound(command[at + 1], to)) {
+    set_error(response, "invalid timestamp");
+    return false;
+  }
+  if (argc == 4) {
+    if (!parse_aggregation(command[at + 2], &ro->agg) ||
+        (ro->agg != AGG_RAW && (!parse_i64(command[at + 3], &ro->bucket) ||
+                                ro->bucket <= 0))) {
+      set_error(response, "invalid aggregation");
+      return false;
+    }
+  }
+  return true;
+}
+
+// ts.add key timestamp value
+static void do_ts_add(const vector<string> &command,
+                      RequestResponse *response) {
+  const string &key = command[1];
+  int64_t ts;
+  char *end;
+  if (command[2] == "*") {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ts = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+  } else if (!parse_i64(command[2], &ts)) {
+    set_error(response, "invalid timestamp");
+    return;
+  }
+  double value = strtod(command[3].c_str(), &end);
+  if (command[3].empty() || *end != '\0' || !std::isfinite(value)) {
+    set_error(response, "invalid value");
+    return;
+  }
+
+  Entry *ent = db_lookup(key.data(), key.size());
+  SeriesHeader sh;
+  ChunkHeader last;
+  if (!ent) {
+    string v;
+    value_tag(&v, VT_TS);
+    v.resize(sizeof(SeriesHeader));
+    memcpy(&sh, v.data(), sizeof(sh));
+    series_append(&v, sh, last, ts, value);
+    db_set(key.data(), key.size(), v.data(), v.size());
+  } else if (!series_tail(ent->value, &sh, &last)) {
+    set_error(response, "value is not a time series");
+    return;
+  } else if (sh.chunks > 0 && ts <= last.last_ts) {
+    set_error(response, "timestamp must be newer than the last sample");
+    return;
+  } else {
+    db_touch(ent);
+    series_append(&ent->value, sh, last, ts, value);
+  }
+  response->status = SUCCESS;
+  response->response = to_string(ts) + "\n";
+}
+
+// ts.range key from to [agg bucket]
+static void do_ts_range(const vector<string> &command,
+                        RequestResponse *response) {
+  int64_t from, to;
+  RangeOut ro;
+  if (!parse_query(command, 2, command.size() - 2, &from, &to, &ro,
+                   response)) {
+    return;
+  }
+  Entry *ent = db_lookup(command[1].data(), command[1].size());
+  if (!ent) {
+    response->status = KEY_NOT_FOUND;
+    response->response = "key not found\n";
+    return;
+  }
+  response->response.clear();
+  ro.out = &response->response;
+  if (!series_range(ent->value, from, to, &ro)) {
+    set_error(response, "value is not a time series");
+    return;
+  }
+  response->status = SUCCESS;
+}
+
+// ts.mrange from to agg bucket key [key ...]
+static void do_ts_mrange(const vector<string> &command,
+                         RequestResponse *response) {
+  int64_t from, to;
+  RangeOut ro;
+  if (!parse_query(command, 1, 4, &from, &to, &ro, response)) {
+    return;
+  }
+  string lines;
+  response->status = SUCCESS;
+  response->response.clear();
+  ro.out = &lines;
+  for (size_t i = 5; i < command.size(); i++) {
+    const string &key = command[i];
+    Entry *ent = db_lookup(key.data(), key.size());
+    lines.clear();
+    if (ent && !series_range(ent->value, from, to, &ro)) {
+      set_error(response, "value is not a time series");
+      return;
+    }
+    response->response += key + " " + to_string(ent ? ro.lines : 0) + "\n";
+    response->response += lines;
+  }
+}
+
+// ts.info key
+static void do_ts_info(const vector<string> &command,
+                       RequestResponse *response) {
+  Entry *ent = db_lookup(command[1].data(), command[1].size());
+  SeriesHeader sh;
+  vector<ChunkRef> chunks;
+  if (!ent) {
+    response->status = KEY_NOT_FOUND;
+    response->response = "key not found\n";
+    return;
+  } else if (!series_open(ent->value, &chunks, &sh)) {
+    set_error(response, "value is not a time series");
+    return;
+  }
+  char buf[160];
+  snprintf(buf, sizeof(buf),
+           "samples %llu chunks %u bytes %zu bytes_per_sample %.2f\n",
+           (unsigned long long)sh.samples, sh.chunks, ent->value.size(),
+           (double)ent->value.size() / (double)max<uint64_t>(sh.samples, 1));
+  response->status = SUCCESS;
+  response->response = buf;
+  if (!chunks.empty()) {
+    response->response += "first " + to_string(chunks.front().h.first_ts) +
+                          " last " + to_string(chunks.back().h.last_ts) +
+                          "\n";
+  }
+}
+
+// -----------------------------------------------------------------------
+// Dispatches the ts.* commands
+// -----------------------------------------------------------------------
+void ts_request(const vector<string> &command, RequestResponse *response) {
+  const string &name = command[0];
+  size_t argc = command.size();
+  if (name == "ts.add" && argc == 4) {
+    do_ts_add(command, response);
+  } else if (name == "ts.range" && (argc == 4 || argc == 6)) {
+    do_ts_range(command, response);
+  } else if (name == "ts.mrange" && argc >= 6) {
+    do_ts_mrange(command, response);
+  } else if (name == "ts.info" && argc == 2) {
+    do_ts_info(command, response);
+  } else if (name == "ts.add" || name == "ts.range" || name == "ts.mrange" ||
+             name == "ts.info") {
+    set_error(response, "invalid number of arguments");
+  } else {
+    response->status = UNKNOWN_COMMAND;
+    response->response = "unknown command\n";
+  }
+}
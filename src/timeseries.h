@@ -0,0 +1,48 @@
+#ifndef TIMESERIES_H
+#define TIMESERIES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct RequestResponse;
+
+// Samples per compressed chunk
+const uint32_t k_ts_chunk_samples = 256;
+
+// Most samples or buckets one ts.range returns, and one ts.mrange per key
+const size_t k_ts_range_max = 1000;
+
+/**
+ * Time series.
+ *
+ *   ts.add key timestamp value                 -> timestamp
+ *   ts.range key from to [agg bucket]          -> "timestamp value" lines
+ *   ts.mrange from to agg bucket key [key ...] -> "key n" and n lines each
+ *   ts.info key
+ *
+ * Timestamps are integers (milliseconds by convention; "*" is the current
+ * time) and must increase within a series. from and to are inclusive; "-"
+ * and "+" mean unbounded. agg is avg, sum, min, max, count, first, last or
+ * raw (ts.mrange only), and bucket the width of an aggregation window;
+ * windows start at multiples of it. At most k_ts_range_max lines are
+ * returned per series; to continue, repeat from the last timestamp plus one
+ * (or plus bucket).
+ *
+ * Samples are kept in the entry's value as chunks of up to
+ * k_ts_chunk_samples, compressed as in Gorilla: timestamps as
+ * delta-of-deltas and values XORed with their predecessor, both with
+ * variable-length codes, so regular metrics take a bit or two each. Each
+ * chunk header records its time span and the count, sum, min and max of its
+ * values. A range query skips chunks outside the range by their headers and
+ * takes a chunk that lies within one window straight from its summary;
+ * other chunks are decoded one sample at a time into the aggregation
+ * without materializing them.
+ */
+
+// Executes a ts.* command against db.
+void ts_request(const std::vector<std::string> &command,
+                RequestResponse *response);
+
+#endif // TIMESERIES_H
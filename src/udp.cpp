@@ -0,0 +1,164 @@
+// udp.cpp - UDP fast path for get and mget
+
+// stdlib
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string.h>
+// system
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+// C++
+#include <string>
+#include <vector>
+// project
+#include "elserver.h"
+#include "logging.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "udp.h"
+
+// Datagrams received or sent by one system call
+const size_t k_udp_batch = 16;
+
+// Batches served per readiness event; the socket is level-triggered, so
+// datagrams left over are reported again
+const int k_udp_batches_per_event = 4;
+
+// Buffers of one batch, kept across calls
+struct UdpBatch {
+  char in[k_udp_batch][UDP_MAX_DATAGRAM];
+  char out[k_udp_batch][UDP_MAX_DATAGRAM];
+  struct sockaddr_in addrs[k_udp_batch];
+  struct iovec in_iov[k_udp_batch];
+  struct iovec out_iov[k_udp_batch];
+  struct mmsghdr in_msgs[k_udp_batch];
+  struct mmsghdr out_msgs[k_udp_batch];
+};
+
+static UdpBatch g_udp;
+static std::vector<std::string> g_command;
+
+// Executes the request in the datagram in of len bytes. Returns false if it
+// is malformed, else sets *resp.
+static bool udp_request(const char *in, size_t len, RequestResponse *resp) {
+  uint16_t flags;
+  memcpy(&flags, in + 4, 2);
+  const char *frame = in + UDP_HEADER_SIZE;
+  const char *end = in + len;
+  const char *error;
+  uint32_t id;
+  int32_t n = frame_request(frame, end, &error);
+  if (flags != 0 || n <= 0 || frame + n != end || request_tag(frame, &id)) {
+    return false;
+  }
+
+  g_command.resize(request_nargs(frame));
+  for (size_t i = 0; i < g_command.size(); i++) {
+    const char *data;
+    uint32_t arg_len;
+    request_arg(frame, (int)i, &data, &arg_len);
+    g_command[i].assign(data, arg_len);
+  }
+  const std::string &name = g_command[0];
+  if (name == "get" || name == "mget") {
+    metric_add(name == "get" ? M_CMD_GET : M_CMD_MGET);
+    *resp = process_request(g_command);
+  } else {
+    resp->status = ERROR;
+    resp->response = "only get and mget are served over udp\n";
+  }
+  return true;
+}
+
+// Builds the response datagram for the request datagram in into out.
+// Returns its size, or 0 if there is nothing to answer.
+static size_t udp_answer(const char *in, size_t len, bool truncated,
+                         char *out) {
+  if (len < UDP_HEADER_SIZE) {
+    // No request ID to answer to
+    return 0;
+  }
+  RequestResponse resp;
+  if (truncated || !udp_request(in, len, &resp)) {
+    resp.status = ERROR;
+    resp.response = "invalid request\n";
+  }
+
+  memcpy(out, in, 4); // request ID
+  uint16_t flags = 0;
+  size_t size = UDP_HEADER_SIZE + 4 + resp.response.size();
+  if (size > UDP_MAX_DATAGRAM) {
+    flags = UDP_FLAG_USE_TCP;
+    size = UDP_HEADER_SIZE;
+    metric_add(M_UDP_TOO_LARGE);
+  } else {
+    uint32_t net_len = htonl((uint32_t)resp.response.size());
+    memcpy(out + UDP_HEADER_SIZE, &net_len, 4);
+    memcpy(out + UDP_HEADER_SIZE + 4, resp.response.data(),
+           resp.response.size());
+  }
+  uint16_t net_flags = htons(flags);
+  memcpy(out + 4, &net_flags, 2);
+  memset(out + 6, 0, 2);
+  return size;
+}
+
+void udp_serve(int fd) {
+  UdpBatch &b = g_udp;
+  for (int round = 0; round < k_udp_batches_per_event; round++) {
+    for (size_t i = 0; i < k_udp_batch; i++) {
+      b.in_iov[i].iov_base = b.in[i];
+      b.in_iov[i].iov_len = sizeof(b.in[i]);
+      memset(&b.in_msgs[i], 0, sizeof(b.in_msgs[i]));
+      b.in_msgs[i].msg_hdr.msg_name = &b.addrs[i];
+      b.in_msgs[i].msg_hdr.msg_namelen = sizeof(b.addrs[i]);
+      b.in_msgs[i].msg_hdr.msg_iov = &b.in_iov[i];
+      b.in_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(fd, b.in_msgs, k_udp_batch, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG_SYS_ERROR("recvmmsg() error");
+      }
+      return;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    size_t m = 0;
+    for (int i = 0; i < n; i++) {
+      const struct msghdr &hdr = b.in_msgs[i].msg_hdr;
+      size_t len = b.in_msgs[i].msg_len;
+      metric_add(M_UDP_REQUESTS);
+      metric_add(M_BYTES_IN, (uint64_t)len);
+      size_t size =
+          udp_answer(b.in[i], len, hdr.msg_flags & MSG_TRUNC, b.out[i]);
+      if (size == 0) {
+        continue;
+      }
+      b.out_iov[m].iov_base = b.out[i];
+      b.out_iov[m].iov_len = size;
+      memset(&b.out_msgs[m], 0, sizeof(b.out_msgs[m]));
+      b.out_msgs[m].msg_hdr.msg_name = &b.addrs[i];
+      b.out_msgs[m].msg_hdr.msg_namelen = hdr.msg_namelen;
+      b.out_msgs[m].msg_hdr.msg_iov = &b.out_iov[m];
+      b.out_msgs[m].msg_hdr.msg_iovlen = 1;
+      m++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    metric_observe_latency((uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+                           (uint64_t)(t1.tv_nsec - t0.tv_nsec));
+
+    // Responses the socket cannot take now are dropped; the client retries
+    int sent = m > 0 ? sendmmsg(fd, b.out_msgs, m, MSG_DONTWAIT) : 0;
+    for (int i = 0; i < sent; i++) {
+      metric_add(M_BYTES_OUT, (uint64_t)b.out_msgs[i].msg_len);
+    }
+    if ((size_t)n < k_udp_batch) {
+      return;
+    }
+  }
+}
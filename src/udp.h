@@ -0,0 +1,23 @@
+#ifndef UDP_H
+#define UDP_H
+
+/**
+ * UDP fast path for reads.
+ *
+ * With --udp the server also reads native requests from datagrams on its
+ * port (see protocol.h for the framing). Only get and mget are served: they
+ * are idempotent, so a client that loses a request or its response simply
+ * sends it again, and the server keeps no state per client. Other commands
+ * get an error response. Datagrams are received and answered in batches
+ * with recvmmsg/sendmmsg; those too short to carry a header are dropped.
+ *
+ * A response can be many times larger than its request and UDP source
+ * addresses are not verified, so an exposed listener can be used to flood
+ * a spoofed victim. The socket therefore binds to 127.0.0.1 unless another
+ * address is given with --udp-bind addr, which also enables it.
+ */
+
+// Serves the datagrams waiting on the UDP socket fd
+void udp_serve(int fd);
+
+#endif // UDP_H
@@ -0,0 +1,48 @@
+#ifndef VALUETYPE_H
+#define VALUETYPE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Kinds of value an entry can hold
+enum ValueType : uint8_t {
+  VT_STRING = 0,
+  VT_CMS = 1,
+  VT_TOPK = 2,
+  VT_VECTOR = 3,
+  VT_JSON = 4,
+  VT_TS = 5,
+};
+
+// Length of the tag that starts a structured value
+const size_t k_value_tag_len = 4;
+
+/**
+ * Structured values.
+ *
+ * An Entry holds a single string. Values of the structured types are
+ * encoded into it, starting with a tag: a NUL byte, "el" and the ValueType.
+ * Because the encoding lives in the value, snapshots and append-only log
+ * rewrites carry structured values with no format changes.
+ *
+ * Each type validates the whole encoding before it uses it, so a plain
+ * string that happens to start with a tag is reported as a corrupt value
+ * and never misread.
+ */
+
+inline ValueType value_type(const std::string &value) {
+  if (value.size() < k_value_tag_len || value[0] != '\0' || value[1] != 'e' ||
+      value[2] != 'l') {
+    return VT_STRING;
+  }
+  return (ValueType)value[3];
+}
+
+// Writes the tag of type at the start of out, replacing its contents
+inline void value_tag(std::string *out, ValueType type) {
+  out->assign("\0el", 3);
+  out->push_back((char)type);
+}
+
+#endif // VALUETYPE_H
@@ -0,0 +1,204 @@
+// vecdist.cpp - SIMD distance kernels with runtime dispatch
+
+// stdlib
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+// project
+#include "vecdist.h"
+
+// -----------------------------------------------------------------------
+// Scalar
+// -----------------------------------------------------------------------
+static float dot_f32_scalar(const float *q, const float *v, uint32_t dim) {
+  float s = 0;
+  for (uint32_t i = 0; i < dim; i++) {
+    s += q[i] * v[i];
+  }
+  return s;
+}
+
+static float l2_f32_scalar(const float *q, const float *v, uint32_t dim) {
+  float s = 0;
+  for (uint32_t i = 0; i < dim; i++) {
+    float d = q[i] - v[i];
+    s += d * d;
+  }
+  return s;
+}
+
+static float dot_i8_scalar(const float *q, const int8_t *v, uint32_t dim) {
+  float s = 0;
+  for (uint32_t i = 0; i < dim; i++) {
+    s += q[i] * (float)v[i];
+  }
+  return s;
+}
+
+static float l2_i8_scalar(const float *q, const int8_t *v, float scale,
+                          uint32_t dim) {
+  float s = 0;
+  for (uint32_t i = 0; i < dim; i++) {
+    float d = q[i] - scale * (float)v[i];
+    s += d * d;
+  }
+  return s;
+}
+
+// -----------------------------------------------------------------------
+// AVX2 + FMA, 8 lanes
+// -----------------------------------------------------------------------
+__attribute__((target("avx2,fma"))) static float hsum256(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma"))) static __m256 load_i8x8(const int8_t *v) {
+  __m128i b = _mm_loadl_epi64((const __m128i *)v);
+  return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(b));
+}
+
+__attribute__((target("avx2,fma"))) static float
+dot_f32_avx2(const float *q, const float *v, uint32_t dim) {
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  uint32_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), _mm256_loadu_ps(v + i),
+                           acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8),
+                           _mm256_loadu_ps(v + i + 8), acc1);
+  }
+  for (; i + 8 <= dim; i += 8) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), _mm256_loadu_ps(v + i),
+                           acc0);
+  }
+  float s = hsum256(_mm256_add_ps(acc0, acc1));
+  return s + dot_f32_scalar(q + i, v + i, dim - i);
+}
+
+__attribute__((target("avx2,fma"))) static float
+l2_f32_avx2(const float *q, const float *v, uint32_t dim) {
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  uint32_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q + i), _mm256_loadu_ps(v + i));
+    __m256 d1 =
+        _mm256_sub_ps(_mm256_loadu_ps(q + i + 8), _mm256_loadu_ps(v + i + 8));
+    acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+  }
+  for (; i + 8 <= dim; i += 8) {
+    __m256 d = _mm256_sub_ps(_mm256_loadu_ps(q + i), _mm256_loadu_ps(v + i));
+    acc0 = _mm256_fmadd_ps(d, d, acc0);
+  }
+  float s = hsum256(_mm256_add_ps(acc0, acc1));
+  return s + l2_f32_scalar(q + i, v + i, dim - i);
+}
+
+__attribute__((target("avx2,fma"))) static float
+dot_i8_avx2(const float *q, const int8_t *v, uint32_t dim) {
+  __m256 acc = _mm256_setzero_ps();
+  uint32_t i = 0;
+  for (; i + 8 <= dim; i += 8) {
+    acc = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), load_i8x8(v + i), acc);
+  }
+  return hsum256(acc) + dot_i8_scalar(q + i, v + i, dim - i);
+}
+
+__attribute__((target("avx2,fma"))) static float
+l2_i8_avx2(const float *q, const int8_t *v, float scale, uint32_t dim) {
+  __m256 acc = _mm256_setzero_ps();
+  __m256 sv = _mm256_set1_ps(scale);
+  uint32_t i = 0;
+  for (; i + 8 <= dim; i += 8) {
+    __m256 d = _mm256_sub_ps(_mm256_loadu_ps(q + i),
+                             _mm256_mul_ps(sv, load_i8x8(v + i)));
+    acc = _mm256_fmadd_ps(d, d, acc);
+  }
+  return hsum256(acc) + l2_i8_scalar(q + i, v + i, scale, dim - i);
+}
+
+// -----------------------------------------------------------------------
+// AVX-512, 16 lanes
+// -----------------------------------------------------------------------
+__attribute__((target("avx512f"))) static __m512 load_i8x16(const int8_t *v) {
+  __m128i b = _mm_loadu_si128((const __m128i *)v);
+  return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(b));
+}
+
+__attribute__((target("avx512f"))) static float
+dot_f32_avx512(const float *q, const float *v, uint32_t dim) {
+  __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+  uint32_t i = 0;
+  for (; i + 32 <= dim; i += 32) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), _mm512_loadu_ps(v + i),
+                           acc0);
+    acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i + 16),
+                           _mm512_loadu_ps(v + i + 16), acc1);
+  }
+  for (; i + 16 <= dim; i += 16) {
+    acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), _mm512_loadu_ps(v + i),
+                           acc0);
+  }
+  float s = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+  return s + dot_f32_scalar(q + i, v + i, dim - i);
+}
+
+__attribute__((target("avx512f"))) static float
+l2_f32_avx512(const float *q, const float *v, uint32_t dim) {
+  __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+  uint32_t i = 0;
+  for (; i + 32 <= dim; i += 32) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(q + i), _mm512_loadu_ps(v + i));
+    __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(q + i + 16),
+                              _mm512_loadu_ps(v + i + 16));
+    acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+  }
+  for (; i + 16 <= dim; i += 16) {
+    __m512 d = _mm512_sub_ps(_mm512_loadu_ps(q + i), _mm512_loadu_ps(v + i));
+    acc0 = _mm512_fmadd_ps(d, d, acc0);
+  }
+  float s = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+  return s + l2_f32_scalar(q + i, v + i, dim - i);
+}
+
+__attribute__((target("avx512f"))) static float
+dot_i8_avx512(const float *q, const int8_t *v, uint32_t dim) {
+  __m512 acc = _mm512_setzero_ps();
+  uint32_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    acc = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), load_i8x16(v + i), acc);
+  }
+  return _mm512_reduce_add_ps(acc) + dot_i8_scalar(q + i, v + i, dim - i);
+}
+
+__attribute__((target("avx512f"))) static float
+l2_i8_avx512(const float *q, const int8_t *v, float scale, uint32_t dim) {
+  __m512 acc = _mm512_setzero_ps();
+  __m512 sv = _mm512_set1_ps(scale);
+  uint32_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    __m512 d = _mm512_sub_ps(_mm512_loadu_ps(q + i),
+                             _mm512_mul_ps(sv, load_i8x16(v + i)));
+    acc = _mm512_fmadd_ps(d, d, acc);
+  }
+  return _mm512_reduce_add_ps(acc) + l2_i8_scalar(q + i, v + i, scale, dim - i);
+}
+
+static DistKernels select_kernels() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return {dot_f32_avx512, l2_f32_avx512, dot_i8_avx512, l2_i8_avx512,
+            "avx512"};
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return {dot_f32_avx2, l2_f32_avx2, dot_i8_avx2, l2_i8_avx2, "avx2"};
+  }
+  return {dot_f32_scalar, l2_f32_scalar, dot_i8_scalar, l2_i8_scalar,
+          "scalar"};
+}
+
+const DistKernels g_dist_kernels = select_kernels();
@@ -0,0 +1,33 @@
+#ifndef VECDIST_H
+#define VECDIST_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Distance kernels for vector sets.
+ *
+ * Stored vectors are either f32, or int8 with one f32 scale per vector (a
+ * component is scale * q[i]); queries are always f32. Every kernel has an
+ * AVX-512, an AVX2+FMA and a scalar version, and g_dist_kernels holds the
+ * widest ones the CPU supports, chosen once at startup. The SIMD versions
+ * are compiled with per-function target attributes, so the binary does not
+ * have to be built for a particular CPU.
+ */
+
+struct DistKernels {
+  // sum q[i] * v[i]
+  float (*dot_f32)(const float *q, const float *v, uint32_t dim);
+  // sum (q[i] - v[i])^2
+  float (*l2_f32)(const float *q, const float *v, uint32_t dim);
+  // sum q[i] * v[i], v unscaled
+  float (*dot_i8)(const float *q, const int8_t *v, uint32_t dim);
+  // sum (q[i] - scale * v[i])^2
+  float (*l2_i8)(const float *q, const int8_t *v, float scale, uint32_t dim);
+  // "avx512", "avx2" or "scalar"
+  const char *isa;
+};
+
+extern const DistKernels g_dist_kernels;
+
+#endif // VECDIST_H
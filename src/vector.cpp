@@ -0,0 +1,760 @@
+// vector.cpp - vector sets with an incrementally built HNSW index
+
+// stdlib
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <stdio.h>
+#include <string.h>
+// C++
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+// project
+#include "elserver.h"
+#include "valuetype.h"
+#include "vecdist.h"
+#include "vector.h"
+
+using namespace std;
+
+// Highest HNSW layer a node can be placed on
+static const int k_hnsw_max_level = 15;
+
+enum Metric : uint32_t { METRIC_L2, METRIC_COSINE, METRIC_IP };
+
+static const char *const k_metric_names[] = {"l2", "cosine", "ip"};
+
+// Starts a vector set value. Records follow, one per id: u32 id length,
+// the vector (dim f32, or an f32 scale and dim int8 padded to 4 bytes),
+// then the id padded to 4 bytes.
+struct VectorHeader {
+  char tag[k_value_tag_len];
+  uint32_t dim;
+  uint32_t metric;
+  uint32_t quant; // 1 => int8
+};
+
+enum NodeState : uint8_t {
+  NODE_LINKED = 1, // In the graph
+  NODE_QUEUED = 2, // Waiting in pending to be (re)linked
+};
+
+// The index of one vector set. Nodes are numbered in record order.
+struct VectorSet {
+  Entry *ent;
+  uint32_t dim;
+  uint32_t metric;
+  uint32_t quant;
+  vector<uint32_t> rec; // Offset of each node's record in ent->value
+  unordered_map<string, uint32_t> ids;
+  vector<uint8_t> level;
+  vector<uint8_t> state;
+  // Layer 0 links, k_hnsw_m0 + 1 slots per node: count, then neighbours
+  vector<uint32_t> links0;
+  // Links on layers 1..level, k_hnsw_m + 1 slots per layer
+  vector<vector<uint32_t>> upper;
+  vector<uint32_t> visited; // visit_epoch of the last search that saw it
+  uint32_t visit_epoch = 0;
+  deque<uint32_t> pending;
+  uint32_t entry = 0;
+  int max_level = -1; // -1 => empty graph
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+  uint64_t work = 0; // Distance computations so far
+  bool busy = false; // In busy_sets
+  // Scratch vectors of dim floats, and the search heaps
+  vector<float> qbuf, nbuf, sbuf;
+  vector<pair<float, uint32_t>> cand, best;
+};
+
+typedef pair<float, uint32_t> Cand; // distance, node
+
+static unordered_map<Entry *, VectorSet *> vsets;
+
+// Sets with pending nodes
+static vector<VectorSet *> busy_sets;
+
+static size_t pad4(size_t n) { return (n + 3) & ~(size_t)3; }
+
+static size_t payload_size(uint32_t dim, uint32_t quant) {
+  return quant ? sizeof(float) + pad4(dim) : (size_t)dim * sizeof(float);
+}
+
+static const char *node_vec(const VectorSet *vs, uint32_t node) {
+  return vs->ent->value.data() + vs->rec[node] + sizeof(uint32_t);
+}
+
+static string node_id(const VectorSet *vs, uint32_t node) {
+  const char *p = vs->ent->value.data() + vs->rec[node];
+  uint32_t len;
+  memcpy(&len, p, sizeof(len));
+  return string(p + sizeof(len) + payload_size(vs->dim, vs->quant), len);
+}
+
+// The vector of node as f32: a pointer into the value, or dequantized into
+// buf
+static const float *node_f32(const VectorSet *vs, uint32_t node, float *buf) {
+  const char *p = node_vec(vs, node);
+  if (!vs->quant) {
+    return (const float *)p;
+  }
+  float scale;
+  memcpy(&scale, p, sizeof(scale));
+  const int8_t *q = (const int8_t *)(p + sizeof(scale));
+  for (uint32_t i = 0; i < vs->dim; i++) {
+    buf[i] = scale * q[i];
+  }
+  return buf;
+}
+
+static float distance(VectorSet *vs, const float *q, uint32_t node) {
+  const DistKernels &k = g_dist_kernels;
+  const char *p = node_vec(vs, node);
+  float dot;
+  vs->work++;
+  if (vs->quant) {
+    float scale;
+    memcpy(&scale, p, sizeof(scale));
+    const int8_t *v = (const int8_t *)(p + sizeof(scale));
+    if (vs->metric == METRIC_L2) {
+      return k.l2_i8(q, v, scale, vs->dim);
+    }
+    dot = scale * k.dot_i8(q, v, vs->dim);
+  } else {
+    const float *v = (const float *)p;
+    if (vs->metric == METRIC_L2) {
+      return k.l2_f32(q, v, vs->dim);
+    }
+    dot = k.dot_f32(q, v, vs->dim);
+  }
+  return vs->metric == METRIC_IP ? -dot : 1 - dot;
+}
+
+static uint32_t max_links(int lc) { return lc == 0 ? k_hnsw_m0 : k_hnsw_m; }
+
+static uint32_t *node_links(VectorSet *vs, uint32_t node, int lc) {
+  if (lc == 0) {
+    return &vs->links0[(size_t)node * (k_hnsw_m0 + 1)];
+  }
+  return &vs->upper[node][(size_t)(lc - 1) * (k_hnsw_m + 1)];
+}
+
+static void set_links(VectorSet *vs, uint32_t node, int lc,
+                      const vector<Cand> &cands) {
+  uint32_t *links = node_links(vs, node, lc);
+  links[0] = (uint32_t)cands.size();
+  for (size_t i = 0; i < cands.size(); i++) {
+    links[i + 1] = cands[i].second;
+  }
+}
+
+static uint32_t add_node(VectorSet *vs, uint32_t rec) {
+  uint32_t node = (uint32_t)vs->rec.size();
+  vs->rec.push_back(rec);
+  vs->level.push_back(0);
+  vs->state.push_back(0);
+  vs->links0.resize(vs->links0.size() + k_hnsw_m0 + 1, 0);
+  vs->upper.emplace_back();
+  vs->visited.push_back(0);
+  return node;
+}
+
+static void queue_node(VectorSet *vs, uint32_t node) {
+  if (!(vs->state[node] & NODE_QUEUED)) {
+    vs->state[node] |= NODE_QUEUED;
+    vs->pending.push_back(node);
+  }
+  if (!vs->busy) {
+    vs->busy = true;
+    busy_sets.push_back(vs);
+  }
+}
+
+static void new_visit(VectorSet *vs) {
+  if (++vs->visit_epoch == 0) {
+    fill(vs->visited.begin(), vs->visited.end(), 0);
+    vs->visit_epoch = 1;
+  }
+}
+
+// Best-first search of layer lc starting from the candidates in *w. Leaves
+// the ef nearest nodes found in *w, nearest first.
+static void search_layer(VectorSet *vs, const float *q, vector<Cand> *w,
+                         uint32_t ef, int lc) {
+  // Heaps kept in the set so searches don't allocate: cand has the
+  // nearest on top, best the farthest
+  vector<Cand> &cand = vs->cand, &best = vs->best;
+  auto farther = [](const Cand &a, const Cand &b) { return a > b; };
+  cand.clear();
+  best.clear();
+  new_visit(vs);
+  for (const Cand &c : *w) {
+    vs->visited[c.second] = vs->visit_epoch;
+    cand.push_back(c);
+    push_heap(cand.begin(), cand.end(), farther);
+    best.push_back(c);
+    push_heap(best.begin(), best.end());
+    if (best.size() > ef) {
+      pop_heap(best.begin(), best.end());
+      best.pop_back();
+    }
+  }
+
+  while (!cand.empty()) {
+    Cand c = cand.front();
+    if (best.size() >= ef && c.first > best.front().first) {
+      break;
+    }
+    pop_heap(cand.begin(), cand.end(), farther);
+    cand.pop_back();
+    const uint32_t *links = node_links(vs, c.second, lc);
+    for (uint32_t j = 1; j <= links[0]; j++) {
+      uint32_t e = links[j];
+      if (vs->visited[e] == vs->visit_epoch) {
+        continue;
+      }
+      vs->visited[e] = vs->visit_epoch;
+      float d = distance(vs, q, e);
+      if (best.size() < ef || d < best.front().first) {
+        cand.push_back({d, e});
+        push_heap(cand.begin(), cand.end(), farther);
+        best.push_back({d, e});
+        push_heap(best.begin(), best.end());
+        if (best.size() > ef) {
+          pop_heap(best.begin(), best.end());
+          best.pop_back();
+        }
+      }
+    }
+  }
+
+  sort_heap(best.begin(), best.end());
+  w->assign(best.begin(), best.end());
+}
+
+// Keeps at most m of cands (nearest first). A candidate closer to the base
+// than to every neighbour kept so far is preferred, which spreads the links
+// in different directions; pruned candidates fill any remaining room.
+static void select_neighbors(VectorSet *vs, vector<Cand> *cands, uint32_t m) {
+  if (cands->size() <= m) {
+    return;
+  }
+  vector<Cand> kept, pruned;
+  for (const Cand &c : *cands) {
+    if (kept.size() >= m) {
+      break;
+    }
+    const float *cv = node_f32(vs, c.second, vs->sbuf.data());
+    bool diverse = true;
+    for (const Cand &k : kept) {
+      if (distance(vs, cv, k.second) < c.first) {
+        diverse = false;
+        break;
+      }
+    }
+    (diverse ? kept : pruned).push_back(c);
+  }
+  for (size_t i = 0; kept.size() < m && i < pruned.size(); i++) {
+    kept.push_back(pruned[i]);
+  }
+  cands->swap(kept);
+}
+
+// Adds the edge e -> node on layer lc, re-selecting e's links if full
+static void add_link(VectorSet *vs, uint32_t e, uint32_t node, float d,
+                     int lc) {
+  uint32_t *links = node_links(vs, e, lc);
+  uint32_t m = max_links(lc);
+  for (uint32_t j = 1; j <= links[0]; j++) {
+    if (links[j] == node) {
+      return;
+    }
+  }
+  if (links[0] < m) {
+    links[++links[0]] = node;
+    return;
+  }
+
+  const float *ev = node_f32(vs, e, vs->nbuf.data());
+  vector<Cand> cands;
+  cands.reserve(m + 1);
+  cands.push_back({d, node});
+  for (uint32_t j = 1; j <= links[0]; j++) {
+    cands.push_back({distance(vs, ev, links[j]), links[j]});
+  }
+  sort(cands.begin(), cands.end());
+  select_neighbors(vs, &cands, m);
+  set_links(vs, e, lc, cands);
+}
+
+static int random_level(VectorSet *vs) {
+  vs->rng ^= vs->rng << 13;
+  vs->rng ^= vs->rng >> 7;
+  vs->rng ^= vs->rng << 17;
+  double u = (double)((vs->rng >> 11) + 1) * 0x1.0p-53; // (0, 1]
+  int level = (int)(-log(u) / log((double)k_hnsw_m));
+  return min(level, k_hnsw_max_level);
+}
+
+// Inserts node into the graph, or re-links it after its vector changed
+static void link_node(VectorSet *vs, uint32_t node) {
+  vs->state[node] &= ~NODE_QUEUED;
+  const float *q = node_f32(vs, node, vs->qbuf.data());
+  bool relink = vs->state[node] & NODE_LINKED;
+  int level = vs->level[node];
+  if (!relink) {
+    level = random_level(vs);
+    vs->level[node] = (uint8_t)level;
+    vs->upper[node].assign((size_t)level * (k_hnsw_m + 1), 0);
+    vs->state[node] |= NODE_LINKED;
+  }
+  if (vs->max_level < 0) {
+    vs->entry = node;
+    vs->max_level = level;
+    return;
+  }
+
+  vector<Cand> w = {{distance(vs, q, vs->entry), vs->entry}};
+  for (int lc = vs->max_level; lc > level; lc--) {
+    search_layer(vs, q, &w, 1, lc);
+  }
+  vector<Cand> sel;
+  for (int lc = min(level, vs->max_level); lc >= 0; lc--) {
+    search_layer(vs, q, &w, k_hnsw_ef_construction, lc);
+    sel.clear();
+    for (const Cand &c : w) {
+      if (c.second != node) {
+        sel.push_back(c);
+      }
+    }
+    if (relink) {
+      // Old links stay candidates, so the node cannot lose its place
+      const uint32_t *links = node_links(vs, node, lc);
+      for (uint32_t j = 1; j <= links[0]; j++) {
+        uint32_t e = links[j];
+        if (none_of(sel.begin(), sel.end(),
+                    [e](const Cand &c) { return c.second == e; })) {
+          sel.push_back({distance(vs, q, e), e});
+        }
+      }
+      sort(sel.begin(), sel.end());
+    }
+    select_neighbors(vs, &sel, max_links(lc));
+    set_links(vs, node, lc, sel);
+    for (const Cand &c : sel) {
+      add_link(vs, c.second, node, c.first, lc);
+    }
+  }
+  if (level > vs->max_level) {
+    vs->max_level = level;
+    vs->entry = node;
+  }
+}
+
+// The index of ent, built from its value on first use. NULL if the value
+// is not a valid vector set.
+static VectorSet *vset_open(Entry *ent) {
+  auto it = vsets.find(ent);
+  if (it != vsets.end()) {
+    return it->second;
+  }
+  const string &value = ent->value;
+  VectorHeader hdr;
+  if (value_type(value) != VT_VECTOR || value.size() < sizeof(hdr)) {
+    return NULL;
+  }
+  memcpy(&hdr, value.data(), sizeof(hdr));
+  if (hdr.dim == 0 || hdr.dim > k_vector_max_dim || hdr.metric > METRIC_IP ||
+      hdr.quant > 1) {
+    return NULL;
+  }
+
+  VectorSet *vs = new VectorSet();
+  vs->ent = ent;
+  vs->dim = hdr.dim;
+  vs->metric = hdr.metric;
+  vs->quant = hdr.quant;
+  vs->qbuf.resize(hdr.dim);
+  vs->nbuf.resize(hdr.dim);
+  vs->sbuf.resize(hdr.dim);
+  size_t payload = payload_size(hdr.dim, hdr.quant);
+  size_t pos = sizeof(hdr);
+  bool ok = true;
+  while (ok && pos < value.size()) {
+    uint32_t len = 0;
+    ok = value.size() - pos >= sizeof(len);
+    if (ok) {
+      memcpy(&len, value.data() + pos, sizeof(len));
+    }
+    size_t size = sizeof(len) + payload + pad4(len);
+    ok = ok && value.size() - pos >= size;
+    if (ok) {
+      string id(value, pos + sizeof(len) + payload, len);
+      ok = vs->ids.emplace(id, add_node(vs, (uint32_t)pos)).second;
+    }
+    pos += size;
+  }
+  if (!ok) {
+    delete vs;
+    return NULL;
+  }
+  for (uint32_t node = 0; node < vs->rec.size(); node++) {
+    queue_node(vs, node);
+  }
+  vsets[ent] = vs;
+  return vs;
+}
+
+// Parses "[x,y,...]", "f32[x,y,...]" or "f32le:" + raw floats
+static bool parse_vector(const string &s, vector<float> *out) {
+  out->clear();
+  if (s.compare(0, 6, "f32le:") == 0) {
+    size_t n = s.size() - 6;
+    if (n % sizeof(float) != 0) {
+      return false;
+    }
+    out->resize(n / sizeof(float));
+    memcpy(out->data(), s.data() + 6, n);
+  } else {
+    size_t pos = s.compare(0, 3, "f32") == 0 ? 3 : 0;
+    if (s.size() < pos + 2 || s[pos] != '[' || s.back() != ']') {
+      return false;
+    }
+    const char *p = s.c_str() + pos + 1;
+    const char *end = s.c_str() + s.size() - 1;
+    while (p < end) {
+      char *next;
+      errno = 0;
+      float f = strtof(p, &next);
+      if (next == p || errno != 0) {
+        return false;
+      }
+      out->push_back(f);
+      while (next < end && *next == ' ') {
+        next++;
+      }
+      if (next < end && *next++ != ',') {
+        return false;
+      }
+      p = next;
+    }
+  }
+  if (out->empty() || out->size() > k_vector_max_dim) {
+    return false;
+  }
+  for (float f : *out) {
+    if (!std::isfinite(f)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Scales v to unit length for the cosine metric; false for a zero vector
+static bool normalize(vector<float> *v) {
+  double sum = 0;
+  for (float f : *v) {
+    sum += (double)f * f;
+  }
+  if (sum == 0) {
+    return false;
+  }
+  float inv = (float)(1 / sqrt(sum));
+  for (float &f : *v) {
+    f *= inv;
+  }
+  return true;
+}
+
+// Appends the stored form of v. For cosine the int8 scale is chosen so the
+// stored vector has unit length, keeping distances in [0, 2].
+static void encode_vector(const vector<float> &v, uint32_t metric,
+                          uint32_t quant, string *out) {
+  if (!quant) {
+    out->append((const char *)v.data(), v.size() * sizeof(float));
+    return;
+  }
+  float maxabs = 0;
+  for (float f : v) {
+    maxabs = max(maxabs, fabsf(f));
+  }
+  float scale = maxabs / 127;
+  size_t at = out->size();
+  out->append((const char *)&scale, sizeof(scale));
+  double norm = 0;
+  for (float f : v) {
+    long q = scale > 0 ? lrintf(f / scale) : 0;
+    q = max(-127L, min(127L, q));
+    norm += (double)q * q;
+    out->push_back((char)(int8_t)q);
+  }
+  out->resize(out->size() + pad4(v.size()) - v.size(), '\0');
+  if (metric == METRIC_COSINE && norm > 0) {
+    scale = (float)(1 / sqrt(norm));
+    memcpy(&(*out)[at], &scale, sizeof(scale));
+  }
+}
+
+static bool parse_u32(const string &s, uint32_t *out) {
+  char *end;
+  errno = 0;
+  unsigned long long v = strtoull(s.c_str(), &end, 10);
+  if (s.empty() || s[0] == '-' || *end != '\0' || errno != 0 ||
+      v > UINT32_MAX) {
+    return false;
+  }
+  *out = (uint32_t)v;
+  return true;
+}
+
+static void set_error(RequestResponse *response, const string &msg) {
+  response->status = ERROR;
+  response->response = msg + "\n";
+}
+
+// Looks up key as a vector set; NULL, with the response filled in, if it
+// does not exist or holds something else
+static VectorSet *vset_lookup(const string &key, RequestResponse *response) {
+  Entry *ent = db_lookup(key.data(), key.size());
+  if (!ent) {
+    response->status = KEY_NOT_FOUND;
+    response->response = "key not found\n";
+    return NULL;
+  }
+  VectorSet *vs = vset_open(ent);
+  if (!vs) {
+    set_error(response, "value is not a vector set");
+  }
+  return vs;
+}
+
+// Parses a query or insert vector for a set with the given shape
+static bool parse_set_vector(const string &s, uint32_t dim, uint32_t metric,
+                             vector<float> *v, RequestResponse *response) {
+  if (!parse_vector(s, v)) {
+    set_error(response, "invalid vector");
+    return false;
+  }
+  if (dim != 0 && v->size() != dim) {
+    set_error(response, "vector has " + to_string(v->size()) +
+                            " dimensions, the set has " + to_string(dim));
+    return false;
+  }
+  if (metric == METRIC_COSINE && !normalize(v)) {
+    set_error(response, "zero vector has no direction");
+    return false;
+  }
+  return true;
+}
+
+// vadd key id vector [l2|cosine|ip] [int8]
+static void do_vadd(const vector<string> &command, RequestResponse *response) {
+  const string &key = command[1];
+  const string &id = command[2];
+  uint32_t metric = METRIC_L2, quant = 0;
+  bool options = command.size() > 4;
+  for (size_t i = 4; i < command.size(); i++) {
+    if (command[i] == "int8") {
+      quant = 1;
+    } else if (command[i] == "l2") {
+      metric = METRIC_L2;
+    } else if (command[i] == "cosine") {
+      metric = METRIC_COSINE;
+    } else if (command[i] == "ip") {
+      metric = METRIC_IP;
+    } else {
+      set_error(response, "invalid option " + command[i]);
+      return;
+    }
+  }
+
+  Entry *ent = db_lookup(key.data(), key.size());
+  VectorSet *vs = NULL;
+  if (ent) {
+    vs = vset_open(ent);
+    if (!vs) {
+      set_error(response, "value is not a vector set");
+      return;
+    }
+    if (options && (metric != vs->metric || quant != vs->quant)) {
+      set_error(response, "options differ from the existing set");
+      return;
+    }
+    metric = vs->metric;
+    quant = vs->quant;
+  }
+  vector<float> v;
+  if (!parse_set_vector(command[3], vs ? vs->dim : 0, metric, &v, response)) {
+    return;
+  }
+  string payload;
+  encode_vector(v, metric, quant, &payload);
+  size_t rec_size = sizeof(uint32_t) + payload.size() + pad4(id.size());
+  if (ent && ent->value.size() + rec_size > UINT32_MAX) {
+    set_error(response, "vector set full");
+    return;
+  }
+
+  if (!ent) {
+    VectorHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.dim = (uint32_t)v.size();
+    hdr.metric = metric;
+    hdr.quant = quant;
+    string value;
+    value_tag(&value, VT_VECTOR);
+    value.append((const char *)&hdr + k_value_tag_len,
+                 sizeof(hdr) - k_value_tag_len);
+    ent = db_set(key.data(), key.size(), value.data(), value.size());
+    vs = vset_open(ent);
+  } else {
+    db_touch(ent);
+  }
+
+  response->status = SUCCESS;
+  auto it = vs->ids.find(id);
+  if (it != vs->ids.end()) {
+    memcpy(&ent->value[vs->rec[it->second] + sizeof(uint32_t)],
+           payload.data(), payload.size());
+    queue_node(vs, it->second);
+    response->response = "updated\n";
+    return;
+  }
+  uint32_t rec = (uint32_t)ent->value.size();
+  uint32_t len = (uint32_t)id.size();
+  ent->value.append((const char *)&len, sizeof(len));
+  ent->value.append(payload);
+  ent->value.append(id);
+  ent->value.resize(rec + rec_size, '\0');
+  uint32_t node = add_node(vs, rec);
+  vs->ids.emplace(id, node);
+  queue_node(vs, node);
+  response->response = "added\n";
+}
+
+// vsim key vector k [ef]
+static void do_vsim(const vector<string> &command, RequestResponse *response) {
+  VectorSet *vs = vset_lookup(command[1], response);
+  vector<float> q;
+  uint32_t k, ef = k_vsim_ef;
+  if (!vs || !parse_set_vector(command[2], vs->dim, vs->metric, &q, response)) {
+    return;
+  }
+  if (!parse_u32(command[3], &k) || k == 0 || k > k_vsim_max_k) {
+    set_error(response, "invalid k");
+    return;
+  }
+  if (command.size() == 5 &&
+      (!parse_u32(command[4], &ef) || ef == 0 || ef > k_vsim_max_ef)) {
+    set_error(response, "invalid ef");
+    return;
+  }
+  ef = max(ef, k);
+
+  vector<Cand> w;
+  if (vs->max_level >= 0) {
+    w.push_back({distance(vs, q.data(), vs->entry), vs->entry});
+    for (int lc = vs->max_level; lc > 0; lc--) {
+      search_layer(vs, q.data(), &w, 1, lc);
+    }
+    search_layer(vs, q.data(), &w, ef, 0);
+  } else {
+    new_visit(vs);
+  }
+  // Vectors not linked yet, or re-queued and not reached by the search
+  size_t scanned = 0;
+  for (uint32_t node : vs->pending) {
+    if (scanned++ == k_vector_scan_limit) {
+      break;
+    }
+    if (vs->visited[node] != vs->visit_epoch) {
+      w.push_back({distance(vs, q.data(), node), node});
+    }
+  }
+  sort(w.begin(), w.end());
+  if (w.size() > k) {
+    w.resize(k);
+  }
+
+  response->status = SUCCESS;
+  response->response.clear();
+  char buf[32];
+  for (const Cand &c : w) {
+    snprintf(buf, sizeof(buf), " %.6g\n", c.first);
+    response->response += node_id(vs, c.second) + buf;
+  }
+}
+
+// vinfo key
+static void do_vinfo(const vector<string> &command,
+                     RequestResponse *response) {
+  VectorSet *vs = vset_lookup(command[1], response);
+  if (!vs) {
+    return;
+  }
+  response->status = SUCCESS;
+  response->response = "dim " + to_string(vs->dim) + " metric " +
+                       k_metric_names[vs->metric] + " quant " +
+                       (vs->quant ? "int8" : "f32") + " count " +
+                       to_string(vs->rec.size()) + " pending " +
+                       to_string(vs->pending.size()) + " levels " +
+                       to_string(vs->max_level + 1) + " isa " +
+                       g_dist_kernels.isa + "\n";
+}
+
+// -----------------------------------------------------------------------
+// Dispatches the vector set commands
+// -----------------------------------------------------------------------
+void vector_request(const vector<string> &command,
+                    RequestResponse *response) {
+  const string &name = command[0];
+  size_t argc = command.size();
+  if (name == "vadd" && argc >= 4 && argc <= 6) {
+    do_vadd(command, response);
+  } else if (name == "vsim" && (argc == 4 || argc == 5)) {
+    do_vsim(command, response);
+  } else if (name == "vinfo" && argc == 2) {
+    do_vinfo(command, response);
+  } else {
+    set_error(response, "invalid number of arguments");
+  }
+}
+
+void vector_drop(Entry *ent) {
+  auto it = vsets.find(ent);
+  if (it == vsets.end()) {
+    return;
+  }
+  VectorSet *vs = it->second;
+  if (vs->busy) {
+    busy_sets.erase(find(busy_sets.begin(), busy_sets.end(), vs));
+  }
+  delete vs;
+  vsets.erase(it);
+}
+
+void vector_step() {
+  uint64_t spent = 0;
+  while (!busy_sets.empty() && spent < k_vector_step_work) {
+    VectorSet *vs = busy_sets.back();
+    uint64_t start = vs->work;
+    while (!vs->pending.empty() &&
+           spent + (vs->work - start) < k_vector_step_work) {
+      uint32_t node = vs->pending.front();
+      vs->pending.pop_front();
+      link_node(vs, node);
+    }
+    spent += vs->work - start;
+    if (vs->pending.empty()) {
+      vs->busy = false;
+      busy_sets.pop_back();
+    }
+  }
+}
+
+bool vector_pending() { return !busy_sets.empty(); }
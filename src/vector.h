@@ -0,0 +1,77 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Entry;
+struct RequestResponse;
+
+const uint32_t k_vector_max_dim = 4096;
+
+// HNSW links per node on the upper layers and on layer 0
+const uint32_t k_hnsw_m = 16;
+const uint32_t k_hnsw_m0 = 32;
+
+// Candidates kept while linking a new node
+const uint32_t k_hnsw_ef_construction = 100;
+
+// Candidates kept by a query unless it asks for more, and the most it may
+// ask for
+const uint32_t k_vsim_ef = 64;
+const uint32_t k_vsim_max_ef = 1024;
+
+const uint32_t k_vsim_max_k = 100;
+
+// Distance computations spent linking nodes per event loop iteration
+const uint64_t k_vector_step_work = 20000;
+
+// Not yet linked vectors a query compares against directly
+const size_t k_vector_scan_limit = 4096;
+
+/**
+ * Vector sets with an HNSW index.
+ *
+ *   vadd key id vector [l2|cosine|ip] [int8]   -> added / updated
+ *   vsim key vector k [ef]                     -> "id distance" lines
+ *   vinfo key
+ *
+ * A vector is written "[0.5,-1,2]" (optionally "f32[...]"), or as "f32le:"
+ * followed by the raw little-endian floats. The metric and the int8 option
+ * are fixed by the vadd that creates the set; smaller distances are closer
+ * (l2 is squared, cosine is 1 - cos, ip is the negated dot product). With
+ * int8 each vector is stored as one f32 scale and a byte per component,
+ * cutting memory by about 4x; queries stay f32.
+ *
+ * The vectors themselves are kept in the entry's value (a tagged encoding,
+ * one record per id), so snapshots and AOF rewrites carry them unchanged.
+ * The HNSW graph is derived state held beside db and points into the value
+ * by offset. It is built incrementally: vadd stores the vector and queues
+ * it, and vector_step() links queued nodes into the graph with a budget of
+ * k_vector_step_work distance computations per loop iteration, so large
+ * inserts (or rebuilding the graph after a load, which happens on first
+ * access) never stall the loop. A query walks the graph with a bounded
+ * candidate list and also compares directly against up to
+ * k_vector_scan_limit queued vectors, so fresh vectors are found before
+ * they are linked.
+ *
+ * Distances use the kernels of vecdist.h.
+ */
+
+// Executes a vadd, vsim or vinfo command against db.
+void vector_request(const std::vector<std::string> &command,
+                    RequestResponse *response);
+
+// Discards the index of ent; called before a vector set value is replaced
+// or deleted.
+void vector_drop(Entry *ent);
+
+// Links queued vectors into their graphs; called once per loop iteration.
+void vector_step();
+
+// True while vectors are waiting to be linked
+bool vector_pending();
+
+#endif // VECTOR_H